@@ -24,6 +24,10 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 static pthread_cond_t maintenance_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -34,46 +38,366 @@ unsigned int hashpower = HASHPOWER_DEFAULT;
 #define hashsize(n) ((uint64_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
+/*
+ * Bucketed hash table (-o hash_buckets). Each bucket is one cache line
+ * holding a few item pointers plus a 16-bit tag per pointer, taken from the
+ * hash value bits above the bucket index. Lookups compare tags first, so most
+ * misses and most non-matching candidates are rejected without touching item
+ * memory.
+ * Items which don't fit in the slots of their bucket are chained off of it
+ * via h_next, same as the classic table, so inserts never allocate.
+ *
+ * The bucket index is still the low hashpower bits of hv, so bucket to item
+ * lock mapping and expansion work exactly as they do for the classic table.
+ */
+#define ASSOC_BUCKET_SLOTS 5
+/* Expand after this many items per bucket, on average. */
+#define ASSOC_BUCKET_LOAD 3
+
+struct assoc_bucket {
+    uint16_t tags[ASSOC_BUCKET_SLOTS];
+    item *slots[ASSOC_BUCKET_SLOTS];
+    item *chain; /* overflow once all slots are used */
+};
+
+/* Items in a bucket only differ in the hash bits above its index. Once the
+ * index is wider than 16 bits there are fewer than 16 of those, and rotating
+ * fills the rest of the tag with index bits, which cost nothing. */
+static inline uint16_t assoc_tag(const uint32_t hv, const unsigned int power) {
+    return (uint16_t)(power >= 32 ? hv : (hv >> power) | (hv << (32 - power)));
+}
+
+static bool use_buckets = false;
+
 /* Main hash table. This is where we look except during expansion. */
 static item** primary_hashtable = 0;
+static struct assoc_bucket *primary_buckets = 0;
 
 /*
- * Previous hash table. During expansion, we look here for keys that haven't
- * been moved over to the primary yet.
+ * Previous hash table. During expansion or shrinking, we look here for keys
+ * that haven't been moved over to the primary yet.
  */
 static item** old_hashtable = 0;
+static struct assoc_bucket *old_buckets = 0;
 
 /* Flag: Are we in the middle of expanding now? */
 static bool expanding = false;
 
+/* Flag: Are we in the middle of shrinking now? */
+static bool shrinking = false;
+
+/* Size of the old table while expanding or shrinking. */
+static unsigned int old_hashpower = 0;
+
+/* Never shrink below the size we started with. */
+static unsigned int hashpower_min = HASHPOWER_DEFAULT;
+
+/*
+ * During expansion or shrinking we migrate values with bucket granularity.
+ * A migration unit is one bucket of the smaller of the two tables, plus the
+ * two buckets of the larger table that fold into it. Units are migrated in
+ * order within each item lock stripe, so this tracks the next unit to move
+ * per stripe, and is only read or written under that stripe's lock. That
+ * lets several threads migrate disjoint stripes at once.
+ * Entries range from the stripe number .. hashsize(migrate_power()).
+ */
+static uint64_t *migrate_cursor = NULL;
+static uint32_t migrate_stripes = 0;
+
+#define migrate_power() (expanding ? old_hashpower : hashpower)
+
+/* If hv hasn't been migrated out of the old table yet, sets oldbucket to
+ * its bucket in there and returns true. */
+static inline bool _in_old_table(const uint32_t hv, uint64_t *oldbucket) {
+    if (expanding || shrinking) {
+        uint64_t unit = hv & hashmask(migrate_power());
+        if (unit >= migrate_cursor[unit & (migrate_stripes - 1)]) {
+            *oldbucket = hv & hashmask(old_hashpower);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Bytes used by a table with hashsize(power) buckets. */
+static uint64_t assoc_table_bytes(const unsigned int power) {
+    return hashsize(power) *
+        (use_buckets ? sizeof(struct assoc_bucket) : sizeof(void *));
+}
+
 /*
- * During expansion we migrate values with bucket granularity; this is how
- * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+ * Page backing for the tables. Every lookup lands on a random bucket, so on
+ * a large table with 4k pages nearly every probe is also a TLB miss. With
+ * -o hash_hugepages tables are mapped directly: first from the explicit
+ * huge page pool (MAP_HUGETLB), falling back to asking for transparent huge
+ * pages, falling back to plain pages. -o hash_numa spreads or binds the
+ * mapping across NUMA nodes. Each table remembers what it actually got, as
+ * the huge page pool can run dry between resizes.
  */
-static uint64_t expand_bucket = 0;
+enum assoc_pages {
+    ASSOC_PAGES_MALLOC = 0, /* from the heap */
+    ASSOC_PAGES_MMAP, /* mapped, but no huge pages */
+    ASSOC_PAGES_THP, /* mapped with MADV_HUGEPAGE */
+    ASSOC_PAGES_HUGETLB, /* mapped from the explicit huge page pool */
+};
+
+static const char *assoc_pages_names[] = {"default", "default", "thp", "hugetlb"};
+
+static enum assoc_pages primary_pages = ASSOC_PAGES_MALLOC;
+static enum assoc_pages old_pages = ASSOC_PAGES_MALLOC;
+static bool numa_applied = false;
+static size_t huge_pagesize = 0;
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+static size_t assoc_huge_pagesize(void) {
+    size_t pagesize = 0;
+#ifdef __linux__
+    FILE *fp = fopen("/proc/meminfo", "r");
+    char buf[64];
+
+    if (fp != NULL) {
+        while ((fgets(buf, sizeof(buf), fp))) {
+            if (!strncmp(buf, "Hugepagesize:", 13)) {
+                if (sscanf(buf + 13, "%zu\n", &pagesize) == 1) {
+                    /* meminfo huge page size is in KiBs */
+                    pagesize <<= 10;
+                }
+                break;
+            }
+        }
+        fclose(fp);
+    }
+#endif
+    if (pagesize == 0) {
+        pagesize = 2 * 1024 * 1024;
+    }
+    return pagesize;
+}
+
+/* Mapped tables are rounded up to whole huge pages, as MAP_HUGETLB
+ * mappings can only be unmapped in huge page units. */
+static size_t assoc_mapped_bytes(const unsigned int power) {
+    size_t len = assoc_table_bytes(power);
+    return (len + huge_pagesize - 1) & ~(huge_pagesize - 1);
+}
+
+/* Applies the -o hash_numa policy to a fresh mapping. Must run before the
+ * pages are first touched. */
+static bool assoc_numa_policy(void *table, size_t len) {
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long nodemask = 0;
+    int mode;
+
+    if (settings.hash_numa == HASH_NUMA_INTERLEAVE) {
+        /* the kernel limits this to the nodes we're allowed to use. */
+        nodemask = ~0UL;
+        mode = MPOL_INTERLEAVE;
+    } else {
+        nodemask = 1UL << settings.hash_numa_node;
+        mode = MPOL_BIND;
+    }
+    if (syscall(SYS_mbind, table, len, mode, &nodemask,
+                sizeof(nodemask) * 8 + 1, 0) != 0) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Failed to set NUMA policy for hash table: %s\n",
+                    strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void *assoc_table_map(const unsigned int power, enum assoc_pages *pages) {
+    size_t len = assoc_mapped_bytes(power);
+    void *table = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (settings.hash_hugepages) {
+        table = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        *pages = ASSOC_PAGES_HUGETLB;
+    }
+#endif
+    if (table == MAP_FAILED) {
+        table = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+            return NULL;
+        }
+        *pages = ASSOC_PAGES_MMAP;
+#ifdef MADV_HUGEPAGE
+        if (settings.hash_hugepages && madvise(table, len, MADV_HUGEPAGE) == 0) {
+            *pages = ASSOC_PAGES_THP;
+        }
+#endif
+    }
+
+    if (settings.hash_numa != HASH_NUMA_NONE) {
+        numa_applied = assoc_numa_policy(table, len);
+    }
+    /* Anonymous mappings come back zeroed. */
+    return table;
+}
+
+static void assoc_table_free(void *table, const unsigned int power,
+        const enum assoc_pages pages) {
+    if (pages == ASSOC_PAGES_MALLOC) {
+        free(table);
+    } else {
+        munmap(table, assoc_mapped_bytes(power));
+    }
+}
+
+/* Returns a zeroed table with hashsize(power) buckets, or NULL. */
+static void *assoc_table_alloc(const unsigned int power, enum assoc_pages *pages) {
+    if (settings.hash_hugepages || settings.hash_numa != HASH_NUMA_NONE) {
+        return assoc_table_map(power, pages);
+    }
+    *pages = ASSOC_PAGES_MALLOC;
+    if (use_buckets) {
+        void *table = NULL;
+        size_t len = assoc_table_bytes(power);
+        if (posix_memalign(&table, 64, len) != 0) {
+            return NULL;
+        }
+        memset(table, 0, len);
+        return table;
+    }
+    return calloc(hashsize(power), sizeof(void *));
+}
 
 void assoc_init(const int hashtable_init) {
+    void *table;
     if (hashtable_init) {
         hashpower = hashtable_init;
     }
-    primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
-    if (! primary_hashtable) {
+    hashpower_min = hashpower;
+    use_buckets = settings.hash_buckets;
+    huge_pagesize = assoc_huge_pagesize();
+    table = assoc_table_alloc(hashpower, &primary_pages);
+    if (! table) {
         fprintf(stderr, "Failed to init hashtable.\n");
         exit(EXIT_FAILURE);
     }
+    if (use_buckets) {
+        primary_buckets = table;
+    } else {
+        primary_hashtable = table;
+    }
     STATS_LOCK();
     stats_state.hash_power_level = hashpower;
-    stats_state.hash_bytes = hashsize(hashpower) * sizeof(void *);
+    stats_state.hash_bytes = assoc_table_bytes(hashpower);
     STATS_UNLOCK();
 }
 
+/* Returns the bucket hv currently lives in, checking the old table if it
+ * hasn't been migrated yet. */
+static struct assoc_bucket *_bucket_for(const uint32_t hv, uint16_t *tag) {
+    uint64_t oldbucket;
+
+    if (_in_old_table(hv, &oldbucket)) {
+        *tag = assoc_tag(hv, old_hashpower);
+        return &old_buckets[oldbucket];
+    }
+    *tag = assoc_tag(hv, hashpower);
+    return &primary_buckets[hv & hashmask(hashpower)];
+}
+
+static item *bucket_find(const char *key, const size_t nkey, const uint32_t hv) {
+    uint16_t tag;
+    struct assoc_bucket *b = _bucket_for(hv, &tag);
+    item *it;
+    int x;
+
+    for (x = 0; x < ASSOC_BUCKET_SLOTS; x++) {
+        if (b->tags[x] == tag && (it = b->slots[x]) != NULL
+                && nkey == it->nkey && memcmp(key, ITEM_key(it), nkey) == 0) {
+            return it;
+        }
+    }
+
+    for (it = b->chain; it != NULL; it = ITEM_h_next(it)) {
+        if ((nkey == it->nkey) && (memcmp(key, ITEM_key(it), nkey) == 0)) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+static void bucket_insert(struct assoc_bucket *b, item *it, const uint16_t tag) {
+    int x;
+    for (x = 0; x < ASSOC_BUCKET_SLOTS; x++) {
+        if (b->slots[x] == NULL) {
+            b->tags[x] = tag;
+            b->slots[x] = it;
+            it->h_next = 0;
+            return;
+        }
+    }
+    ITEM_set_h_next(it, b->chain);
+    b->chain = it;
+}
+
+/* Takes the item with this key out of a hash chain. Returns false if it
+ * wasn't found. */
+static bool chain_delete(item **head, const char *key, const size_t nkey) {
+    item *prev = NULL;
+    item *it = *head;
+
+    while (it && ((nkey != it->nkey) || memcmp(key, ITEM_key(it), nkey))) {
+        prev = it;
+        it = ITEM_h_next(it);
+    }
+    if (it == NULL)
+        return false;
+    if (prev) {
+        prev->h_next = it->h_next;
+    } else {
+        *head = ITEM_h_next(it);
+    }
+    it->h_next = 0;   /* probably pointless, but whatever. */
+    return true;
+}
+
+/* Slots are never compacted on delete, so an iterator walking a bucket by
+ * slot index stays valid when the item it just returned is removed. */
+static bool bucket_delete(const char *key, const size_t nkey, const uint32_t hv) {
+    uint16_t tag;
+    struct assoc_bucket *b = _bucket_for(hv, &tag);
+    int x;
+
+    for (x = 0; x < ASSOC_BUCKET_SLOTS; x++) {
+        item *it = b->slots[x];
+        if (b->tags[x] == tag && it != NULL
+                && nkey == it->nkey && memcmp(key, ITEM_key(it), nkey) == 0) {
+            b->slots[x] = NULL;
+            b->tags[x] = 0;
+            return true;
+        }
+    }
+
+    return chain_delete(&b->chain, key, nkey);
+}
+
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     item *it;
     uint64_t oldbucket;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
+    if (use_buckets) {
+        it = bucket_find(key, nkey, hv);
+        MEMCACHED_ASSOC_FIND(key, nkey, 0);
+        return it;
+    }
+
+    if (_in_old_table(hv, &oldbucket)) {
         it = old_hashtable[oldbucket];
     } else {
         it = primary_hashtable[hv & hashmask(hashpower)];
@@ -88,7 +412,7 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
             ret = it;
             break;
         }
-        it = it->h_next;
+        it = ITEM_h_next(it);
 #ifdef ENABLE_DTRACE
         ++depth;
 #endif
@@ -97,71 +421,142 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     return ret;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
-
-static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
+/* Hint that hv is about to be looked up. Only computes bucket addresses, so
+ * it's safe to call without holding the item lock. */
+void assoc_prefetch(const uint32_t hv) {
     uint64_t oldbucket;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
+    if (use_buckets) {
+        uint16_t tag;
+        __builtin_prefetch(_bucket_for(hv, &tag));
+    } else if (_in_old_table(hv, &oldbucket)) {
+        __builtin_prefetch(&old_hashtable[oldbucket]);
     } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
+        __builtin_prefetch(&primary_hashtable[hv & hashmask(hashpower)]);
     }
+}
 
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
-        pos = &(*pos)->h_next;
+/* returns the address of the head of the chain holding hv */
+
+static item** _hashitem_head (const uint32_t hv) {
+    uint64_t oldbucket;
+
+    if (_in_old_table(hv, &oldbucket)) {
+        return &old_hashtable[oldbucket];
+    } else {
+        return &primary_hashtable[hv & hashmask(hashpower)];
     }
-    return pos;
 }
 
-/* grows the hashtable to the next power of 2. */
-static void assoc_expand(void) {
-    old_hashtable = primary_hashtable;
+/*
+ * Wall clock time the current expansion or shrink started. Only touched by
+ * the maintenance thread.
+ */
+static struct timeval expand_started;
 
-    primary_hashtable = calloc(hashsize(hashpower + 1), sizeof(void *));
-    if (primary_hashtable) {
-        if (settings.verbose > 1)
-            fprintf(stderr, "Hash table expansion starting\n");
-        hashpower++;
+static uint64_t assoc_elapsed_us(const struct timeval *since) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000000
+        + (now.tv_usec - since->tv_usec);
+}
+
+/* Swaps in a table of hashsize(new_power) buckets, one power of 2 larger or
+ * smaller than the current one, and starts migrating items into it.
+ * new_table must already be allocated. */
+static void assoc_resize(void *new_table, const unsigned int new_power,
+        const enum assoc_pages new_pages) {
+    old_pages = primary_pages;
+    primary_pages = new_pages;
+    if (use_buckets) {
+        old_buckets = primary_buckets;
+        primary_buckets = new_table;
+    } else {
+        old_hashtable = primary_hashtable;
+        primary_hashtable = new_table;
+    }
+
+    old_hashpower = hashpower;
+    hashpower = new_power;
+    for (uint32_t x = 0; x < migrate_stripes; x++) {
+        migrate_cursor[x] = x;
+    }
+    if (hashpower > old_hashpower) {
         expanding = true;
-        expand_bucket = 0;
-        STATS_LOCK();
-        stats_state.hash_power_level = hashpower;
-        stats_state.hash_bytes += hashsize(hashpower) * sizeof(void *);
-        stats_state.hash_is_expanding = true;
-        STATS_UNLOCK();
     } else {
-        primary_hashtable = old_hashtable;
-        /* Bad news, but we can keep running. */
+        shrinking = true;
     }
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table %s starting\n", expanding ? "expansion" : "shrink");
+    STATS_LOCK();
+    stats_state.hash_power_level = hashpower;
+    stats_state.hash_bytes += assoc_table_bytes(hashpower);
+    stats_state.hash_is_expanding = expanding;
+    stats_state.hash_is_shrinking = shrinking;
+    STATS_UNLOCK();
 }
 
-void assoc_start_expand(uint64_t curr_items) {
+/* Size change the maintenance thread was woken up for: +1 to grow the
+ * table, -1 to shrink it, 0 for nothing. Protected by maintenance_lock. */
+static int resize_wanted = 0;
+
+void assoc_start_resize(uint64_t curr_items) {
     if (pthread_mutex_trylock(&maintenance_lock) == 0) {
-        if (curr_items > (hashsize(hashpower) * 3) / 2 && hashpower < HASHPOWER_MAX) {
+        uint64_t limit = use_buckets ? hashsize(hashpower) * ASSOC_BUCKET_LOAD
+            : (hashsize(hashpower) * 3) / 2;
+        if (curr_items > limit && hashpower < HASHPOWER_MAX) {
+            resize_wanted = 1;
+            pthread_cond_signal(&maintenance_cond);
+        } else if (settings.hash_shrink_ratio > 0 && hashpower > hashpower_min
+                && curr_items < hashsize(hashpower) * settings.hash_shrink_ratio) {
+            resize_wanted = -1;
             pthread_cond_signal(&maintenance_cond);
         }
         pthread_mutex_unlock(&maintenance_lock);
     }
 }
 
+/* Kind of pages backing the current table, for stats settings. */
+const char *assoc_page_type(void) {
+    return assoc_pages_names[primary_pages];
+}
+
+/* If the -o hash_numa policy took on the most recent table. */
+bool assoc_numa_applied(void) {
+    return numa_applied;
+}
+
+/* Buckets left to migrate in the current expansion or shrink. Unlocked, so
+ * only good for stats. */
+uint64_t assoc_migrate_remaining(void) {
+    uint64_t remaining = 0;
+    if (expanding || shrinking) {
+        uint64_t units = hashsize(migrate_power());
+        for (uint32_t x = 0; x < migrate_stripes; x++) {
+            uint64_t cursor = migrate_cursor[x];
+            if (cursor < units) {
+                remaining += (units - cursor + migrate_stripes - 1) / migrate_stripes;
+            }
+        }
+    }
+    return remaining;
+}
+
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(item *it, const uint32_t hv) {
     uint64_t oldbucket;
 
 //    assert(assoc_find(ITEM_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it->h_next = old_hashtable[oldbucket];
+    if (use_buckets) {
+        uint16_t tag;
+        struct assoc_bucket *b = _bucket_for(hv, &tag);
+        bucket_insert(b, it, tag);
+    } else if (_in_old_table(hv, &oldbucket)) {
+        ITEM_set_h_next(it, old_hashtable[oldbucket]);
         old_hashtable[oldbucket] = it;
     } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
+        ITEM_set_h_next(it, primary_hashtable[hv & hashmask(hashpower)]);
         primary_hashtable[hv & hashmask(hashpower)] = it;
     }
 
@@ -170,93 +565,240 @@ int assoc_insert(item *it, const uint32_t hv) {
 }
 
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
-    item **before = _hashitem_before(key, nkey, hv);
-
-    if (*before) {
-        item *nxt;
-        /* The DTrace probe cannot be triggered as the last instruction
-         * due to possible tail-optimization by the compiler
-         */
+    if (use_buckets) {
+        bool found = bucket_delete(key, nkey, hv);
         MEMCACHED_ASSOC_DELETE(key, nkey);
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
+        assert(found);
+        (void)found;
         return;
     }
+
+    bool found = chain_delete(_hashitem_head(hv), key, nkey);
+    /* The DTrace probe cannot be triggered as the last instruction
+     * due to possible tail-optimization by the compiler
+     */
+    MEMCACHED_ASSOC_DELETE(key, nkey);
     /* Note:  we never actually get here.  the callers don't delete things
        they can't find. */
-    assert(*before != 0);
+    assert(found);
+    (void)found;
 }
 
 
+/* Moves everything in bucket oldbucket of the old table into the primary
+ * table. The caller holds the item lock covering oldbucket, which also
+ * covers every bucket its items can land in. */
+static void assoc_migrate_bucket(const uint64_t oldbucket) {
+    item *it, *next;
+    uint32_t hv;
+
+    if (use_buckets) {
+        struct assoc_bucket *b = &old_buckets[oldbucket];
+        int x;
+        for (x = 0; x < ASSOC_BUCKET_SLOTS; x++) {
+            if ((it = b->slots[x]) != NULL) {
+                hv = hash(ITEM_key(it), it->nkey);
+                bucket_insert(&primary_buckets[hv & hashmask(hashpower)], it,
+                        assoc_tag(hv, hashpower));
+            }
+        }
+        for (it = b->chain; NULL != it; it = next) {
+            next = ITEM_h_next(it);
+            hv = hash(ITEM_key(it), it->nkey);
+            bucket_insert(&primary_buckets[hv & hashmask(hashpower)], it,
+                    assoc_tag(hv, hashpower));
+        }
+        memset(b, 0, sizeof(*b));
+        return;
+    }
+
+    for (it = old_hashtable[oldbucket]; NULL != it; it = next) {
+        uint64_t bucket;
+        next = ITEM_h_next(it);
+        bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
+        ITEM_set_h_next(it, primary_hashtable[bucket]);
+        primary_hashtable[bucket] = it;
+    }
+
+    old_hashtable[oldbucket] = NULL;
+}
+
 static volatile int do_run_maintenance_thread = 1;
 
 #define DEFAULT_HASH_BULK_MOVE 1
 int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
 
-static void *assoc_maintenance_thread(void *arg) {
+/* Migrates every unit belonging to item lock stripes [first, last).
+ * bucket = hv & hashmask(hashpower) => the bucket of hash table is the
+ * lowest N bits of the hv, and the bucket of item_locks is also the lowest M
+ * bits of hv, and N is greater than M. So a whole migration unit is covered
+ * by one item lock. Shrinking never goes below the starting hashpower, so
+ * the same holds for the smaller table there. */
+static void assoc_migrate_stripes(const uint32_t first, const uint32_t last) {
+    uint64_t units = hashsize(migrate_power());
+    uint32_t x;
+
+    for (x = first; x < last && do_run_maintenance_thread; x++) {
+        while (migrate_cursor[x] < units && do_run_maintenance_thread) {
+            int ii;
+            item_lock(x);
+            for (ii = 0; ii < hash_bulk_move && migrate_cursor[x] < units; ++ii) {
+                uint64_t unit = migrate_cursor[x];
+                assoc_migrate_bucket(unit);
+                if (shrinking) {
+                    assoc_migrate_bucket(unit + hashsize(hashpower));
+                }
+                migrate_cursor[x] += migrate_stripes;
+            }
+            item_unlock(x);
+        }
+    }
+}
 
-    mutex_lock(&maintenance_lock);
-    while (do_run_maintenance_thread) {
-        int ii = 0;
-
-        /* There is only one expansion thread, so no need to global lock. */
-        for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-            item *it, *next;
-            uint64_t bucket;
-            void *item_lock = NULL;
-
-            /* bucket = hv & hashmask(hashpower) =>the bucket of hash table
-             * is the lowest N bits of the hv, and the bucket of item_locks is
-             *  also the lowest M bits of hv, and N is greater than M.
-             *  So we can process expanding with only one item_lock. cool! */
-            if ((item_lock = item_trylock(expand_bucket))) {
-                    for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                        next = it->h_next;
-                        bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
-                        it->h_next = primary_hashtable[bucket];
-                        primary_hashtable[bucket] = it;
-                    }
-
-                    old_hashtable[expand_bucket] = NULL;
-
-                    expand_bucket++;
-                    if (expand_bucket == hashsize(hashpower - 1)) {
-                        expanding = false;
-                        free(old_hashtable);
-                        STATS_LOCK();
-                        stats_state.hash_bytes -= hashsize(hashpower - 1) * sizeof(void *);
-                        stats_state.hash_is_expanding = false;
-                        STATS_UNLOCK();
-                        if (settings.verbose > 1)
-                            fprintf(stderr, "Hash table expansion done\n");
-                    }
+/*
+ * Migration helper threads. The maintenance thread migrates the first range
+ * of stripes itself and hands each helper one of the others.
+ */
+static pthread_mutex_t migrate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t migrate_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t migrate_done_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t migrate_generation = 0;
+static int migrate_pending = 0;
+static int migrate_threads = 1;
+static pthread_t *migrate_tids = NULL;
+
+static void assoc_migrate_range(const int id) {
+    uint32_t per = migrate_stripes / migrate_threads;
+    uint32_t first = per * id;
+    uint32_t last = (id == migrate_threads - 1) ? migrate_stripes : first + per;
+    assoc_migrate_stripes(first, last);
+}
 
-            } else {
-                usleep(10*1000);
+static void *assoc_migrate_thread(void *arg) {
+    int id = (intptr_t) arg;
+    uint64_t seen = 0;
+
+    mutex_lock(&migrate_lock);
+    while (1) {
+        // always check in for a handed out range, even when stopping, since
+        // the maintenance thread is waiting on it.
+        if (seen != migrate_generation) {
+            seen = migrate_generation;
+            mutex_unlock(&migrate_lock);
+
+            assoc_migrate_range(id);
+
+            mutex_lock(&migrate_lock);
+            if (--migrate_pending == 0) {
+                pthread_cond_signal(&migrate_done_cond);
             }
+            continue;
+        }
+        if (!do_run_maintenance_thread) {
+            break;
+        }
+        pthread_cond_wait(&migrate_cond, &migrate_lock);
+    }
+    mutex_unlock(&migrate_lock);
+    return NULL;
+}
+
+/* Runs a whole migration across all migration threads. Returns false if
+ * we were asked to stop before it finished. */
+static bool assoc_migrate(void) {
+    mutex_lock(&migrate_lock);
+    migrate_pending = migrate_threads - 1;
+    migrate_generation++;
+    pthread_cond_broadcast(&migrate_cond);
+    mutex_unlock(&migrate_lock);
+
+    assoc_migrate_range(0);
+
+    mutex_lock(&migrate_lock);
+    while (migrate_pending > 0) {
+        pthread_cond_wait(&migrate_done_cond, &migrate_lock);
+    }
+    mutex_unlock(&migrate_lock);
+
+    return do_run_maintenance_thread;
+}
 
-            if (item_lock) {
-                item_trylock_unlock(item_lock);
-                item_lock = NULL;
+/* Every unit has moved, so nothing can reach the old table anymore. */
+static void assoc_migrate_finish(void) {
+    uint64_t elapsed_us = assoc_elapsed_us(&expand_started);
+    bool was_expanding = expanding;
+    expanding = false;
+    shrinking = false;
+    if (use_buckets) {
+        assoc_table_free(old_buckets, old_hashpower, old_pages);
+        old_buckets = NULL;
+    } else {
+        assoc_table_free(old_hashtable, old_hashpower, old_pages);
+        old_hashtable = NULL;
+    }
+    STATS_LOCK();
+    stats_state.hash_bytes -= assoc_table_bytes(old_hashpower);
+    stats_state.hash_is_expanding = false;
+    stats_state.hash_is_shrinking = false;
+    if (was_expanding) {
+        stats.hash_expansions++;
+        stats.hash_expand_time_us += elapsed_us;
+    } else {
+        stats.hash_shrinks++;
+        stats.hash_shrink_time_us += elapsed_us;
+    }
+    STATS_UNLOCK();
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table %s done\n",
+                was_expanding ? "expansion" : "shrink");
+}
+
+static void *assoc_maintenance_thread(void *arg) {
+
+    mutex_lock(&maintenance_lock);
+    while (do_run_maintenance_thread) {
+        if (expanding || shrinking) {
+            if (!assoc_migrate()) {
+                break;
             }
+            assoc_migrate_finish();
         }
 
-        if (!expanding) {
-            /* We are done expanding.. just wait for next invocation */
-            pthread_cond_wait(&maintenance_cond, &maintenance_lock);
-            /* assoc_expand() swaps out the hash table entirely, so we need
-             * all threads to not hold any references related to the hash
-             * table while this happens.
-             * This is instead of a more complex, possibly slower algorithm to
-             * allow dynamic hash table expansion without causing significant
-             * wait times.
+        /* We are done expanding.. just wait for next invocation */
+        pthread_cond_wait(&maintenance_cond, &maintenance_lock);
+        if (do_run_maintenance_thread && resize_wanted != 0) {
+            unsigned int new_power = hashpower + resize_wanted;
+            resize_wanted = 0;
+            /* Allocating (and zeroing) the new table can take a while
+             * for large tables, so do it before stalling anyone. */
+            enum assoc_pages new_pages;
+            void *new_table = assoc_table_alloc(new_power, &new_pages);
+            if (new_table == NULL) {
+                /* Bad news, but we can keep running. */
+                continue;
+            }
+            gettimeofday(&expand_started, NULL);
+            /* assoc_resize() swaps out the hash table entirely, so no
+             * thread may hold a reference into the hash table while it
+             * runs. Every bucket access is made under an item lock, so
+             * holding all of them is enough: workers touching a stripe
+             * wait only for the pointer swap and everything else keeps
+             * running. hash_expand_pause restores the old behavior of
+             * parking all worker and background threads instead.
              */
-            if (do_run_maintenance_thread) {
+            if (settings.hash_expand_pause) {
                 pause_threads(PAUSE_ALL_THREADS);
-                assoc_expand();
+                assoc_resize(new_table, new_power, new_pages);
                 pause_threads(RESUME_ALL_THREADS);
+            } else {
+                item_lock_all();
+                assoc_resize(new_table, new_power, new_pages);
+                item_unlock_all();
             }
+            uint64_t stall_us = assoc_elapsed_us(&expand_started);
+            STATS_LOCK();
+            stats.hash_expand_stall_us += stall_us;
+            STATS_UNLOCK();
         }
     }
     mutex_unlock(&maintenance_lock);
@@ -275,6 +817,33 @@ int start_assoc_maintenance_thread(void) {
         }
     }
 
+    migrate_stripes = item_lock_stripes();
+    migrate_cursor = calloc(migrate_stripes, sizeof(uint64_t));
+    if (migrate_cursor == NULL) {
+        fprintf(stderr, "Can't allocate hash migration state\n");
+        return -1;
+    }
+    migrate_threads = settings.hash_migrate_threads;
+    if (migrate_threads > migrate_stripes) {
+        migrate_threads = migrate_stripes;
+    }
+
+    if (migrate_threads > 1) {
+        migrate_tids = calloc(migrate_threads, sizeof(pthread_t));
+        if (migrate_tids == NULL) {
+            fprintf(stderr, "Can't allocate hash migration threads\n");
+            return -1;
+        }
+        for (int x = 1; x < migrate_threads; x++) {
+            if ((ret = pthread_create(&migrate_tids[x], NULL,
+                            assoc_migrate_thread, (void *)(intptr_t)x)) != 0) {
+                fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
+                return -1;
+            }
+            thread_setname(migrate_tids[x], "mc-assocmigr");
+        }
+    }
+
     if ((ret = pthread_create(&maintenance_tid, NULL,
                               assoc_maintenance_thread, NULL)) != 0) {
         fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
@@ -285,19 +854,27 @@ int start_assoc_maintenance_thread(void) {
 }
 
 void stop_assoc_maintenance_thread(void) {
-    mutex_lock(&maintenance_lock);
+    /* Set before taking the lock so an in-progress migration bails out. */
     do_run_maintenance_thread = 0;
+    mutex_lock(&maintenance_lock);
     pthread_cond_signal(&maintenance_cond);
     mutex_unlock(&maintenance_lock);
 
     /* Wait for the maintenance thread to stop */
     pthread_join(maintenance_tid, NULL);
+
+    mutex_lock(&migrate_lock);
+    pthread_cond_broadcast(&migrate_cond);
+    mutex_unlock(&migrate_lock);
+    for (int x = 1; x < migrate_threads; x++) {
+        pthread_join(migrate_tids[x], NULL);
+    }
 }
 
 struct assoc_iterator {
     uint64_t bucket;
-    item *it;
     item *next;
+    int slot; /* next slot to check when using the bucketed table */
     bool bucket_locked;
 };
 
@@ -311,22 +888,41 @@ void *assoc_get_iterator(void) {
     return iter;
 }
 
+// returns the next item in the locked bucket, or NULL if it's exhausted.
+static item *_iterate_bucket(struct assoc_iterator *iter) {
+    item *it;
+    if (use_buckets) {
+        struct assoc_bucket *b = &primary_buckets[iter->bucket];
+        while (iter->slot < ASSOC_BUCKET_SLOTS) {
+            if ((it = b->slots[iter->slot++]) != NULL) {
+                return it;
+            }
+        }
+        // slots done, walk the overflow chain.
+        if (iter->slot == ASSOC_BUCKET_SLOTS) {
+            iter->slot++;
+            iter->next = b->chain;
+        }
+    }
+
+    it = iter->next;
+    if (it != NULL) {
+        iter->next = ITEM_h_next(it);
+    }
+    return it;
+}
+
 bool assoc_iterate(void *iterp, item **it) {
     struct assoc_iterator *iter = (struct assoc_iterator *) iterp;
     *it = NULL;
     // - if locked bucket and next, update next and return
     if (iter->bucket_locked) {
-        if (iter->next != NULL) {
-            iter->it = iter->next;
-            iter->next = iter->it->h_next;
-            *it = iter->it;
-        } else {
+        if ((*it = _iterate_bucket(iter)) == NULL) {
             // unlock previous bucket, if any
             item_unlock(iter->bucket);
             // iterate the bucket post since it starts at 0.
             iter->bucket++;
             iter->bucket_locked = false;
-            *it = NULL;
         }
         return true;
     }
@@ -337,12 +933,9 @@ bool assoc_iterate(void *iterp, item **it) {
         item_lock(iter->bucket);
         iter->bucket_locked = true;
         // - only check the primary hash table since expand is blocked.
-        iter->it = primary_hashtable[iter->bucket];
-        if (iter->it != NULL) {
-            // - set it, next and return
-            iter->next = iter->it->h_next;
-            *it = iter->it;
-        } else {
+        iter->slot = 0;
+        iter->next = use_buckets ? NULL : primary_hashtable[iter->bucket];
+        if ((*it = _iterate_bucket(iter)) == NULL) {
             // - nothing found in this bucket, try next.
             item_unlock(iter->bucket);
             iter->bucket_locked = false;
@@ -4,10 +4,14 @@ void assoc_init(const int hashpower_init);
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
 int assoc_insert(item *item, const uint32_t hv);
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv);
+void assoc_prefetch(const uint32_t hv);
 
 int start_assoc_maintenance_thread(void);
 void stop_assoc_maintenance_thread(void);
-void assoc_start_expand(uint64_t curr_items);
+void assoc_start_resize(uint64_t curr_items);
+uint64_t assoc_migrate_remaining(void);
+const char *assoc_page_type(void);
+bool assoc_numa_applied(void);
 
 /* walk functions */
 void *assoc_get_iterator(void);
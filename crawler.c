@@ -106,7 +106,12 @@ static int lru_crawler_write(crawler_client_t *c);
 crawler_module_t active_crawler_mod;
 enum crawler_run_type active_crawler_type;
 
+#ifdef COMPACT_ITEMS
+/* Items link to the sentinels, so they live in the item arena's head */
+static crawler *crawlers = NULL;
+#else
 static crawler crawlers[LARGEST_ID];
+#endif
 
 static int crawler_count = 0;
 static volatile int do_run_lru_crawler_thread = 0;
@@ -515,7 +520,7 @@ static void *item_crawler_thread(void *arg) {
                 lru_crawler_class_done(i);
                 continue;
             }
-            pthread_mutex_lock(&lru_locks[i]);
+            lru_lock(i);
             search = do_item_crawl_q((item *)&crawlers[i]);
             if (search == NULL ||
                 (crawlers[i].remaining && --crawlers[i].remaining < 1)) {
@@ -658,7 +663,7 @@ static int do_lru_crawler_start(uint32_t id, uint32_t remaining) {
     uint32_t sid = id;
     int starts = 0;
 
-    pthread_mutex_lock(&lru_locks[sid]);
+    lru_lock(sid);
     if (crawlers[sid].it_flags == 0) {
         if (settings.verbose > 2)
             fprintf(stderr, "Kicking LRU crawler off for LRU %u\n", sid);
@@ -853,6 +858,10 @@ int init_lru_crawler(void *arg) {
         active_crawler_mod.c.c = NULL;
         active_crawler_mod.mod = NULL;
         active_crawler_mod.data = NULL;
+#ifdef COMPACT_ITEMS
+        assert(sizeof(crawler) * LARGEST_ID <= ITEM_ARENA_HEAD);
+        crawlers = slabs_arena_head();
+#endif
         lru_crawler_initialized = 1;
     }
     return 0;
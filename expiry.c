@@ -0,0 +1,302 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Expiry timer wheel.
+ *
+ * Items linked with a TTL inside the wheel's horizon are noted in the slot
+ * for the second they expire. Once a second a background thread walks the
+ * slots which have come due and unlinks whatever is still expired, so short
+ * lived items are reclaimed right away instead of waiting for the LRU
+ * crawler to find them. Work done is proportional to what expires, not to
+ * the number of items in the cache.
+ *
+ * Entries aren't removed when an item is deleted, replaced or touched.
+ * Instead they are checked when their slot fires. An entry holds a copy of
+ * the key, which is looked up under the item lock; it is only acted on if
+ * the lookup finds the same item, and that item has expired. The item
+ * pointer is never followed, as its memory may have been freed, moved or
+ * reused by then. Items with a TTL past the horizon, or noted while the
+ * wheel is at its memory limit, are left to the LRU crawler.
+ */
+#include "memcached.h"
+#include "expiry.h"
+#include "storage.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define EXPIRY_LOCKS 64
+#define EXPIRY_BLOCK_BYTES 4080
+
+struct expiry_entry {
+    item *it; /* compared against, never dereferenced */
+    uint32_t hv;
+    rel_time_t exptime;
+    uint8_t nkey;
+    char key[];
+};
+
+/* Entries are packed one after another, each padded to pointer alignment. */
+#define EXPIRY_ENTRY_SIZE(nkey) \
+    ((offsetof(struct expiry_entry, key) + (nkey) + sizeof(void *) - 1) \
+     & ~(sizeof(void *) - 1))
+
+struct expiry_block {
+    struct expiry_block *next;
+    size_t used; /* bytes of data in use, keeps data aligned */
+    char data[EXPIRY_BLOCK_BYTES];
+};
+
+/* one list of blocks per second, indexed by exptime % horizon */
+static struct expiry_block **slots = NULL;
+static unsigned int horizon = 0;
+/* Wheel memory is kept to a share of -m; past it new TTLs go unnoted and are
+ * left to the LRU crawler. */
+#define EXPIRY_MEM_SHARE 32
+static uint64_t block_limit = 0;
+static pthread_mutex_t slot_locks[EXPIRY_LOCKS];
+
+static pthread_t expiry_tid;
+static volatile int do_run_expiry_thread = 0;
+static pthread_mutex_t expiry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t expiry_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_mutex_t expiry_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    uint64_t blocks;
+    uint64_t reclaimed;
+    uint64_t stale;
+    uint64_t add_failures;
+    uint64_t runs;
+} expiry_stats;
+
+bool expiry_wheel_init(const unsigned int seconds, const size_t limit) {
+    int i;
+    slots = calloc(seconds, sizeof(struct expiry_block *));
+    if (slots == NULL)
+        return false;
+    horizon = seconds;
+    block_limit = limit / EXPIRY_MEM_SHARE / sizeof(struct expiry_block);
+    if (block_limit < EXPIRY_LOCKS)
+        block_limit = EXPIRY_LOCKS;
+    for (i = 0; i < EXPIRY_LOCKS; i++) {
+        pthread_mutex_init(&slot_locks[i], NULL);
+    }
+    return true;
+}
+
+static void expiry_slot_push(const unsigned int s, item *it,
+        const uint32_t hv, const rel_time_t exptime,
+        const char *key, const uint8_t nkey) {
+    struct expiry_block *b;
+    struct expiry_entry *e;
+    size_t size = EXPIRY_ENTRY_SIZE(nkey);
+
+    pthread_mutex_lock(&slot_locks[s % EXPIRY_LOCKS]);
+    b = slots[s];
+    if (b == NULL || b->used + size > EXPIRY_BLOCK_BYTES) {
+        struct expiry_block *nb = NULL;
+        /* Count the block before allocating it so racing slots can't
+         * overshoot the limit together. */
+        pthread_mutex_lock(&expiry_stats_lock);
+        if (expiry_stats.blocks < block_limit) {
+            expiry_stats.blocks++;
+            pthread_mutex_unlock(&expiry_stats_lock);
+            nb = malloc(sizeof(struct expiry_block));
+            pthread_mutex_lock(&expiry_stats_lock);
+            if (nb == NULL)
+                expiry_stats.blocks--;
+        }
+        if (nb == NULL) {
+            expiry_stats.add_failures++;
+            pthread_mutex_unlock(&expiry_stats_lock);
+            pthread_mutex_unlock(&slot_locks[s % EXPIRY_LOCKS]);
+            return;
+        }
+        pthread_mutex_unlock(&expiry_stats_lock);
+        nb->used = 0;
+        nb->next = b;
+        slots[s] = nb;
+        b = nb;
+    }
+    e = (struct expiry_entry *)(b->data + b->used);
+    e->it = it;
+    e->hv = hv;
+    e->exptime = exptime;
+    e->nkey = nkey;
+    memcpy(e->key, key, nkey);
+    b->used += size;
+    pthread_mutex_unlock(&slot_locks[s % EXPIRY_LOCKS]);
+}
+
+/* Called with the item lock held, after the item was linked or had its
+ * exptime changed. */
+void expiry_wheel_add(item *it, const uint32_t hv) {
+    rel_time_t exptime = it->exptime;
+
+    if (exptime == 0 || exptime <= current_time
+            || exptime - current_time >= horizon)
+        return;
+
+    expiry_slot_push(exptime % horizon, it, hv, exptime,
+            ITEM_key(it), it->nkey);
+}
+
+/* Returns true if the item was reclaimed. */
+static bool expiry_entry_run(struct expiry_entry *e) {
+    bool reclaimed = false;
+    item *it;
+
+    item_lock(e->hv);
+    /* Whatever is linked under the key is safe to look at while we hold
+     * its lock, but it's only ours if it's the item the entry was made
+     * for. */
+    it = assoc_find(e->key, e->nkey, e->hv);
+    if (it != NULL && it == e->it
+            && it->exptime != 0 && it->exptime <= current_time) {
+        STORAGE_delete(ext_storage, it);
+        do_item_unlink(it, e->hv);
+        reclaimed = true;
+    }
+    item_unlock(e->hv);
+    return reclaimed;
+}
+
+static void expiry_slot_run(const unsigned int s) {
+    struct expiry_block *b, *next;
+    uint64_t reclaimed = 0;
+    uint64_t stale = 0;
+    uint64_t blocks = 0;
+    struct expiry_entry *e;
+    size_t off;
+
+    pthread_mutex_lock(&slot_locks[s % EXPIRY_LOCKS]);
+    b = slots[s];
+    slots[s] = NULL;
+    pthread_mutex_unlock(&slot_locks[s % EXPIRY_LOCKS]);
+
+    for (; b != NULL; b = next) {
+        next = b->next;
+        for (off = 0; off < b->used; off += EXPIRY_ENTRY_SIZE(e->nkey)) {
+            e = (struct expiry_entry *)(b->data + off);
+            /* The wheel can run a slot early while catching up after a
+             * clock jump; those entries wait for the next lap. */
+            if (e->exptime > current_time) {
+                expiry_slot_push(s, e->it, e->hv, e->exptime,
+                        e->key, e->nkey);
+                continue;
+            }
+            if (expiry_entry_run(e)) {
+                reclaimed++;
+            } else {
+                stale++;
+            }
+        }
+        blocks++;
+        free(b);
+    }
+
+    pthread_mutex_lock(&expiry_stats_lock);
+    expiry_stats.blocks -= blocks;
+    expiry_stats.reclaimed += reclaimed;
+    expiry_stats.stale += stale;
+    pthread_mutex_unlock(&expiry_stats_lock);
+}
+
+static void *expiry_wheel_thread(void *arg) {
+    rel_time_t done = current_time;
+
+    pthread_mutex_lock(&expiry_lock);
+    pthread_cond_signal(&expiry_cond);
+    if (settings.verbose > 2)
+        fprintf(stderr, "Starting expiry wheel thread\n");
+    while (do_run_expiry_thread) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        pthread_cond_timedwait(&expiry_cond, &expiry_lock, &ts);
+        if (!do_run_expiry_thread)
+            break;
+        pthread_mutex_unlock(&expiry_lock);
+
+        rel_time_t now = current_time;
+        /* After a long stall every slot is due once */
+        if (now - done > horizon)
+            done = now - horizon;
+        while (done < now) {
+            done++;
+            expiry_slot_run(done % horizon);
+        }
+        pthread_mutex_lock(&expiry_stats_lock);
+        expiry_stats.runs++;
+        pthread_mutex_unlock(&expiry_stats_lock);
+
+        pthread_mutex_lock(&expiry_lock);
+    }
+    pthread_mutex_unlock(&expiry_lock);
+    if (settings.verbose > 2)
+        fprintf(stderr, "Expiry wheel thread stopping\n");
+    return NULL;
+}
+
+int start_expiry_wheel_thread(void) {
+    int ret;
+    pthread_mutex_lock(&expiry_lock);
+    do_run_expiry_thread = 1;
+    if ((ret = pthread_create(&expiry_tid, NULL,
+        expiry_wheel_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create expiry wheel thread: %s\n",
+            strerror(ret));
+        do_run_expiry_thread = 0;
+        pthread_mutex_unlock(&expiry_lock);
+        return -1;
+    }
+    thread_setname(expiry_tid, "mc-expiry");
+    /* Avoid returning until the thread has actually started */
+    pthread_cond_wait(&expiry_cond, &expiry_lock);
+    pthread_mutex_unlock(&expiry_lock);
+    return 0;
+}
+
+/* If we hold this lock, the wheel thread can't wake up or touch items */
+void expiry_wheel_pause(void) {
+    pthread_mutex_lock(&expiry_lock);
+}
+
+void expiry_wheel_resume(void) {
+    pthread_mutex_unlock(&expiry_lock);
+}
+
+int stop_expiry_wheel_thread(void) {
+    int ret;
+    pthread_mutex_lock(&expiry_lock);
+    if (do_run_expiry_thread == 0) {
+        pthread_mutex_unlock(&expiry_lock);
+        return 0;
+    }
+    do_run_expiry_thread = 0;
+    pthread_cond_signal(&expiry_cond);
+    pthread_mutex_unlock(&expiry_lock);
+    if ((ret = pthread_join(expiry_tid, NULL)) != 0) {
+        fprintf(stderr, "Failed to stop expiry wheel thread: %s\n", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+void expiry_wheel_stats(ADD_STAT add_stats, void *c) {
+    pthread_mutex_lock(&expiry_stats_lock);
+    APPEND_STAT("expiry_wheel_runs", "%llu",
+            (unsigned long long)expiry_stats.runs);
+    APPEND_STAT("expiry_wheel_reclaimed", "%llu",
+            (unsigned long long)expiry_stats.reclaimed);
+    APPEND_STAT("expiry_wheel_stale", "%llu",
+            (unsigned long long)expiry_stats.stale);
+    APPEND_STAT("expiry_wheel_add_failures", "%llu",
+            (unsigned long long)expiry_stats.add_failures);
+    APPEND_STAT("expiry_wheel_bytes", "%llu",
+            (unsigned long long)(expiry_stats.blocks * sizeof(struct expiry_block)));
+    APPEND_STAT("expiry_wheel_limit", "%llu",
+            (unsigned long long)(block_limit * sizeof(struct expiry_block)));
+    pthread_mutex_unlock(&expiry_stats_lock);
+}
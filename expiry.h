@@ -0,0 +1,13 @@
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+/* Timer wheel of items with a TTL, for -o expiry_wheel. */
+bool expiry_wheel_init(const unsigned int horizon, const size_t limit);
+int start_expiry_wheel_thread(void);
+int stop_expiry_wheel_thread(void);
+void expiry_wheel_pause(void);
+void expiry_wheel_resume(void);
+void expiry_wheel_add(item *it, const uint32_t hv);
+void expiry_wheel_stats(ADD_STAT add_stats, void *c);
+
+#endif
@@ -2,7 +2,12 @@
 #include "memcached.h"
 #include "bipbuffer.h"
 #include "slab_automove.h"
+#include "slab_automove_shadow.h"
 #include "storage.h"
+#include "tinylfu.h"
+#include "expiry.h"
+#include "mrc.h"
+#include "quota.h"
 #ifdef EXTSTORE
 #include "slab_automove_extstore.h"
 #endif
@@ -44,6 +49,10 @@ typedef struct {
     uint64_t moves_to_warm;
     uint64_t moves_within_lru;
     uint64_t direct_reclaims;
+    uint64_t admission_rejects; /* allocations refused by lru_admission */
+    uint64_t ghost_hits; /* S3-FIFO inserts which skipped the small queue */
+    uint64_t ghost_misses; /* S3-FIFO inserts into the small queue */
+    uint64_t evicted_cost; /* summed cost of evicted items */
     uint64_t hits_to_hot;
     uint64_t hits_to_warm;
     uint64_t hits_to_cold;
@@ -57,20 +66,28 @@ static item *tails[LARGEST_ID];
 static itemstats_t itemstats[LARGEST_ID];
 static unsigned int sizes[LARGEST_ID];
 static uint64_t sizes_bytes[LARGEST_ID];
+static uint64_t sizes_cost[LARGEST_ID];
 static unsigned int *stats_sizes_hist = NULL;
 static uint64_t stats_sizes_cas_min = 0;
 static int stats_sizes_buckets = 0;
+/* Items in the histogram and their total size, for items_per_gb */
+static uint64_t stats_sizes_items = 0;
+static uint64_t stats_sizes_bytes = 0;
 static uint64_t cas_id = 0;
+/* S3-FIFO ghost queue: hashes of items recently evicted from the small queue.
+ * Direct mapped, so a newer eviction overwrites an older one in its slot. */
+static uint32_t *s3fifo_ghost = NULL;
+static uint32_t s3fifo_ghost_mask = 0;
 
 static volatile int do_run_lru_maintainer_thread = 0;
-static pthread_mutex_t lru_maintainer_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t cas_id_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t stats_sizes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t s3fifo_init_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void item_stats_reset(void) {
     int i;
     for (i = 0; i < LARGEST_ID; i++) {
-        pthread_mutex_lock(&lru_locks[i]);
+        lru_lock(i);
         memset(&itemstats[i], 0, sizeof(itemstats_t));
         pthread_mutex_unlock(&lru_locks[i]);
     }
@@ -90,6 +107,7 @@ typedef struct _lru_bump_buf {
     pthread_mutex_t mutex;
     bipbuf_t *buf;
     uint64_t dropped;
+    unsigned int id; /* picks the LRU maintainer thread draining it */
 } lru_bump_buf;
 
 typedef struct {
@@ -99,6 +117,7 @@ typedef struct {
 
 static lru_bump_buf *bump_buf_head = NULL;
 static lru_bump_buf *bump_buf_tail = NULL;
+static unsigned int bump_buf_count = 0;
 static pthread_mutex_t bump_buf_lock = PTHREAD_MUTEX_INITIALIZER;
 /* TODO: tunable? Need bench results */
 #define LRU_BUMP_BUF_SIZE 8192
@@ -109,14 +128,14 @@ static uint64_t lru_total_bumps_dropped(void);
 /* Get the next CAS id for a new item. */
 /* TODO: refactor some atomics for this. */
 uint64_t get_cas_id(void) {
-    pthread_mutex_lock(&cas_id_lock);
+    mutex_lock_class(&cas_id_lock, LOCK_CLASS_CAS_ID, NULL);
     uint64_t next_id = ++cas_id;
     pthread_mutex_unlock(&cas_id_lock);
     return next_id;
 }
 
 void set_cas_id(uint64_t new_cas) {
-    pthread_mutex_lock(&cas_id_lock);
+    mutex_lock_class(&cas_id_lock, LOCK_CLASS_CAS_ID, NULL);
     cas_id = new_cas;
     pthread_mutex_unlock(&cas_id_lock);
 }
@@ -171,16 +190,38 @@ static size_t item_make_header(const uint8_t nkey, const client_flags_t flags, c
     return sizeof(item) + nkey + *nsuffix + nbytes;
 }
 
-item *do_item_alloc_pull(const size_t ntotal, const unsigned int id) {
+/* S3-FIFO evicts from the small queue (HOT) while it holds more than its
+ * share of the class, otherwise from main (COLD). Unlocked reads; this only
+ * has to be roughly right. */
+#define S3FIFO_SMALL_PCT 10
+static bool s3fifo_small_over(const unsigned int id) {
+    uint64_t small = sizes_bytes[id|HOT_LRU];
+    uint64_t main = sizes_bytes[id|COLD_LRU];
+    return small * 100 > (small + main) * S3FIFO_SMALL_PCT;
+}
+
+/* If admit is set, the item being allocated (admit->hv) has to win admission
+ * against the COLD tail before that tail is evicted for it. admit->rejected
+ * tells a lost admission apart from running out of memory. */
+item *do_item_alloc_pull(const size_t ntotal, const unsigned int id,
+        struct lru_pull_tail_return *admit) {
     item *it = NULL;
     int i;
+    uint8_t evict_flags = LRU_PULL_EVICT;
+    if (admit != NULL) {
+        admit->rejected = false;
+        evict_flags |= LRU_PULL_ADMIT;
+    }
     /* If no memory is available, attempt a direct LRU juggle/eviction */
     /* This is a race in order to simplify lru_pull_tail; in cases where
      * locked items are on the tail, you want them to fall out and cause
      * occasional OOM's, rather than internally work around them.
      * This also gives one fewer code path for slab alloc/free
      */
-    for (i = 0; i < 10; i++) {
+    /* An eviction frees a chunk of the class being allocated from, but in
+     * the log an item may free far less than this one needs */
+    const int tries = settings.log_memory ? 100 : 10;
+    for (i = 0; i < tries; i++) {
         /* Try to reclaim memory first */
         if (!settings.lru_segmented) {
             lru_pull_tail(id, COLD_LRU, 0, 0, 0, NULL);
@@ -188,11 +229,23 @@ item *do_item_alloc_pull(const size_t ntotal, const unsigned int id) {
         it = slabs_alloc(ntotal, id, 0);
 
         if (it == NULL) {
+            int evict_lru = COLD_LRU;
+            if (settings.lru_s3fifo && s3fifo_small_over(id)) {
+                evict_lru = HOT_LRU;
+            }
             // We send '0' in for "total_bytes" as this routine is always
             // pulling to evict, or forcing HOT -> COLD migration.
             // As of this writing, total_bytes isn't at all used with COLD_LRU.
-            if (lru_pull_tail(id, COLD_LRU, 0, LRU_PULL_EVICT, 0, NULL) <= 0) {
-                if (settings.lru_segmented) {
+            if (lru_pull_tail(id, evict_lru, 0, evict_flags, 0, admit) <= 0) {
+                if (admit != NULL && admit->rejected) {
+                    break;
+                } else if (settings.lru_s3fifo) {
+                    /* One queue was empty or all locked; try the other. */
+                    lru_pull_tail(id, evict_lru == HOT_LRU ? COLD_LRU : HOT_LRU,
+                            0, evict_flags, 0, admit);
+                    if (admit != NULL && admit->rejected)
+                        break;
+                } else if (settings.lru_segmented) {
                     lru_pull_tail(id, HOT_LRU, 0, 0, 0, NULL);
                 } else {
                     break;
@@ -204,7 +257,7 @@ item *do_item_alloc_pull(const size_t ntotal, const unsigned int id) {
     }
 
     if (i > 0) {
-        pthread_mutex_lock(&lru_locks[id]);
+        lru_lock(id);
         itemstats[id].direct_reclaims += i;
         pthread_mutex_unlock(&lru_locks[id]);
     }
@@ -224,7 +277,7 @@ item_chunk *do_item_alloc_chunk(item_chunk *ch, const size_t bytes_remain) {
         size = settings.slab_chunk_size_max;
     unsigned int id = slabs_clsid(size);
 
-    item_chunk *nch = (item_chunk *) do_item_alloc_pull(size, id);
+    item_chunk *nch = (item_chunk *) do_item_alloc_pull(size, id, NULL);
     if (nch == NULL) {
         // The final chunk in a large item will attempt to be a more
         // appropriately sized chunk to minimize memory overhead. However, if
@@ -236,7 +289,7 @@ item_chunk *do_item_alloc_chunk(item_chunk *ch, const size_t bytes_remain) {
         } else {
             size = settings.slab_chunk_size_max;
             id = slabs_clsid(size);
-            nch = (item_chunk *) do_item_alloc_pull(size, id);
+            nch = (item_chunk *) do_item_alloc_pull(size, id, NULL);
 
             if (nch == NULL)
                 return NULL;
@@ -258,11 +311,26 @@ item_chunk *do_item_alloc_chunk(item_chunk *ch, const size_t bytes_remain) {
     return nch;
 }
 
+/* Never held to the admission filter; see do_item_alloc_hv(). */
 item *do_item_alloc(const char *key, const size_t nkey, const client_flags_t flags,
                     const rel_time_t exptime, const int nbytes) {
+    return do_item_alloc_hv(key, nkey, flags, exptime, nbytes, 0, NULL);
+}
+
+/* If rejected is set and lru_admission is on, a key which isn't linked yet
+ * has to win admission against the eviction victim, and rejected reports
+ * whether a NULL return was the filter keeping the victim rather than a
+ * lack of memory. The caller then holds the item lock for hv. A linked key
+ * is let in regardless, as storing it frees the old item. Callers replacing
+ * an item they hold pass NULL. */
+item *do_item_alloc_hv(const char *key, const size_t nkey, const client_flags_t flags,
+                    const rel_time_t exptime, const int nbytes, const uint32_t hv,
+                    bool *rejected) {
     uint8_t nsuffix;
     item *it = NULL;
     char suffix[40];
+    if (rejected != NULL)
+        *rejected = false;
     // Avoid potential underflows.
     if (nbytes < 2)
         return 0;
@@ -277,6 +345,19 @@ item *do_item_alloc(const char *key, const size_t nkey, const client_flags_t fla
     if (id == 0)
         return 0;
 
+    if (settings.prefix_quotas && !quota_make_room(key, nkey, ntotal))
+        return NULL;
+
+    /* A write counts as an access, so a new key has some frequency to bring
+     * against the eviction victim. */
+    struct lru_pull_tail_return admit = {NULL, hv, false};
+    struct lru_pull_tail_return *admit_p = NULL;
+    if (settings.lru_admission && rejected != NULL) {
+        tinylfu_record(hv);
+        if (assoc_find(key, nkey, hv) == NULL)
+            admit_p = &admit;
+    }
+
     /* This is a large item. Allocate a header object now, lazily allocate
      *  chunks while reading the upload.
      */
@@ -297,16 +378,22 @@ item *do_item_alloc(const char *key, const size_t nkey, const client_flags_t fla
         }
 #endif
         hdr_id = slabs_clsid(htotal);
-        it = do_item_alloc_pull(htotal, hdr_id);
+        it = do_item_alloc_pull(htotal, hdr_id, admit_p);
         /* setting ITEM_CHUNKED is fine here because we aren't LINKED yet. */
         if (it != NULL)
             it->it_flags |= ITEM_CHUNKED;
     } else {
-        it = do_item_alloc_pull(ntotal, id);
+        it = do_item_alloc_pull(ntotal, id, admit_p);
     }
 
     if (it == NULL) {
-        pthread_mutex_lock(&lru_locks[id]);
+        if (admit.rejected) {
+            /* Not a memory problem; admission_rejects already counted it. */
+            if (rejected != NULL)
+                *rejected = true;
+            return NULL;
+        }
+        lru_lock(id);
         itemstats[id].outofmemory++;
         pthread_mutex_unlock(&lru_locks[id]);
         return NULL;
@@ -324,7 +411,7 @@ item *do_item_alloc(const char *key, const size_t nkey, const client_flags_t fla
     if (settings.temp_lru &&
             exptime - current_time <= settings.temporary_ttl) {
         id |= TEMP_LRU;
-    } else if (settings.lru_segmented) {
+    } else if (settings.lru_segmented || settings.lru_s3fifo) {
         id |= HOT_LRU;
     } else {
         /* There is only COLD in compat-mode */
@@ -335,6 +422,7 @@ item *do_item_alloc(const char *key, const size_t nkey, const client_flags_t fla
     DEBUG_REFCNT(it, '*');
     it->it_flags |= settings.use_cas ? ITEM_CAS : 0;
     it->it_flags |= nsuffix != 0 ? ITEM_CFLAGS : 0;
+    it->cost = 1;
     it->nkey = nkey;
     it->nbytes = nbytes;
     memcpy(ITEM_key(it), key, nkey);
@@ -413,6 +501,9 @@ void do_item_link_fixup(item *it) {
     STATS_UNLOCK();
 
     item_stats_sizes_add(it);
+    if (settings.prefix_quotas) {
+        quota_link(it, hv);
+    }
 
     return;
 }
@@ -426,8 +517,8 @@ static void do_item_link_q(item *it) { /* item is the new head */
     assert(it != *head);
     assert((*head && *tail) || (*head == 0 && *tail == 0));
     it->prev = 0;
-    it->next = *head;
-    if (it->next) it->next->prev = it;
+    ITEM_set_next(it, *head);
+    if (it->next) ITEM_set_prev(ITEM_next(it), it);
     *head = it;
     if (*tail == 0) *tail = it;
     sizes[it->slabs_clsid]++;
@@ -440,18 +531,41 @@ static void do_item_link_q(item *it) { /* item is the new head */
 #else
     sizes_bytes[it->slabs_clsid] += ITEM_ntotal(it);
 #endif
+    sizes_cost[it->slabs_clsid] += it->cost;
 
     return;
 }
 
 static void item_link_q(item *it) {
-    pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
+    lru_lock(it->slabs_clsid);
     do_item_link_q(it);
     pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
 }
 
+/* S3-FIFO inserts into the small queue, unless the key was evicted from it
+ * recently enough to still be in the ghost queue. Then it goes to main. */
+static void item_link_q_s3fifo(item *it, const uint32_t hv) {
+    bool ghost_hit = false;
+    if (ITEM_lruid(it) == HOT_LRU && s3fifo_ghost != NULL) {
+        uint32_t *slot = &s3fifo_ghost[hv & s3fifo_ghost_mask];
+        if (*slot == hv && hv != 0) {
+            *slot = 0;
+            ghost_hit = true;
+            it->slabs_clsid = ITEM_clsid(it) | COLD_LRU;
+        }
+    }
+    lru_lock(it->slabs_clsid);
+    do_item_link_q(it);
+    if (ghost_hit) {
+        itemstats[it->slabs_clsid].ghost_hits++;
+    } else if (ITEM_lruid(it) == HOT_LRU) {
+        itemstats[it->slabs_clsid].ghost_misses++;
+    }
+    pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
+}
+
 static void item_link_q_warm(item *it) {
-    pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
+    lru_lock(it->slabs_clsid);
     do_item_link_q(it);
     itemstats[it->slabs_clsid].moves_to_warm++;
     pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
@@ -464,17 +578,17 @@ static void do_item_unlink_q(item *it) {
 
     if (*head == it) {
         assert(it->prev == 0);
-        *head = it->next;
+        *head = ITEM_next(it);
     }
     if (*tail == it) {
         assert(it->next == 0);
-        *tail = it->prev;
+        *tail = ITEM_prev(it);
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+    assert(ITEM_next(it) != it);
+    assert(ITEM_prev(it) != it);
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
+    if (it->next) ITEM_next(it)->prev = it->prev;
+    if (it->prev) ITEM_prev(it)->next = it->next;
     sizes[it->slabs_clsid]--;
 #ifdef EXTSTORE
     if (it->it_flags & ITEM_HDR) {
@@ -485,12 +599,13 @@ static void do_item_unlink_q(item *it) {
 #else
     sizes_bytes[it->slabs_clsid] -= ITEM_ntotal(it);
 #endif
+    sizes_cost[it->slabs_clsid] -= it->cost;
 
     return;
 }
 
 static void item_unlink_q(item *it) {
-    pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
+    lru_lock(it->slabs_clsid);
     do_item_unlink_q(it);
     pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
 }
@@ -500,6 +615,7 @@ int do_item_link(item *it, const uint32_t hv) {
     assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
     it->it_flags |= ITEM_LINKED;
     it->time = current_time;
+    it->credit = it->cost;
 
     STATS_LOCK();
     stats_state.curr_bytes += ITEM_ntotal(it);
@@ -510,9 +626,22 @@ int do_item_link(item *it, const uint32_t hv) {
     /* Allocate a new CAS ID on link. */
     ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
     assoc_insert(it, hv);
-    item_link_q(it);
+    if (settings.lru_s3fifo) {
+        item_link_q_s3fifo(it, hv);
+    } else {
+        item_link_q(it);
+    }
     refcount_incr(it);
     item_stats_sizes_add(it);
+    if (settings.expiry_wheel) {
+        expiry_wheel_add(it, hv);
+    }
+    if (settings.mrc_sample_rate > 0) {
+        mrc_record(hv, it, false);
+    }
+    if (settings.prefix_quotas) {
+        quota_link(it, hv);
+    }
 
     return 1;
 }
@@ -526,6 +655,9 @@ void do_item_unlink(item *it, const uint32_t hv) {
         stats_state.curr_items -= 1;
         STATS_UNLOCK();
         item_stats_sizes_remove(it);
+        if (settings.prefix_quotas) {
+            quota_unlink(it);
+        }
         assoc_delete(ITEM_key(it), it->nkey, hv);
         item_unlink_q(it);
         do_item_remove(it);
@@ -542,6 +674,9 @@ void do_item_unlink_nolock(item *it, const uint32_t hv) {
         stats_state.curr_items -= 1;
         STATS_UNLOCK();
         item_stats_sizes_remove(it);
+        if (settings.prefix_quotas) {
+            quota_unlink(it);
+        }
         assoc_delete(ITEM_key(it), it->nkey, hv);
         do_item_unlink_q(it);
         do_item_remove(it);
@@ -562,6 +697,22 @@ void do_item_remove(item *it) {
 void do_item_update(item *it) {
     MEMCACHED_ITEM_UPDATE(ITEM_key(it), it->nkey, it->nbytes);
 
+    /* CLOCK only marks the item as referenced. The eviction sweep in
+     * lru_pull_tail() gives it a second chance instead of evicting it, so
+     * hits never touch the LRU or its lock. S3-FIFO uses the same mark.
+     * GDSF also credits the item its cost once per hit. */
+    if (settings.lru_clock || settings.lru_s3fifo || settings.lru_gdsf) {
+        it->it_flags |= ITEM_ACTIVE;
+        if (settings.lru_gdsf) {
+            it->credit = it->credit + it->cost > UINT8_MAX
+                ? UINT8_MAX : it->credit + it->cost;
+        }
+        if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
+            it->time = current_time;
+        }
+        return;
+    }
+
     /* Hits to COLD_LRU immediately move to WARM. */
     if (settings.lru_segmented) {
         assert((it->it_flags & ITEM_SLABBED) == 0);
@@ -616,7 +767,7 @@ char *item_cachedump(const unsigned int slabs_clsid, const unsigned int limit, u
     unsigned int id = slabs_clsid;
     id |= COLD_LRU;
 
-    pthread_mutex_lock(&lru_locks[id]);
+    lru_lock(id);
     it = heads[id];
 
     buffer = malloc((size_t)memlimit);
@@ -630,7 +781,7 @@ char *item_cachedump(const unsigned int slabs_clsid, const unsigned int limit, u
         assert(it->nkey <= KEY_MAX_LENGTH);
         // protect from printing binary keys.
         if ((it->nbytes == 0 && it->nkey == 0) || (it->it_flags & ITEM_KEY_BINARY)) {
-            it = it->next;
+            it = ITEM_next(it);
             continue;
         }
         /* Copy the key since it may not be null-terminated in the struct */
@@ -645,7 +796,7 @@ char *item_cachedump(const unsigned int slabs_clsid, const unsigned int limit, u
         memcpy(buffer + bufcurr, temp, len);
         bufcurr += len;
         shown++;
-        it = it->next;
+        it = ITEM_next(it);
     }
 
     memcpy(buffer + bufcurr, "END\r\n", 6);
@@ -666,20 +817,22 @@ void fill_item_stats_automove(item_stats_automove *am) {
 
         // outofmemory records into HOT
         int i = n | HOT_LRU;
-        pthread_mutex_lock(&lru_locks[i]);
+        lru_lock(i);
         cur->outofmemory = itemstats[i].outofmemory;
         pthread_mutex_unlock(&lru_locks[i]);
 
         // evictions and tail age are from COLD
         i = n | COLD_LRU;
-        pthread_mutex_lock(&lru_locks[i]);
+        lru_lock(i);
         cur->evicted = itemstats[i].evicted;
+        cur->cost = sizes_cost[i];
+        cur->bytes = sizes_bytes[i];
         if (!tails[i]) {
             cur->age = 0;
         } else if (tails[i]->nbytes == 0 && tails[i]->nkey == 0 && tails[i]->it_flags == 1) {
             /* it's a crawler, check previous entry */
             if (tails[i]->prev) {
-               cur->age = current_time - tails[i]->prev->time;
+               cur->age = current_time - ITEM_prev(tails[i])->time;
             } else {
                cur->age = 0;
             }
@@ -699,7 +852,7 @@ void item_stats_totals(ADD_STAT add_stats, void *c) {
         int i;
         for (x = 0; x < 4; x++) {
             i = n | lru_type_map[x];
-            pthread_mutex_lock(&lru_locks[i]);
+            lru_lock(i);
             totals.expired_unfetched += itemstats[i].expired_unfetched;
             totals.evicted_unfetched += itemstats[i].evicted_unfetched;
             totals.evicted_active += itemstats[i].evicted_active;
@@ -712,6 +865,7 @@ void item_stats_totals(ADD_STAT add_stats, void *c) {
             totals.moves_to_warm += itemstats[i].moves_to_warm;
             totals.moves_within_lru += itemstats[i].moves_within_lru;
             totals.direct_reclaims += itemstats[i].direct_reclaims;
+            totals.admission_rejects += itemstats[i].admission_rejects;
             pthread_mutex_unlock(&lru_locks[i]);
         }
     }
@@ -745,6 +899,10 @@ void item_stats_totals(ADD_STAT add_stats, void *c) {
         APPEND_STAT("lru_bumps_dropped", "%llu",
                     (unsigned long long)lru_total_bumps_dropped());
     }
+    if (settings.lru_admission) {
+        APPEND_STAT("admission_rejects", "%llu",
+                    (unsigned long long)totals.admission_rejects);
+    }
 }
 
 void item_stats(ADD_STAT add_stats, void *c) {
@@ -767,7 +925,7 @@ void item_stats(ADD_STAT add_stats, void *c) {
         int klen = 0, vlen = 0;
         for (x = 0; x < 4; x++) {
             i = n | lru_type_map[x];
-            pthread_mutex_lock(&lru_locks[i]);
+            lru_lock(i);
             totals.evicted += itemstats[i].evicted;
             totals.evicted_nonzero += itemstats[i].evicted_nonzero;
             totals.outofmemory += itemstats[i].outofmemory;
@@ -783,6 +941,10 @@ void item_stats(ADD_STAT add_stats, void *c) {
             totals.moves_to_warm += itemstats[i].moves_to_warm;
             totals.moves_within_lru += itemstats[i].moves_within_lru;
             totals.direct_reclaims += itemstats[i].direct_reclaims;
+            totals.admission_rejects += itemstats[i].admission_rejects;
+            totals.ghost_hits += itemstats[i].ghost_hits;
+            totals.ghost_misses += itemstats[i].ghost_misses;
+            totals.evicted_cost += itemstats[i].evicted_cost;
             totals.mem_requested += sizes_bytes[i];
             size += sizes[i];
             lru_size_map[x] = sizes[i];
@@ -874,6 +1036,24 @@ void item_stats(ADD_STAT add_stats, void *c) {
                                 "%llu", (unsigned long long)totals.hits_to_temp);
 
         }
+        if (settings.lru_admission) {
+            APPEND_NUM_FMT_STAT(fmt, n, "admission_rejects",
+                                "%llu", (unsigned long long)totals.admission_rejects);
+        }
+        if (settings.lru_s3fifo) {
+            APPEND_NUM_FMT_STAT(fmt, n, "small_hits",
+                                "%llu", (unsigned long long)totals.hits_to_hot);
+            APPEND_NUM_FMT_STAT(fmt, n, "main_hits",
+                                "%llu", (unsigned long long)totals.hits_to_cold);
+            APPEND_NUM_FMT_STAT(fmt, n, "ghost_hits",
+                                "%llu", (unsigned long long)totals.ghost_hits);
+            APPEND_NUM_FMT_STAT(fmt, n, "ghost_misses",
+                                "%llu", (unsigned long long)totals.ghost_misses);
+        }
+        if (settings.lru_gdsf) {
+            APPEND_NUM_FMT_STAT(fmt, n, "evicted_cost",
+                                "%llu", (unsigned long long)totals.evicted_cost);
+        }
     }
 
     /* getting here means both ascii and binary terminators fit */
@@ -889,14 +1069,54 @@ bool item_stats_sizes_status(void) {
     return ret;
 }
 
+/* Returns a copy of the size histogram for the caller to free, or NULL if
+ * size tracking is off. */
+unsigned int *item_stats_sizes_copy(int *buckets) {
+    unsigned int *hist = NULL;
+    mutex_lock(&stats_sizes_lock);
+    if (stats_sizes_hist != NULL) {
+        hist = malloc(stats_sizes_buckets * sizeof(unsigned int));
+        if (hist != NULL) {
+            memcpy(hist, stats_sizes_hist, stats_sizes_buckets * sizeof(unsigned int));
+            *buckets = stats_sizes_buckets;
+        }
+    }
+    mutex_unlock(&stats_sizes_lock);
+    return hist;
+}
+
 void item_stats_sizes_init(void) {
     if (stats_sizes_hist != NULL)
         return;
     stats_sizes_buckets = settings.item_size_max / 32 + 1;
     stats_sizes_hist = calloc(stats_sizes_buckets, sizeof(int));
+    stats_sizes_items = 0;
+    stats_sizes_bytes = 0;
     stats_sizes_cas_min = (settings.use_cas) ? get_cas_id() : 0;
 }
 
+/* Sets up the S3-FIFO ghost queue, sized like the admission sketch at one
+ * slot per 512 bytes of memory. Returns false if it couldn't be allocated. */
+bool item_s3fifo_init(void) {
+    bool ret = true;
+    mutex_lock(&s3fifo_init_lock);
+    if (s3fifo_ghost == NULL) {
+        uint64_t slots = 1 << 12;
+        while (slots < settings.maxbytes / 512 && slots < (1 << 24)) {
+            slots <<= 1;
+        }
+        uint32_t *ghost = calloc(slots, sizeof(uint32_t));
+        if (ghost != NULL) {
+            s3fifo_ghost_mask = slots - 1;
+            s3fifo_ghost = ghost;
+        } else {
+            ret = false;
+        }
+    }
+    mutex_unlock(&s3fifo_init_lock);
+    return ret;
+}
+
 void item_stats_sizes_enable(ADD_STAT add_stats, void *c) {
     mutex_lock(&stats_sizes_lock);
     if (!settings.use_cas) {
@@ -933,6 +1153,8 @@ void item_stats_sizes_add(item *it) {
     int bucket = ntotal / 32;
     if ((ntotal % 32) != 0) bucket++;
     if (bucket < stats_sizes_buckets) stats_sizes_hist[bucket]++;
+    stats_sizes_items++;
+    stats_sizes_bytes += ntotal;
 }
 
 /* I think there's no way for this to be accurate without using the CAS value.
@@ -945,6 +1167,8 @@ void item_stats_sizes_remove(item *it) {
     int bucket = ntotal / 32;
     if ((ntotal % 32) != 0) bucket++;
     if (bucket < stats_sizes_buckets) stats_sizes_hist[bucket]--;
+    stats_sizes_items--;
+    stats_sizes_bytes -= ntotal;
 }
 
 /** dumps out a list of objects of each size, with granularity of 32 bytes */
@@ -965,6 +1189,17 @@ void item_stats_sizes(ADD_STAT add_stats, void *c) {
                 APPEND_STAT(key, "%u", stats_sizes_hist[i]);
             }
         }
+        /* How many of these items a GB holds, and would hold with pointer
+         * links in the header. Slab class rounding isn't counted. */
+        APPEND_STAT("header_size", "%u", (unsigned int)sizeof(item));
+        uint64_t ptr_bytes = stats_sizes_bytes + stats_sizes_items
+            * (ITEM_HEADER_POINTERS - sizeof(item));
+        if (stats_sizes_items > 0 && stats_sizes_bytes > 0 && ptr_bytes > 0) {
+            APPEND_STAT("items_per_gb", "%llu", (unsigned long long)
+                    ((1ULL << 30) * stats_sizes_items / stats_sizes_bytes));
+            APPEND_STAT("pointer_items_per_gb", "%llu", (unsigned long long)
+                    ((1ULL << 30) * stats_sizes_items / ptr_bytes));
+        }
     } else {
         APPEND_STAT("sizes_status", "disabled", "");
     }
@@ -1056,6 +1291,52 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, LIBEVEN
     return it;
 }
 
+/* The common case of do_item_get(), for callers holding the item lock
+ * shared: the item is live and a bump wouldn't change it. Other readers can
+ * be looking at the item, so anything else (expiring, flushing, bumping)
+ * returns false and the caller must retry with do_item_get() under an
+ * exclusive lock. */
+bool do_item_get_shared(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update, item **itp) {
+    item *it = assoc_find(key, nkey, hv);
+    *itp = NULL;
+
+    if (settings.verbose > 2) {
+        return false;
+    }
+
+    if (it != NULL) {
+        if (item_is_flushed(it)
+                || (it->exptime != 0 && it->exptime <= current_time)) {
+            return false;
+        }
+        if (do_update) {
+            if (settings.lru_segmented) {
+                if ((it->it_flags & ITEM_ACTIVE) == 0) {
+                    return false;
+                }
+            } else if ((it->it_flags & ITEM_FETCHED) == 0
+                    || it->time < current_time - ITEM_UPDATE_INTERVAL
+                    || ((settings.lru_clock || settings.lru_s3fifo
+                            || settings.lru_gdsf)
+                        && (it->it_flags & ITEM_ACTIVE) == 0)) {
+                return false;
+            }
+            // do_item_update() would credit the hit.
+            if (settings.lru_gdsf) {
+                item_credit_shared(it);
+            }
+        }
+        refcount_incr_shared(it);
+        DEBUG_REFCNT(it, '+');
+    }
+
+    LOGGER_LOG(t->l, LOG_FETCHERS, LOGGER_ITEM_GET, NULL, it != NULL, key,
+               nkey, (it) ? it->nbytes : 0, (it) ? ITEM_clsid(it) : 0, t->cur_sfd);
+
+    *itp = it;
+    return true;
+}
+
 // Requires lock held for item.
 // Split out of do_item_get() to allow mget functions to look through header
 // data before losing state modified via the bump function.
@@ -1091,6 +1372,9 @@ item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
     item *it = do_item_get(key, nkey, hv, t, DO_UPDATE);
     if (it != NULL) {
         it->exptime = exptime;
+        if (settings.expiry_wheel) {
+            expiry_wheel_add(it, hv);
+        }
     }
     return it;
 }
@@ -1099,6 +1383,10 @@ item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
 
 /* Returns number of items remove, expired, or evicted.
  * Callable from worker threads or the LRU maintainer thread */
+/* Most referenced items the CLOCK hand passes over per eviction, to bound
+ * how long the LRU lock is held when the whole tail is hot. */
+#define LRU_CLOCK_MAX_RESCUES 50
+
 int lru_pull_tail(const int orig_id, const int cur_lru,
         const uint64_t total_bytes, const uint8_t flags, const rel_time_t max_age,
         struct lru_pull_tail_return *ret_it) {
@@ -1109,6 +1397,7 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
         return 0;
 
     int tries = 5;
+    int rescues = 0;
     item *search;
     item *next_it;
     void *hold_lock = NULL;
@@ -1116,12 +1405,12 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
     uint64_t limit = 0;
 
     id |= cur_lru;
-    pthread_mutex_lock(&lru_locks[id]);
+    lru_lock(id);
     search = tails[id];
     /* We walk up *only* for locked items, and if bottom is expired. */
     for (; tries > 0 && search != NULL; tries--, search=next_it) {
         /* we might relink search mid-loop, so search->prev isn't reliable */
-        next_it = search->prev;
+        next_it = ITEM_prev(search);
         if (search->nbytes == 0 && search->nkey == 0 && search->it_flags == 1) {
             /* We are a crawler, ignore it. */
             if (flags & LRU_PULL_CRAWL_BLOCKS) {
@@ -1176,8 +1465,9 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
 
         /* If we're HOT_LRU or WARM_LRU and over size limit, send to COLD_LRU.
          * If we're COLD_LRU, send to WARM_LRU unless we need to evict
+         * S3-FIFO evicts from its small queue (HOT) just like from COLD.
          */
-        switch (cur_lru) {
+        switch (settings.lru_s3fifo && (flags & LRU_PULL_EVICT) ? COLD_LRU : cur_lru) {
             case HOT_LRU:
                 limit = total_bytes * settings.hot_lru_pct / 100;
             case WARM_LRU:
@@ -1214,13 +1504,53 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
                 }
                 break;
             case COLD_LRU:
+                if ((flags & LRU_PULL_EVICT)
+                        && rescues < LRU_CLOCK_MAX_RESCUES
+                        && (settings.lru_gdsf ? search->credit > 1
+                            : ((settings.lru_clock || settings.lru_s3fifo)
+                                && (search->it_flags & ITEM_ACTIVE) != 0))) {
+                    /* CLOCK: referenced since the hand last passed, so
+                     * clear the bit and send it around again.
+                     * GDSF: the item still has credit from its cost and
+                     * hits. Halve it, which ages valuable items out over
+                     * a few passes, like GDSF's inflation value. */
+                    search->it_flags &= ~ITEM_ACTIVE;
+                    if (settings.lru_gdsf)
+                        search->credit /= 2;
+                    do_item_unlink_q(search);
+                    if (cur_lru == HOT_LRU) {
+                        /* S3-FIFO: hit while in the small queue, so it
+                         * graduates to main. Nests COLD's lock in HOT's. */
+                        itemstats[id].moves_to_cold++;
+                        search->slabs_clsid = ITEM_clsid(search) | COLD_LRU;
+                        item_link_q(search);
+                    } else {
+                        itemstats[id].moves_within_lru++;
+                        do_item_link_q(search);
+                    }
+                    do_item_remove(search);
+                    item_trylock_unlock(hold_lock);
+                    rescues++;
+                    removed++;
+                    tries++;
+                    break;
+                }
                 it = search; /* No matter what, we're stopping */
                 if (flags & LRU_PULL_EVICT) {
                     if (settings.evict_to_free == 0) {
                         /* Don't think we need a counter for this. It'll OOM.  */
                         break;
                     }
+                    if ((flags & LRU_PULL_ADMIT) && !tinylfu_admit(ret_it->hv,
+                                hv, (search->it_flags & ITEM_FETCHED) != 0)) {
+                        /* The tail is more popular than what would replace
+                         * it; keep it and OOM the new item instead. */
+                        itemstats[id].admission_rejects++;
+                        ret_it->rejected = true;
+                        break;
+                    }
                     itemstats[id].evicted++;
+                    itemstats[id].evicted_cost += search->cost;
                     itemstats[id].evicted_time = current_time - search->time;
                     if (search->exptime != 0)
                         itemstats[id].evicted_nonzero++;
@@ -1230,6 +1560,12 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
                     if ((search->it_flags & ITEM_ACTIVE)) {
                         itemstats[id].evicted_active++;
                     }
+                    if (cur_lru == HOT_LRU && s3fifo_ghost != NULL) {
+                        s3fifo_ghost[hv & s3fifo_ghost_mask] = hv;
+                    }
+                    if (settings.slab_automove == 3) {
+                        slab_automove_shadow_evict(hv, orig_id);
+                    }
                     LOGGER_LOG(NULL, LOG_EVICTIONS, LOGGER_EVICTION, search);
                     STORAGE_delete(ext_storage, search);
                     do_item_unlink_nolock(search, hv);
@@ -1284,6 +1620,7 @@ static void lru_bump_buf_link_q(lru_bump_buf *b) {
     b->prev = 0;
     b->next = bump_buf_head;
     if (b->next) b->next->prev = b;
+    b->id = bump_buf_count++;
     bump_buf_head = b;
     if (bump_buf_tail == 0) bump_buf_tail = b;
     pthread_mutex_unlock(&bump_buf_lock);
@@ -1336,15 +1673,23 @@ static bool lru_bump_async(lru_bump_buf *b, item *it, uint32_t hv) {
  * non-zero, then remove from list if zero more than N times.
  * If very few hits on cold this would avoid extra memory barriers from LRU
  * maintainer thread. If many hits, they'll just stay in the list.
+ *
+ * With several maintainer threads each drains every Nth buffer. Buffers are
+ * only ever added at the head, so the rest of the list can be walked
+ * without holding bump_buf_lock.
  */
-static bool lru_maintainer_bumps(void) {
+static bool lru_maintainer_bumps(const int id, const int count) {
     lru_bump_buf *b;
     lru_bump_entry *be;
     unsigned int size;
     unsigned int todo;
     bool bumped = false;
     pthread_mutex_lock(&bump_buf_lock);
-    for (b = bump_buf_head; b != NULL; b=b->next) {
+    b = bump_buf_head;
+    pthread_mutex_unlock(&bump_buf_lock);
+    for (; b != NULL; b=b->next) {
+        if (b->id % count != id)
+            continue;
         pthread_mutex_lock(&b->mutex);
         be = (lru_bump_entry *) bipbuf_peek_all(b->buf, &size);
         pthread_mutex_unlock(&b->mutex);
@@ -1368,7 +1713,6 @@ static bool lru_maintainer_bumps(void) {
         be = (lru_bump_entry *) bipbuf_poll(b->buf, size);
         pthread_mutex_unlock(&b->mutex);
     }
-    pthread_mutex_unlock(&bump_buf_lock);
     return bumped;
 }
 
@@ -1418,7 +1762,7 @@ static int lru_maintainer_juggle(const int slabs_clsid) {
     rel_time_t warm_age = 0;
     /* If LRU is in flat mode, force items to drain into COLD via max age of 0 */
     if (settings.lru_segmented) {
-        pthread_mutex_lock(&lru_locks[slabs_clsid|COLD_LRU]);
+        lru_lock(slabs_clsid|COLD_LRU);
         if (tails[slabs_clsid|COLD_LRU]) {
             cold_age = current_time - tails[slabs_clsid|COLD_LRU]->time;
         }
@@ -1430,11 +1774,11 @@ static int lru_maintainer_juggle(const int slabs_clsid) {
         warm_age = cold_age * settings.warm_max_factor;
 
         // total_bytes doesn't have to be exact. cache it for the juggles.
-        pthread_mutex_lock(&lru_locks[slabs_clsid|HOT_LRU]);
+        lru_lock(slabs_clsid|HOT_LRU);
         total_bytes += sizes_bytes[slabs_clsid|HOT_LRU];
         pthread_mutex_unlock(&lru_locks[slabs_clsid|HOT_LRU]);
 
-        pthread_mutex_lock(&lru_locks[slabs_clsid|WARM_LRU]);
+        lru_lock(slabs_clsid|WARM_LRU);
         total_bytes += sizes_bytes[slabs_clsid|WARM_LRU];
         pthread_mutex_unlock(&lru_locks[slabs_clsid|WARM_LRU]);
     }
@@ -1442,7 +1786,8 @@ static int lru_maintainer_juggle(const int slabs_clsid) {
     /* Juggle HOT/WARM up to N times */
     for (i = 0; i < 500; i++) {
         int do_more = 0;
-        if (lru_pull_tail(slabs_clsid, HOT_LRU, total_bytes, LRU_PULL_CRAWL_BLOCKS, hot_age, NULL) ||
+        /* S3-FIFO's small queue lives in HOT; only evictions drain it. */
+        if ((!settings.lru_s3fifo && lru_pull_tail(slabs_clsid, HOT_LRU, total_bytes, LRU_PULL_CRAWL_BLOCKS, hot_age, NULL)) ||
             lru_pull_tail(slabs_clsid, WARM_LRU, total_bytes, LRU_PULL_CRAWL_BLOCKS, warm_age, NULL)) {
             do_more++;
         }
@@ -1546,7 +1891,7 @@ static void lru_maintainer_crawler_check(struct crawler_expired_data *cdata, log
             pthread_mutex_unlock(&cdata->lock);
         }
         if (current_time > next_crawls[i]) {
-            pthread_mutex_lock(&lru_locks[i]);
+            lru_lock(i);
             if (sizes[i] > tocrawl_limit) {
                 tocrawl_limit = sizes[i];
             }
@@ -1569,6 +1914,11 @@ slab_automove_reg_t slab_automove_default = {
     .free = slab_automove_free,
     .run = slab_automove_run
 };
+slab_automove_reg_t slab_automove_shadow = {
+    .init = slab_automove_shadow_init,
+    .free = slab_automove_shadow_free,
+    .run = slab_automove_shadow_run
+};
 #ifdef EXTSTORE
 slab_automove_reg_t slab_automove_extstore = {
     .init = slab_automove_extstore_init,
@@ -1576,50 +1926,90 @@ slab_automove_reg_t slab_automove_extstore = {
     .run = slab_automove_extstore_run
 };
 #endif
-static pthread_t lru_maintainer_tid;
+
+/* slab_automove=3 has its own algorithm; otherwise it depends on whether
+ * extstore is in use. */
+static slab_automove_reg_t *lru_maintainer_automover(void *storage) {
+    if (settings.slab_automove == 3)
+        return &slab_automove_shadow;
+#ifdef EXTSTORE
+    if (storage != NULL)
+        return &slab_automove_extstore;
+#endif
+    return &slab_automove_default;
+}
+
+/* One per LRU maintainer thread. Slab classes are dealt out round robin, so
+ * thread n juggles classes n + 1, n + 1 + count, ... Thread 0 also runs the
+ * crawler checks and the slab automover. */
+struct lru_maintainer {
+    pthread_t tid;
+    /* Held while the thread is working; see lru_maintainer_pause() */
+    pthread_mutex_t lock;
+    int id;
+    void *storage;
+    uint64_t started_us;
+    uint64_t juggles;
+    uint64_t moves;
+    uint64_t busy_us;
+};
+
+static struct lru_maintainer *maintainers = NULL;
+static int maintainer_count = 0;
 
 #define MAX_LRU_MAINTAINER_SLEEP 1000000
 #define MIN_LRU_MAINTAINER_SLEEP 1000
 
+static uint64_t lru_maintainer_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static void *lru_maintainer_thread(void *arg) {
-    slab_automove_reg_t *sam = &slab_automove_default;
-#ifdef EXTSTORE
-    void *storage = arg;
-    if (storage != NULL)
-        sam = &slab_automove_extstore;
-#endif
+    struct lru_maintainer *m = arg;
+    slab_automove_reg_t *sam = lru_maintainer_automover(m->storage);
     int i;
     useconds_t to_sleep = MIN_LRU_MAINTAINER_SLEEP;
     useconds_t last_sleep = MIN_LRU_MAINTAINER_SLEEP;
     rel_time_t last_crawler_check = 0;
     rel_time_t last_automove_check = 0;
+    rel_time_t last_compact_check = 0;
     useconds_t next_juggles[MAX_NUMBER_OF_SLAB_CLASSES] = {0};
     useconds_t backoff_juggles[MAX_NUMBER_OF_SLAB_CLASSES] = {0};
-    struct crawler_expired_data *cdata =
-        calloc(1, sizeof(struct crawler_expired_data));
-    if (cdata == NULL) {
-        fprintf(stderr, "Failed to allocate crawler data for LRU maintainer thread\n");
-        abort();
-    }
-    pthread_mutex_init(&cdata->lock, NULL);
-    cdata->crawl_complete = true; // kick off the crawler.
-    logger *l = logger_create();
-    if (l == NULL) {
-        fprintf(stderr, "Failed to allocate logger for LRU maintainer thread\n");
-        abort();
-    }
-
+    struct crawler_expired_data *cdata = NULL;
+    logger *l = NULL;
     double last_ratio = settings.slab_automove_ratio;
-    void *am = sam->init(&settings);
+    int last_automove = settings.slab_automove;
+    void *am = NULL;
+
+    if (m->id == 0) {
+        cdata = calloc(1, sizeof(struct crawler_expired_data));
+        if (cdata == NULL) {
+            fprintf(stderr, "Failed to allocate crawler data for LRU maintainer thread\n");
+            abort();
+        }
+        pthread_mutex_init(&cdata->lock, NULL);
+        cdata->crawl_complete = true; // kick off the crawler.
+        l = logger_create();
+        if (l == NULL) {
+            fprintf(stderr, "Failed to allocate logger for LRU maintainer thread\n");
+            abort();
+        }
+        am = sam->init(&settings);
+    }
 
-    pthread_mutex_lock(&lru_maintainer_lock);
+    pthread_mutex_lock(&m->lock);
     if (settings.verbose > 2)
-        fprintf(stderr, "Starting LRU maintainer background thread\n");
+        fprintf(stderr, "Starting LRU maintainer background thread %d\n", m->id);
     while (do_run_lru_maintainer_thread) {
-        pthread_mutex_unlock(&lru_maintainer_lock);
+        uint64_t moves = 0;
+        uint64_t start;
+        pthread_mutex_unlock(&m->lock);
         if (to_sleep)
             usleep(to_sleep);
-        pthread_mutex_lock(&lru_maintainer_lock);
+        pthread_mutex_lock(&m->lock);
+        start = lru_maintainer_now();
         /* A sleep of zero counts as a minimum of a 1ms wait */
         last_sleep = to_sleep > 1000 ? to_sleep : 1000;
         to_sleep = MAX_LRU_MAINTAINER_SLEEP;
@@ -1629,7 +2019,8 @@ static void *lru_maintainer_thread(void *arg) {
         STATS_UNLOCK();
 
         /* Each slab class gets its own sleep to avoid hammering locks */
-        for (i = POWER_SMALLEST; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        for (i = POWER_SMALLEST + m->id; i < MAX_NUMBER_OF_SLAB_CLASSES;
+                i += maintainer_count) {
             next_juggles[i] = next_juggles[i] > last_sleep ? next_juggles[i] - last_sleep : 0;
 
             if (next_juggles[i] > 0) {
@@ -1640,6 +2031,7 @@ static void *lru_maintainer_thread(void *arg) {
             }
 
             int did_moves = lru_maintainer_juggle(i);
+            moves += did_moves;
             if (did_moves == 0) {
                 if (backoff_juggles[i] != 0) {
                     backoff_juggles[i] += backoff_juggles[i] / 8;
@@ -1660,21 +2052,27 @@ static void *lru_maintainer_thread(void *arg) {
         }
 
         /* Minimize the sleep if we had async LRU bumps to process */
-        if (settings.lru_segmented && lru_maintainer_bumps() && to_sleep > 1000) {
+        if (settings.lru_segmented
+                && lru_maintainer_bumps(m->id, maintainer_count)
+                && to_sleep > 1000) {
             to_sleep = 1000;
         }
 
         /* Once per second at most */
-        if (settings.lru_crawler && last_crawler_check != current_time) {
+        if (m->id == 0 && settings.lru_crawler && last_crawler_check != current_time) {
             lru_maintainer_crawler_check(cdata, l);
             last_crawler_check = current_time;
         }
 
-        if (settings.slab_automove == 1 && last_automove_check != current_time) {
-            if (last_ratio != settings.slab_automove_ratio) {
+        if (m->id == 0 && (settings.slab_automove == 1 || settings.slab_automove == 3)
+                && last_automove_check != current_time) {
+            if (last_ratio != settings.slab_automove_ratio
+                    || last_automove != settings.slab_automove) {
                 sam->free(am);
+                sam = lru_maintainer_automover(m->storage);
                 am = sam->init(&settings);
                 last_ratio = settings.slab_automove_ratio;
+                last_automove = settings.slab_automove;
             }
             int src, dst;
             sam->run(am, &src, &dst);
@@ -1691,57 +2089,169 @@ static void *lru_maintainer_thread(void *arg) {
                 to_sleep = 1000;
             }
         }
+
+        /* Classes retired by re-profiling are emptied as fast as the
+         * mover goes */
+        if (m->id == 0 && settings.slab_reassign) {
+            int src = slabs_drain_retired();
+            if (src > 0) {
+                LOGGER_LOG(l, LOG_SYSEVENTS, LOGGER_SLAB_MOVE, NULL,
+                        src, SLAB_GLOBAL_PAGE_POOL);
+            }
+            if (src != -1)
+                to_sleep = 1000;
+        }
+
+        /* A lowered memory limit is met as fast as the mover goes */
+        if (m->id == 0 && settings.slab_reassign) {
+            int src = slabs_shrink();
+            if (src > 0) {
+                LOGGER_LOG(l, LOG_SYSEVENTS, LOGGER_SLAB_MOVE, NULL,
+                        src, SLAB_GLOBAL_PAGE_POOL);
+            }
+            if (src != -1)
+                to_sleep = 1000;
+        }
+
+        if (m->id == 0 && settings.slab_idle_trim) {
+            slabs_trim_idle();
+        }
+
+        /* One sparse page a second at most */
+        if (m->id == 0 && settings.slab_compact_ratio > 0 && last_compact_check != current_time) {
+            int src = slabs_compact();
+            if (src != -1) {
+                LOGGER_LOG(l, LOG_SYSEVENTS, LOGGER_SLAB_MOVE, NULL,
+                        src, SLAB_GLOBAL_PAGE_POOL);
+            }
+            last_compact_check = current_time;
+        }
+
+        m->juggles++;
+        m->moves += moves;
+        m->busy_us += lru_maintainer_now() - start;
+    }
+    pthread_mutex_unlock(&m->lock);
+    if (m->id == 0) {
+        sam->free(am);
+        // LRU crawler *must* be stopped.
+        free(cdata);
     }
-    pthread_mutex_unlock(&lru_maintainer_lock);
-    sam->free(am);
-    // LRU crawler *must* be stopped.
-    free(cdata);
     if (settings.verbose > 2)
-        fprintf(stderr, "LRU maintainer thread stopping\n");
+        fprintf(stderr, "LRU maintainer thread %d stopping\n", m->id);
 
     return NULL;
 }
 
 int stop_lru_maintainer_thread(void) {
     int ret;
-    pthread_mutex_lock(&lru_maintainer_lock);
-    /* LRU thread is a sleep loop, will die on its own */
+    int i;
+    int failed = 0;
+    /* LRU threads are sleep loops, will die on their own */
+    lru_maintainer_pause();
     do_run_lru_maintainer_thread = 0;
-    pthread_mutex_unlock(&lru_maintainer_lock);
-    if ((ret = pthread_join(lru_maintainer_tid, NULL)) != 0) {
-        fprintf(stderr, "Failed to stop LRU maintainer thread: %s\n", strerror(ret));
-        return -1;
+    lru_maintainer_resume();
+    for (i = 0; i < maintainer_count; i++) {
+        if ((ret = pthread_join(maintainers[i].tid, NULL)) != 0) {
+            fprintf(stderr, "Failed to stop LRU maintainer thread: %s\n", strerror(ret));
+            failed = -1;
+        }
     }
+    if (failed != 0)
+        return failed;
     settings.lru_maintainer_thread = false;
     return 0;
 }
 
 int start_lru_maintainer_thread(void *arg) {
     int ret;
+    int i;
+    int count = settings.lru_maintainer_threads;
+
+    if (count < 1)
+        count = 1;
+    if (maintainers == NULL) {
+        maintainers = calloc(count, sizeof(struct lru_maintainer));
+        if (maintainers == NULL) {
+            fprintf(stderr, "Can't allocate LRU maintainer threads\n");
+            return -1;
+        }
+        for (i = 0; i < count; i++) {
+            pthread_mutex_init(&maintainers[i].lock, NULL);
+        }
+    }
+    maintainer_count = count;
 
-    pthread_mutex_lock(&lru_maintainer_lock);
+    lru_maintainer_pause();
     do_run_lru_maintainer_thread = 1;
     settings.lru_maintainer_thread = true;
-    if ((ret = pthread_create(&lru_maintainer_tid, NULL,
-        lru_maintainer_thread, arg)) != 0) {
-        fprintf(stderr, "Can't create LRU maintainer thread: %s\n",
-            strerror(ret));
-        pthread_mutex_unlock(&lru_maintainer_lock);
-        return -1;
+    for (i = 0; i < count; i++) {
+        struct lru_maintainer *m = &maintainers[i];
+        m->id = i;
+        m->storage = arg;
+        m->started_us = lru_maintainer_now();
+        if ((ret = pthread_create(&m->tid, NULL,
+            lru_maintainer_thread, m)) != 0) {
+            fprintf(stderr, "Can't create LRU maintainer thread: %s\n",
+                strerror(ret));
+            lru_maintainer_resume();
+            return -1;
+        }
+        thread_setname(m->tid, "mc-lrumaint");
     }
-    thread_setname(lru_maintainer_tid, "mc-lrumaint");
-    pthread_mutex_unlock(&lru_maintainer_lock);
+    lru_maintainer_resume();
 
     return 0;
 }
 
-/* If we hold this lock, crawler can't wake up or move */
+/* If we hold these locks, the maintainers can't wake up or move */
 void lru_maintainer_pause(void) {
-    pthread_mutex_lock(&lru_maintainer_lock);
+    int i;
+    for (i = 0; i < maintainer_count; i++) {
+        pthread_mutex_lock(&maintainers[i].lock);
+    }
 }
 
 void lru_maintainer_resume(void) {
-    pthread_mutex_unlock(&lru_maintainer_lock);
+    int i;
+    for (i = maintainer_count - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&maintainers[i].lock);
+    }
+}
+
+void lru_maintainer_stats(ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    int i;
+
+    APPEND_STAT("threads", "%d", maintainer_count);
+    for (i = 0; i < maintainer_count; i++) {
+        struct lru_maintainer *m = &maintainers[i];
+        uint64_t juggles, moves, busy_us, run_us;
+        int classes = 0;
+        int x;
+
+        pthread_mutex_lock(&m->lock);
+        juggles = m->juggles;
+        moves = m->moves;
+        busy_us = m->busy_us;
+        run_us = lru_maintainer_now() - m->started_us;
+        pthread_mutex_unlock(&m->lock);
+
+        for (x = POWER_SMALLEST + i; x < MAX_NUMBER_OF_SLAB_CLASSES;
+                x += maintainer_count) {
+            classes++;
+        }
+        APPEND_NUM_STAT(i, "classes", "%d", classes);
+        APPEND_NUM_STAT(i, "juggles", "%llu", (unsigned long long)juggles);
+        APPEND_NUM_STAT(i, "moves", "%llu", (unsigned long long)moves);
+        APPEND_NUM_STAT(i, "busy_us", "%llu", (unsigned long long)busy_us);
+        APPEND_NUM_STAT(i, "utilization", "%.2f",
+                run_us ? 100.0 * busy_us / run_us : 0.0);
+    }
+
+    add_stats(NULL, 0, NULL, 0, c);
 }
 
 /* Tail linkers and crawler for the LRU crawler. */
@@ -1755,11 +2265,11 @@ void do_item_linktail_q(item *it) { /* item is the new tail */
     //assert(*tail != 0);
     assert(it != *tail);
     assert((*head && *tail) || (*head == 0 && *tail == 0));
-    it->prev = *tail;
+    ITEM_set_prev(it, *tail);
     it->next = 0;
     if (it->prev) {
-        assert(it->prev->next == 0);
-        it->prev->next = it;
+        assert(ITEM_prev(it)->next == 0);
+        ITEM_set_next(ITEM_prev(it), it);
     }
     *tail = it;
     if (*head == 0) *head = it;
@@ -1773,17 +2283,17 @@ void do_item_unlinktail_q(item *it) {
 
     if (*head == it) {
         assert(it->prev == 0);
-        *head = it->next;
+        *head = ITEM_next(it);
     }
     if (*tail == it) {
         assert(it->next == 0);
-        *tail = it->prev;
+        *tail = ITEM_prev(it);
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+    assert(ITEM_next(it) != it);
+    assert(ITEM_prev(it) != it);
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
+    if (it->next) ITEM_next(it)->prev = it->prev;
+    if (it->prev) ITEM_prev(it)->next = it->next;
     return;
 }
 
@@ -1800,45 +2310,45 @@ item *do_item_crawl_q(item *it) {
     if (it->prev == 0) {
         assert(*head == it);
         if (it->next) {
-            *head = it->next;
-            assert(it->next->prev == it);
-            it->next->prev = 0;
+            *head = ITEM_next(it);
+            assert(ITEM_prev(ITEM_next(it)) == it);
+            ITEM_next(it)->prev = 0;
         }
         return NULL; /* Done */
     }
 
     /* Swing ourselves in front of the next item */
     /* NB: If there is a prev, we can't be the head */
-    assert(it->prev != it);
+    assert(ITEM_prev(it) != it);
     if (it->prev) {
-        if (*head == it->prev) {
+        if (*head == ITEM_prev(it)) {
             /* Prev was the head, now we're the head */
             *head = it;
         }
         if (*tail == it) {
             /* We are the tail, now they are the tail */
-            *tail = it->prev;
+            *tail = ITEM_prev(it);
         }
-        assert(it->next != it);
+        assert(ITEM_next(it) != it);
         if (it->next) {
-            assert(it->prev->next == it);
-            it->prev->next = it->next;
-            it->next->prev = it->prev;
+            assert(ITEM_next(ITEM_prev(it)) == it);
+            ITEM_prev(it)->next = it->next;
+            ITEM_next(it)->prev = it->prev;
         } else {
             /* Tail. Move this above? */
-            it->prev->next = 0;
+            ITEM_prev(it)->next = 0;
         }
         /* prev->prev's next is it->prev */
         it->next = it->prev;
-        it->prev = it->next->prev;
-        it->next->prev = it;
+        it->prev = ITEM_next(it)->prev;
+        ITEM_set_prev(ITEM_next(it), it);
         /* New it->prev now, if we're not at the head. */
         if (it->prev) {
-            it->prev->next = it;
+            ITEM_set_next(ITEM_prev(it), it);
         }
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+    assert(ITEM_next(it) != it);
+    assert(ITEM_prev(it) != it);
 
-    return it->next; /* success */
+    return ITEM_next(it); /* success */
 }
@@ -12,8 +12,9 @@ void set_cas_id(uint64_t new_cas);
 
 /*@null@*/
 item *do_item_alloc(const char *key, const size_t nkey, const client_flags_t flags, const rel_time_t exptime, const int nbytes);
+/*@null@*/
+item *do_item_alloc_hv(const char *key, const size_t nkey, const client_flags_t flags, const rel_time_t exptime, const int nbytes, const uint32_t hv, bool *rejected);
 item_chunk *do_item_alloc_chunk(item_chunk *ch, const size_t bytes_remain);
-item *do_item_alloc_pull(const size_t ntotal, const unsigned int id);
 void item_free(item *it);
 bool item_size_ok(const size_t nkey, const client_flags_t flags, const int nbytes);
 
@@ -38,12 +39,17 @@ void *item_lru_bump_buf_create(void);
 #define LRU_PULL_EVICT 1
 #define LRU_PULL_CRAWL_BLOCKS 2
 #define LRU_PULL_RETURN_ITEM 4 /* fill info struct if available */
+#define LRU_PULL_ADMIT 8 /* only evict if ret_it->hv wins admission */
 
 struct lru_pull_tail_return {
     item *it;
     uint32_t hv;
+    bool rejected; /* LRU_PULL_ADMIT: candidate lost to the tail item */
 };
 
+item *do_item_alloc_pull(const size_t ntotal, const unsigned int id,
+        struct lru_pull_tail_return *admit);
+
 int lru_pull_tail(const int orig_id, const int cur_lru,
         const uint64_t total_bytes, const uint8_t flags, const rel_time_t max_age,
         struct lru_pull_tail_return *ret_it);
@@ -57,29 +63,37 @@ void item_stats_totals(ADD_STAT add_stats, void *c);
 /*@null@*/
 void item_stats_sizes(ADD_STAT add_stats, void *c);
 void item_stats_sizes_init(void);
+bool item_s3fifo_init(void);
 void item_stats_sizes_enable(ADD_STAT add_stats, void *c);
 void item_stats_sizes_disable(ADD_STAT add_stats, void *c);
 void item_stats_sizes_add(item *it);
 void item_stats_sizes_remove(item *it);
 bool item_stats_sizes_status(void);
+unsigned int *item_stats_sizes_copy(int *buckets);
 
 /* stats getter for slab automover */
 typedef struct {
     int64_t evicted;
     int64_t outofmemory;
     uint32_t age;
+    uint64_t cost; /* summed item cost in COLD, for lru_gdsf */
+    uint64_t bytes;
 } item_stats_automove;
 void fill_item_stats_automove(item_stats_automove *am);
 
 item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update);
 item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime, const uint32_t hv, LIBEVENT_THREAD *t);
 void do_item_bump(LIBEVENT_THREAD *t, item *it, const uint32_t hv);
+bool do_item_get_shared(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update, item **itp);
 void item_stats_reset(void);
 extern pthread_mutex_t lru_locks[POWER_LARGEST];
+extern struct lock_stats lru_lock_stats[POWER_LARGEST];
+#define lru_lock(id) mutex_lock_class(&lru_locks[id], LOCK_CLASS_LRU, &lru_lock_stats[id])
 
 int start_lru_maintainer_thread(void *arg);
 int stop_lru_maintainer_thread(void);
 void lru_maintainer_pause(void);
 void lru_maintainer_resume(void);
+void lru_maintainer_stats(ADD_STAT add_stats, void *c);
 
 void *lru_bump_buf_create(void);
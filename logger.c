@@ -494,6 +494,9 @@ static const entry_details default_entries[] = {
     [LOGGER_SLAB_MOVE] = {512, LOG_SYSEVENTS, _logger_log_text, _logger_parse_text,
         "type=slab_move src=%d dst=%d"
     },
+    [LOGGER_SLAB_AUTOMOVE] = {512, LOG_SYSEVENTS, _logger_log_text, _logger_parse_text,
+        "type=slab_automove src=%d dst=%d src_hits=%llu dst_hits=%llu src_pages=%ld dst_pages=%ld"
+    },
     [LOGGER_CONNECTION_NEW] = {512, LOG_CONNEVENTS, _logger_log_conn_event, _logger_parse_cne, NULL},
     [LOGGER_CONNECTION_CLOSE] = {512, LOG_CONNEVENTS, _logger_log_conn_event, _logger_parse_cce, NULL},
     [LOGGER_DELETIONS] = {512, LOG_DELETIONS, _logger_log_item_deleted, _logger_parse_ide, NULL},
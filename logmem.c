@@ -0,0 +1,615 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Log structured item memory.
+ *
+ * Instead of carving pages into chunks of one size per slab class, items of
+ * every size are appended to the head of a log made of fixed size segments.
+ * Freeing an item only marks its record dead. A cleaner thread keeps a few
+ * segments spare: it picks the segment with the best mix of dead space and
+ * age, copies the items still live in it to a survivor segment of their own,
+ * and hands the emptied segment back to be written again. Memory is never
+ * tied to an item size, so no class can calcify.
+ *
+ * Items keep the slabs_alloc()/slabs_free() interface. The cleaner moves
+ * them the way the slab mover rescues items: pinned under their item lock
+ * with no other references, copied, then swapped in with do_item_replace().
+ * Records, like slab chunks and the links of chunked items, are protected by
+ * the slabs lock.
+ */
+#include "memcached.h"
+#include "logmem.h"
+#include "storage.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Spare segments only the cleaner may write to, so it can always copy */
+#define LOGMEM_RESERVE 2
+#define LOGMEM_MIN_SEGMENTS 8
+/* How long a writer waits for the cleaner before its allocation fails */
+#define LOGMEM_ALLOC_WAIT_US 10000
+/* Fuller segments are only cleaned when memory runs short */
+#define LOGMEM_MAX_UTIL 0.95
+/* Share of the segments not kept spare that live items may fill before
+ * writers have to evict. The rest is dead space, spread out enough that
+ * cleaning a segment frees a good part of it. */
+#define LOGMEM_MAX_LIVE 0.9
+/* Keeps records 8 byte aligned after the segment header */
+#define LOGMEM_SEG_HDR 64
+
+enum logmem_seg_state {
+    SEG_FREE = 0, SEG_HEAD, SEG_SURVIVOR, SEG_SEALED, SEG_CLEANING
+};
+
+typedef struct _logmem_seg {
+    struct _logmem_seg *next;   /* free list */
+    uint32_t used;              /* bytes appended, counting this header */
+    uint32_t live;              /* bytes of records not yet freed */
+    rel_time_t sealed;          /* when it stopped taking writes */
+    rel_time_t retry;           /* busy items kept it from being emptied */
+    uint8_t state;
+} logmem_seg;
+
+typedef struct {
+    uint32_t len;               /* whole record, header included */
+    uint32_t live;
+} logmem_rec;
+
+static logmem_seg **segs = NULL;
+static unsigned int seg_limit = 0;
+static unsigned int seg_count = 0;
+static logmem_seg *free_segs = NULL;
+static unsigned int free_count = 0;
+static logmem_seg *head = NULL;
+static logmem_seg *survivor = NULL;
+static size_t seg_size = 0;
+/* The cleaner runs while fewer segments than this are spare */
+static unsigned int clean_target = 0;
+static uint64_t live_bytes = 0;
+static uint64_t live_limit = 0;
+
+/* Under the slabs lock */
+static struct {
+    uint64_t bytes_written;
+    uint64_t bytes_relocated;
+    uint64_t bytes_reclaimed;
+    uint64_t items_relocated;
+    uint64_t segments_cleaned;
+    uint64_t segments_emptied;
+    uint64_t cleaner_evictions;
+    uint64_t cleaner_busy_items;
+} logmem_stats_data;
+
+static pthread_t cleaner_tid;
+static volatile int do_run_cleaner = 0;
+static pthread_mutex_t cleaner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cleaner_cond = PTHREAD_COND_INITIALIZER;
+/* Held while the cleaner works; see logmem_cleaner_pause() */
+static pthread_mutex_t cleaner_run_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Writers out of space wait on this for the cleaner to free a segment */
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+/* Under cleaner_lock */
+static uint64_t space_gen = 0;
+/* Set by writers so a wakeup isn't lost while the cleaner is busy */
+static bool cleaner_kicked = false;
+static uint64_t cleaner_usec = 0;
+static uint64_t alloc_waits = 0;
+static uint64_t alloc_failures = 0;
+
+bool logmem_init(const size_t limit) {
+    /* Segments are aligned to their size so a record can find its own */
+    seg_size = 1;
+    while (seg_size < (size_t)settings.slab_page_size)
+        seg_size <<= 1;
+    seg_limit = limit / seg_size;
+    if (seg_limit < LOGMEM_MIN_SEGMENTS) {
+        fprintf(stderr, "log_memory needs room for at least %d segments of %llu bytes\n",
+                LOGMEM_MIN_SEGMENTS, (unsigned long long)seg_size);
+        return false;
+    }
+    segs = calloc(seg_limit, sizeof(logmem_seg *));
+    if (segs == NULL)
+        return false;
+    clean_target = seg_limit / 32;
+    if (clean_target < LOGMEM_RESERVE + 2)
+        clean_target = LOGMEM_RESERVE + 2;
+    live_limit = (uint64_t)((seg_limit - clean_target) * seg_size * LOGMEM_MAX_LIVE);
+    return true;
+}
+
+unsigned int do_logmem_spare(void) {
+    return free_count + seg_limit - seg_count;
+}
+
+static void logmem_cleaner_wake(void) {
+    pthread_mutex_lock(&cleaner_lock);
+    cleaner_kicked = true;
+    pthread_cond_signal(&cleaner_cond);
+    pthread_mutex_unlock(&cleaner_lock);
+}
+
+static logmem_seg *do_logmem_seg_get(void) {
+    logmem_seg *s = free_segs;
+    if (s != NULL) {
+        free_segs = s->next;
+        free_count--;
+    } else if (seg_count < seg_limit) {
+        void *p;
+        if (posix_memalign(&p, seg_size, seg_size) != 0)
+            return NULL;
+        s = p;
+        segs[seg_count++] = s;
+    } else {
+        return NULL;
+    }
+    s->next = NULL;
+    s->used = LOGMEM_SEG_HDR;
+    s->live = 0;
+    s->sealed = 0;
+    s->retry = 0;
+    s->state = SEG_FREE;
+    return s;
+}
+
+static void do_logmem_seg_put(logmem_seg *s) {
+    s->state = SEG_FREE;
+    s->next = free_segs;
+    free_segs = s;
+    free_count++;
+    logmem_stats_data.bytes_reclaimed += seg_size;
+}
+
+/* Appends a record to the segment at *cur, moving to a new one once it's
+ * full, as long as more than reserve segments are left spare. */
+static void *do_logmem_append(logmem_seg **cur, const size_t size,
+        const uint8_t state, const unsigned int reserve) {
+    uint32_t len = (sizeof(logmem_rec) + size + 7) & ~7;
+    logmem_seg *s = *cur;
+    logmem_rec *rec;
+
+    if (s == NULL || s->used + len > seg_size) {
+        if (s != NULL) {
+            s->sealed = current_time;
+            if (s->live == 0) {
+                do_logmem_seg_put(s);
+                logmem_stats_data.segments_emptied++;
+            } else {
+                s->state = SEG_SEALED;
+            }
+        }
+        *cur = NULL;
+        if (do_logmem_spare() <= reserve || (s = do_logmem_seg_get()) == NULL)
+            return NULL;
+        s->state = state;
+        *cur = s;
+    }
+
+    rec = (logmem_rec *)((char *)s + s->used);
+    rec->len = len;
+    rec->live = 1;
+    s->used += len;
+    s->live += len;
+    live_bytes += len;
+    return rec + 1;
+}
+
+static void do_logmem_rec_free(void *ptr) {
+    logmem_rec *rec = (logmem_rec *)ptr - 1;
+    logmem_seg *s = (logmem_seg *)((uintptr_t)ptr & ~(uintptr_t)(seg_size - 1));
+
+    assert(rec->live);
+    rec->live = 0;
+    s->live -= rec->len;
+    live_bytes -= rec->len;
+    /* Nothing to copy, so there's no need to wait for the cleaner */
+    if (s->live == 0 && s->state == SEG_SEALED) {
+        do_logmem_seg_put(s);
+        logmem_stats_data.segments_emptied++;
+    }
+}
+
+/* Sets *full if live items have used up their share of the log, in which
+ * case the LRU has to evict; waiting on the cleaner won't help. A write
+ * that starts under the limit may run past it, otherwise a large chunk
+ * could need more evictions than the LRU makes for one allocation. */
+static void *do_logmem_alloc(const size_t size, bool *full) {
+    logmem_seg *was = head;
+    item *it;
+
+    *full = live_bytes >= live_limit;
+    if (*full)
+        return NULL;
+    it = do_logmem_append(&head, size, SEG_HEAD, LOGMEM_RESERVE);
+    if (it == NULL) {
+        logmem_cleaner_wake();
+        return NULL;
+    }
+    logmem_stats_data.bytes_written += ((logmem_rec *)it - 1)->len;
+    /* Unlike a slab chunk, this may still hold a freed item's flags */
+    it->it_flags = 0;
+    it->refcount = 1;
+    if (head != was && do_logmem_spare() < clean_target)
+        logmem_cleaner_wake();
+    return it;
+}
+
+void *logmem_alloc(const size_t size, const unsigned int flags) {
+    struct timespec ts;
+    void *ret;
+    uint64_t gen;
+    bool full;
+
+    pthread_mutex_lock(&cleaner_lock);
+    gen = space_gen;
+    pthread_mutex_unlock(&cleaner_lock);
+
+    slabs_mlock();
+    ret = do_logmem_alloc(size, &full);
+    slabs_munlock();
+    if (ret != NULL || full || flags == SLABS_ALLOC_NO_NEWPAGE)
+        return ret;
+
+    /* Give the cleaner a moment before the caller starts evicting. Freeing
+     * a whole segment can take it a few passes, so try after each one. */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += LOGMEM_ALLOC_WAIT_US * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&cleaner_lock);
+    alloc_waits++;
+    while (ret == NULL && !full) {
+        if (gen == space_gen && pthread_cond_timedwait(&space_cond,
+                    &cleaner_lock, &ts) == ETIMEDOUT)
+            break;
+        gen = space_gen;
+        pthread_mutex_unlock(&cleaner_lock);
+        slabs_mlock();
+        ret = do_logmem_alloc(size, &full);
+        slabs_munlock();
+        pthread_mutex_lock(&cleaner_lock);
+    }
+    if (ret == NULL && !full)
+        alloc_failures++;
+    pthread_mutex_unlock(&cleaner_lock);
+    return ret;
+}
+
+void logmem_free(void *ptr) {
+    item *it = (item *)ptr;
+
+    slabs_mlock();
+    if (it->it_flags & ITEM_CHUNKED) {
+        item_chunk *chunk = ((item_chunk *) ITEM_schunk(it))->next;
+        while (chunk) {
+            item_chunk *next = chunk->next;
+            assert(chunk->it_flags == ITEM_CHUNK);
+            chunk->it_flags = ITEM_SLABBED;
+            do_logmem_rec_free(chunk);
+            chunk = next;
+        }
+    }
+    it->it_flags = ITEM_SLABBED;
+    do_logmem_rec_free(it);
+    slabs_munlock();
+}
+
+/* Best (1 - u) * age / (1 + u) among sealed segments, where u is the share
+ * still live. When short of memory and nothing has dead space worth
+ * copying around, the oldest segment goes, evicting its COLD items. */
+static logmem_seg *do_logmem_pick(const bool short_of_memory) {
+    logmem_seg *best = NULL, *oldest = NULL;
+    double best_score = 0;
+    unsigned int i;
+
+    for (i = 0; i < seg_count; i++) {
+        logmem_seg *s = segs[i];
+        double u, score;
+        if (s->state != SEG_SEALED || s->retry > current_time)
+            continue;
+        if (oldest == NULL || s->sealed < oldest->sealed)
+            oldest = s;
+        u = (double)s->live / seg_size;
+        if (u >= LOGMEM_MAX_UTIL)
+            continue;
+        score = (1 - u) * (current_time - s->sealed + 1) / (1 + u);
+        if (score > best_score) {
+            best_score = score;
+            best = s;
+        }
+    }
+    if (best == NULL && short_of_memory)
+        return oldest;
+    return best;
+}
+
+/* Moves one live record out of the segment being cleaned. Called with the
+ * slabs lock held, which is dropped before returning. */
+static void logmem_clean_rec(logmem_rec *rec, const bool short_of_memory) {
+    item *it = (item *)(rec + 1);
+    item_chunk *ch = NULL;
+    item *new_it = NULL;
+    void *hold_lock;
+    uint32_t hv;
+    size_t len = rec->len - sizeof(logmem_rec);
+
+    if (it->it_flags & ITEM_CHUNK) {
+        /* Part of a larger item; the head locks the whole structure. A
+         * linked chunk's head can't be freed while we hold the slabs lock. */
+        ch = (item_chunk *) it;
+        it = ch->head;
+        assert(it->it_flags & ITEM_CHUNKED);
+    }
+    /* Being uploaded, or unlinked but still referenced. Let it bleed off
+     * and catch it next time around. */
+    if ((it->it_flags & ITEM_LINKED) == 0) {
+        logmem_stats_data.cleaner_busy_items++;
+        slabs_munlock();
+        return;
+    }
+    hv = hash(ITEM_key(it), it->nkey);
+    if ((hold_lock = item_trylock(hv)) == NULL) {
+        logmem_stats_data.cleaner_busy_items++;
+        slabs_munlock();
+        return;
+    }
+    if (refcount_incr(it) != 2 || (it->it_flags & ITEM_LINKED) == 0) {
+        refcount_decr(it);
+        item_trylock_unlock(hold_lock);
+        logmem_stats_data.cleaner_busy_items++;
+        slabs_munlock();
+        return;
+    }
+
+    if ((it->exptime != 0 && it->exptime < current_time)
+            || item_is_flushed(it)) {
+        /* Expired, don't save. */
+    } else if (short_of_memory && (GET_LRU(it->slabs_clsid) == COLD_LRU
+                || survivor == NULL || survivor->used + rec->len > seg_size)) {
+        /* Starting another survivor segment would eat the space this
+         * clean is meant to free up. */
+        logmem_stats_data.cleaner_evictions++;
+    } else if ((new_it = do_logmem_append(&survivor, len, SEG_SURVIVOR, 0)) == NULL) {
+        logmem_stats_data.cleaner_evictions++;
+    } else {
+        logmem_stats_data.bytes_relocated += rec->len;
+        logmem_stats_data.items_relocated++;
+    }
+    slabs_munlock();
+
+    if (new_it == NULL) {
+        STORAGE_delete(ext_storage, it);
+        do_item_unlink(it, hv);
+        /* Drops our reference, freeing every part of it */
+        do_item_remove(it);
+    } else if (ch == NULL) {
+        memcpy(new_it, it, len);
+        new_it->prev = 0;
+        new_it->next = 0;
+        new_it->h_next = 0;
+        new_it->it_flags &= ~ITEM_LINKED;
+        new_it->refcount = 0;
+        do_item_replace(it, new_it, hv);
+        /* Need to walk the chunks and repoint head */
+        if (new_it->it_flags & ITEM_CHUNKED) {
+            item_chunk *fch = (item_chunk *) ITEM_schunk(new_it);
+            slabs_mlock();
+            if (fch->next)
+                fch->next->prev = fch;
+            for (; fch; fch = fch->next)
+                fch->head = new_it;
+            slabs_munlock();
+        }
+        slabs_mlock();
+        /* Its chunks now belong to the copy, so only the record goes */
+        it->refcount = 0;
+        it->it_flags = ITEM_SLABBED;
+        do_logmem_rec_free(it);
+        slabs_munlock();
+    } else {
+        item_chunk *nch = (item_chunk *) new_it;
+        memcpy(nch, ch, len);
+        slabs_mlock();
+        /* Chunks always have a head chunk before them */
+        ch->prev->next = nch;
+        if (ch->next)
+            ch->next->prev = nch;
+        ch->it_flags = ITEM_SLABBED;
+        do_logmem_rec_free(ch);
+        slabs_munlock();
+        refcount_decr(it);
+    }
+    item_trylock_unlock(hold_lock);
+}
+
+/* Returns true if the segment was emptied. */
+static bool logmem_clean(logmem_seg *s, const bool short_of_memory) {
+    /* Sealed, so its records won't change size or move */
+    uint32_t offset = LOGMEM_SEG_HDR;
+    bool emptied = false;
+
+    while (offset < s->used) {
+        logmem_rec *rec = (logmem_rec *)((char *)s + offset);
+        offset += rec->len;
+        slabs_mlock();
+        if (rec->live) {
+            logmem_clean_rec(rec, short_of_memory);
+        } else {
+            slabs_munlock();
+        }
+    }
+
+    slabs_mlock();
+    logmem_stats_data.segments_cleaned++;
+    if (s->live == 0) {
+        do_logmem_seg_put(s);
+        emptied = true;
+    } else {
+        /* Don't keep picking it while whatever holds its items is busy */
+        s->retry = current_time + 1;
+        s->state = SEG_SEALED;
+    }
+    slabs_munlock();
+    return emptied;
+}
+
+static uint64_t logmem_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *logmem_cleaner_thread(void *arg) {
+    pthread_mutex_lock(&cleaner_lock);
+    pthread_cond_signal(&cleaner_cond);
+    if (settings.verbose > 2)
+        fprintf(stderr, "Starting log memory cleaner thread\n");
+    while (do_run_cleaner) {
+        logmem_seg *victim = NULL;
+        bool short_of_memory = false;
+        bool emptied = false;
+        uint64_t start = 0;
+        struct timespec ts;
+
+        cleaner_kicked = false;
+        pthread_mutex_unlock(&cleaner_lock);
+        pthread_mutex_lock(&cleaner_run_lock);
+        slabs_mlock();
+        if (do_logmem_spare() < clean_target) {
+            short_of_memory = do_logmem_spare() <= LOGMEM_RESERVE;
+            victim = do_logmem_pick(short_of_memory);
+            if (victim != NULL)
+                victim->state = SEG_CLEANING;
+        }
+        slabs_munlock();
+
+        if (victim != NULL) {
+            start = logmem_now();
+            emptied = logmem_clean(victim, short_of_memory);
+        }
+        pthread_mutex_unlock(&cleaner_run_lock);
+
+        pthread_mutex_lock(&cleaner_lock);
+        if (victim != NULL) {
+            cleaner_usec += logmem_now() - start;
+            space_gen++;
+            pthread_cond_broadcast(&space_cond);
+            if (emptied)
+                continue;
+        }
+        if (cleaner_kicked)
+            continue;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        /* Busy items held the last one back; give them a moment */
+        if (victim != NULL) {
+            ts.tv_nsec += 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+        } else {
+            ts.tv_sec++;
+        }
+        if (do_run_cleaner)
+            pthread_cond_timedwait(&cleaner_cond, &cleaner_lock, &ts);
+    }
+    pthread_mutex_unlock(&cleaner_lock);
+    if (settings.verbose > 2)
+        fprintf(stderr, "Log memory cleaner thread stopping\n");
+    return NULL;
+}
+
+int start_logmem_cleaner_thread(void) {
+    int ret;
+    pthread_mutex_lock(&cleaner_lock);
+    do_run_cleaner = 1;
+    if ((ret = pthread_create(&cleaner_tid, NULL,
+        logmem_cleaner_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create log memory cleaner thread: %s\n",
+            strerror(ret));
+        do_run_cleaner = 0;
+        pthread_mutex_unlock(&cleaner_lock);
+        return -1;
+    }
+    thread_setname(cleaner_tid, "mc-logclean");
+    /* Avoid returning until the thread has actually started */
+    pthread_cond_wait(&cleaner_cond, &cleaner_lock);
+    pthread_mutex_unlock(&cleaner_lock);
+    return 0;
+}
+
+/* Writers take cleaner_lock to wait for space, so pausing holds a lock of
+ * the cleaner's own instead. */
+void logmem_cleaner_pause(void) {
+    pthread_mutex_lock(&cleaner_run_lock);
+}
+
+void logmem_cleaner_resume(void) {
+    pthread_mutex_unlock(&cleaner_run_lock);
+}
+
+int stop_logmem_cleaner_thread(void) {
+    int ret;
+    pthread_mutex_lock(&cleaner_lock);
+    if (do_run_cleaner == 0) {
+        pthread_mutex_unlock(&cleaner_lock);
+        return 0;
+    }
+    do_run_cleaner = 0;
+    pthread_cond_signal(&cleaner_cond);
+    pthread_mutex_unlock(&cleaner_lock);
+    if ((ret = pthread_join(cleaner_tid, NULL)) != 0) {
+        fprintf(stderr, "Failed to stop log memory cleaner thread: %s\n", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+void logmem_stats(ADD_STAT add_stats, void *c) {
+    typeof(logmem_stats_data) st;
+    uint64_t live, usec, waits, failures;
+    unsigned int i, in_use = 0, spare, count;
+
+    slabs_mlock();
+    st = logmem_stats_data;
+    for (i = 0; i < seg_count; i++) {
+        if (segs[i]->state != SEG_FREE)
+            in_use++;
+    }
+    live = live_bytes;
+    spare = do_logmem_spare();
+    count = seg_count;
+    slabs_munlock();
+
+    pthread_mutex_lock(&cleaner_lock);
+    usec = cleaner_usec;
+    waits = alloc_waits;
+    failures = alloc_failures;
+    pthread_mutex_unlock(&cleaner_lock);
+
+    APPEND_STAT("segment_size", "%llu", (unsigned long long)seg_size);
+    APPEND_STAT("segments_limit", "%u", seg_limit);
+    APPEND_STAT("segments", "%u", count);
+    APPEND_STAT("segments_spare", "%u", spare);
+    APPEND_STAT("live_bytes", "%llu", (unsigned long long)live);
+    APPEND_STAT("utilization", "%.4f",
+            in_use ? (double)live / ((double)in_use * seg_size) : 0.0);
+    APPEND_STAT("bytes_written", "%llu", (unsigned long long)st.bytes_written);
+    APPEND_STAT("bytes_relocated", "%llu", (unsigned long long)st.bytes_relocated);
+    APPEND_STAT("bytes_reclaimed", "%llu", (unsigned long long)st.bytes_reclaimed);
+    APPEND_STAT("write_amplification", "%.4f", st.bytes_written == 0 ? 1.0
+            : (double)(st.bytes_written + st.bytes_relocated) / st.bytes_written);
+    APPEND_STAT("cleaner_cost", "%.4f", st.bytes_reclaimed == 0 ? 0.0
+            : (double)st.bytes_relocated / st.bytes_reclaimed);
+    APPEND_STAT("items_relocated", "%llu", (unsigned long long)st.items_relocated);
+    APPEND_STAT("segments_cleaned", "%llu", (unsigned long long)st.segments_cleaned);
+    APPEND_STAT("segments_emptied", "%llu", (unsigned long long)st.segments_emptied);
+    APPEND_STAT("cleaner_evictions", "%llu", (unsigned long long)st.cleaner_evictions);
+    APPEND_STAT("cleaner_busy_items", "%llu", (unsigned long long)st.cleaner_busy_items);
+    APPEND_STAT("cleaner_usec", "%llu", (unsigned long long)usec);
+    APPEND_STAT("alloc_waits", "%llu", (unsigned long long)waits);
+    APPEND_STAT("alloc_failures", "%llu", (unsigned long long)failures);
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
@@ -0,0 +1,17 @@
+#ifndef LOGMEM_H
+#define LOGMEM_H
+
+/* Log structured item memory behind -o log_memory. Takes over from the slab
+ * classes inside slabs_alloc() and slabs_free(). */
+bool logmem_init(const size_t limit);
+int start_logmem_cleaner_thread(void);
+int stop_logmem_cleaner_thread(void);
+void logmem_cleaner_pause(void);
+void logmem_cleaner_resume(void);
+void *logmem_alloc(const size_t size, const unsigned int flags);
+void logmem_free(void *ptr);
+/* Segments left for writers and the cleaner. Requires the slabs lock. */
+unsigned int do_logmem_spare(void);
+void logmem_stats(ADD_STAT add_stats, void *c);
+
+#endif
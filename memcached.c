@@ -17,6 +17,11 @@
 #include "storage.h"
 #include "authfile.h"
 #include "restart.h"
+#include "tinylfu.h"
+#include "expiry.h"
+#include "mrc.h"
+#include "quota.h"
+#include "logmem.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -54,6 +59,10 @@
 #include "tls.h"
 #endif
 
+#ifdef WORKER_URING
+#include "uring.h"
+#endif
+
 #include "proto_text.h"
 #include "proto_bin.h"
 #include "proto_proxy.h"
@@ -213,6 +222,9 @@ void stats_reset(void) {
     stats_prefix_clear();
     STATS_UNLOCK();
     threadlocal_stats_reset();
+    lock_stats_reset();
+    if (settings.mrc_sample_rate > 0)
+        mrc_stats_reset();
     item_stats_reset();
 }
 
@@ -264,7 +276,21 @@ static void settings_init(void) {
     settings.lru_crawler_sleep = 100;
     settings.lru_crawler_tocrawl = 0;
     settings.lru_maintainer_thread = false;
+    settings.lru_maintainer_threads = 1;
+    settings.slab_magazines = 0;
+    settings.slab_compact_ratio = 0;
+    settings.slab_idle_trim = 0;
+    settings.log_memory = false;
+    settings.prealloc_threads = 0;
     settings.lru_segmented = true;
+    settings.lru_clock = false;
+    settings.lru_s3fifo = false;
+    settings.lru_gdsf = false;
+    settings.expiry_wheel = 0;
+    settings.mrc_sample_rate = 0;
+    settings.mrc_max_keys = 65536;
+    settings.prefix_quotas = false;
+    settings.lru_admission = false;
     settings.hot_lru_pct = 20;
     settings.warm_lru_pct = 40;
     settings.hot_max_factor = 0.2;
@@ -273,6 +299,14 @@ static void settings_init(void) {
     settings.temporary_ttl = 61;
     settings.idle_timeout = 0; /* disabled */
     settings.hashpower_init = 0;
+    settings.hash_expand_pause = false;
+    settings.hash_buckets = false;
+    settings.hash_shrink_ratio = 0;
+    settings.hash_migrate_threads = 1;
+    settings.hash_hugepages = false;
+    settings.hash_numa = HASH_NUMA_NONE;
+    settings.hash_numa_node = 0;
+    settings.item_lock_rw = false;
     settings.slab_reassign = true;
     settings.slab_automove = 1;
     settings.slab_automove_ratio = 0.8;
@@ -295,6 +329,9 @@ static void settings_init(void) {
 #ifdef SOCK_COOKIE_ID
     settings.sock_cookie_id = 0;
 #endif
+#ifdef WORKER_URING
+    settings.worker_uring = false;
+#endif
 }
 
 extern pthread_mutex_t conn_lock;
@@ -539,6 +576,10 @@ void conn_close_idle(conn *c) {
 }
 
 static void _conn_event_readd(conn *c) {
+#ifdef WORKER_URING
+    if (c->uring && uring_conn_readd(c))
+        return;
+#endif
     c->ev_flags = EV_READ | EV_PERSIST;
     event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
     event_base_set(c->thread->base, &c->event);
@@ -584,6 +625,15 @@ void conn_worker_readd(conn *c) {
 
 }
 
+/* stop watching a conn which is being handed to a side thread. */
+void conn_event_del(conn *c) {
+    event_del(&c->event);
+#ifdef WORKER_URING
+    if (c->uring)
+        uring_conn_detach(c);
+#endif
+}
+
 void thread_io_queue_add(LIBEVENT_THREAD *t, int type, void *ctx, io_queue_stack_cb cb) {
     io_queue_cb_t *q = t->io_queues;
     while (q->type != IO_QUEUE_NONE) {
@@ -754,6 +804,7 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->rcurr = c->rbuf;
     c->ritem = 0;
     c->rbuf_malloced = false;
+    c->rprefetched = NULL;
     c->item_malloced = false;
     c->sasl_started = false;
     c->set_stale = false;
@@ -907,6 +958,9 @@ void conn_free(conn *c) {
         if (c->ssl_wbuf)
             c->ssl_wbuf = NULL;
 #endif
+#ifdef WORKER_URING
+        uring_conn_free(c);
+#endif
 
         free(c);
     }
@@ -915,15 +969,21 @@ void conn_free(conn *c) {
 static void conn_close(conn *c) {
     assert(c != NULL);
 
+    /* delete the event, the socket and the conn */
+    event_del(&c->event);
+#ifdef WORKER_URING
+    /* A send still in flight reads from the responses; the conn stays in
+     * conn_closing until it completes and drives us here again. */
+    if (c->uring && !uring_conn_close(c))
+        return;
+#endif
+
     if (c->thread) {
         LOGGER_LOG(c->thread->l, LOG_CONNEVENTS, LOGGER_CONNECTION_CLOSE, NULL,
                 &c->request_addr, c->request_addr_size, c->transport,
                 c->close_reason, c->sfd);
     }
 
-    /* delete the event, the socket and the conn */
-    event_del(&c->event);
-
     if (settings.verbose > 1)
         fprintf(stderr, "<%d connection closed.\n", c->sfd);
 
@@ -1574,6 +1634,25 @@ static int _store_item_copy_data(int comm, item *old_it, item *new_it, item *add
     return 0;
 }
 
+/*
+ * What a store turned away by the admission filter answers. Only a key which
+ * wasn't linked can be turned away, so it's as if the item was stored and
+ * evicted straight away, unless the command needed an item to be there.
+ */
+enum store_item_type store_refused_status(const int comm) {
+    switch (comm) {
+        case NREAD_SET:
+        case NREAD_ADD:
+        case NREAD_APPENDVIV:
+        case NREAD_PREPENDVIV:
+            return STORED;
+        case NREAD_CAS:
+            return NOT_FOUND;
+        default:
+            return NOT_STORED;
+    }
+}
+
 /*
  * Stores an item in the cache according to the semantics of one of the set
  * commands. Protected by the item lock.
@@ -1668,7 +1747,7 @@ enum store_item_type do_store_item(item *it, int comm, LIBEVENT_THREAD *t, const
 #endif
                 /* we have it and old_it here - alloc memory to hold both */
                 FLAGS_CONV(old_it, flags);
-                new_it = do_item_alloc(key, it->nkey, flags, old_it->exptime, it->nbytes + old_it->nbytes - 2 /* CRLF */);
+                new_it = do_item_alloc_hv(key, it->nkey, flags, old_it->exptime, it->nbytes + old_it->nbytes - 2 /* CRLF */, hv, NULL);
 
                 // OOM trying to copy.
                 if (new_it == NULL)
@@ -1680,6 +1759,7 @@ enum store_item_type do_store_item(item *it, int comm, LIBEVENT_THREAD *t, const
                 } else {
                     // refcount of new_it is 1 here. will end up 2 after link.
                     // it's original ref is managed outside of this function
+                    new_it->cost = old_it->cost;
                     it = new_it;
                     do_store = true;
                     // Upstream final object size for meta
@@ -1844,6 +1924,10 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("get_misses", "%llu", (unsigned long long)thread_stats.get_misses);
     APPEND_STAT("get_expired", "%llu", (unsigned long long)thread_stats.get_expired);
     APPEND_STAT("get_flushed", "%llu", (unsigned long long)thread_stats.get_flushed);
+    APPEND_STAT("get_prefetch_batches", "%llu", (unsigned long long)thread_stats.get_prefetch_batches);
+    APPEND_STAT("get_prefetch_keys", "%llu", (unsigned long long)thread_stats.get_prefetch_keys);
+    APPEND_STAT("get_lock_waits", "%llu", (unsigned long long)thread_stats.get_lock_waits);
+    APPEND_STAT("get_lock_upgrades", "%llu", (unsigned long long)thread_stats.get_lock_upgrades);
 #ifdef EXTSTORE
     if (c->thread->storage) {
         APPEND_STAT("get_extstore", "%llu", (unsigned long long)thread_stats.get_extstore);
@@ -1872,6 +1956,15 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     if (settings.idle_timeout) {
         APPEND_STAT("idle_kicks", "%llu", (unsigned long long)thread_stats.idle_kicks);
     }
+#ifdef WORKER_URING
+    if (settings.worker_uring) {
+        APPEND_STAT("uring_submits", "%llu", (unsigned long long)thread_stats.uring_submits);
+        APPEND_STAT("uring_sqes", "%llu", (unsigned long long)thread_stats.uring_sqes);
+        APPEND_STAT("uring_cqe_batches", "%llu", (unsigned long long)thread_stats.uring_cqe_batches);
+        APPEND_STAT("uring_cqes", "%llu", (unsigned long long)thread_stats.uring_cqes);
+        APPEND_STAT("uring_recv_nobufs", "%llu", (unsigned long long)thread_stats.uring_recv_nobufs);
+    }
+#endif
     APPEND_STAT("bytes_read", "%llu", (unsigned long long)thread_stats.bytes_read);
     APPEND_STAT("bytes_written", "%llu", (unsigned long long)thread_stats.bytes_written);
     APPEND_STAT("limit_maxbytes", "%llu", (unsigned long long)settings.maxbytes);
@@ -1883,6 +1976,13 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("hash_power_level", "%u", stats_state.hash_power_level);
     APPEND_STAT("hash_bytes", "%llu", (unsigned long long)stats_state.hash_bytes);
     APPEND_STAT("hash_is_expanding", "%u", stats_state.hash_is_expanding);
+    APPEND_STAT("hash_expansions", "%llu", (unsigned long long)stats.hash_expansions);
+    APPEND_STAT("hash_expand_time_us", "%llu", (unsigned long long)stats.hash_expand_time_us);
+    APPEND_STAT("hash_expand_stall_us", "%llu", (unsigned long long)stats.hash_expand_stall_us);
+    APPEND_STAT("hash_is_shrinking", "%u", stats_state.hash_is_shrinking);
+    APPEND_STAT("hash_shrinks", "%llu", (unsigned long long)stats.hash_shrinks);
+    APPEND_STAT("hash_shrink_time_us", "%llu", (unsigned long long)stats.hash_shrink_time_us);
+    APPEND_STAT("hash_migrate_remaining", "%llu", (unsigned long long)assoc_migrate_remaining());
     if (settings.slab_reassign) {
         APPEND_STAT("slab_reassign_rescues", "%llu", stats.slab_reassign_rescues);
         APPEND_STAT("slab_reassign_chunk_rescues", "%llu", stats.slab_reassign_chunk_rescues);
@@ -1892,6 +1992,9 @@ void server_stats(ADD_STAT add_stats, conn *c) {
         APPEND_STAT("slab_reassign_busy_deletes", "%llu", stats.slab_reassign_busy_deletes);
         APPEND_STAT("slab_reassign_running", "%u", stats_state.slab_reassign_running);
         APPEND_STAT("slabs_moved", "%llu", stats.slabs_moved);
+        if (settings.slab_compact_ratio > 0) {
+            APPEND_STAT("slabs_compacted", "%llu", (unsigned long long)stats.slabs_compacted);
+        }
     }
     if (settings.lru_crawler) {
         APPEND_STAT("lru_crawler_running", "%u", stats_state.lru_crawler_running);
@@ -1900,6 +2003,10 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     if (settings.lru_maintainer_thread) {
         APPEND_STAT("lru_maintainer_juggles", "%llu", (unsigned long long)stats.lru_maintainer_juggles);
     }
+    if (settings.expiry_wheel) {
+        expiry_wheel_stats(add_stats, c);
+    }
+    slabs_prealloc_stats(add_stats, c);
     APPEND_STAT("malloc_fails", "%llu",
                 (unsigned long long)stats.malloc_fails);
     APPEND_STAT("log_worker_dropped", "%llu", (unsigned long long)stats.log_worker_dropped);
@@ -1959,11 +2066,35 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("item_size_max", "%d", settings.item_size_max);
     APPEND_STAT("maxconns_fast", "%s", settings.maxconns_fast ? "yes" : "no");
     APPEND_STAT("hashpower_init", "%d", settings.hashpower_init);
+    APPEND_STAT("hash_expand_pause", "%s", settings.hash_expand_pause ? "yes" : "no");
+    APPEND_STAT("hash_buckets", "%s", settings.hash_buckets ? "yes" : "no");
+    APPEND_STAT("hash_shrink_ratio", "%.2f", settings.hash_shrink_ratio);
+    APPEND_STAT("hash_migrate_threads", "%d", settings.hash_migrate_threads);
+    APPEND_STAT("hash_hugepages", "%s", settings.hash_hugepages ? "yes" : "no");
+    APPEND_STAT("hash_page_type", "%s", assoc_page_type());
+    if (settings.hash_numa == HASH_NUMA_BIND) {
+        APPEND_STAT("hash_numa", "%d", settings.hash_numa_node);
+    } else {
+        APPEND_STAT("hash_numa", "%s",
+                settings.hash_numa == HASH_NUMA_INTERLEAVE ? "interleave" : "none");
+    }
+    APPEND_STAT("hash_numa_applied", "%s", assoc_numa_applied() ? "yes" : "no");
+    APPEND_STAT("item_lock_mode", "%s", settings.item_lock_rw ? "rwlock" : "mutex");
     APPEND_STAT("slab_reassign", "%s", settings.slab_reassign ? "yes" : "no");
     APPEND_STAT("slab_automove", "%d", settings.slab_automove);
     APPEND_STAT("slab_automove_ratio", "%.2f", settings.slab_automove_ratio);
     APPEND_STAT("slab_automove_window", "%u", settings.slab_automove_window);
     APPEND_STAT("slab_chunk_max", "%d", settings.slab_chunk_size_max);
+    APPEND_STAT("slab_magazines", "%d", settings.slab_magazines);
+    APPEND_STAT("slab_compact_ratio", "%.2f", settings.slab_compact_ratio);
+    APPEND_STAT("slab_idle_trim", "%d", settings.slab_idle_trim);
+    APPEND_STAT("log_memory", "%s", settings.log_memory ? "yes" : "no");
+    APPEND_STAT("prealloc_threads", "%d", settings.prealloc_threads);
+#ifdef COMPACT_ITEMS
+    APPEND_STAT("compact_items", "%s", "yes");
+#else
+    APPEND_STAT("compact_items", "%s", "no");
+#endif
     APPEND_STAT("lru_crawler", "%s", settings.lru_crawler ? "yes" : "no");
     APPEND_STAT("lru_crawler_sleep", "%d", settings.lru_crawler_sleep);
     APPEND_STAT("lru_crawler_tocrawl", "%lu", (unsigned long)settings.lru_crawler_tocrawl);
@@ -1972,7 +2103,16 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("dump_enabled", "%s", settings.dump_enabled ? "yes" : "no");
     APPEND_STAT("hash_algorithm", "%s", settings.hash_algorithm);
     APPEND_STAT("lru_maintainer_thread", "%s", settings.lru_maintainer_thread ? "yes" : "no");
+    APPEND_STAT("lru_maintainer_threads", "%d", settings.lru_maintainer_threads);
     APPEND_STAT("lru_segmented", "%s", settings.lru_segmented ? "yes" : "no");
+    APPEND_STAT("lru_clock", "%s", settings.lru_clock ? "yes" : "no");
+    APPEND_STAT("lru_s3fifo", "%s", settings.lru_s3fifo ? "yes" : "no");
+    APPEND_STAT("lru_gdsf", "%s", settings.lru_gdsf ? "yes" : "no");
+    APPEND_STAT("expiry_wheel", "%d", settings.expiry_wheel);
+    APPEND_STAT("mrc_sample_rate", "%.6f", settings.mrc_sample_rate);
+    APPEND_STAT("mrc_max_keys", "%d", settings.mrc_max_keys);
+    APPEND_STAT("prefix_quotas", "%s", settings.prefix_quotas ? "yes" : "no");
+    APPEND_STAT("lru_admission", "%s", settings.lru_admission ? "yes" : "no");
     APPEND_STAT("hot_lru_pct", "%d", settings.hot_lru_pct);
     APPEND_STAT("warm_lru_pct", "%d", settings.warm_lru_pct);
     APPEND_STAT("hot_max_factor", "%.2f", settings.hot_max_factor);
@@ -2017,6 +2157,9 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
 #ifdef PROXY
     APPEND_STAT("proxy_enabled", "%s", settings.proxy_enabled ? "yes" : "no");
     APPEND_STAT("proxy_uring_enabled", "%s", settings.proxy_uring ? "yes" : "no");
+#endif
+#ifdef WORKER_URING
+    APPEND_STAT("worker_uring", "%s", settings.worker_uring ? "yes" : "no");
 #endif
     APPEND_STAT("num_napi_ids", "%s", settings.num_napi_ids);
     APPEND_STAT("memory_file", "%s", settings.memory_file);
@@ -2045,12 +2188,32 @@ bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c) {
             item_stats(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "slabs") == 0) {
             slabs_stats(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "slab_profile") == 0) {
+            slabs_profile_stats(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "sizes") == 0) {
             item_stats_sizes(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "sizes_enable") == 0) {
             item_stats_sizes_enable(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "sizes_disable") == 0) {
             item_stats_sizes_disable(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "locks") == 0) {
+            lock_stats(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "lru_maintainer") == 0) {
+            lru_maintainer_stats(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "mrc") == 0) {
+            mrc_stats(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "quotas") == 0) {
+            if (settings.prefix_quotas) {
+                quota_stats(add_stats, c);
+            } else {
+                ret = false;
+            }
+        } else if (nz_strcmp(nkey, stat_type, "log") == 0) {
+            if (settings.log_memory) {
+                logmem_stats(add_stats, c);
+            } else {
+                ret = false;
+            }
         } else {
             ret = false;
         }
@@ -2214,11 +2377,15 @@ void process_stats_conns(ADD_STAT add_stats, void *c) {
 
 #define IT_REFCOUNT_LIMIT 60000
 item* limited_get(const char *key, size_t nkey, LIBEVENT_THREAD *t, uint32_t exptime, bool should_touch, bool do_update, bool *overflow) {
+    return limited_get_hv(key, nkey, hash(key, nkey), t, exptime, should_touch, do_update, overflow);
+}
+
+item* limited_get_hv(const char *key, size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, uint32_t exptime, bool should_touch, bool do_update, bool *overflow) {
     item *it;
     if (should_touch) {
-        it = item_touch(key, nkey, exptime, t);
+        it = item_touch_hv(key, nkey, hv, exptime, t);
     } else {
-        it = item_get(key, nkey, t, do_update);
+        it = item_get_hv(key, nkey, hv, t, do_update);
     }
     if (it && it->refcount > IT_REFCOUNT_LIMIT) {
         item_remove(it);
@@ -2338,13 +2505,14 @@ enum delta_result_type do_add_delta(LIBEVENT_THREAD *t, const char *key, const s
         item *new_it;
         client_flags_t flags;
         FLAGS_CONV(it, flags);
-        new_it = do_item_alloc(ITEM_key(it), it->nkey, flags, it->exptime, res + 2);
+        new_it = do_item_alloc_hv(ITEM_key(it), it->nkey, flags, it->exptime, res + 2, hv, NULL);
         if (new_it == 0) {
             do_item_remove(it);
             return EOM;
         }
         memcpy(ITEM_data(new_it), buf, res);
         memcpy(ITEM_data(new_it) + res, "\r\n", 2);
+        new_it->cost = it->cost;
         item_replace(it, new_it, hv);
         // Overwrite the older item's CAS with our new CAS since we're
         // returning the CAS of the old item below.
@@ -2527,6 +2695,10 @@ static bool update_event(conn *c, const int new_flags) {
     assert(c != NULL);
 
     struct event_base *base = c->event.ev_base;
+#ifdef WORKER_URING
+    if (c->uring && uring_conn_update(c, new_flags))
+        return true;
+#endif
     if (c->ev_flags == new_flags)
         return true;
     if (event_del(&c->event) == -1) return false;
@@ -2988,6 +3160,79 @@ static int read_into_chunked_item(conn *c) {
     return total;
 }
 
+/*
+ * Rejects a newly accepted socket or hands it to a worker thread. Returns
+ * false if it was dropped because its TLS handshake failed.
+ */
+bool conn_accepted(conn *c, const int sfd) {
+    bool reject;
+    if (settings.maxconns_fast) {
+        reject = sfd >= settings.maxconns - 1;
+        if (reject) {
+            STATS_LOCK();
+            stats.rejected_conns++;
+            STATS_UNLOCK();
+        }
+    } else {
+        reject = false;
+    }
+
+    if (reject) {
+        const char *str = "ERROR Too many open connections\r\n";
+        ssize_t res = write(sfd, str, strlen(str));
+        (void)res;
+        close(sfd);
+    } else {
+        void *ssl_v = NULL;
+#ifdef TLS
+        SSL *ssl = NULL;
+        if (c->ssl_enabled) {
+            assert(IS_TCP(c->transport) && settings.ssl_enabled);
+
+            if (settings.ssl_ctx == NULL) {
+                if (settings.verbose) {
+                    fprintf(stderr, "SSL context is not initialized\n");
+                }
+                close(sfd);
+                return false;
+            }
+            SSL_LOCK();
+            ssl = SSL_new(settings.ssl_ctx);
+            SSL_UNLOCK();
+            if (ssl == NULL) {
+                if (settings.verbose) {
+                    fprintf(stderr, "Failed to created the SSL object\n");
+                }
+                close(sfd);
+                return false;
+            }
+            SSL_set_fd(ssl, sfd);
+            int ret = SSL_accept(ssl);
+            if (ret <= 0) {
+                int err = SSL_get_error(ssl, ret);
+                if (err == SSL_ERROR_SYSCALL || err == SSL_ERROR_SSL) {
+                    if (settings.verbose) {
+                        fprintf(stderr, "SSL connection failed with error code : %d : %s\n", err, strerror(errno));
+                    }
+                    SSL_free(ssl);
+                    close(sfd);
+                    STATS_LOCK();
+                    stats.ssl_handshake_errors++;
+                    STATS_UNLOCK();
+                    return false;
+                }
+            }
+        }
+        ssl_v = (void*) ssl;
+#endif
+
+        dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                             READ_BUFFER_CACHED, c->transport, ssl_v, c->tag, c->protocol);
+    }
+
+    return true;
+}
+
 static void drive_machine(conn *c) {
     bool stop = false;
     int sfd;
@@ -2995,7 +3240,6 @@ static void drive_machine(conn *c) {
     struct sockaddr_storage addr;
     int nreqs = settings.reqs_per_event;
     int res;
-    const char *str;
 #ifdef HAVE_ACCEPT4
     static int  use_accept4 = 1;
 #else
@@ -3046,68 +3290,8 @@ static void drive_machine(conn *c) {
                 }
             }
 
-            bool reject;
-            if (settings.maxconns_fast) {
-                reject = sfd >= settings.maxconns - 1;
-                if (reject) {
-                    STATS_LOCK();
-                    stats.rejected_conns++;
-                    STATS_UNLOCK();
-                }
-            } else {
-                reject = false;
-            }
-
-            if (reject) {
-                str = "ERROR Too many open connections\r\n";
-                res = write(sfd, str, strlen(str));
-                close(sfd);
-            } else {
-                void *ssl_v = NULL;
-#ifdef TLS
-                SSL *ssl = NULL;
-                if (c->ssl_enabled) {
-                    assert(IS_TCP(c->transport) && settings.ssl_enabled);
-
-                    if (settings.ssl_ctx == NULL) {
-                        if (settings.verbose) {
-                            fprintf(stderr, "SSL context is not initialized\n");
-                        }
-                        close(sfd);
-                        break;
-                    }
-                    SSL_LOCK();
-                    ssl = SSL_new(settings.ssl_ctx);
-                    SSL_UNLOCK();
-                    if (ssl == NULL) {
-                        if (settings.verbose) {
-                            fprintf(stderr, "Failed to created the SSL object\n");
-                        }
-                        close(sfd);
-                        break;
-                    }
-                    SSL_set_fd(ssl, sfd);
-                    int ret = SSL_accept(ssl);
-                    if (ret <= 0) {
-                        int err = SSL_get_error(ssl, ret);
-                        if (err == SSL_ERROR_SYSCALL || err == SSL_ERROR_SSL) {
-                            if (settings.verbose) {
-                                fprintf(stderr, "SSL connection failed with error code : %d : %s\n", err, strerror(errno));
-                            }
-                            SSL_free(ssl);
-                            close(sfd);
-                            STATS_LOCK();
-                            stats.ssl_handshake_errors++;
-                            STATS_UNLOCK();
-                            break;
-                        }
-                    }
-                }
-                ssl_v = (void*) ssl;
-#endif
-
-                dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
-                                     READ_BUFFER_CACHED, c->transport, ssl_v, c->tag, c->protocol);
+            if (!conn_accepted(c, sfd)) {
+                break;
             }
 
             stop = true;
@@ -3422,6 +3606,12 @@ static void drive_machine(conn *c) {
         }
     }
 
+#ifdef WORKER_URING
+    /* nothing polls a ring driven conn's socket, so this is where it
+     * notices it already has what it's waiting on. */
+    if (c->uring)
+        uring_conn_pending(c);
+#endif
     return;
 }
 
@@ -3447,6 +3637,14 @@ void event_handler(const evutil_socket_t fd, const short which, void *arg) {
     return;
 }
 
+#ifdef WORKER_URING
+/* a completion on the thread's ring, standing in for an event on c. */
+void conn_uring_event(conn *c, const short which) {
+    c->which = which;
+    drive_machine(c);
+}
+#endif
+
 static int new_socket(struct addrinfo *ai) {
     int sfd;
     int flags;
@@ -3969,7 +4167,7 @@ static void clock_handler(const evutil_socket_t fd, const short which, void *arg
 
     // While we're here, check for hash table expansion.
     // This function should be quick to avoid delaying the timer.
-    assoc_start_expand(stats_state.curr_items);
+    assoc_start_resize(stats_state.curr_items);
     // also, if HUP'ed we need to do some maintenance.
     // for now that's just the authfile reload.
     if (settings.sig_hup) {
@@ -4118,6 +4316,25 @@ static void usage(void) {
            settings.read_buf_mem_limit);
     verify_default("read_buf_mem_limit", settings.read_buf_mem_limit == 0);
     printf("   - no_lru_maintainer:   disable new LRU system + background thread.\n"
+           "   - lru_maintainer_threads: LRU maintainer threads, each looking after\n"
+           "                          its share of the slab classes. (default: 1)\n"
+           "   - lru_clock:           CLOCK replacement in a flat LRU. hits only mark the\n"
+           "                          item, which the eviction sweep skips once.\n"
+           "   - lru_s3fifo:          S3-FIFO eviction: new items enter a small FIFO and\n"
+           "                          only move to the main FIFO if hit while there.\n"
+           "   - lru_gdsf:            cost aware eviction. items are kept longer the more\n"
+           "                          they are hit and the higher their meta set G cost.\n"
+           "   - expiry_wheel:        reclaim items within a second of expiring if their\n"
+           "                          TTL is under this many seconds. (default: 0, off)\n"
+           "   - mrc_sample_rate:     fraction of keys sampled to estimate the miss ratio\n"
+           "                          curve for 'stats mrc'. (default: 0, off)\n"
+           "   - mrc_max_keys:        most sampled keys tracked for 'stats mrc'. the\n"
+           "                          sample rate drops to stay under it. (default: %d)\n"
+           "   - prefix_quotas:       track memory per key prefix (see -D) and allow\n"
+           "                          the 'quota' command to cap it. a prefix over its\n"
+           "                          quota evicts its own items.\n"
+           "   - lru_admission:       only let a new item evict the LRU tail if its key\n"
+           "                          has been accessed more often recently.\n"
            "   - hot_lru_pct:         pct of slab memory to reserve for hot lru.\n"
            "                          (requires lru_maintainer, default pct: %d)\n"
            "   - warm_lru_pct:        pct of slab memory to reserve for warm lru.\n"
@@ -4127,15 +4344,47 @@ static void usage(void) {
            "   - temporary_ttl:       TTL's below get separate LRU, can't be evicted.\n"
            "                          (requires lru_maintainer, default: %d)\n"
            "   - idle_timeout:        timeout for idle connections. (default: %d, no timeout)\n",
+           settings.mrc_max_keys,
            settings.hot_lru_pct, settings.warm_lru_pct, settings.hot_max_factor, settings.warm_max_factor,
            settings.temporary_ttl, settings.idle_timeout);
     printf("   - slab_chunk_max:      (EXPERIMENTAL) maximum slab size in kilobytes. use extreme care. (default: %d)\n"
+           "   - slab_magazines:      per worker thread cache of up to this many free\n"
+           "                          chunks per slab class, moved to and from the\n"
+           "                          class in batches. (default: 0, off)\n"
+           "   - slab_compact_ratio:  once a class has less than this fraction of its\n"
+           "                          chunks in use, move live items out of its\n"
+           "                          sparsest pages and free them, one page a second.\n"
+           "                          (requires slab_reassign, default: 0, off)\n"
+           "   - slab_idle_trim:      return global page pool memory to the OS once it\n"
+           "                          has gone unused for this many seconds.\n"
+           "                          (requires slab_reassign, default: 0, off)\n"
+           "   - log_memory:          store items in a log of page sized segments\n"
+           "                          instead of slab classes. a cleaner thread\n"
+           "                          compacts segments to free space.\n"
+           "                          (disables slab_reassign and slab_automove)\n"
+           "   - prealloc_threads:    threads which fault in memory preallocated by -L\n"
+           "                          at startup. (default: 0, one per CPU)\n"
            "   - watcher_logbuf_size: size in kilobytes of per-watcher write buffer. (default: %u)\n"
            "   - worker_logbuf_size:  size in kilobytes of per-worker-thread buffer\n"
            "                          read by background thread, then written to watchers. (default: %u)\n"
            "   - track_sizes:         enable dynamic reports for 'stats sizes' command.\n"
            "                          note that counts for each size are approximate.\n"
            "   - no_hashexpand:       disables hash table expansion (dangerous)\n"
+           "   - hash_expand_pause:   pause all threads while swapping in a grown hash\n"
+           "                          table, instead of briefly holding the item locks\n"
+           "   - hash_buckets:        use a hash table of cache line sized buckets with\n"
+           "                          per-entry hash tags, instead of chained buckets\n"
+           "   - hash_shrink_ratio:   halve the hash table in the background while fewer\n"
+           "                          than this many items per bucket are stored.\n"
+           "                          must be below 0.75. (default: 0, disabled)\n"
+           "   - hash_migrate_threads: threads moving items into a resized hash table.\n"
+           "                          each owns a range of item lock stripes. (default: 1)\n"
+           "   - hash_hugepages:      map the hash table from explicit huge pages, falling\n"
+           "                          back to transparent huge pages\n"
+           "   - hash_numa:           'interleave' the hash table across NUMA nodes, or\n"
+           "                          bind it to the given node number (linux only)\n"
+           "   - item_lock_mode:      'mutex' or 'rwlock'. rwlock lets lookups of items\n"
+           "                          which need no update share their lock. (default: mutex)\n"
            "   - modern:              enables options which will be default in future.\n"
            "                          currently: nothing\n"
            "   - no_modern:           uses defaults of previous major version (1.4.x)\n",
@@ -4158,6 +4407,11 @@ static void usage(void) {
 #ifdef SOCK_COOKIE_ID
     printf("   - sock_cookie_id:      attributes an ID to a socket for ip filtering/firewalls \n");
 #endif
+#ifdef WORKER_URING
+    printf("   - worker_uring:        (EXPERIMENTAL) accept, read and write client\n"
+           "                          connections through io_uring instead of libevent.\n"
+           "                          not used for UDP or TLS. requires linux 6.0\n");
+#endif
 #ifdef EXTSTORE
     printf("\n   - External storage (ext_*) related options (see: https://memcached.org/extstore)\n");
     printf("   - ext_path:            file to write to for external storage.\n"
@@ -4794,6 +5048,13 @@ int main (int argc, char **argv) {
         MAXCONNS_FAST = 0,
         HASHPOWER_INIT,
         NO_HASHEXPAND,
+        HASH_EXPAND_PAUSE,
+        HASH_BUCKETS,
+        HASH_SHRINK_RATIO,
+        HASH_MIGRATE_THREADS,
+        HASH_HUGEPAGES,
+        HASH_NUMA,
+        ITEM_LOCK_MODE,
         SLAB_REASSIGN,
         SLAB_AUTOMOVE,
         SLAB_AUTOMOVE_RATIO,
@@ -4804,6 +5065,15 @@ int main (int argc, char **argv) {
         LRU_CRAWLER_SLEEP,
         LRU_CRAWLER_TOCRAWL,
         LRU_MAINTAINER,
+        LRU_MAINTAINER_THREADS,
+        LRU_CLOCK,
+        LRU_S3FIFO,
+        LRU_GDSF,
+        EXPIRY_WHEEL,
+        MRC_SAMPLE_RATE,
+        MRC_MAX_KEYS,
+        PREFIX_QUOTAS,
+        LRU_ADMISSION,
         HOT_LRU_PCT,
         WARM_LRU_PCT,
         HOT_MAX_FACTOR,
@@ -4814,6 +5084,11 @@ int main (int argc, char **argv) {
         WORKER_LOGBUF_SIZE,
         SLAB_SIZES,
         SLAB_CHUNK_MAX,
+        SLAB_MAGAZINES,
+        SLAB_COMPACT_RATIO,
+        SLAB_IDLE_TRIM,
+        LOG_MEMORY,
+        PREALLOC_THREADS,
         TRACK_SIZES,
         NO_INLINE_ASCII_RESP,
         MODERN,
@@ -4851,12 +5126,22 @@ int main (int argc, char **argv) {
 #endif
 #ifdef SOCK_COOKIE_ID
         COOKIE_ID,
+#endif
+#ifdef WORKER_URING
+        WORKER_URING_OPT,
 #endif
     };
     char *const subopts_tokens[] = {
         [MAXCONNS_FAST] = "maxconns_fast",
         [HASHPOWER_INIT] = "hashpower",
         [NO_HASHEXPAND] = "no_hashexpand",
+        [HASH_EXPAND_PAUSE] = "hash_expand_pause",
+        [HASH_BUCKETS] = "hash_buckets",
+        [HASH_SHRINK_RATIO] = "hash_shrink_ratio",
+        [HASH_MIGRATE_THREADS] = "hash_migrate_threads",
+        [HASH_HUGEPAGES] = "hash_hugepages",
+        [HASH_NUMA] = "hash_numa",
+        [ITEM_LOCK_MODE] = "item_lock_mode",
         [SLAB_REASSIGN] = "slab_reassign",
         [SLAB_AUTOMOVE] = "slab_automove",
         [SLAB_AUTOMOVE_RATIO] = "slab_automove_ratio",
@@ -4867,6 +5152,15 @@ int main (int argc, char **argv) {
         [LRU_CRAWLER_SLEEP] = "lru_crawler_sleep",
         [LRU_CRAWLER_TOCRAWL] = "lru_crawler_tocrawl",
         [LRU_MAINTAINER] = "lru_maintainer",
+        [LRU_MAINTAINER_THREADS] = "lru_maintainer_threads",
+        [LRU_CLOCK] = "lru_clock",
+        [LRU_S3FIFO] = "lru_s3fifo",
+        [LRU_GDSF] = "lru_gdsf",
+        [EXPIRY_WHEEL] = "expiry_wheel",
+        [MRC_SAMPLE_RATE] = "mrc_sample_rate",
+        [MRC_MAX_KEYS] = "mrc_max_keys",
+        [PREFIX_QUOTAS] = "prefix_quotas",
+        [LRU_ADMISSION] = "lru_admission",
         [HOT_LRU_PCT] = "hot_lru_pct",
         [WARM_LRU_PCT] = "warm_lru_pct",
         [HOT_MAX_FACTOR] = "hot_max_factor",
@@ -4877,6 +5171,11 @@ int main (int argc, char **argv) {
         [WORKER_LOGBUF_SIZE] = "worker_logbuf_size",
         [SLAB_SIZES] = "slab_sizes",
         [SLAB_CHUNK_MAX] = "slab_chunk_max",
+        [SLAB_MAGAZINES] = "slab_magazines",
+        [SLAB_COMPACT_RATIO] = "slab_compact_ratio",
+        [SLAB_IDLE_TRIM] = "slab_idle_trim",
+        [LOG_MEMORY] = "log_memory",
+        [PREALLOC_THREADS] = "prealloc_threads",
         [TRACK_SIZES] = "track_sizes",
         [NO_INLINE_ASCII_RESP] = "no_inline_ascii_resp",
         [MODERN] = "modern",
@@ -4914,6 +5213,9 @@ int main (int argc, char **argv) {
 #endif
 #ifdef SOCK_COOKIE_ID
         [COOKIE_ID] = "sock_cookie_id",
+#endif
+#ifdef WORKER_URING
+        [WORKER_URING_OPT] = "worker_uring",
 #endif
         NULL
     };
@@ -5284,6 +5586,72 @@ int main (int argc, char **argv) {
             case NO_HASHEXPAND:
                 start_assoc_maint = false;
                 break;
+            case HASH_EXPAND_PAUSE:
+                settings.hash_expand_pause = true;
+                break;
+            case HASH_BUCKETS:
+                settings.hash_buckets = true;
+                break;
+            case HASH_SHRINK_RATIO:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing hash_shrink_ratio argument\n");
+                    return 1;
+                }
+                settings.hash_shrink_ratio = atof(subopts_value);
+                if (settings.hash_shrink_ratio < 0 || settings.hash_shrink_ratio >= 0.75) {
+                    fprintf(stderr, "hash_shrink_ratio must be >= 0 and < 0.75\n");
+                    return 1;
+                }
+                break;
+            case HASH_MIGRATE_THREADS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing hash_migrate_threads argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.hash_migrate_threads)) {
+                    fprintf(stderr, "could not parse argument to hash_migrate_threads\n");
+                    return 1;
+                }
+                if (settings.hash_migrate_threads < 1 || settings.hash_migrate_threads > 64) {
+                    fprintf(stderr, "hash_migrate_threads must be between 1 and 64\n");
+                    return 1;
+                }
+                break;
+            case HASH_HUGEPAGES:
+                settings.hash_hugepages = true;
+                break;
+            case HASH_NUMA:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing hash_numa argument\n");
+                    return 1;
+                }
+                if (strcmp(subopts_value, "interleave") == 0) {
+                    settings.hash_numa = HASH_NUMA_INTERLEAVE;
+                } else if (safe_strtol(subopts_value, &settings.hash_numa_node)) {
+                    if (settings.hash_numa_node < 0 || settings.hash_numa_node > 63) {
+                        fprintf(stderr, "hash_numa node must be between 0 and 63\n");
+                        return 1;
+                    }
+                    settings.hash_numa = HASH_NUMA_BIND;
+                } else {
+                    fprintf(stderr, "hash_numa must be 'interleave' or a node number\n");
+                    return 1;
+                }
+                break;
+            case ITEM_LOCK_MODE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing item_lock_mode argument\n");
+                    return 1;
+                }
+                if (strcmp(subopts_value, "mutex") == 0) {
+                    settings.item_lock_rw = false;
+                } else if (strcmp(subopts_value, "rwlock") == 0) {
+                    settings.item_lock_rw = true;
+                } else {
+                    fprintf(stderr, "item_lock_mode must be 'mutex' or 'rwlock'\n");
+                    return 1;
+                }
+                break;
             case SLAB_REASSIGN:
                 settings.slab_reassign = true;
                 break;
@@ -5293,8 +5661,8 @@ int main (int argc, char **argv) {
                     break;
                 }
                 settings.slab_automove = atoi(subopts_value);
-                if (settings.slab_automove < 0 || settings.slab_automove > 2) {
-                    fprintf(stderr, "slab_automove must be between 0 and 2\n");
+                if (settings.slab_automove < 0 || settings.slab_automove > 3) {
+                    fprintf(stderr, "slab_automove must be between 0 and 3\n");
                     return 1;
                 }
                 break;
@@ -5376,6 +5744,74 @@ int main (int argc, char **argv) {
                 start_lru_maintainer = true;
                 settings.lru_segmented = true;
                 break;
+            case LRU_MAINTAINER_THREADS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing lru_maintainer_threads argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.lru_maintainer_threads)) {
+                    fprintf(stderr, "could not parse argument to lru_maintainer_threads\n");
+                    return 1;
+                }
+                if (settings.lru_maintainer_threads < 1 || settings.lru_maintainer_threads > 16) {
+                    fprintf(stderr, "lru_maintainer_threads must be between 1 and 16\n");
+                    return 1;
+                }
+                break;
+            case LRU_CLOCK:
+                settings.lru_clock = true;
+                break;
+            case LRU_S3FIFO:
+                settings.lru_s3fifo = true;
+                break;
+            case LRU_GDSF:
+                settings.lru_gdsf = true;
+                break;
+            case EXPIRY_WHEEL:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing expiry_wheel argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.expiry_wheel)) {
+                    fprintf(stderr, "could not parse argument to expiry_wheel\n");
+                    return 1;
+                }
+                if (settings.expiry_wheel < 0 || settings.expiry_wheel > 86400) {
+                    fprintf(stderr, "expiry_wheel must be between 0 and 86400\n");
+                    return 1;
+                }
+                break;
+            case MRC_SAMPLE_RATE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing mrc_sample_rate argument\n");
+                    return 1;
+                }
+                settings.mrc_sample_rate = atof(subopts_value);
+                if (settings.mrc_sample_rate < 0 || settings.mrc_sample_rate > 1) {
+                    fprintf(stderr, "mrc_sample_rate must be between 0 and 1\n");
+                    return 1;
+                }
+                break;
+            case MRC_MAX_KEYS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing mrc_max_keys argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.mrc_max_keys)) {
+                    fprintf(stderr, "could not parse argument to mrc_max_keys\n");
+                    return 1;
+                }
+                if (settings.mrc_max_keys < 1024 || settings.mrc_max_keys > (1 << 24)) {
+                    fprintf(stderr, "mrc_max_keys must be between 1024 and 16777216\n");
+                    return 1;
+                }
+                break;
+            case PREFIX_QUOTAS:
+                settings.prefix_quotas = true;
+                break;
+            case LRU_ADMISSION:
+                settings.lru_admission = true;
+                break;
             case HOT_LRU_PCT:
                 if (subopts_value == NULL) {
                     fprintf(stderr, "Missing hot_lru_pct argument\n");
@@ -5468,6 +5904,62 @@ int main (int argc, char **argv) {
                 }
                 slab_chunk_size_changed = true;
                 break;
+            case SLAB_MAGAZINES:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing slab_magazines argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.slab_magazines)) {
+                    fprintf(stderr, "could not parse argument to slab_magazines\n");
+                    return 1;
+                }
+                if (settings.slab_magazines < 0 || settings.slab_magazines > 1024) {
+                    fprintf(stderr, "slab_magazines must be between 0 and 1024\n");
+                    return 1;
+                }
+                break;
+            case SLAB_COMPACT_RATIO:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing slab_compact_ratio argument\n");
+                    return 1;
+                }
+                settings.slab_compact_ratio = atof(subopts_value);
+                if (settings.slab_compact_ratio < 0 || settings.slab_compact_ratio >= 1) {
+                    fprintf(stderr, "slab_compact_ratio must be >= 0 and < 1\n");
+                    return 1;
+                }
+                break;
+            case SLAB_IDLE_TRIM:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing slab_idle_trim argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.slab_idle_trim)) {
+                    fprintf(stderr, "could not parse argument to slab_idle_trim\n");
+                    return 1;
+                }
+                if (settings.slab_idle_trim < 0) {
+                    fprintf(stderr, "slab_idle_trim must not be negative\n");
+                    return 1;
+                }
+                break;
+            case LOG_MEMORY:
+                settings.log_memory = true;
+                break;
+            case PREALLOC_THREADS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing prealloc_threads argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.prealloc_threads)) {
+                    fprintf(stderr, "could not parse argument to prealloc_threads\n");
+                    return 1;
+                }
+                if (settings.prealloc_threads < 0) {
+                    fprintf(stderr, "prealloc_threads must not be negative\n");
+                    return 1;
+                }
+                break;
             case TRACK_SIZES:
                 item_stats_sizes_init();
                 break;
@@ -5683,6 +6175,11 @@ int main (int argc, char **argv) {
             case COOKIE_ID:
                 (void)safe_strtoul(subopts_value, &settings.sock_cookie_id);
                 break;
+#endif
+#ifdef WORKER_URING
+            case WORKER_URING_OPT:
+                settings.worker_uring = true;
+                break;
 #endif
             default:
 #ifdef EXTSTORE
@@ -5788,11 +6285,77 @@ int main (int argc, char **argv) {
         exit(EX_USAGE);
     }
 
+    /* CLOCK keeps everything in a single LRU per class */
+    if (settings.lru_clock) {
+        settings.lru_segmented = false;
+    }
+
+    if (settings.lru_clock + settings.lru_s3fifo + settings.lru_gdsf > 1) {
+        fprintf(stderr, "only one of lru_clock, lru_s3fifo and lru_gdsf can be used\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.lru_s3fifo || settings.lru_gdsf) {
+        settings.lru_segmented = false;
+    }
+
     if (settings.temp_lru && !start_lru_maintainer) {
         fprintf(stderr, "temporary_ttl requires lru_maintainer to be enabled\n");
         exit(EX_USAGE);
     }
 
+#ifdef COMPACT_ITEMS
+    /* Item refs can't reach any further */
+    if (settings.maxbytes > ITEM_ARENA_MAX - ITEM_ARENA_HEAD) {
+        fprintf(stderr, "compact items can address at most %zu megabytes\n",
+                (ITEM_ARENA_MAX - ITEM_ARENA_HEAD) / 1024 / 1024);
+        exit(EX_USAGE);
+    }
+    /* Log segments are allocated outside of the item arena */
+    if (settings.log_memory) {
+        fprintf(stderr, "log_memory can't be used with compact items\n");
+        exit(EX_USAGE);
+    }
+#endif
+
+    if (settings.log_memory) {
+        if (preallocate || settings.memory_file != NULL) {
+            fprintf(stderr, "log_memory can't be used with -L or memory_file\n");
+            exit(EX_USAGE);
+        }
+#ifdef EXTSTORE
+        if (storage_enabled) {
+            fprintf(stderr, "log_memory can't be used with ext_path\n");
+            exit(EX_USAGE);
+        }
+#endif
+        if (settings.slab_magazines || settings.slab_compact_ratio > 0
+                || settings.slab_idle_trim) {
+            fprintf(stderr, "log_memory can't be used with slab_magazines, slab_compact_ratio or slab_idle_trim\n");
+            exit(EX_USAGE);
+        }
+        /* A chunk and its record header have to fit in a segment */
+        if (settings.slab_chunk_size_max > settings.slab_page_size / 2) {
+            fprintf(stderr, "log_memory requires slab_chunk_max to be at most half of slab_page_size\n");
+            exit(EX_USAGE);
+        }
+        /* There are no slab pages to move around */
+        settings.slab_reassign = false;
+        settings.slab_automove = 0;
+    }
+
+    if (settings.slab_compact_ratio > 0 &&
+            (!settings.slab_reassign || !start_lru_maintainer)) {
+        fprintf(stderr, "slab_compact_ratio requires slab_reassign and lru_maintainer\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.slab_idle_trim > 0 &&
+            (!settings.slab_reassign || !start_lru_maintainer)) {
+        fprintf(stderr, "slab_idle_trim requires slab_reassign and lru_maintainer\n");
+        exit(EX_USAGE);
+    }
+
     if (hash_init(hash_type) != 0) {
         fprintf(stderr, "Failed to initialize hash_algorithm!\n");
         exit(EX_USAGE);
@@ -6036,6 +6599,25 @@ int main (int argc, char **argv) {
     // previously, to avoid filling a huge set of items into a tiny hash
     // table.
     assoc_init(settings.hashpower_init);
+    if (settings.lru_admission) {
+        tinylfu_init(settings.maxbytes);
+    }
+    if (settings.lru_s3fifo && !item_s3fifo_init()) {
+        fprintf(stderr, "Failed to allocate the S3-FIFO ghost queue\n");
+        exit(EXIT_FAILURE);
+    }
+    if (settings.expiry_wheel && !expiry_wheel_init(settings.expiry_wheel, settings.maxbytes)) {
+        fprintf(stderr, "Failed to allocate the expiry wheel\n");
+        exit(EXIT_FAILURE);
+    }
+    if (settings.mrc_sample_rate > 0
+            && !mrc_init(settings.mrc_sample_rate, settings.mrc_max_keys)) {
+        fprintf(stderr, "Failed to allocate the miss ratio curve estimator\n");
+        exit(EXIT_FAILURE);
+    }
+    if (settings.prefix_quotas) {
+        quota_init(settings.prefix_delimiter);
+    }
 #ifdef EXTSTORE
     if (storage_enabled && reuse_mem) {
         fprintf(stderr, "[restart] memory restart with extstore not presently supported.\n");
@@ -6044,6 +6626,9 @@ int main (int argc, char **argv) {
 #endif
     slabs_init(settings.maxbytes, settings.factor, preallocate,
             use_slab_sizes ? slab_sizes : NULL, mem_base, reuse_mem);
+    if (settings.log_memory && !logmem_init(settings.maxbytes)) {
+        exit(EXIT_FAILURE);
+    }
 #ifdef EXTSTORE
     if (storage_enabled) {
         storage = storage_init(storage_cf);
@@ -6113,6 +6698,14 @@ int main (int argc, char **argv) {
         fprintf(stderr, "Failed to enable LRU crawler thread\n");
         exit(EXIT_FAILURE);
     }
+    if (settings.expiry_wheel && start_expiry_wheel_thread() != 0) {
+        fprintf(stderr, "Failed to start expiry wheel thread\n");
+        exit(EXIT_FAILURE);
+    }
+    if (settings.log_memory && start_logmem_cleaner_thread() != 0) {
+        fprintf(stderr, "Failed to start log memory cleaner thread\n");
+        exit(EXIT_FAILURE);
+    }
 #ifdef EXTSTORE
     if (storage && start_storage_compact_thread(storage) != 0) {
         fprintf(stderr, "Failed to start storage compaction thread\n");
@@ -6231,6 +6824,19 @@ int main (int argc, char **argv) {
             free(temp_portnumber_filename);
     }
 
+#ifdef WORKER_URING
+    if (settings.worker_uring) {
+        struct uring_ctx *u = uring_ctx_new(main_base, NULL);
+        if (u == NULL) {
+            fprintf(stderr, "Failed to set up io_uring for listening sockets\n");
+            exit(EX_OSERR);
+        }
+        for (conn *next = listen_conn; next; next = next->next) {
+            uring_conn_attach(u, next);
+        }
+    }
+#endif
+
     /* Give the sockets a moment to open. I know this is dumb, but the error
      * is only an advisory.
      */
@@ -100,6 +100,17 @@ typedef uint32_t client_flags_t;
 #define safe_strtoflags safe_strtoul
 #endif
 
+/* Links between items. Compact builds keep every item in one arena and store
+ * links as 32bit offsets into it; see ITEM_next() and friends. */
+#ifdef COMPACT_ITEMS
+#if SIZEOF_VOID_P < 8
+#error "compact items need a 64bit build"
+#endif
+typedef uint32_t item_ref;
+#else
+typedef struct _stritem *item_ref;
+#endif
+
 /*
  * We only reposition items in the LRU queue if they haven't been repositioned
  * in this many seconds. That saves us from churning on frequently-accessed
@@ -257,6 +268,28 @@ enum pause_thread_types {
     RESUME_WORKER_THREADS
 };
 
+enum hash_numa_policy {
+    HASH_NUMA_NONE = 0,
+    HASH_NUMA_INTERLEAVE,
+    HASH_NUMA_BIND
+};
+
+/* Lock contention profiling, for "stats locks". Only acquisitions which
+ * find the lock busy get counted and timed, so this is always on. */
+enum lock_class {
+    LOCK_CLASS_ITEM = 0,
+    LOCK_CLASS_LRU,
+    LOCK_CLASS_SLABS,
+    LOCK_CLASS_CAS_ID,
+    LOCK_CLASS_MAX
+};
+
+struct lock_stats {
+    uint64_t contended; /* acquisitions which had to wait */
+    uint64_t trylock_fails; /* trylocks which gave up */
+    uint64_t wait_us; /* total time spent waiting */
+};
+
 enum stop_reasons {
     NOT_STOP,
     GRACE_STOP,
@@ -345,7 +378,11 @@ struct slab_stats {
     X(response_obj_bytes) \
     X(read_buf_oom) \
     X(store_too_large) \
-    X(store_no_memory)
+    X(store_no_memory) \
+    X(get_prefetch_batches) /* key batches prefetched before lookup */ \
+    X(get_prefetch_keys) /* keys in those batches */ \
+    X(get_lock_waits) /* lookups which waited for their item lock */ \
+    X(get_lock_upgrades) /* shared lookups retried exclusively */
 
 #ifdef EXTSTORE
 #define EXTSTORE_THREAD_STATS_FIELDS \
@@ -366,6 +403,15 @@ struct slab_stats {
     X(proxy_await_active)
 #endif
 
+#ifdef WORKER_URING
+#define URING_THREAD_STATS_FIELDS \
+    X(uring_submits) /* io_uring_enter calls submitting SQEs */ \
+    X(uring_sqes) /* SQEs submitted by those calls */ \
+    X(uring_cqe_batches) /* passes over the completion queue */ \
+    X(uring_cqes) /* CQEs reaped by those passes */ \
+    X(uring_recv_nobufs) /* receives which ran out of provided buffers */
+#endif
+
 /**
  * Stats stored per-thread.
  */
@@ -379,6 +425,9 @@ struct thread_stats {
 #ifdef PROXY
     PROXY_THREAD_STATS_FIELDS
 #endif
+#ifdef WORKER_URING
+    URING_THREAD_STATS_FIELDS
+#endif
 #undef X
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
     uint64_t lru_hits[POWER_LARGEST];
@@ -397,6 +446,7 @@ struct stats {
     uint64_t      malloc_fails;
     uint64_t      listen_disabled_num;
     uint64_t      slabs_moved;       /* times slabs were moved around */
+    uint64_t      slabs_compacted;   /* of those, sparse pages emptied */
     uint64_t      slab_reassign_rescues; /* items rescued during slab move */
     uint64_t      slab_reassign_evictions_nomem; /* valid items lost during slab move */
     uint64_t      slab_reassign_inline_reclaim; /* valid items lost during slab move */
@@ -406,6 +456,11 @@ struct stats {
     uint64_t      lru_crawler_starts; /* Number of item crawlers kicked off */
     uint64_t      lru_maintainer_juggles; /* number of LRU bg pokes */
     uint64_t      time_in_listen_disabled_us;  /* elapsed time in microseconds while server unable to process new connections */
+    uint64_t      hash_expansions; /* number of completed hash table expansions */
+    uint64_t      hash_expand_time_us; /* elapsed time spent migrating to a grown hash table */
+    uint64_t      hash_expand_stall_us; /* time item locks were held to publish a resized hash table */
+    uint64_t      hash_shrinks; /* number of completed hash table shrinks */
+    uint64_t      hash_shrink_time_us; /* elapsed time spent migrating to a shrunk hash table */
     uint64_t      log_worker_dropped; /* logs dropped by worker threads */
     uint64_t      log_worker_written; /* logs written by worker threads */
     uint64_t      log_watcher_skipped; /* logs watchers missed */
@@ -438,6 +493,7 @@ struct stats_state {
     unsigned int  hash_power_level; /* Better hope it's not over 9000 */
     unsigned int  log_watchers; /* number of currently active watchers */
     bool          hash_is_expanding; /* If the hash table is being expanded */
+    bool          hash_is_shrinking; /* If the hash table is being shrunk */
     bool          accepting_conns;  /* whether we are currently accepting */
     bool          slab_reassign_running; /* slab reassign in progress */
     bool          lru_crawler_running; /* crawl in progress */
@@ -481,12 +537,34 @@ struct settings {
     bool maxconns_fast;     /* Whether or not to early close connections */
     bool lru_crawler;        /* Whether or not to enable the autocrawler thread */
     bool lru_maintainer_thread; /* LRU maintainer background thread */
+    int lru_maintainer_threads; /* slab classes are split between this many */
+    int slab_magazines; /* free chunks cached per class per worker, 0 is off */
+    double slab_compact_ratio; /* compact classes less full than this, 0 is off */
+    int slab_idle_trim; /* seconds a global pool page sits before release, 0 is off */
+    bool log_memory; /* items live in a cleaned log of segments, not slab classes */
+    int prealloc_threads; /* threads faulting in preallocated memory, 0 is one per CPU */
+    bool lru_clock; /* CLOCK replacement: hits only set a reference bit */
+    bool lru_s3fifo; /* S3-FIFO: small, main and ghost queues per class */
+    bool lru_gdsf; /* GreedyDual-Size-Frequency style cost aware eviction */
+    int expiry_wheel; /* seconds of TTL covered by the expiry wheel, 0 is off */
+    double mrc_sample_rate; /* fraction of keys sampled for stats mrc, 0 is off */
+    int mrc_max_keys; /* most keys the miss ratio curve estimator tracks */
+    bool prefix_quotas; /* charge items to their key prefix and enforce quotas */
+    bool lru_admission; /* TinyLFU filter decides if new items may evict */
     bool lru_segmented;     /* Use split or flat LRU's */
     bool slab_reassign;     /* Whether or not slab reassignment is allowed */
     int slab_automove;     /* Whether or not to automatically move slabs */
     double slab_automove_ratio; /* youngest must be within pct of oldest */
     unsigned int slab_automove_window; /* window mover for algorithm */
     int hashpower_init;     /* Starting hash power level */
+    bool hash_expand_pause; /* stop all threads to swap in a grown hash table */
+    bool hash_buckets;      /* use cache line buckets with hash tags */
+    double hash_shrink_ratio; /* shrink hash table below this many items per bucket */
+    int hash_migrate_threads; /* threads migrating items after a hash table resize */
+    bool hash_hugepages; /* back the hash table with huge pages */
+    enum hash_numa_policy hash_numa; /* NUMA placement of the hash table */
+    int hash_numa_node; /* node to bind the hash table to */
+    bool item_lock_rw; /* item locks are rwlocks, shared by lookups */
     bool shutdown_command; /* allow shutdown command */
     int tail_repair_time;   /* LRU tail refcount leak repair time */
     bool flush_enabled;     /* flush_all enabled */
@@ -552,6 +630,9 @@ struct settings {
 #ifdef SOCK_COOKIE_ID
     uint32_t sock_cookie_id;
 #endif
+#ifdef WORKER_URING
+    bool worker_uring; /* drive client connections from io_uring */
+#endif
 };
 
 extern struct stats stats;
@@ -590,10 +671,10 @@ extern struct settings settings;
  */
 typedef struct _stritem {
     /* Protected by LRU locks */
-    struct _stritem *next;
-    struct _stritem *prev;
+    item_ref        next;
+    item_ref        prev;
     /* Rest are protected by an item lock */
-    struct _stritem *h_next;    /* hash chain next */
+    item_ref        h_next;     /* hash chain next */
     rel_time_t      time;       /* least recent access */
     rel_time_t      exptime;    /* expire time */
     int             nbytes;     /* size of data */
@@ -601,6 +682,8 @@ typedef struct _stritem {
     uint16_t        it_flags;   /* ITEM_* above */
     uint8_t         slabs_clsid;/* which slab class we're in */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
+    uint8_t         cost;       /* cost to regenerate, meta set G flag */
+    uint8_t         credit;     /* lru_gdsf: cost earned by hits, aged by the sweep */
     /* this odd type prevents type-punning issues when we do
      * the little shuffle to save space when not using CAS. */
     union {
@@ -619,9 +702,9 @@ enum crawler_run_type {
 };
 
 typedef struct {
-    struct _stritem *next;
-    struct _stritem *prev;
-    struct _stritem *h_next;    /* hash chain next */
+    item_ref        next;
+    item_ref        prev;
+    item_ref        h_next;     /* hash chain next */
     rel_time_t      time;       /* least recent access */
     rel_time_t      exptime;    /* expire time */
     int             nbytes;     /* size of data */
@@ -640,6 +723,16 @@ typedef struct _strchunk {
     struct _strchunk *next;     /* points within its own chain. */
     struct _strchunk *prev;     /* can potentially point to the head. */
     struct _stritem  *head;     /* always points to the owner chunk */
+#ifdef COMPACT_ITEMS
+    /* Keeps refcount, it_flags and slabs_clsid where a compact item has them */
+    unsigned short   refcount;  /* used? */
+    uint16_t         it_flags;  /* ITEM_* above. */
+    uint8_t          slabs_clsid; /* Same as above. */
+    uint8_t          orig_clsid; /* For obj hdr chunks slabs_clsid is fake. */
+    int              size;      /* available chunk space in bytes */
+    int              used;      /* chunk space used */
+    int              nbytes;    /* used. */
+#else
     int              size;      /* available chunk space in bytes */
     int              used;      /* chunk space used */
     int              nbytes;    /* used. */
@@ -647,9 +740,46 @@ typedef struct _strchunk {
     uint16_t         it_flags;  /* ITEM_* above. */
     uint8_t          slabs_clsid; /* Same as above. */
     uint8_t          orig_clsid; /* For obj hdr chunks slabs_clsid is fake. */
+#endif
     char data[];
 } item_chunk;
 
+#ifdef COMPACT_ITEMS
+/* A ref is the item's distance from item_arena in 8 byte units, so 0 can
+ * stay NULL and 32bit links reach 32GB. The arena starts with a head which
+ * holds the LRU crawler's sentinels, followed by every slab page. */
+#define ITEM_REF_SHIFT 3
+#define ITEM_ARENA_HEAD (64 * 1024)
+#define ITEM_ARENA_MAX ((size_t)UINT32_MAX << ITEM_REF_SHIFT)
+extern char *item_arena;
+
+static inline item *item_ref_ptr(const item_ref r) {
+    return r ? (item *)(item_arena + ((size_t)r << ITEM_REF_SHIFT)) : NULL;
+}
+
+static inline item_ref item_ref_of(const item *it) {
+    return it ? (item_ref)(((char *)it - item_arena) >> ITEM_REF_SHIFT) : 0;
+}
+
+#define ITEM_next(item) item_ref_ptr((item)->next)
+#define ITEM_prev(item) item_ref_ptr((item)->prev)
+#define ITEM_h_next(item) item_ref_ptr((item)->h_next)
+#define ITEM_set_next(item,v) ((item)->next = item_ref_of(v))
+#define ITEM_set_prev(item,v) ((item)->prev = item_ref_of(v))
+#define ITEM_set_h_next(item,v) ((item)->h_next = item_ref_of(v))
+/* What the header would take with pointer links, for "stats sizes" */
+#define ITEM_HEADER_POINTERS ((sizeof(item) + 3 * (sizeof(void *) \
+        - sizeof(item_ref)) + CHUNK_ALIGN_BYTES - 1) & ~(CHUNK_ALIGN_BYTES - 1))
+#else
+#define ITEM_next(item) ((item)->next)
+#define ITEM_prev(item) ((item)->prev)
+#define ITEM_h_next(item) ((item)->h_next)
+#define ITEM_set_next(item,v) ((item)->next = (v))
+#define ITEM_set_prev(item,v) ((item)->prev = (v))
+#define ITEM_set_h_next(item,v) ((item)->h_next = (v))
+#define ITEM_HEADER_POINTERS sizeof(item)
+#endif
+
 #ifdef NEED_ALIGN
 static inline char *ITEM_schunk(item *it) {
     int offset = it->nkey + 1
@@ -740,6 +870,9 @@ typedef struct {
     char   *ssl_wbuf;
 #endif
     int napi_id;                /* napi id associated with this thread */
+#ifdef WORKER_URING
+    struct uring_ctx *uring;    /* io_uring driving this thread's conns */
+#endif
 #ifdef PROXY
     void *proxy_ctx; // proxy global context
     void *L; // lua VM
@@ -824,6 +957,7 @@ struct conn {
     bool mset_res; /** uses mset format for return code */
     bool close_after_write; /** flush write then move to close connection */
     bool rbuf_malloced; /** read buffer was malloc'ed for ascii mget, needs free() */
+    char *rprefetched; /** rbuf position meta get keys were prefetched up to */
     bool item_malloced; /** item for conn_nread state is a temporary malloc */
 #ifdef TLS
     SSL    *ssl;
@@ -897,6 +1031,9 @@ struct conn {
     ssize_t (*read)(conn  *c, void *buf, size_t count);
     ssize_t (*sendmsg)(conn *c, struct msghdr *msg, int flags);
     ssize_t (*write)(conn *c, void *buf, size_t count);
+#ifdef WORKER_URING
+    struct uring_conn *uring; /* set once the conn has been driven by io_uring */
+#endif
 };
 
 /* array of conn structures, indexed by file descriptor */
@@ -919,6 +1056,7 @@ struct slab_rebalance {
     void *slab_pos;
     int s_clsid;
     int d_clsid;
+    void *compact_page; /* page picked by slabs_compact(), else the oldest */
     uint32_t busy_items;
     uint32_t rescues;
     uint32_t evictions_nomem;
@@ -944,6 +1082,7 @@ enum delta_result_type do_add_delta(LIBEVENT_THREAD *t, const char *key,
                                     uint64_t *cas, const uint32_t hv,
                                     item **it_ret);
 enum store_item_type do_store_item(item *item, int comm, LIBEVENT_THREAD *t, const uint32_t hv, int *nbytes, uint64_t *cas, bool cas_stale);
+enum store_item_type store_refused_status(const int comm);
 void thread_io_queue_add(LIBEVENT_THREAD *t, int type, void *ctx, io_queue_stack_cb cb);
 void conn_io_queue_setup(conn *c);
 io_queue_t *conn_io_queue_get(conn *c, int type);
@@ -953,6 +1092,11 @@ conn *conn_new(const int sfd, const enum conn_states init_state, const int event
     enum network_transport transport, struct event_base *base, void *ssl, uint64_t conntag, enum protocol bproto);
 
 void conn_worker_readd(conn *c);
+void conn_event_del(conn *c);
+bool conn_accepted(conn *c, const int sfd);
+#ifdef WORKER_URING
+void conn_uring_event(conn *c, const short which);
+#endif
 extern int daemonize(int nochdir, int noclose);
 
 #define mutex_lock(x) pthread_mutex_lock(x)
@@ -992,11 +1136,15 @@ void accept_new_conns(const bool do_accept);
 void  conn_close_idle(conn *c);
 void  conn_close_all(void);
 item *item_alloc(const char *key, size_t nkey, client_flags_t flags, rel_time_t exptime, int nbytes);
+item *item_alloc_admit(const char *key, size_t nkey, client_flags_t flags, rel_time_t exptime, int nbytes, bool *rejected);
 #define DO_UPDATE true
 #define DONT_UPDATE false
 item *item_get(const char *key, const size_t nkey, LIBEVENT_THREAD *t, const bool do_update);
+item *item_get_hv(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update);
 item *item_get_locked(const char *key, const size_t nkey, LIBEVENT_THREAD *t, const bool do_update, uint32_t *hv);
 item *item_touch(const char *key, const size_t nkey, uint32_t exptime, LIBEVENT_THREAD *t);
+item *item_touch_hv(const char *key, const size_t nkey, const uint32_t hv, uint32_t exptime, LIBEVENT_THREAD *t);
+void item_prefetch_batch(const uint32_t *hvs, const int count);
 int   item_link(item *it);
 void  item_remove(item *it);
 int   item_replace(item *it, item *new_it, const uint32_t hv);
@@ -1006,11 +1154,29 @@ void item_lock(uint32_t hv);
 void *item_trylock(uint32_t hv);
 void item_trylock_unlock(void *arg);
 void item_unlock(uint32_t hv);
+void item_lock_all(void);
+void item_unlock_all(void);
+uint32_t item_lock_stripes(void);
+
+/* Lock contention profiling, for "stats locks". */
+void mutex_lock_contended(pthread_mutex_t *lock, enum lock_class cls, struct lock_stats *ls);
+void lock_stats_trylock_fail(enum lock_class cls, struct lock_stats *ls);
+void lock_stats(ADD_STAT add_stats, void *c);
+void lock_stats_reset(void);
+/* pthread_mutex_lock(), counting the wait against cls and ls (if not NULL) */
+#define mutex_lock_class(l, cls, ls) do { \
+    if (pthread_mutex_trylock(l) != 0) { \
+        mutex_lock_contended(l, cls, ls); \
+    } \
+} while (0)
+
 void pause_threads(enum pause_thread_types type);
 void stop_threads(void);
 int stop_conn_timeout_thread(void);
 #define refcount_incr(it) ++(it->refcount)
 #define refcount_decr(it) --(it->refcount)
+unsigned short refcount_incr_shared(item *it);
+void item_credit_shared(item *it);
 void STATS_LOCK(void);
 void STATS_UNLOCK(void);
 #define THR_STATS_LOCK(t) pthread_mutex_lock(&t->stats.mutex)
@@ -1037,6 +1203,7 @@ void out_string(conn *c, const char *str);
         REALTIME_MAXDELTA + 1 : exptime
 rel_time_t realtime(const time_t exptime);
 item* limited_get(const char *key, size_t nkey, LIBEVENT_THREAD *t, uint32_t exptime, bool should_touch, bool do_update, bool *overflow);
+item* limited_get_hv(const char *key, size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, uint32_t exptime, bool should_touch, bool do_update, bool *overflow);
 item* limited_get_locked(const char *key, size_t nkey, LIBEVENT_THREAD *t, bool do_update, uint32_t *hv, bool *overflow);
 // Read/Response object handlers.
 void resp_reset(mc_resp *resp);
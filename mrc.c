@@ -0,0 +1,307 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Miss ratio curve estimation (SHARDS).
+ *
+ * Only keys whose hash falls under a threshold are looked at, which picks
+ * a stable sample of the key space. For each sampled key we remember when
+ * it was last referenced and how large it was. On a get, the bytes of the
+ * distinct sampled keys referenced since then, scaled up by the sample
+ * rate, is the reuse distance: the smallest LRU cache which would have
+ * still held the key. A histogram of reuse distances gives the hit ratio
+ * for any cache size.
+ *
+ * The bytes referenced after a given time come from a Fenwick tree indexed
+ * by reference time, holding each key's size at its last reference. Times
+ * are renumbered once the tree fills up.
+ *
+ * Memory is bounded by max_keys. When that many keys are tracked the
+ * threshold is halved and keys above it are forgotten (SHARDS-adj style),
+ * so the effective sample rate can drop below the configured one on a
+ * large key space.
+ */
+#include "memcached.h"
+#include "mrc.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Sampling looks at the top 24 bits of the hash; the low bits pick item
+ * locks and hash buckets. */
+#define MRC_SAMPLE_BITS 24
+#define MRC_SAMPLE_MOD (1U << MRC_SAMPLE_BITS)
+#define MRC_SAMPLE(hv) ((hv) >> (32 - MRC_SAMPLE_BITS))
+/* Histogram bucket b counts distances under MRC_BUCKET_MIN << b bytes */
+#define MRC_BUCKET_MIN (64 * 1024)
+#define MRC_BUCKETS 32
+
+struct mrc_key {
+    uint32_t hv;
+    uint32_t ts; /* 0 for an empty slot */
+    uint32_t size;
+    uint8_t clsid;
+};
+
+static pthread_mutex_t mrc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mrc_key *keys = NULL;
+static uint32_t keys_mask = 0;
+static unsigned int keys_max = 0;
+static unsigned int keys_count = 0;
+static uint64_t *tree = NULL;
+static uint32_t tree_size = 0;
+static uint32_t clock_ts = 0;
+static volatile uint32_t threshold = 0;
+
+/* Class 0 holds cold misses for keys of unknown class. */
+static uint64_t hist[MAX_NUMBER_OF_SLAB_CLASSES][MRC_BUCKETS];
+static uint64_t cold[MAX_NUMBER_OF_SLAB_CLASSES];
+static uint64_t threshold_drops = 0;
+
+static void tree_add(uint32_t i, const int64_t v) {
+    for (; i <= tree_size; i += i & -i) {
+        tree[i] += v;
+    }
+}
+
+/* Sum of sizes referenced at times 1 through i */
+static uint64_t tree_sum(uint32_t i) {
+    uint64_t sum = 0;
+    for (; i > 0; i -= i & -i) {
+        sum += tree[i];
+    }
+    return sum;
+}
+
+static struct mrc_key *mrc_find(const uint32_t hv) {
+    uint32_t i = (hv * 0x9e3779b1) & keys_mask;
+    while (keys[i].ts != 0) {
+        if (keys[i].hv == hv)
+            return &keys[i];
+        i = (i + 1) & keys_mask;
+    }
+    return &keys[i];
+}
+
+static int mrc_ts_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct mrc_key *)a)->ts;
+    uint32_t y = ((const struct mrc_key *)b)->ts;
+    return (x > y) - (x < y);
+}
+
+/* Drops keys at or over the current threshold and renumbers the rest by
+ * reference order from 1, rebuilding the table and tree. */
+static void mrc_rebuild(void) {
+    struct mrc_key *kept;
+    unsigned int count = 0;
+    uint32_t i;
+
+    kept = malloc(sizeof(struct mrc_key) * (keys_count + 1));
+    if (kept == NULL) {
+        /* Start over rather than run out of timestamps */
+        memset(keys, 0, sizeof(struct mrc_key) * (keys_mask + 1));
+        memset(tree, 0, sizeof(uint64_t) * (tree_size + 1));
+        keys_count = 0;
+        clock_ts = 0;
+        return;
+    }
+    for (i = 0; i <= keys_mask; i++) {
+        if (keys[i].ts != 0 && MRC_SAMPLE(keys[i].hv) < threshold) {
+            kept[count++] = keys[i];
+        }
+    }
+    qsort(kept, count, sizeof(struct mrc_key), mrc_ts_cmp);
+
+    memset(keys, 0, sizeof(struct mrc_key) * (keys_mask + 1));
+    memset(tree, 0, sizeof(uint64_t) * (tree_size + 1));
+    for (i = 0; i < count; i++) {
+        struct mrc_key *k = mrc_find(kept[i].hv);
+        *k = kept[i];
+        k->ts = i + 1;
+        tree_add(k->ts, k->size);
+    }
+    keys_count = count;
+    clock_ts = count;
+    free(kept);
+}
+
+bool mrc_init(const double sample_rate, const unsigned int max_keys) {
+    uint32_t slots = 1;
+    while (slots < max_keys * 2)
+        slots <<= 1;
+
+    keys = calloc(slots, sizeof(struct mrc_key));
+    tree = calloc(max_keys * 2 + 1, sizeof(uint64_t));
+    if (keys == NULL || tree == NULL) {
+        free(keys);
+        free(tree);
+        keys = NULL;
+        tree = NULL;
+        return false;
+    }
+    keys_mask = slots - 1;
+    keys_max = max_keys;
+    tree_size = max_keys * 2;
+    threshold = sample_rate * MRC_SAMPLE_MOD;
+    if (threshold == 0)
+        threshold = 1;
+    return true;
+}
+
+void mrc_record(const uint32_t hv, item *it, const bool get) {
+    struct mrc_key *k;
+    int clsid = it ? ITEM_clsid(it) : 0;
+
+    if (MRC_SAMPLE(hv) >= threshold || keys == NULL)
+        return;
+
+    pthread_mutex_lock(&mrc_lock);
+    /* the threshold may have dropped while we waited */
+    if (MRC_SAMPLE(hv) >= threshold) {
+        pthread_mutex_unlock(&mrc_lock);
+        return;
+    }
+    k = mrc_find(hv);
+    if (k->ts != 0) {
+        if (clsid == 0)
+            clsid = k->clsid;
+        if (get) {
+            uint64_t dist = tree_sum(clock_ts) - tree_sum(k->ts);
+            uint64_t limit = MRC_BUCKET_MIN;
+            int b = 0;
+            dist = dist * MRC_SAMPLE_MOD / threshold;
+            while (b < MRC_BUCKETS - 1 && dist >= limit) {
+                limit <<= 1;
+                b++;
+            }
+            hist[clsid][b]++;
+        }
+        tree_add(k->ts, -(int64_t)k->size);
+        if (it != NULL) {
+            k->size = ITEM_ntotal(it);
+            k->clsid = clsid;
+        }
+    } else {
+        if (get)
+            cold[clsid]++;
+        /* a miss doesn't tell us how big the key will be */
+        if (it == NULL) {
+            pthread_mutex_unlock(&mrc_lock);
+            return;
+        }
+        if (keys_count >= keys_max) {
+            while (keys_count >= keys_max && threshold > 1) {
+                threshold /= 2;
+                threshold_drops++;
+                mrc_rebuild();
+            }
+            if (MRC_SAMPLE(hv) >= threshold || keys_count >= keys_max) {
+                pthread_mutex_unlock(&mrc_lock);
+                return;
+            }
+            k = mrc_find(hv);
+        }
+        k->hv = hv;
+        k->size = ITEM_ntotal(it);
+        k->clsid = clsid;
+        keys_count++;
+    }
+
+    if (clock_ts == tree_size) {
+        /* keep k out of the renumbering, it gets the next time below */
+        struct mrc_key saved = *k;
+        k->ts = 0;
+        keys_count--;
+        mrc_rebuild();
+        k = mrc_find(hv);
+        *k = saved;
+        keys_count++;
+    }
+    k->ts = ++clock_ts;
+    tree_add(k->ts, k->size);
+    pthread_mutex_unlock(&mrc_lock);
+}
+
+void mrc_stats_reset(void) {
+    pthread_mutex_lock(&mrc_lock);
+    memset(hist, 0, sizeof(hist));
+    memset(cold, 0, sizeof(cold));
+    pthread_mutex_unlock(&mrc_lock);
+}
+
+/* Miss ratio for each cache size up to the last used bucket, for a class
+ * or for everything if clsid is 0. */
+static void mrc_curve(ADD_STAT add_stats, void *c, const int clsid,
+        const uint64_t *h, const uint64_t refs, const int last) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    uint64_t hits = 0;
+    int b;
+
+    for (b = 0; b <= last; b++) {
+        unsigned long long size = (unsigned long long)MRC_BUCKET_MIN << b;
+        hits += h[b];
+        if (clsid == 0) {
+            klen = snprintf(key_str, STAT_KEY_LEN, "miss_ratio:%llu", size);
+        } else {
+            klen = snprintf(key_str, STAT_KEY_LEN, "%d:miss_ratio:%llu",
+                    clsid, size);
+        }
+        vlen = snprintf(val_str, STAT_VAL_LEN, "%.4f",
+                1.0 - (double)hits / refs);
+        add_stats(key_str, klen, val_str, vlen, c);
+    }
+}
+
+void mrc_stats(ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    uint64_t total[MRC_BUCKETS];
+    uint64_t refs[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t all_refs = 0;
+    uint64_t all_cold = 0;
+    int last = 0;
+    int i, b;
+
+    if (keys == NULL) {
+        add_stats(NULL, 0, NULL, 0, c);
+        return;
+    }
+
+    pthread_mutex_lock(&mrc_lock);
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        refs[i] = cold[i];
+        all_cold += cold[i];
+        for (b = 0; b < MRC_BUCKETS; b++) {
+            refs[i] += hist[i][b];
+            total[b] += hist[i][b];
+            if (hist[i][b] != 0 && b > last)
+                last = b;
+        }
+        all_refs += refs[i];
+    }
+
+    APPEND_STAT("sample_rate", "%.6f", (double)threshold / MRC_SAMPLE_MOD);
+    APPEND_STAT("sample_rate_drops", "%llu", (unsigned long long)threshold_drops);
+    APPEND_STAT("sampled_keys", "%u", keys_count);
+    APPEND_STAT("max_keys", "%u", keys_max);
+    APPEND_STAT("bytes", "%llu", (unsigned long long)
+            ((keys_mask + 1) * sizeof(struct mrc_key)
+             + (tree_size + 1) * sizeof(uint64_t)));
+    APPEND_STAT("references", "%llu", (unsigned long long)all_refs);
+    APPEND_STAT("cold_misses", "%llu", (unsigned long long)all_cold);
+    if (all_refs != 0) {
+        mrc_curve(add_stats, c, 0, total, all_refs, last);
+    }
+
+    for (i = 1; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        if (refs[i] == 0)
+            continue;
+        APPEND_NUM_STAT(i, "references", "%llu", (unsigned long long)refs[i]);
+        APPEND_NUM_STAT(i, "cold_misses", "%llu", (unsigned long long)cold[i]);
+        mrc_curve(add_stats, c, i, hist[i], refs[i], last);
+    }
+    pthread_mutex_unlock(&mrc_lock);
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
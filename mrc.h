@@ -0,0 +1,12 @@
+#ifndef MRC_H
+#define MRC_H
+
+/* SHARDS miss ratio curve estimator behind -o mrc_sample_rate and
+ * "stats mrc". Keys are sampled by their item hash, so callers pass the hv
+ * they already have. it is NULL for a get which missed. */
+bool mrc_init(const double sample_rate, const unsigned int max_keys);
+void mrc_record(const uint32_t hv, item *it, const bool get);
+void mrc_stats(ADD_STAT add_stats, void *c);
+void mrc_stats_reset(void);
+
+#endif
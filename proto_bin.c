@@ -1119,12 +1119,30 @@ static void process_bin_update(conn *c, char *extbuf) {
         stats_prefix_record_set(key, nkey);
     }
 
-    it = item_alloc(key, nkey, req->message.body.flags,
-            realtime(req->message.body.expiration), vlen+2);
+    bool rejected;
+    it = item_alloc_admit(key, nkey, req->message.body.flags,
+            realtime(req->message.body.expiration), vlen+2, &rejected);
 
     if (it == 0) {
         enum store_item_type status;
-        if (! item_size_ok(nkey, req->message.body.flags, vlen + 2)) {
+        if (rejected) {
+            /* The admission filter kept the eviction victim; not an error.
+             * The value is dropped as if it was evicted at once. */
+            int comm = c->cmd == PROTOCOL_BINARY_CMD_ADD ? NREAD_ADD
+                : c->cmd == PROTOCOL_BINARY_CMD_SET ? NREAD_SET : NREAD_REPLACE;
+            if (c->binary_header.request.cas != 0)
+                comm = NREAD_CAS;
+            status = store_refused_status(comm);
+            if (status == STORED) {
+                c->cas = 0;
+                write_bin_response(c, NULL, 0, 0, 0);
+                c->sbytes = vlen;
+            } else {
+                write_bin_error(c, status == NOT_FOUND
+                        ? PROTOCOL_BINARY_RESPONSE_KEY_ENOENT
+                        : PROTOCOL_BINARY_RESPONSE_NOT_STORED, NULL, vlen);
+            }
+        } else if (! item_size_ok(nkey, req->message.body.flags, vlen + 2)) {
             write_bin_error(c, PROTOCOL_BINARY_RESPONSE_E2BIG, NULL, vlen);
             status = TOO_LARGE;
         } else {
@@ -12,6 +12,8 @@
 #include "authfile.h"
 #include "storage.h"
 #include "base64.h"
+#include "expiry.h"
+#include "quota.h"
 #ifdef TLS
 #include "tls.h"
 #endif
@@ -444,6 +446,56 @@ int try_read_command_asciiauth(conn *c) {
     return 1;
 }
 
+/* Max number of pipelined meta gets to prefetch ahead of processing. */
+#define MGET_PREFETCH_MAX 32
+
+/* Meta gets are one key per command, so a deep pipeline would otherwise
+ * stall on the bucket and item of every key in turn. When the command about
+ * to run is an mg, hash the keys of every complete mg line already sitting
+ * in rbuf and prefetch them as one batch. Keys using base64 encoding hash
+ * wrong here, which only wastes the hint. */
+static void process_mget_prefetch(conn *c, char *cont) {
+    uint32_t hvs[MGET_PREFETCH_MAX];
+    int count = 0;
+    char *line = c->rcurr;
+    char *end = c->rcurr + c->rbytes;
+
+    if (c->rprefetched > c->rcurr && c->rprefetched <= end) {
+        // the next command was covered by an earlier batch.
+        if (c->rprefetched > cont) {
+            return;
+        }
+        line = c->rprefetched;
+    }
+
+    while (line < end && count < MGET_PREFETCH_MAX) {
+        char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        if (eol - line > 3 && strncmp(line, "mg ", 3) == 0) {
+            char *key = line + 3;
+            size_t nkey = 0;
+            while (key + nkey < eol && key[nkey] != ' ' && key[nkey] != '\r') {
+                nkey++;
+            }
+            if (nkey > 0 && nkey <= KEY_MAX_LENGTH) {
+                hvs[count++] = hash(key, nkey);
+            }
+        }
+        line = eol + 1;
+    }
+    c->rprefetched = line;
+
+    if (count > 1) {
+        item_prefetch_batch(hvs, count);
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.get_prefetch_batches++;
+        c->thread->stats.get_prefetch_keys += count;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
+}
+
 int try_read_command_ascii(conn *c) {
     char *el, *cont;
 
@@ -483,6 +535,9 @@ int try_read_command_ascii(conn *c) {
         return 0;
     }
     cont = el + 1;
+    if (cont < c->rcurr + c->rbytes && strncmp(c->rcurr, "mg ", 3) == 0) {
+        process_mget_prefetch(c, cont);
+    }
     if ((el - c->rcurr) > 1 && *(el - 1) == '\r') {
         el--;
     }
@@ -545,6 +600,28 @@ static inline int make_ascii_get_suffix(char *suffix, item *it, bool return_cas,
     return (p - suffix) + 2;
 }
 
+/* Hashes every key token up to the end of the current batch and prefetches
+ * their buckets before any of them are looked up. Returns the number of keys
+ * hashed into hvs. */
+static int process_get_prefetch(conn *c, token_t *key_token, uint32_t *hvs) {
+    int count = 0;
+    for (; key_token->length != 0; key_token++) {
+        if (key_token->length > KEY_MAX_LENGTH) {
+            break;
+        }
+        hvs[count++] = hash(key_token->value, key_token->length);
+    }
+
+    if (count > 1) {
+        item_prefetch_batch(hvs, count);
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.get_prefetch_batches++;
+        c->thread->stats.get_prefetch_keys += count;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
+    return count;
+}
+
 /* ntokens is overwritten here... shrug.. */
 static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool return_cas, bool should_touch) {
     char *key;
@@ -554,6 +631,9 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     int32_t exptime_int = 0;
     rel_time_t exptime = 0;
     bool fail_length = false;
+    uint32_t hvs[MAX_TOKENS];
+    int hv_count = 0;
+    int hv_next = 0;
     assert(c != NULL);
     mc_resp *resp = c->resp;
 
@@ -568,6 +648,8 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     }
 
     do {
+        hv_count = process_get_prefetch(c, key_token, hvs);
+        hv_next = 0;
         while(key_token->length != 0) {
             bool overflow; // not used here.
             key = key_token->value;
@@ -578,7 +660,8 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 goto stop;
             }
 
-            it = limited_get(key, nkey, c->thread, exptime, should_touch, DO_UPDATE, &overflow);
+            uint32_t hv = hv_next < hv_count ? hvs[hv_next++] : hash(key, nkey);
+            it = limited_get_hv(key, nkey, hv, c->thread, exptime, should_touch, DO_UPDATE, &overflow);
             if (settings.detail_enabled) {
                 stats_prefix_record_get(key, nkey, NULL != it);
             }
@@ -921,6 +1004,7 @@ struct _meta_flags {
     uint64_t req_cas_id;
     uint64_t delta; // ma
     uint64_t initial; // ma
+    uint8_t cost; // ms
 };
 
 static int _meta_flag_preparse(token_t *tokens, const size_t start,
@@ -1047,6 +1131,15 @@ static int _meta_flag_preparse(token_t *tokens, const size_t start,
             case 'I':
                 of->set_stale = 1;
                 break;
+            case 'G': // mset regeneration cost
+                if (!safe_strtol(tokens[i].value+1, &tmp_int)
+                        || tmp_int < 1 || tmp_int > UINT8_MAX) {
+                    *errstr = "CLIENT_ERROR bad token in command line format";
+                    of->has_error = 1;
+                } else {
+                    of->cost = tmp_int;
+                }
+                break;
             default: // unknown flag, bail.
                 *errstr = "CLIENT_ERROR invalid flag";
                 return -1;
@@ -1153,11 +1246,17 @@ static void process_mget_command(conn *c, token_t *tokens, const size_t ntokens)
                 case 'T':
                     ttl_set = true;
                     it->exptime = of.exptime;
+                    if (settings.expiry_wheel) {
+                        expiry_wheel_add(it, hv);
+                    }
                     break;
                 case 'N':
                     if (item_created) {
                         it->exptime = of.autoviv_exptime;
                         won_token = true;
+                        if (settings.expiry_wheel) {
+                            expiry_wheel_add(it, hv);
+                        }
                     }
                     break;
                 case 'R':
@@ -1516,13 +1615,18 @@ static void process_mset_command(conn *c, token_t *tokens, const size_t ntokens)
     if (has_error)
         goto error;
 
-    it = item_alloc(key, nkey, of.client_flags, exptime, vlen);
+    bool rejected;
+    it = item_alloc_admit(key, nkey, of.client_flags, exptime, vlen, &rejected);
 
     if (it == 0) {
         enum store_item_type status;
         // TODO: These could be normalized codes (TL and OM). Need to
         // reorganize the output stuff a bit though.
-        if (! item_size_ok(nkey, of.client_flags, vlen)) {
+        if (rejected) {
+            // Turned away by the admission filter, which isn't an error.
+            status = store_refused_status(comm);
+            errstr = status == NOT_FOUND ? "NF" : "NS";
+        } else if (! item_size_ok(nkey, of.client_flags, vlen)) {
             errstr = "SERVER_ERROR object too large for cache";
             status = TOO_LARGE;
             pthread_mutex_lock(&c->thread->stats.mutex);
@@ -1549,9 +1653,19 @@ static void process_mset_command(conn *c, token_t *tokens, const size_t ntokens)
         }
         item_unlock(hv);
 
+        if (status == STORED) {
+            // Dropped as if evicted straight away; q hides this like any HD.
+            c->sbytes = vlen;
+            out_string(c, "HD");
+            conn_set_state(c, conn_swallow);
+            return;
+        }
         goto error;
     }
     ITEM_set_cas(it, of.req_cas_id);
+    if (of.cost) {
+        it->cost = of.cost;
+    }
 
     c->item = it;
 #ifdef NEED_ALIGN
@@ -1668,6 +1782,9 @@ static void process_mdelete_command(conn *c, token_t *tokens, const size_t ntoke
         if (of.set_stale) {
             if (of.new_ttl) {
                 it->exptime = of.exptime;
+                if (settings.expiry_wheel) {
+                    expiry_wheel_add(it, hv);
+                }
             }
             it->it_flags |= ITEM_STALE;
             // Also need to remove TOKEN_SENT, so next client can win.
@@ -1872,10 +1989,16 @@ static void process_marithmetic_command(conn *c, token_t *tokens, const size_t n
                     break;
                 case 'T':
                     it->exptime = of.exptime;
+                    if (settings.expiry_wheel) {
+                        expiry_wheel_add(it, hv);
+                    }
                     break;
                 case 'N':
                     if (item_created) {
                         it->exptime = of.autoviv_exptime;
+                        if (settings.expiry_wheel) {
+                            expiry_wheel_add(it, hv);
+                        }
                     }
                     break;
                 // TODO: macro perhaps?
@@ -1990,11 +2113,18 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
         stats_prefix_record_set(key, nkey);
     }
 
-    it = item_alloc(key, nkey, flags, exptime, vlen);
+    bool rejected;
+    it = item_alloc_admit(key, nkey, flags, exptime, vlen, &rejected);
 
     if (it == 0) {
         enum store_item_type status;
-        if (! item_size_ok(nkey, flags, vlen)) {
+        if (rejected) {
+            /* The admission filter kept what would have been evicted. Not
+             * an error: the value is dropped as if it was evicted at once. */
+            status = store_refused_status(comm);
+            out_string(c, status == STORED ? "STORED"
+                    : status == NOT_FOUND ? "NOT_FOUND" : "NOT_STORED");
+        } else if (! item_size_ok(nkey, flags, vlen)) {
             out_string(c, "SERVER_ERROR object too large for cache");
             status = TOO_LARGE;
             pthread_mutex_lock(&c->thread->stats.mutex);
@@ -2275,7 +2405,7 @@ static void process_slabs_automove_command(conn *c, token_t *tokens, const size_
         }
         if (level == 0) {
             settings.slab_automove = 0;
-        } else if (level == 1 || level == 2) {
+        } else if (level <= 3) {
             settings.slab_automove = level;
         } else {
             out_string(c, "ERROR");
@@ -2343,7 +2473,7 @@ static void process_watch_command(conn *c, token_t *tokens, const size_t ntokens
             break;
         case LOGGER_ADD_WATCHER_OK:
             conn_set_state(c, conn_watch);
-            event_del(&c->event);
+            conn_event_del(c);
             break;
     }
 }
@@ -2375,6 +2505,23 @@ static void process_memlimit_command(conn *c, token_t *tokens, const size_t ntok
     }
 }
 
+static void process_quota_command(conn *c, token_t *tokens, const size_t ntokens) {
+    uint64_t limit;
+    assert(c != NULL);
+
+    set_noreply_maybe(c, tokens, ntokens);
+
+    if (!settings.prefix_quotas) {
+        out_string(c, "CLIENT_ERROR prefix quotas not enabled");
+    } else if (!safe_strtoull(tokens[2].value, &limit)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+    } else if (!quota_set(tokens[1].value, tokens[1].length, limit)) {
+        out_string(c, "CLIENT_ERROR bad prefix");
+    } else {
+        out_string(c, "OK");
+    }
+}
+
 static void process_lru_command(conn *c, token_t *tokens, const size_t ntokens) {
     uint32_t pct_hot;
     uint32_t pct_warm;
@@ -2407,10 +2554,38 @@ static void process_lru_command(conn *c, token_t *tokens, const size_t ntokens)
                settings.lru_maintainer_thread) {
         if (strcmp(tokens[2].value, "flat") == 0) {
             settings.lru_segmented = false;
+            settings.lru_clock = false;
+            settings.lru_s3fifo = false;
+            settings.lru_gdsf = false;
             out_string(c, "OK");
         } else if (strcmp(tokens[2].value, "segmented") == 0) {
             settings.lru_segmented = true;
+            settings.lru_clock = false;
+            settings.lru_s3fifo = false;
+            settings.lru_gdsf = false;
             out_string(c, "OK");
+        } else if (strcmp(tokens[2].value, "clock") == 0) {
+            settings.lru_segmented = false;
+            settings.lru_clock = true;
+            settings.lru_s3fifo = false;
+            settings.lru_gdsf = false;
+            out_string(c, "OK");
+        } else if (strcmp(tokens[2].value, "gdsf") == 0) {
+            settings.lru_segmented = false;
+            settings.lru_clock = false;
+            settings.lru_s3fifo = false;
+            settings.lru_gdsf = true;
+            out_string(c, "OK");
+        } else if (strcmp(tokens[2].value, "s3fifo") == 0) {
+            if (!item_s3fifo_init()) {
+                out_string(c, "SERVER_ERROR out of memory");
+            } else {
+                settings.lru_segmented = false;
+                settings.lru_clock = false;
+                settings.lru_s3fifo = true;
+                settings.lru_gdsf = false;
+                out_string(c, "OK");
+            }
         } else {
             out_string(c, "ERROR");
         }
@@ -2600,6 +2775,40 @@ static void process_slabs_command(conn *c, token_t *tokens, const size_t ntokens
             break;
         }
         return;
+    } else if ((ntokens == 3 || ntokens == 4) &&
+        strcmp(tokens[COMMAND_TOKEN + 1].value, "reprofile") == 0) {
+        uint32_t classes = 0;
+
+        if (settings.slab_reassign == false) {
+            out_string(c, "CLIENT_ERROR slab reassignment disabled");
+            return;
+        }
+        if (ntokens == 4 && !safe_strtoul(tokens[2].value, &classes)) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+
+        switch (slabs_reprofile(classes)) {
+        case REPROFILE_OK:
+            out_string(c, "OK");
+            break;
+        case REPROFILE_RUNNING:
+            out_string(c, "BUSY still moving pages");
+            break;
+        case REPROFILE_NOSIZES:
+            out_string(c, "NOSIZES no items in stats sizes");
+            break;
+        case REPROFILE_NOSPARE:
+            out_string(c, "NOSPARE not enough free class ids");
+            break;
+        case REPROFILE_NOGAIN:
+            out_string(c, "NOGAIN current classes are as good");
+            break;
+        case REPROFILE_RESTARTABLE:
+            out_string(c, "CLIENT_ERROR not supported with restartable memory");
+            break;
+        }
+        return;
     } else if (ntokens >= 4 &&
         (strcmp(tokens[COMMAND_TOKEN + 1].value, "automove") == 0)) {
         process_slabs_automove_command(c, tokens, ntokens);
@@ -2661,7 +2870,7 @@ static void process_lru_crawler_command(conn *c, token_t *tokens, const size_t n
                 //out_string(c, "OK");
                 // TODO: Don't reuse conn_watch here.
                 conn_set_state(c, conn_watch);
-                event_del(&c->event);
+                conn_event_del(c);
                 break;
             case CRAWLER_RUNNING:
                 out_string(c, "BUSY currently processing crawler request");
@@ -2696,7 +2905,7 @@ static void process_lru_crawler_command(conn *c, token_t *tokens, const size_t n
         switch(rv) {
             case CRAWLER_OK:
                 conn_set_state(c, conn_watch);
-                event_del(&c->event);
+                conn_event_del(c);
                 break;
             case CRAWLER_RUNNING:
                 out_string(c, "BUSY currently processing crawler request");
@@ -2967,6 +3176,9 @@ void process_command_ascii(conn *c, char *command) {
     } else if (strcmp(tokens[COMMAND_TOKEN].value, "lru") == 0) {
         WANT_TOKENS_MIN(ntokens, 3);
         process_lru_command(c, tokens, ntokens);
+    } else if (strcmp(tokens[COMMAND_TOKEN].value, "quota") == 0) {
+        WANT_TOKENS_OR(ntokens, 4, 5);
+        process_quota_command(c, tokens, ntokens);
 #ifdef MEMCACHED_DEBUG
     // commands which exist only for testing the memcached's security protection
     } else if (strcmp(tokens[COMMAND_TOKEN].value, "misbehave") == 0) {
@@ -348,11 +348,18 @@ static void process_update_cmd(LIBEVENT_THREAD *t, mcp_parser_t *pr, mc_resp *re
         stats_prefix_record_set(key, nkey);
     }
 
-    it = item_alloc(key, nkey, flags, exptime, pr->vlen);
+    bool rejected;
+    it = item_alloc_admit(key, nkey, flags, exptime, pr->vlen, &rejected);
 
     if (it == 0) {
         //enum store_item_type status;
-        if (! item_size_ok(nkey, flags, pr->vlen)) {
+        if (rejected) {
+            /* The admission filter kept the eviction victim; not an error.
+             * The value is dropped as if it was evicted at once. */
+            enum store_item_type status = store_refused_status(comm);
+            pout_string(resp, status == STORED ? "STORED"
+                    : status == NOT_FOUND ? "NOT_FOUND" : "NOT_STORED");
+        } else if (! item_size_ok(nkey, flags, pr->vlen)) {
             pout_string(resp, "SERVER_ERROR object too large for cache");
             //status = TOO_LARGE;
             pthread_mutex_lock(&t->stats.mutex);
@@ -596,6 +603,7 @@ struct _meta_flags {
     uint64_t req_cas_id;
     uint64_t delta; // ma
     uint64_t initial; // ma
+    uint8_t cost; // ms
 };
 
 static int _meta_flag_preparse(mcp_parser_t *pr, const size_t start,
@@ -721,6 +729,15 @@ static int _meta_flag_preparse(mcp_parser_t *pr, const size_t start,
             case 'I':
                 of->set_stale = 1;
                 break;
+            case 'G': // mset regeneration cost
+                if (!safe_strtol(&pr->request[pr->tokens[i]+1], &tmp_int)
+                        || tmp_int < 1 || tmp_int > UINT8_MAX) {
+                    *errstr = "CLIENT_ERROR bad token in command line format";
+                    of->has_error = 1;
+                } else {
+                    of->cost = tmp_int;
+                }
+                break;
             default: // unknown flag, bail.
                 *errstr = "CLIENT_ERROR invalid flag";
                 return -1;
@@ -1117,10 +1134,16 @@ static void process_mset_cmd(LIBEVENT_THREAD *t, mcp_parser_t *pr, mc_resp *resp
         comm = NREAD_CAS;
     }
 
-    it = item_alloc(key, nkey, of.client_flags, exptime, vlen);
+    bool rejected;
+    it = item_alloc_admit(key, nkey, of.client_flags, exptime, vlen, &rejected);
 
     if (it == 0) {
-        if (! item_size_ok(nkey, of.client_flags, vlen)) {
+        enum store_item_type status = NO_MEMORY;
+        if (rejected) {
+            // Turned away by the admission filter, which isn't an error.
+            status = store_refused_status(comm);
+            errstr = status == NOT_FOUND ? "NF" : "NS";
+        } else if (! item_size_ok(nkey, of.client_flags, vlen)) {
             errstr = "SERVER_ERROR object too large for cache";
             pthread_mutex_lock(&t->stats.mutex);
             t->stats.store_too_large++;
@@ -1142,9 +1165,19 @@ static void process_mset_cmd(LIBEVENT_THREAD *t, mcp_parser_t *pr, mc_resp *resp
         }
         item_unlock(hv);
 
+        if (status == STORED) {
+            // Dropped as if evicted straight away; q hides this like any HD.
+            pout_string(resp, "HD");
+            if (of.no_reply)
+                resp->skip = true;
+            return;
+        }
         goto error;
     }
     ITEM_set_cas(it, of.req_cas_id);
+    if (of.cost) {
+        it->cost = of.cost;
+    }
 
     // data should already be read into the request.
 
@@ -0,0 +1,303 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Per prefix memory quotas.
+ *
+ * Every linked item whose key has a prefix is charged to that prefix, and
+ * noted in a FIFO of the prefix's items. When an allocation for a prefix
+ * would take it over its quota, items are evicted from the head of its own
+ * FIFO until the new item fits, so a tenant filling its quota only pushes
+ * out its own data. If none of its items can be evicted the allocation
+ * fails.
+ *
+ * Like the expiry wheel, FIFO entries aren't removed when an item goes
+ * away. An entry holds a copy of the key, and is only acted on if looking
+ * the key up under its item lock finds the item the entry was made for; the
+ * old item pointer is never followed. Stale entries are dropped as they
+ * reach the head, and a few are checked on every link so a prefix which
+ * never fills its quota doesn't build up garbage.
+ */
+#include "memcached.h"
+#include "quota.h"
+#include "storage.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define QUOTA_HASH_SIZE 256
+#define QUOTA_BLOCK_BYTES 4072
+/* Entries looked at per allocation before giving up on making room */
+#define QUOTA_EVICT_TRIES 50
+/* Entries rechecked per link once a FIFO is mostly stale */
+#define QUOTA_PRUNE 2
+
+/* Blocks only hold as much of the key as is used. */
+struct quota_entry {
+    item *it; /* compared against, never dereferenced */
+    uint32_t hv;
+    uint8_t nkey;
+    char key[KEY_MAX_LENGTH];
+};
+
+#define QUOTA_ENTRY_SIZE(nkey) \
+    ((offsetof(struct quota_entry, key) + (nkey) + sizeof(void *) - 1) \
+     & ~(sizeof(void *) - 1))
+
+struct quota_block {
+    struct quota_block *next;
+    size_t first; /* byte offsets into data */
+    size_t used;
+    char data[QUOTA_BLOCK_BYTES];
+};
+
+struct quota {
+    struct quota *next;
+    char *prefix;
+    size_t prefix_len;
+    uint64_t limit; /* 0 is no quota */
+    uint64_t bytes;
+    uint64_t items;
+    uint64_t entries;
+    uint64_t evictions;
+    uint64_t rejects;
+    struct quota_block *head;
+    struct quota_block *tail;
+};
+
+static pthread_mutex_t quota_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct quota *quotas[QUOTA_HASH_SIZE];
+static char quota_delimiter;
+
+void quota_init(const char delimiter) {
+    quota_delimiter = delimiter;
+    memset(quotas, 0, sizeof(quotas));
+}
+
+/* Finds the quota for a key's prefix, creating it if asked. Returns NULL
+ * for keys without a prefix. Requires quota_lock. */
+static struct quota *quota_find(const char *key, const size_t nkey,
+        const bool create) {
+    struct quota *q;
+    uint32_t hashval;
+    size_t length;
+
+    for (length = 0; length < nkey; length++) {
+        if (key[length] == quota_delimiter)
+            break;
+    }
+    if (length == nkey)
+        return NULL;
+
+    hashval = hash(key, length) % QUOTA_HASH_SIZE;
+    for (q = quotas[hashval]; q != NULL; q = q->next) {
+        if (q->prefix_len == length && memcmp(q->prefix, key, length) == 0)
+            return q;
+    }
+    if (!create)
+        return NULL;
+
+    q = calloc(1, sizeof(struct quota));
+    if (q == NULL)
+        return NULL;
+    q->prefix = malloc(length + 1);
+    if (q->prefix == NULL) {
+        free(q);
+        return NULL;
+    }
+    memcpy(q->prefix, key, length);
+    q->prefix[length] = '\0';
+    q->prefix_len = length;
+    q->next = quotas[hashval];
+    quotas[hashval] = q;
+    return q;
+}
+
+static void quota_push(struct quota *q, struct quota_entry *e) {
+    struct quota_block *b = q->tail;
+    size_t size = QUOTA_ENTRY_SIZE(e->nkey);
+    if (b == NULL || b->used + size > QUOTA_BLOCK_BYTES) {
+        b = malloc(sizeof(struct quota_block));
+        if (b == NULL)
+            return;
+        b->next = NULL;
+        b->first = 0;
+        b->used = 0;
+        if (q->tail != NULL) {
+            q->tail->next = b;
+        } else {
+            q->head = b;
+        }
+        q->tail = b;
+    }
+    memcpy(b->data + b->used, e, size);
+    b->used += size;
+    q->entries++;
+}
+
+static bool quota_pop(struct quota *q, struct quota_entry *e) {
+    struct quota_block *b = q->head;
+    if (b == NULL)
+        return false;
+    struct quota_entry *be = (struct quota_entry *)(b->data + b->first);
+    size_t size = QUOTA_ENTRY_SIZE(be->nkey);
+    memcpy(e, be, size);
+    b->first += size;
+    q->entries--;
+    if (b->first == b->used) {
+        q->head = b->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+        free(b);
+    }
+    return true;
+}
+
+/* Returns the entry's item if it's still the one linked under its key, or
+ * NULL. Requires the item lock for e->hv. */
+static item *quota_entry_item(struct quota_entry *e) {
+    item *it = assoc_find(e->key, e->nkey, e->hv);
+    return it == e->it ? it : NULL;
+}
+
+/* Requeue live entries from the head and drop stale ones. Called with the
+ * item lock for the item being linked held, so others are only trylocked. */
+static void quota_prune(struct quota *q) {
+    struct quota_entry e;
+    int i;
+
+    for (i = 0; i < QUOTA_PRUNE; i++) {
+        void *hold_lock;
+        if (!quota_pop(q, &e))
+            return;
+        if ((hold_lock = item_trylock(e.hv)) == NULL) {
+            quota_push(q, &e);
+            continue;
+        }
+        if (quota_entry_item(&e) != NULL)
+            quota_push(q, &e);
+        item_trylock_unlock(hold_lock);
+    }
+}
+
+/* Called with the item lock held. */
+void quota_link(item *it, const uint32_t hv) {
+    struct quota *q;
+
+    pthread_mutex_lock(&quota_lock);
+    q = quota_find(ITEM_key(it), it->nkey, true);
+    if (q != NULL) {
+        struct quota_entry e;
+        q->bytes += ITEM_ntotal(it);
+        q->items++;
+        if (q->entries > q->items * 2)
+            quota_prune(q);
+        e.it = it;
+        e.hv = hv;
+        e.nkey = it->nkey;
+        memcpy(e.key, ITEM_key(it), it->nkey);
+        quota_push(q, &e);
+    }
+    pthread_mutex_unlock(&quota_lock);
+}
+
+/* Called with the item lock held. */
+void quota_unlink(item *it) {
+    struct quota *q;
+
+    pthread_mutex_lock(&quota_lock);
+    q = quota_find(ITEM_key(it), it->nkey, false);
+    if (q != NULL) {
+        q->bytes -= ITEM_ntotal(it);
+        q->items--;
+    }
+    pthread_mutex_unlock(&quota_lock);
+}
+
+/* Evicts the prefix's own items until ntotal more bytes fit in its quota.
+ * The caller may hold an item lock, so victims are only trylocked; busy
+ * ones go back on the FIFO. Returns false if it couldn't make room. */
+bool quota_make_room(const char *key, const size_t nkey, const size_t ntotal) {
+    struct quota *q;
+    struct quota_entry e;
+    int tries;
+
+    pthread_mutex_lock(&quota_lock);
+    q = quota_find(key, nkey, false);
+    if (q == NULL || q->limit == 0) {
+        pthread_mutex_unlock(&quota_lock);
+        return true;
+    }
+
+    for (tries = 0; q->bytes + ntotal > q->limit; tries++) {
+        void *hold_lock;
+        item *it;
+        if (tries == QUOTA_EVICT_TRIES || !quota_pop(q, &e)) {
+            q->rejects++;
+            pthread_mutex_unlock(&quota_lock);
+            return false;
+        }
+        /* quota_unlink() takes quota_lock under the item lock */
+        pthread_mutex_unlock(&quota_lock);
+        if ((hold_lock = item_trylock(e.hv)) == NULL) {
+            pthread_mutex_lock(&quota_lock);
+            quota_push(q, &e);
+            continue;
+        }
+        if ((it = quota_entry_item(&e)) != NULL) {
+            STORAGE_delete(ext_storage, it);
+            do_item_unlink(it, e.hv);
+            pthread_mutex_lock(&quota_lock);
+            q->evictions++;
+        } else {
+            pthread_mutex_lock(&quota_lock);
+        }
+        item_trylock_unlock(hold_lock);
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return true;
+}
+
+bool quota_set(const char *prefix, const size_t nprefix, const uint64_t limit) {
+    struct quota *q;
+    char key[KEY_MAX_LENGTH + 1];
+
+    if (nprefix >= KEY_MAX_LENGTH || memchr(prefix, quota_delimiter, nprefix))
+        return false;
+    memcpy(key, prefix, nprefix);
+    key[nprefix] = quota_delimiter;
+
+    pthread_mutex_lock(&quota_lock);
+    q = quota_find(key, nprefix + 1, true);
+    if (q != NULL)
+        q->limit = limit;
+    pthread_mutex_unlock(&quota_lock);
+    return q != NULL;
+}
+
+void quota_stats(ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    struct quota *q;
+    int i;
+
+    pthread_mutex_lock(&quota_lock);
+    for (i = 0; i < QUOTA_HASH_SIZE; i++) {
+        for (q = quotas[i]; q != NULL; q = q->next) {
+            APPEND_NUM_FMT_STAT("%s:%s", q->prefix, "limit", "%llu",
+                    (unsigned long long)q->limit);
+            APPEND_NUM_FMT_STAT("%s:%s", q->prefix, "bytes", "%llu",
+                    (unsigned long long)q->bytes);
+            APPEND_NUM_FMT_STAT("%s:%s", q->prefix, "items", "%llu",
+                    (unsigned long long)q->items);
+            APPEND_NUM_FMT_STAT("%s:%s", q->prefix, "evictions", "%llu",
+                    (unsigned long long)q->evictions);
+            APPEND_NUM_FMT_STAT("%s:%s", q->prefix, "rejects", "%llu",
+                    (unsigned long long)q->rejects);
+            APPEND_NUM_FMT_STAT("%s:%s", q->prefix, "fifo_entries", "%llu",
+                    (unsigned long long)q->entries);
+        }
+    }
+    pthread_mutex_unlock(&quota_lock);
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
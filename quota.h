@@ -0,0 +1,13 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+/* Per key prefix memory quotas behind -o prefix_quotas. Prefixes are split
+ * off with the -D delimiter, the same as "stats detail". */
+void quota_init(const char delimiter);
+void quota_link(item *it, const uint32_t hv);
+void quota_unlink(item *it);
+bool quota_make_room(const char *key, const size_t nkey, const size_t ntotal);
+bool quota_set(const char *prefix, const size_t nprefix, const uint64_t limit);
+void quota_stats(ADD_STAT add_stats, void *c);
+
+#endif
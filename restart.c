@@ -316,7 +316,20 @@ bool restart_mmap_open(const size_t limit, const char *file, void **mem_base) {
         fprintf(stderr, "[restart] memory limit not divisible evenly by pagesize (please report bug)\n");
         abort();
     }
+#ifdef COMPACT_ITEMS
+    // compact item links count from the arena head, which has to sit right
+    // below the item memory.
+    char *head = mmap(NULL, ITEM_ARENA_HEAD + limit, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (head == MAP_FAILED) {
+        perror("failed to reserve the item arena, aborting");
+        abort();
+    }
+    mmap_base = mmap(head + ITEM_ARENA_HEAD, limit, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_FIXED, mmap_fd, 0);
+#else
     mmap_base = mmap(NULL, limit, PROT_READ|PROT_WRITE, MAP_SHARED, mmap_fd, 0);
+#endif
     if (mmap_base == MAP_FAILED) {
         perror("failed to mmap, aborting");
         abort();
@@ -341,6 +354,10 @@ void restart_mmap_close(void) {
 
     if (munmap(mmap_base, slabmem_limit) != 0) {
         perror("[restart] failed to munmap shared memory");
+#ifdef COMPACT_ITEMS
+    } else if (munmap((char *)mmap_base - ITEM_ARENA_HEAD, ITEM_ARENA_HEAD) != 0) {
+        perror("[restart] failed to munmap the item arena head");
+#endif
     } else if (close(mmap_fd) != 0) {
         perror("[restart] failed to close shared memory fd");
     }
@@ -381,7 +398,9 @@ unsigned int restart_fixup(void *orig_addr) {
         }
 
         if (it->it_flags & ITEM_LINKED) {
-            // fixup next/prev links while on LRU.
+#ifndef COMPACT_ITEMS
+            // fixup next/prev links while on LRU. compact links are offsets
+            // into the arena and don't move with it.
             if (it->next) {
                 it->next = (item *)((mc_ptr_t)it->next - (mc_ptr_t)orig_addr);
                 it->next = (item *)((mc_ptr_t)it->next + (mc_ptr_t)mmap_base);
@@ -390,6 +409,7 @@ unsigned int restart_fixup(void *orig_addr) {
                 it->prev = (item *)((mc_ptr_t)it->prev - (mc_ptr_t)orig_addr);
                 it->prev = (item *)((mc_ptr_t)it->prev + (mc_ptr_t)mmap_base);
             }
+#endif
 
             //fprintf(stderr, "item was linked\n");
             do_item_link_fixup(it);
@@ -88,8 +88,19 @@ void slab_automove_run(void *arg, int *src, int *dst) {
     fill_slab_stats_automove(a->sam_after);
     // Loop once to get total_evicted for this window.
     uint64_t evicted_total = 0;
+    uint64_t cost_total = 0;
+    uint64_t bytes_total = 0;
     for (n = POWER_SMALLEST; n < MAX_NUMBER_OF_SLAB_CLASSES; n++) {
         evicted_total += a->iam_after[n].evicted - a->iam_before[n].evicted;
+        cost_total += a->iam_after[n].cost;
+        bytes_total += a->iam_after[n].bytes;
+    }
+    // With lru_gdsf, ages are scaled by what a class's items are worth per
+    // byte against the whole cache: valuable classes look younger, so they
+    // are picked to receive pages and passed over as a source.
+    double cost_per_byte = 0;
+    if (settings.lru_gdsf && bytes_total != 0) {
+        cost_per_byte = (double)cost_total / bytes_total;
     }
     a->window_cur++;
 
@@ -118,6 +129,11 @@ void slab_automove_run(void *arg, int *src, int *dst) {
 
         // set age into window
         wd->age = a->iam_after[n].age;
+        if (cost_per_byte > 0 && a->iam_after[n].cost != 0) {
+            double value = (double)a->iam_after[n].cost
+                / a->iam_after[n].bytes / cost_per_byte;
+            wd->age = wd->age / value;
+        }
 
         // summarize the window-up-to-now.
         memset(&w_sum, 0, sizeof(struct window_data));
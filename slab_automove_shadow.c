@@ -0,0 +1,211 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Marginal hit rate slab automover (Cliffhanger style), slab_automove=3.
+ *
+ * What a page is worth to a slab class is the hits it would add. Each class
+ * gets a shadow queue holding the keys of its last page worth of evictions;
+ * a get which misses on a key in the shadow is a hit the class would have
+ * had with one more page. Shadow hits summed over the window estimate the
+ * marginal hit rate of every class, and pages go from the class where it is
+ * lowest to the class where it is highest. Hit rate curves are assumed to be
+ * concave, so a page is worth no more to its current owner than the next
+ * page would be.
+ *
+ * The shadow queues share one table indexed by key hash. An entry holds the
+ * hash, the class and the class's eviction count at the time; it is in the
+ * queue while fewer than a page of chunks have been evicted from the class
+ * since. Colliding evictions overwrite each other, which only loses
+ * samples.
+ */
+#include "memcached.h"
+#include "slab_automove_shadow.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_PAGES_FOR_SOURCE 2
+#define MIN_PAGES_FOR_RECLAIM 2.5
+
+/* Entries are hv | clsid << 32 | eviction count << 40 */
+#define SHADOW_SEQ_SHIFT 40
+#define SHADOW_SEQ_MASK ((1U << 24) - 1)
+
+static uint64_t *shadow = NULL;
+static uint32_t shadow_mask = 0;
+static uint32_t shadow_evicted[MAX_NUMBER_OF_SLAB_CLASSES];
+static uint64_t shadow_hits[MAX_NUMBER_OF_SLAB_CLASSES];
+/* Chunks per page of each class, the depth of its shadow queue */
+static unsigned int shadow_depth[MAX_NUMBER_OF_SLAB_CLASSES];
+
+struct window_data {
+    uint64_t hits;
+    uint64_t evicted;
+};
+
+typedef struct {
+    struct window_data *window_data;
+    uint32_t window_size;
+    uint32_t window_cur;
+    double max_ratio;
+    uint64_t hits_before[MAX_NUMBER_OF_SLAB_CLASSES];
+    item_stats_automove iam_before[MAX_NUMBER_OF_SLAB_CLASSES];
+    item_stats_automove iam_after[MAX_NUMBER_OF_SLAB_CLASSES];
+    slab_stats_automove sam_after[MAX_NUMBER_OF_SLAB_CLASSES];
+} slab_automove;
+
+/* Called from the LRU with the class's LRU lock held. Classes evict from
+ * more than one LRU, so the count is bumped atomically. */
+void slab_automove_shadow_evict(const uint32_t hv, const unsigned int clsid) {
+    if (shadow == NULL)
+        return;
+    uint32_t seq = __sync_fetch_and_add(&shadow_evicted[clsid], 1);
+    shadow[hv & shadow_mask] = (uint64_t)hv | ((uint64_t)clsid << 32)
+        | ((uint64_t)(seq & SHADOW_SEQ_MASK) << SHADOW_SEQ_SHIFT);
+}
+
+void slab_automove_shadow_miss(const uint32_t hv) {
+    if (shadow == NULL)
+        return;
+    uint64_t *slot = &shadow[hv & shadow_mask];
+    uint64_t e = *slot;
+    if (e == 0 || (uint32_t)e != hv)
+        return;
+    unsigned int clsid = (e >> 32) & 0xff;
+    uint32_t seq = e >> SHADOW_SEQ_SHIFT;
+    uint32_t distance = (shadow_evicted[clsid] - seq) & SHADOW_SEQ_MASK;
+    // Count a key once, even if it's missed again before being set.
+    *slot = 0;
+    if (distance <= shadow_depth[clsid]) {
+        __sync_fetch_and_add(&shadow_hits[clsid], 1);
+    }
+}
+
+void *slab_automove_shadow_init(struct settings *settings) {
+    uint32_t window_size = settings->slab_automove_window;
+    int n;
+    slab_automove *a = calloc(1, sizeof(slab_automove));
+    if (a == NULL)
+        return NULL;
+    a->window_data = calloc(window_size * MAX_NUMBER_OF_SLAB_CLASSES, sizeof(struct window_data));
+    a->window_size = window_size;
+    a->max_ratio = settings->slab_automove_ratio;
+    if (a->window_data == NULL) {
+        free(a);
+        return NULL;
+    }
+
+    // The table outlives the automover, as workers may be looking at it.
+    // Sized for a page of the smallest items in every class, with room
+    // for collisions.
+    if (shadow == NULL) {
+        uint64_t slots = 1 << 17;
+        while (slots < settings->maxbytes / 1024 && slots < (1 << 22)) {
+            slots <<= 1;
+        }
+        uint64_t *s = calloc(slots, sizeof(uint64_t));
+        if (s == NULL) {
+            free(a->window_data);
+            free(a);
+            return NULL;
+        }
+        shadow_mask = slots - 1;
+        shadow = s;
+    }
+
+    fill_item_stats_automove(a->iam_before);
+    fill_slab_stats_automove(a->sam_after);
+    for (n = 0; n < MAX_NUMBER_OF_SLAB_CLASSES; n++) {
+        shadow_depth[n] = a->sam_after[n].chunks_per_page;
+        a->hits_before[n] = shadow_hits[n];
+    }
+
+    return (void *)a;
+}
+
+void slab_automove_shadow_free(void *arg) {
+    slab_automove *a = (slab_automove *)arg;
+    free(a->window_data);
+    free(a);
+}
+
+void slab_automove_shadow_run(void *arg, int *src, int *dst) {
+    slab_automove *a = (slab_automove *)arg;
+    int n, x;
+    int low = -1;
+    uint64_t low_hits = 0;
+    long int low_pages = 0;
+    int high = -1;
+    uint64_t high_hits = 0;
+    int reclaim = -1;
+    *src = -1;
+    *dst = -1;
+
+    fill_item_stats_automove(a->iam_after);
+    fill_slab_stats_automove(a->sam_after);
+    a->window_cur++;
+
+    for (n = POWER_SMALLEST; n < MAX_NUMBER_OF_SLAB_CLASSES; n++) {
+        slab_stats_automove *sam = &a->sam_after[n];
+        int w_offset = n * a->window_size;
+        struct window_data *wd = &a->window_data[w_offset + (a->window_cur % a->window_size)];
+        uint64_t hits = shadow_hits[n];
+
+        shadow_depth[n] = sam->chunks_per_page;
+        wd->hits = hits - a->hits_before[n];
+        wd->evicted = a->iam_after[n].evicted - a->iam_before[n].evicted;
+        a->hits_before[n] = hits;
+
+        uint64_t w_hits = 0;
+        uint64_t w_evicted = 0;
+        for (x = 0; x < a->window_size; x++) {
+            w_hits += a->window_data[w_offset + x].hits;
+            w_evicted += a->window_data[w_offset + x].evicted;
+        }
+
+        // Free memory is worth nothing to a class that isn't evicting.
+        if (reclaim == -1 && w_evicted == 0
+                && sam->free_chunks > sam->chunks_per_page * MIN_PAGES_FOR_RECLAIM) {
+            reclaim = n;
+        }
+
+        // Of the classes gaining least from their last page, take from the
+        // one which has the most.
+        if (sam->total_pages > MIN_PAGES_FOR_SOURCE
+                && (low == -1 || w_hits < low_hits
+                    || (w_hits == low_hits && sam->total_pages > low_pages))) {
+            low = n;
+            low_hits = w_hits;
+            low_pages = sam->total_pages;
+        }
+
+        // A page only helps a class which is evicting, and a handful of
+        // shadow hits is noise.
+        if (w_evicted > 0 && w_hits >= a->window_size && w_hits > high_hits) {
+            high = n;
+            high_hits = w_hits;
+        }
+    }
+
+    memcpy(a->iam_before, a->iam_after,
+            sizeof(item_stats_automove) * MAX_NUMBER_OF_SLAB_CLASSES);
+    if (reclaim != -1) {
+        *src = reclaim;
+        *dst = 0;
+        return;
+    }
+    // Only decide once the window has filled.
+    if (low != -1 && high != -1 && low != high && a->window_cur > a->window_size
+            && low_hits < high_hits * a->max_ratio) {
+        *src = low;
+        *dst = high;
+        // Both were measured at their old sizes; start over so one burst
+        // of shadow hits doesn't move a page every second for a window.
+        memset(&a->window_data[low * a->window_size], 0,
+                sizeof(struct window_data) * a->window_size);
+        memset(&a->window_data[high * a->window_size], 0,
+                sizeof(struct window_data) * a->window_size);
+        LOGGER_LOG(NULL, LOG_SYSEVENTS, LOGGER_SLAB_AUTOMOVE, NULL,
+                low, high, (unsigned long long)low_hits,
+                (unsigned long long)high_hits, low_pages,
+                a->sam_after[high].total_pages);
+    }
+}
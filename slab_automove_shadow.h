@@ -0,0 +1,14 @@
+#ifndef SLAB_AUTOMOVE_SHADOW_H
+#define SLAB_AUTOMOVE_SHADOW_H
+
+/* Marginal hit rate automover behind slab_automove=3. Evictions are
+ * remembered in a shadow of each slab class, and misses on keys still in a
+ * shadow are hits the class would have had with one more page. */
+void *slab_automove_shadow_init(struct settings *settings);
+void slab_automove_shadow_free(void *arg);
+void slab_automove_shadow_run(void *arg, int *src, int *dst);
+
+void slab_automove_shadow_evict(const uint32_t hv, const unsigned int clsid);
+void slab_automove_shadow_miss(const uint32_t hv);
+
+#endif
@@ -9,6 +9,7 @@
  */
 #include "memcached.h"
 #include "storage.h"
+#include "logmem.h"
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -37,19 +38,54 @@ typedef struct {
 
     void **slab_list;       /* array of slab pointers */
     unsigned int list_size; /* size of prev array */
+
+    bool retired;           /* replaced by re-profiling, being drained */
 } slabclass_t;
 
+/* The classes new items are sized into, smallest first. Re-profiling swaps
+ * in a new layout while workers may still be reading the old one, so old
+ * layouts are never freed; there can only be a handful. */
+struct slab_layout {
+    unsigned int count;
+    unsigned char ids[MAX_NUMBER_OF_SLAB_CLASSES];
+};
+
 static slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
 static size_t mem_limit = 0;
 static size_t mem_malloced = 0;
 /* If the memory limit has been hit once. Used as a hint to decide when to
  * early-wake the LRU maintenance thread */
 static bool mem_limit_reached = false;
+/* Highest class id in use. Re-profiled classes are numbered above it. */
 static int power_largest;
+/* Class for chunks of large items, always the last of the layout */
+static int chunk_clsid;
+static struct slab_layout * volatile slab_layout = NULL;
+/* Set when classes are retired with pages, cleared by the drain once a scan
+ * finds none left. Only spares the maintainer the slabs lock otherwise. */
+static volatile bool retired_pages_left = false;
 
 static void *mem_base = NULL;
 static void *mem_current = NULL;
 static size_t mem_avail = 0;
+/* Restartable memory, which has to stay mapped as it is */
+static bool mem_external = false;
+static size_t mem_base_size = 0;
+static size_t os_page_size = 4096;
+/* A lowered limit is being met by moving pages out of classes */
+static volatile bool mem_shrinking = false;
+/* Preallocated pages given back to the OS. They can't be freed on their
+ * own, so they wait here to be faulted back in if the limit grows again. */
+static void **released_list = NULL;
+static unsigned int released_count = 0;
+static uint64_t pages_released = 0;
+#ifdef COMPACT_ITEMS
+/* Base of every item ref, see item_ref_ptr() */
+char *item_arena = NULL;
+#endif
+static uint64_t pages_trimmed = 0;
+/* Fewest pages the global pool held since the last idle trim */
+static unsigned int pool_low_water = 0;
 #ifdef EXTSTORE
 static void *storage  = NULL;
 #endif
@@ -59,12 +95,22 @@ static void *storage  = NULL;
 static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t slabs_rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Totals from the per worker magazines, gathered for "stats slabs" */
+struct slab_magazine_stats {
+    unsigned int chunks[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t hits;
+    uint64_t refills;
+    uint64_t drains;
+    uint64_t flushes;
+};
+
 /*
  * Forward Declarations
  */
 static int grow_slab_list (const unsigned int id);
 static int do_slabs_newslab(const unsigned int id);
 static void *memory_allocate(size_t size);
+static void slabs_magazine_init(void);
 static void do_slabs_free(void *ptr, const size_t size, unsigned int id);
 
 /* Preallocate as many slab pages as possible (called from slabs_init)
@@ -88,20 +134,25 @@ void slabs_set_storage(void *arg) {
  */
 
 unsigned int slabs_clsid(const size_t size) {
-    int res = POWER_SMALLEST;
+    struct slab_layout *l = slab_layout;
+    unsigned int res = 0;
 
     if (size == 0 || size > settings.item_size_max)
         return 0;
-    while (size > slabclass[res].size)
-        if (res++ == power_largest)     /* won't fit in the biggest slab */
-            return power_largest;
-    return res;
+    /* The log holds every size, so there's only the one LRU */
+    if (settings.log_memory)
+        return POWER_SMALLEST;
+    while (size > slabclass[l->ids[res]].size)
+        if (++res == l->count)      /* won't fit in the biggest slab */
+            return chunk_clsid;
+    return l->ids[res];
 }
 
 unsigned int slabs_size(const int clsid) {
     return slabclass[clsid].size;
 }
 
+#ifndef COMPACT_ITEMS
 // TODO: could this work with the restartable memory?
 // Docs say hugepages only work with private shm allocs.
 /* Function split out for better error path handling */
@@ -162,6 +213,7 @@ static void * alloc_large_chunk(const size_t limit)
 #endif
     return ptr;
 }
+#endif
 
 unsigned int slabs_fixup(char *chunk, const int border) {
     slabclass_t *p;
@@ -190,8 +242,8 @@ unsigned int slabs_fixup(char *chunk, const int border) {
         // if ITEM_SLABBED re-stack on freelist.
         // don't have to run pointer fixups.
         it->prev = 0;
-        it->next = p->slots;
-        if (it->next) it->next->prev = it;
+        ITEM_set_next(it, p->slots);
+        if (it->next) ITEM_set_prev(ITEM_next(it), it);
         p->slots = it;
 
         p->sl_curr++;
@@ -201,6 +253,202 @@ unsigned int slabs_fixup(char *chunk, const int border) {
     return p->size;
 }
 
+#ifdef COMPACT_ITEMS
+/* Compact item refs only reach within one arena, so all item memory comes
+ * out of a single reservation: as much as refs can address, or failing that
+ * the limit. Pages are only faulted in once handed out, and the address
+ * space above the limit lets cache_memlimit grow the cache later. */
+static void slabs_arena_init(void *mem_base_external) {
+    char *head;
+
+    if (mem_base_external != NULL) {
+        /* restart_mmap_open() maps the head right below the file */
+        head = (char *)mem_base_external - ITEM_ARENA_HEAD;
+    } else {
+        size_t size = ITEM_ARENA_MAX - ITEM_ARENA_HEAD;
+        head = mmap(NULL, ITEM_ARENA_HEAD + size, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (head == MAP_FAILED) {
+            size = mem_limit;
+            head = mmap(NULL, ITEM_ARENA_HEAD + size, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        }
+        if (head == MAP_FAILED) {
+            perror("Failed to reserve the item arena");
+            exit(EXIT_FAILURE);
+        }
+        mem_base = head + ITEM_ARENA_HEAD;
+        mem_current = mem_base;
+        mem_avail = size;
+        mem_base_size = size;
+        released_list = calloc(size / settings.slab_page_size + 1,
+                sizeof(void *));
+    }
+    item_arena = head - (1 << ITEM_REF_SHIFT);
+}
+
+/* The arena head, where the LRU crawler keeps its sentinels */
+void *slabs_arena_head(void) {
+    return item_arena + (1 << ITEM_REF_SHIFT);
+}
+#endif
+
+/* Faulting in preallocated memory at startup, split evenly over a few
+ * threads. Each thread is pinned to a different CPU, so first touch spreads
+ * the pages over every NUMA node the process may run on.
+ *
+ * MADV_POPULATE_WRITE leaves memory contents alone, so it can keep going
+ * after startup while the memory is already in use; prealloc_ready tells
+ * when it's done. Without it pages have to be written by hand, which is only
+ * safe before anything else uses them, so startup waits for that. */
+#define POPULATE_STEP (64 * 1024 * 1024)
+#define POPULATE_MAX_THREADS 256
+
+struct populate_range {
+    char *start;
+    size_t len;
+    bool touch;
+};
+
+static pthread_mutex_t populate_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct populate_range populate_ranges[POPULATE_MAX_THREADS];
+static int populate_threads = 0;
+static int populate_running = 0;
+static uint64_t populate_bytes = 0;
+static uint64_t populate_usec = 0;
+static struct timeval populate_started;
+
+static uint64_t populate_elapsed_us(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - populate_started.tv_sec) * 1000000
+        + (now.tv_usec - populate_started.tv_usec);
+}
+
+static void *slabs_populate_thread(void *arg) {
+    struct populate_range *r = arg;
+    size_t done = 0;
+
+    while (done < r->len) {
+        char *p = r->start + done;
+        size_t len = r->len - done;
+        if (len > POPULATE_STEP)
+            len = POPULATE_STEP;
+        if (r->touch) {
+            size_t x;
+            for (x = 0; x < len; x += os_page_size)
+                ((volatile char *)p)[x] = 0;
+        }
+#ifdef MADV_POPULATE_WRITE
+        else {
+            madvise(p, len, MADV_POPULATE_WRITE);
+        }
+#endif
+        done += len;
+        pthread_mutex_lock(&populate_lock);
+        populate_bytes += len;
+        pthread_mutex_unlock(&populate_lock);
+    }
+
+    pthread_mutex_lock(&populate_lock);
+    if (--populate_running == 0) {
+        populate_usec = populate_elapsed_us();
+        if (settings.verbose > 0) {
+            fprintf(stderr, "Preallocated %llu megabytes with %d threads in %llu ms\n",
+                    (unsigned long long)populate_bytes / 1024 / 1024,
+                    populate_threads, (unsigned long long)populate_usec / 1000);
+        }
+    }
+    pthread_mutex_unlock(&populate_lock);
+    return NULL;
+}
+
+static void slabs_populate(char *base, const size_t size) {
+    pthread_t tids[POPULATE_MAX_THREADS];
+    size_t share;
+    bool touch = true;
+    int threads = settings.prealloc_threads;
+    int cpus = 0;
+    int i;
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        cpus = CPU_COUNT(&allowed);
+#endif
+
+    if (threads == 0)
+        threads = cpus > 0 ? cpus : settings.num_threads;
+    if (threads > POPULATE_MAX_THREADS)
+        threads = POPULATE_MAX_THREADS;
+    /* Don't bother splitting up small amounts of memory */
+    if ((size_t)threads > size / POPULATE_STEP)
+        threads = size / POPULATE_STEP > 0 ? size / POPULATE_STEP : 1;
+    share = (size / threads + os_page_size - 1) & ~(os_page_size - 1);
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(base, os_page_size, MADV_POPULATE_WRITE) == 0)
+        touch = false;
+#endif
+
+    gettimeofday(&populate_started, NULL);
+    populate_threads = threads;
+    populate_running = threads;
+    for (i = 0; i < threads; i++) {
+        struct populate_range *r = &populate_ranges[i];
+        pthread_attr_t attr;
+        int ret;
+
+        r->start = base + share * i;
+        r->len = i == threads - 1 ? size - share * i : share;
+        r->touch = touch;
+
+        pthread_attr_init(&attr);
+#if defined(__linux__) && defined(CPU_SET)
+        if (cpus > 1) {
+            /* The (i * cpus / threads)th CPU we're allowed to run on */
+            cpu_set_t cpu;
+            int want = i * cpus / threads;
+            int n;
+            CPU_ZERO(&cpu);
+            for (n = 0; n < CPU_SETSIZE; n++) {
+                if (CPU_ISSET(n, &allowed) && want-- == 0) {
+                    CPU_SET(n, &cpu);
+                    pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+                    break;
+                }
+            }
+        }
+#endif
+        if ((ret = pthread_create(&tids[i], &attr, slabs_populate_thread, r)) != 0) {
+            fprintf(stderr, "Can't create prealloc thread: %s\n",
+                strerror(ret));
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+        thread_setname(tids[i], "mc-prealloc");
+    }
+
+    for (i = 0; i < threads; i++) {
+        if (touch) {
+            pthread_join(tids[i], NULL);
+        } else {
+            pthread_detach(tids[i]);
+        }
+    }
+}
+
+void slabs_prealloc_stats(ADD_STAT add_stats, void *c) {
+    if (populate_threads == 0)
+        return;
+    pthread_mutex_lock(&populate_lock);
+    APPEND_STAT("prealloc_ready", "%d", populate_running == 0);
+    APPEND_STAT("prealloc_bytes", "%llu", (unsigned long long)populate_bytes);
+    APPEND_STAT("prealloc_usec", "%llu", (unsigned long long)
+            (populate_running == 0 ? populate_usec : populate_elapsed_us()));
+    pthread_mutex_unlock(&populate_lock);
+}
+
 /**
  * Determines the chunk sizes and initializes the slab class descriptors
  * accordingly.
@@ -216,23 +464,37 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
     bool __attribute__ ((unused)) do_slab_prealloc = false;
 
     mem_limit = limit;
+#if defined(HAVE_SYSCONF) && defined(_SC_PAGESIZE)
+    if (sysconf(_SC_PAGESIZE) > 0)
+        os_page_size = sysconf(_SC_PAGESIZE);
+#endif
 
+#ifdef COMPACT_ITEMS
+    slabs_arena_init(mem_base_external);
+    do_slab_prealloc = prealloc;
+#else
     if (prealloc && mem_base_external == NULL) {
         mem_base = alloc_large_chunk(mem_limit);
         if (mem_base) {
             do_slab_prealloc = true;
             mem_current = mem_base;
             mem_avail = mem_limit;
+            mem_base_size = mem_limit;
+            released_list = calloc(mem_limit / settings.slab_page_size + 1,
+                    sizeof(void *));
         } else {
             fprintf(stderr, "Warning: Failed to allocate requested memory in"
                     " one large chunk.\nWill allocate in smaller chunks\n");
         }
-    } else if (prealloc && mem_base_external != NULL) {
+    }
+#endif
+    if (prealloc && mem_base_external != NULL) {
         // Can't (yet) mix hugepages with mmap allocations, so separate the
         // logic from above. Reusable memory also force-preallocates memory
         // pages into the global pool, which requires turning mem_* variables.
         do_slab_prealloc = true;
         mem_base = mem_base_external;
+        mem_external = true;
         // _current shouldn't be used in this case, but we set it to where it
         // should be anyway.
         if (reuse_mem) {
@@ -269,6 +531,7 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
     }
 
     power_largest = i;
+    chunk_clsid = i;
     slabclass[power_largest].size = settings.slab_chunk_size_max;
     slabclass[power_largest].perslab = settings.slab_page_size / settings.slab_chunk_size_max;
     if (settings.verbose > 1) {
@@ -276,6 +539,15 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
                 i, slabclass[i].size, slabclass[i].perslab);
     }
 
+    slab_layout = calloc(1, sizeof(struct slab_layout));
+    if (slab_layout == NULL) {
+        fprintf(stderr, "Failed to allocate slab class layout\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        slab_layout->ids[slab_layout->count++] = i;
+    }
+
     /* for the test suite:  faking of how much we've already malloc'd */
     {
         char *t_initial_malloc = getenv("T_MEMD_INITIAL_MALLOC");
@@ -289,10 +561,15 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
     }
 
     if (do_slab_prealloc) {
+        if (!mem_external) {
+            slabs_populate(mem_base, mem_limit);
+        }
         if (!reuse_mem) {
             slabs_preallocate(power_largest);
         }
     }
+
+    slabs_magazine_init();
 }
 
 void slabs_prefill_global(void) {
@@ -363,6 +640,8 @@ static void *get_page_from_global_pool(void) {
     }
     char *ret = p->slab_list[p->slabs - 1];
     p->slabs--;
+    if (p->slabs < pool_low_water)
+        pool_low_water = p->slabs;
     return ret;
 }
 
@@ -374,6 +653,11 @@ static int do_slabs_newslab(const unsigned int id) {
         : p->size * p->perslab;
     char *ptr;
 
+    /* Retired classes only shrink; an item sized into one just before the
+     * layout changed makes do with its free chunks or evicts. */
+    if (p->retired)
+        return 0;
+
     if ((mem_limit && mem_malloced + len > mem_limit && p->slabs > 0
          && g->slabs == 0)) {
         mem_limit_reached = true;
@@ -426,8 +710,8 @@ static void *do_slabs_alloc(const size_t size, unsigned int id,
     if (p->sl_curr != 0) {
         /* return off our freelist */
         it = (item *)p->slots;
-        p->slots = it->next;
-        if (it->next) it->next->prev = 0;
+        p->slots = ITEM_next(it);
+        if (it->next) ITEM_next(it)->prev = 0;
         /* Kill flag and initialize refcount here for lock safety in slab
          * mover's freeness detection. */
         it->it_flags &= ~ITEM_SLABBED;
@@ -470,8 +754,8 @@ static void do_slabs_free_chunked(item *it, const size_t size) {
     // return the header object.
     // TODO: This is in three places, here and in do_slabs_free().
     it->prev = 0;
-    it->next = p->slots;
-    if (it->next) it->next->prev = it;
+    ITEM_set_next(it, p->slots);
+    if (it->next) ITEM_set_prev(ITEM_next(it), it);
     p->slots = it;
     p->sl_curr++;
 
@@ -482,10 +766,12 @@ static void do_slabs_free_chunked(item *it, const size_t size) {
         p = &slabclass[chunk->slabs_clsid];
         next_chunk = chunk->next;
 
-        chunk->prev = 0;
-        chunk->next = p->slots;
-        if (chunk->next) chunk->next->prev = chunk;
-        p->slots = chunk;
+        /* Free chunks are linked like any other free item */
+        item *fit = (item *)chunk;
+        fit->prev = 0;
+        ITEM_set_next(fit, p->slots);
+        if (fit->next) ITEM_set_prev(ITEM_next(fit), fit);
+        p->slots = fit;
         p->sl_curr++;
 
         chunk = next_chunk;
@@ -511,8 +797,8 @@ static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
         it->it_flags = ITEM_SLABBED;
         it->slabs_clsid = id;
         it->prev = 0;
-        it->next = p->slots;
-        if (it->next) it->next->prev = it;
+        ITEM_set_next(it, p->slots);
+        if (it->next) ITEM_set_prev(ITEM_next(it), it);
         p->slots = it;
 
         p->sl_curr++;
@@ -527,7 +813,7 @@ static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
  */
 void fill_slab_stats_automove(slab_stats_automove *am) {
     int n;
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
     for (n = 0; n < MAX_NUMBER_OF_SLAB_CLASSES; n++) {
         slabclass_t *p = &slabclass[n];
         slab_stats_automove *cur = &am[n];
@@ -544,7 +830,14 @@ void fill_slab_stats_automove(slab_stats_automove *am) {
  */
 unsigned int global_page_pool_size(bool *mem_flag) {
     unsigned int ret = 0;
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    if (settings.log_memory) {
+        ret = do_logmem_spare();
+        if (mem_flag != NULL)
+            *mem_flag = ret == 0;
+        pthread_mutex_unlock(&slabs_lock);
+        return ret;
+    }
     if (mem_flag != NULL)
         *mem_flag = mem_malloced >= mem_limit ? true : false;
     ret = slabclass[SLAB_GLOBAL_PAGE_POOL].slabs;
@@ -553,7 +846,8 @@ unsigned int global_page_pool_size(bool *mem_flag) {
 }
 
 /*@null@*/
-static void do_slabs_stats(ADD_STAT add_stats, void *c) {
+static void do_slabs_stats(ADD_STAT add_stats, void *c,
+        struct slab_magazine_stats *ms) {
     int i, total;
     /* Get the per-thread stats which contain some interesting aggregates */
     struct thread_stats thread_stats;
@@ -596,6 +890,9 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
                     (unsigned long long)thread_stats.slab_stats[i].cas_badval);
             APPEND_NUM_STAT(i, "touch_hits", "%llu",
                     (unsigned long long)thread_stats.slab_stats[i].touch_hits);
+            if (settings.slab_magazines) {
+                APPEND_NUM_STAT(i, "magazine_chunks", "%u", ms->chunks[i]);
+            }
             total++;
         }
     }
@@ -604,12 +901,28 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
 
     APPEND_STAT("active_slabs", "%d", total);
     APPEND_STAT("total_malloced", "%llu", (unsigned long long)mem_malloced);
+    APPEND_STAT("pages_released", "%llu", (unsigned long long)pages_released);
+    if (settings.slab_idle_trim) {
+        APPEND_STAT("pages_trimmed", "%llu", (unsigned long long)pages_trimmed);
+    }
+    if (settings.slab_magazines) {
+        APPEND_STAT("magazine_hits", "%llu", (unsigned long long)ms->hits);
+        APPEND_STAT("magazine_refills", "%llu", (unsigned long long)ms->refills);
+        APPEND_STAT("magazine_drains", "%llu", (unsigned long long)ms->drains);
+        APPEND_STAT("magazine_flushes", "%llu", (unsigned long long)ms->flushes);
+    }
     add_stats(NULL, 0, NULL, 0, c);
 }
 
 static void *memory_allocate(size_t size) {
     void *ret;
 
+    if (released_count > 0 && size == settings.slab_page_size) {
+        /* Zero filled by the OS on first touch */
+        mem_malloced += size;
+        return released_list[--released_count];
+    }
+
     if (mem_base == NULL) {
         /* We are not using a preallocated large memory chunk */
         ret = malloc(size);
@@ -637,58 +950,328 @@ static void *memory_allocate(size_t size) {
     return ret;
 }
 
+/* Drops the memory behind a free page. Partial OS pages at either end are
+ * kept, as they may be shared with a neighbour or hold malloc's headers. */
+static void memory_dontneed(void *ptr, const size_t len) {
+#ifdef MADV_DONTNEED
+    uintptr_t start = (uintptr_t)ptr;
+    uintptr_t end = start + len;
+    /* free() keeps its list pointers at the front of the chunk */
+    if (mem_base == NULL)
+        start += 64;
+    start = (start + os_page_size - 1) & ~(uintptr_t)(os_page_size - 1);
+    end &= ~(uintptr_t)(os_page_size - 1);
+    if (end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+#endif
+}
+
+/* Hands a free page back to the OS. Returns false if it has to be kept. */
+static bool memory_release_page(void *p) {
+    if (mem_base == NULL) {
+        /* Large frees don't always reach the OS by themselves */
+        memory_dontneed(p, settings.slab_page_size);
+        free(p);
+    } else if (released_list != NULL) {
+        memory_dontneed(p, settings.slab_page_size);
+        released_list[released_count++] = p;
+    } else {
+        return false;
+    }
+    mem_malloced -= settings.slab_page_size;
+    pages_released++;
+    return true;
+}
+
 /* Must only be used if all pages are item_size_max */
 static void memory_release(void) {
-    void *p = NULL;
-    if (mem_base != NULL)
+    slabclass_t *g = &slabclass[SLAB_GLOBAL_PAGE_POOL];
+    if (mem_external)
         return;
 
     if (!settings.slab_reassign)
         return;
 
-    while (mem_malloced > mem_limit &&
-            (p = get_page_from_global_pool()) != NULL) {
-        free(p);
-        mem_malloced -= settings.slab_page_size;
+    while (mem_malloced > mem_limit && g->slabs > 0) {
+        if (!memory_release_page(g->slab_list[g->slabs - 1]))
+            break;
+        g->slabs--;
     }
+    if (g->slabs < pool_low_water)
+        pool_low_water = g->slabs;
+}
+
+/* Per worker thread magazines of free chunks.
+ *
+ * Each worker keeps a small stack of free chunks per slab class. Allocations
+ * and frees are served from it, and only when it runs empty or full is half
+ * a magazine moved to or from the class freelist in one trip under
+ * slabs_lock. A magazine's own mutex is only ever contended by the slab
+ * mover, which empties every magazine before it starts walking a page and
+ * keeps them out of use until the page is moved.
+ *
+ * Chunks sitting in a magazine look free to anything inspecting them:
+ * ITEM_SLABBED is set and slabs_clsid is their class. They aren't on the
+ * class freelist, so they don't show up in free_chunks.
+ */
+#define SLAB_MAGAZINE_BYTES (64 * 1024)
+/* Classes whose magazine would hold fewer chunks than this skip them */
+#define SLAB_MAGAZINE_MIN 4
+
+struct slab_magazine {
+    pthread_mutex_t lock;
+    struct slab_magazine *next;
+    unsigned int count[MAX_NUMBER_OF_SLAB_CLASSES];
+    void **chunks[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t hits;
+    uint64_t refills;
+    uint64_t drains;
+};
+
+static unsigned int magazine_size[MAX_NUMBER_OF_SLAB_CLASSES];
+static struct slab_magazine *magazines = NULL;
+static pthread_mutex_t magazines_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t magazine_key;
+/* Set by the slab mover while it has magazines emptied */
+static volatile bool magazines_paused = false;
+static uint64_t magazine_flushes = 0;
+
+/* Also used when classes are added by slabs_reprofile(). */
+static void slabs_magazine_size(unsigned int id) {
+    unsigned int size = SLAB_MAGAZINE_BYTES / slabclass[id].size;
+    if (size > settings.slab_magazines)
+        size = settings.slab_magazines;
+    magazine_size[id] = size >= SLAB_MAGAZINE_MIN ? size : 0;
+}
+
+static void slabs_magazine_init(void) {
+    int i;
+
+    memset(magazine_size, 0, sizeof(magazine_size));
+    if (settings.slab_magazines == 0)
+        return;
+
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        slabs_magazine_size(i);
+    }
+    pthread_key_create(&magazine_key, NULL);
+}
+
+/* Called by each worker thread during setup. */
+void slabs_magazine_create(void) {
+    struct slab_magazine *m;
+    void **chunks;
+    int i;
+
+    if (settings.slab_magazines == 0)
+        return;
+
+    /* Room for every class id at full size, as re-profiling can add
+     * classes after workers have started. */
+    m = calloc(1, sizeof(struct slab_magazine));
+    chunks = calloc(MAX_NUMBER_OF_SLAB_CLASSES * settings.slab_magazines,
+            sizeof(void *));
+    if (m == NULL || chunks == NULL) {
+        free(m);
+        free(chunks);
+        return;
+    }
+    pthread_mutex_init(&m->lock, NULL);
+    for (i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        m->chunks[i] = chunks + i * settings.slab_magazines;
+    }
+
+    pthread_mutex_lock(&magazines_lock);
+    m->next = magazines;
+    magazines = m;
+    pthread_mutex_unlock(&magazines_lock);
+    pthread_setspecific(magazine_key, m);
+}
+
+/* Returns the calling thread's magazine if class id can use it. */
+static inline struct slab_magazine *slabs_magazine(unsigned int id) {
+    if (settings.slab_magazines == 0 || id < POWER_SMALLEST
+            || id > power_largest || magazine_size[id] == 0)
+        return NULL;
+    return pthread_getspecific(magazine_key);
+}
+
+/* Moves chunks from the bottom of a magazine back to the class freelist.
+ * Requires m->lock and slabs_lock. */
+static void do_slabs_magazine_drain(struct slab_magazine *m, unsigned int id,
+        unsigned int count) {
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        do_slabs_free(m->chunks[id][i], 0, id);
+    }
+    m->count[id] -= count;
+    memmove(m->chunks[id], m->chunks[id] + count,
+            m->count[id] * sizeof(void *));
+}
+
+/* Requires m->lock. */
+static void slabs_magazine_refill(struct slab_magazine *m, unsigned int id,
+        unsigned int flags) {
+    item *it;
+
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    while (m->count[id] < magazine_size[id] / 2) {
+        it = do_slabs_alloc(slabclass[id].size, id, flags);
+        if (it == NULL)
+            break;
+        it->it_flags = ITEM_SLABBED;
+        it->refcount = 0;
+        m->chunks[id][m->count[id]++] = it;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    m->refills++;
+}
+
+/* Empties every magazine and keeps them unused until
+ * slabs_magazines_resume(). Must be called without slabs_lock. */
+static void slabs_magazines_flush(void) {
+    struct slab_magazine *m;
+    int i;
+
+    magazines_paused = true;
+    pthread_mutex_lock(&magazines_lock);
+    for (m = magazines; m != NULL; m = m->next) {
+        pthread_mutex_lock(&m->lock);
+        mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+        for (i = POWER_SMALLEST; i <= power_largest; i++) {
+            if (m->count[i] != 0)
+                do_slabs_magazine_drain(m, i, m->count[i]);
+        }
+        pthread_mutex_unlock(&slabs_lock);
+        pthread_mutex_unlock(&m->lock);
+    }
+    magazine_flushes++;
+    pthread_mutex_unlock(&magazines_lock);
+}
+
+static void slabs_magazines_resume(void) {
+    magazines_paused = false;
 }
 
 void *slabs_alloc(size_t size, unsigned int id,
         unsigned int flags) {
     void *ret;
+    struct slab_magazine *m;
+
+    if (settings.log_memory)
+        return logmem_alloc(size, flags);
+
+    m = slabs_magazine(id);
+    if (m != NULL) {
+        pthread_mutex_lock(&m->lock);
+        if (!magazines_paused) {
+            if (m->count[id] == 0)
+                slabs_magazine_refill(m, id, flags);
+            if (m->count[id] != 0) {
+                item *it = m->chunks[id][--m->count[id]];
+                /* Same as do_slabs_alloc(). The mover can't be looking at
+                 * this chunk as it would have emptied the magazine. */
+                it->it_flags &= ~ITEM_SLABBED;
+                it->refcount = 1;
+                m->hits++;
+                ret = it;
+            } else {
+                ret = NULL;
+            }
+            pthread_mutex_unlock(&m->lock);
+            return ret;
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
 
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
     ret = do_slabs_alloc(size, id, flags);
     pthread_mutex_unlock(&slabs_lock);
     return ret;
 }
 
 void slabs_free(void *ptr, size_t size, unsigned int id) {
-    pthread_mutex_lock(&slabs_lock);
+    item *it = (item *)ptr;
+    struct slab_magazine *m;
+
+    if (settings.log_memory) {
+        logmem_free(ptr);
+        return;
+    }
+
+    if ((it->it_flags & ITEM_CHUNKED) == 0 && (m = slabs_magazine(id)) != NULL) {
+        pthread_mutex_lock(&m->lock);
+        if (!magazines_paused) {
+            if (m->count[id] == magazine_size[id]) {
+                mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+                do_slabs_magazine_drain(m, id, magazine_size[id] / 2);
+                pthread_mutex_unlock(&slabs_lock);
+                m->drains++;
+            }
+            it->it_flags = ITEM_SLABBED;
+            it->slabs_clsid = id;
+            m->chunks[id][m->count[id]++] = it;
+            pthread_mutex_unlock(&m->lock);
+            return;
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
     do_slabs_free(ptr, size, id);
     pthread_mutex_unlock(&slabs_lock);
 }
 
+/* Must be called without slabs_lock, as magazine locks come first. */
+static void slabs_magazine_gather(struct slab_magazine_stats *ms) {
+    struct slab_magazine *m;
+    int i;
+
+    memset(ms, 0, sizeof(*ms));
+    pthread_mutex_lock(&magazines_lock);
+    for (m = magazines; m != NULL; m = m->next) {
+        pthread_mutex_lock(&m->lock);
+        for (i = POWER_SMALLEST; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+            ms->chunks[i] += m->count[i];
+        }
+        ms->hits += m->hits;
+        ms->refills += m->refills;
+        ms->drains += m->drains;
+        pthread_mutex_unlock(&m->lock);
+    }
+    ms->flushes = magazine_flushes;
+    pthread_mutex_unlock(&magazines_lock);
+}
+
 void slabs_stats(ADD_STAT add_stats, void *c) {
-    pthread_mutex_lock(&slabs_lock);
-    do_slabs_stats(add_stats, c);
+    struct slab_magazine_stats ms;
+
+    slabs_magazine_gather(&ms);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    do_slabs_stats(add_stats, c, &ms);
     pthread_mutex_unlock(&slabs_lock);
 }
 
 static bool do_slabs_adjust_mem_limit(size_t new_mem_limit) {
-    /* Cannot adjust memory limit at runtime if prealloc'ed */
-    if (mem_base != NULL)
+    /* A preallocated chunk can shrink, and grow back to its original size */
+    if (mem_external || (mem_base != NULL && new_mem_limit > mem_base_size))
         return false;
     settings.maxbytes = new_mem_limit;
     mem_limit = new_mem_limit;
     mem_limit_reached = false; /* Will reset on next alloc */
     memory_release(); /* free what might already be in the global pool */
+    /* The LRU maintainer moves pages out of classes for the rest */
+    mem_shrinking = mem_malloced > mem_limit;
     return true;
 }
 
 bool slabs_adjust_mem_limit(size_t new_mem_limit) {
     bool ret;
-    pthread_mutex_lock(&slabs_lock);
+    /* Segments are handed out up to the limit given at startup */
+    if (settings.log_memory)
+        return false;
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
     ret = do_slabs_adjust_mem_limit(new_mem_limit);
     pthread_mutex_unlock(&slabs_lock);
     return ret;
@@ -699,7 +1282,17 @@ unsigned int slabs_available_chunks(const unsigned int id, bool *mem_flag,
     unsigned int ret;
     slabclass_t *p;
 
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    if (settings.log_memory) {
+        /* Whole segments are the closest thing to free chunks */
+        ret = do_logmem_spare();
+        if (mem_flag != NULL)
+            *mem_flag = ret == 0;
+        if (chunks_perslab != NULL)
+            *chunks_perslab = 1;
+        pthread_mutex_unlock(&slabs_lock);
+        return ret;
+    }
     p = &slabclass[id];
     ret = p->sl_curr;
     if (mem_flag != NULL)
@@ -717,7 +1310,7 @@ unsigned int slabs_available_chunks(const unsigned int id, bool *mem_flag,
  * into callbacks when an interface becomes more obvious.
  */
 void slabs_mlock(void) {
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
 }
 
 void slabs_munlock(void) {
@@ -729,9 +1322,15 @@ static volatile int do_run_slab_rebalance_thread = 1;
 
 static int slab_rebalance_start(void) {
     slabclass_t *s_cls;
+    unsigned int page;
     int no_go = 0;
 
-    pthread_mutex_lock(&slabs_lock);
+    /* Chunks held in magazines must be back on the freelist before the
+     * page is walked, and stay there until it's done. */
+    if (slab_rebal.s_clsid > SLAB_GLOBAL_PAGE_POOL)
+        slabs_magazines_flush();
+
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
 
     if (slab_rebal.s_clsid < SLAB_GLOBAL_PAGE_POOL ||
         slab_rebal.s_clsid > power_largest  ||
@@ -746,18 +1345,30 @@ static int slab_rebalance_start(void) {
         no_go = -1;
     }
 
-    if (s_cls->slabs < 2)
+    /* A retired class gives up every page, not just its spares */
+    if (s_cls->slabs < (s_cls->retired ? 1 : 2))
         no_go = -3;
 
+    /* Compaction picks its own page, which may have gone meanwhile */
+    page = 0;
+    if (no_go == 0 && slab_rebal.compact_page != NULL) {
+        while (page < s_cls->slabs && s_cls->slab_list[page] != slab_rebal.compact_page)
+            page++;
+        if (page == s_cls->slabs)
+            no_go = -4;
+    }
+
     if (no_go != 0) {
+        slab_rebal.compact_page = NULL;
         pthread_mutex_unlock(&slabs_lock);
+        slabs_magazines_resume();
         return no_go; /* Should use a wrapper function... */
     }
 
-    /* Always kill the first available slab page as it is most likely to
-     * contain the oldest items
+    /* Otherwise always kill the first available slab page as it is most
+     * likely to contain the oldest items
      */
-    slab_rebal.slab_start = s_cls->slab_list[0];
+    slab_rebal.slab_start = s_cls->slab_list[page];
     slab_rebal.slab_end   = (char *)slab_rebal.slab_start +
         (s_cls->size * s_cls->perslab);
     slab_rebal.slab_pos   = slab_rebal.slab_start;
@@ -823,10 +1434,10 @@ static void slab_rebalance_cut_free(slabclass_t *s_cls, item *it) {
     /* Ensure this was on the freelist and nothing else. */
     assert(it->it_flags == ITEM_SLABBED);
     if (s_cls->slots == it) {
-        s_cls->slots = it->next;
+        s_cls->slots = ITEM_next(it);
     }
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
+    if (it->next) ITEM_next(it)->prev = it->prev;
+    if (it->prev) ITEM_prev(it)->next = it->next;
     s_cls->sl_curr--;
 }
 
@@ -859,6 +1470,7 @@ static int slab_rebalance_move(void) {
     int refcount = 0;
     uint32_t hv;
     void *hold_lock;
+    unsigned int new_id = 0;
     enum move_status status = MOVE_PASS;
 
     s_cls = &slabclass[slab_rebal.s_clsid];
@@ -867,7 +1479,7 @@ static int slab_rebalance_move(void) {
 
     // skip acquiring the slabs lock for items we've already fully processed.
     if (slab_rebal.completed[offset] == 0) {
-        pthread_mutex_lock(&slabs_lock);
+        mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
         hv = 0;
         hold_lock = NULL;
         item *it = slab_rebal.slab_pos;
@@ -927,7 +1539,7 @@ static int slab_rebalance_move(void) {
                             STORAGE_delete(storage, it);
                             pthread_mutex_unlock(&slabs_lock);
                             do_item_unlink(it, hv);
-                            pthread_mutex_lock(&slabs_lock);
+                            mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
                         }
                         status = MOVE_BUSY;
                     } else {
@@ -978,6 +1590,17 @@ static int slab_rebalance_move(void) {
                     || item_is_flushed(it)) {
                     /* Expired, don't save. */
                     save_item = 0;
+                } else if (s_cls->retired) {
+                    /* Draining a re-profiled class: items move into the class
+                     * they'd be sized into now. Parts of chunked items are
+                     * evicted instead, as their chunk links record classes. */
+                    if (ch == NULL && (it->it_flags & ITEM_CHUNKED) == 0) {
+                        new_id = slabs_clsid(ntotal);
+                        new_it = do_slabs_alloc(ntotal, new_id, 0);
+                    }
+                    save_item = new_it != NULL;
+                    if (!save_item)
+                        slab_rebal.evictions_nomem++;
                 } else if (ch == NULL &&
                         (new_it = slab_rebalance_alloc(ntotal, slab_rebal.s_clsid)) == NULL) {
                     /* Not a chunk of an item, and nomem. */
@@ -1004,6 +1627,8 @@ static int slab_rebalance_move(void) {
                         /* These are definitely required. else fails assert */
                         new_it->it_flags &= ~ITEM_LINKED;
                         new_it->refcount = 0;
+                        if (new_id != 0)
+                            new_it->slabs_clsid = ITEM_lruid(it) | new_id;
                         do_item_replace(it, new_it, hv);
                         /* Need to walk the chunks and repoint head  */
                         if (new_it->it_flags & ITEM_CHUNKED) {
@@ -1059,7 +1684,7 @@ static int slab_rebalance_move(void) {
 
                 }
                 item_trylock_unlock(hold_lock);
-                pthread_mutex_lock(&slabs_lock);
+                mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
                 /* Always remove the ntotal, as we added it in during
                  * do_slabs_alloc() when copying the item.
                  */
@@ -1115,8 +1740,9 @@ static void slab_rebalance_finish(void) {
     uint32_t inline_reclaim;
     uint32_t chunk_rescues;
     uint32_t busy_deletes;
+    bool compacted;
 
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
 
     s_cls = &slabclass[slab_rebal.s_clsid];
     d_cls = &slabclass[slab_rebal.d_clsid];
@@ -1136,11 +1762,13 @@ static void slab_rebalance_finish(void) {
 #endif
 
     /* At this point the stolen slab is completely clear.
-     * We always kill the "first"/"oldest" slab page in the slab_list, so
-     * shuffle the page list backwards and decrement.
+     * It's usually the "first"/"oldest" slab page in the slab_list, so
+     * shuffle the page list backwards from it and decrement.
      */
+    for (x = 0; s_cls->slab_list[x] != slab_rebal.slab_start; x++)
+        ;
     s_cls->slabs--;
-    for (x = 0; x < s_cls->slabs; x++) {
+    for (; x < s_cls->slabs; x++) {
         s_cls->slab_list[x] = s_cls->slab_list[x+1];
     }
 
@@ -1165,6 +1793,8 @@ static void slab_rebalance_finish(void) {
     slab_rebal.slab_start = NULL;
     slab_rebal.slab_end   = NULL;
     slab_rebal.slab_pos   = NULL;
+    compacted = slab_rebal.compact_page != NULL;
+    slab_rebal.compact_page = NULL;
     evictions_nomem    = slab_rebal.evictions_nomem;
     inline_reclaim = slab_rebal.inline_reclaim;
     rescues   = slab_rebal.rescues;
@@ -1180,9 +1810,12 @@ static void slab_rebalance_finish(void) {
 
     free(slab_rebal.completed);
     pthread_mutex_unlock(&slabs_lock);
+    slabs_magazines_resume();
 
     STATS_LOCK();
     stats.slabs_moved++;
+    if (compacted)
+        stats.slabs_compacted++;
     stats.slab_reassign_rescues += rescues;
     stats.slab_reassign_evictions_nomem += evictions_nomem;
     stats.slab_reassign_inline_reclaim += inline_reclaim;
@@ -1276,10 +1909,11 @@ static enum reassign_result_type do_slabs_reassign(int src, int dst) {
     }
 
     if (src < SLAB_GLOBAL_PAGE_POOL || src > power_largest ||
-        dst < SLAB_GLOBAL_PAGE_POOL || dst > power_largest)
+        dst < SLAB_GLOBAL_PAGE_POOL || dst > power_largest ||
+        slabclass[dst].retired)
         return REASSIGN_BADCLASS;
 
-    pthread_mutex_lock(&slabs_lock);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
     if (slabclass[src].slabs < 2)
         nospare = true;
     pthread_mutex_unlock(&slabs_lock);
@@ -1305,6 +1939,595 @@ enum reassign_result_type slabs_reassign(int src, int dst) {
     return ret;
 }
 
+/* Online compaction.
+ *
+ * Once traffic moves on, a class can be left holding many pages which are
+ * mostly free chunks. Compaction hands the emptiest page of the sparsest
+ * such class to the slab mover with the global page pool as the
+ * destination. The mover rescues the page's live items into free chunks on
+ * the class's other pages, packing them together, and the emptied page can
+ * then be reused by any class.
+ *
+ * A class qualifies once fewer than slab_compact_ratio of its chunks are in
+ * use and it has at least a page worth of free chunks, so every live item
+ * on the page has somewhere to go. Only a few pages are scanned per call
+ * and slabs_lock is dropped between slices of a page. The LRU maintainer
+ * calls this at most once a second, and the mover does its usual amount of
+ * work per lock hold, so workers see no more than a normal page move.
+ */
+#define SLAB_COMPACT_SCAN_PAGES 16
+#define SLAB_COMPACT_SCAN_CHUNKS 1024
+
+/* Number of free chunks on a page. The count is only a hint: chunks can be
+ * allocated and freed while it runs. */
+static unsigned int slabs_compact_page_free(unsigned int id, char *page) {
+    slabclass_t *p = &slabclass[id];
+    unsigned int x, free_chunks = 0;
+
+    for (x = 0; x < p->perslab; x++) {
+        if (x % SLAB_COMPACT_SCAN_CHUNKS == 0) {
+            if (x != 0)
+                pthread_mutex_unlock(&slabs_lock);
+            mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+        }
+        if (((item *)(page + (size_t)x * p->size))->it_flags & ITEM_SLABBED)
+            free_chunks++;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    return free_chunks;
+}
+
+/* Meets a lowered memory limit by moving a page at a time to the global pool,
+ * where memory_release() hands it back to the OS. A class with a page worth
+ * of free chunks goes first, since its items can be rescued; otherwise the
+ * class with the most pages is evicted from. Returns the class moved from, 0
+ * if the mover is busy, or -1 once there's nothing left to do. */
+int slabs_shrink(void) {
+    int i, id = -1;
+    unsigned int most_free = 0, most_pages = 1;
+    int emptiest = 0, biggest = 0;
+
+    if (!mem_shrinking)
+        return -1;
+    if (slab_rebalance_signal != 0)
+        return 0;
+    if (pthread_mutex_trylock(&slabs_rebalance_lock) != 0)
+        return 0;
+    if (slab_rebalance_signal != 0) {
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+        return 0;
+    }
+
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    memory_release();
+    if (mem_malloced > mem_limit) {
+        for (i = POWER_SMALLEST; i <= power_largest; i++) {
+            slabclass_t *p = &slabclass[i];
+            if (p->slabs < 2)
+                continue;
+            if (p->sl_curr >= p->perslab && p->sl_curr / p->perslab > most_free) {
+                most_free = p->sl_curr / p->perslab;
+                emptiest = i;
+            }
+            if (p->slabs > most_pages) {
+                most_pages = p->slabs;
+                biggest = i;
+            }
+        }
+        id = emptiest ? emptiest : biggest;
+    }
+    if (id <= 0) {
+        /* Under the limit, or every class is down to its last page */
+        id = -1;
+        mem_shrinking = false;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+
+    if (id > 0) {
+        slab_rebal.s_clsid = id;
+        slab_rebal.d_clsid = SLAB_GLOBAL_PAGE_POOL;
+        slab_rebalance_signal = 1;
+        pthread_cond_signal(&slab_rebalance_cond);
+    }
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+    return id;
+}
+
+/* Hands back global pool pages that weren't needed for a whole slab_idle_trim
+ * period. Classes only give up pages to the pool when the automover finds
+ * them unused, so this follows the working set down. Returns how many pages
+ * were released. */
+unsigned int slabs_trim_idle(void) {
+    static rel_time_t last_trim = 0;
+    slabclass_t *g = &slabclass[SLAB_GLOBAL_PAGE_POOL];
+    unsigned int released = 0;
+
+    if (current_time - last_trim < (rel_time_t)settings.slab_idle_trim)
+        return 0;
+
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    if (!mem_external) {
+        while (released < pool_low_water && g->slabs > 0
+                && memory_release_page(g->slab_list[g->slabs - 1])) {
+            g->slabs--;
+            released++;
+        }
+        pages_trimmed += released;
+    }
+    pool_low_water = g->slabs;
+    pthread_mutex_unlock(&slabs_lock);
+    last_trim = current_time;
+    return released;
+}
+
+/* Starts a page move if a class is fragmented past slab_compact_ratio.
+ * Returns the class compacted, or -1. */
+int slabs_compact(void) {
+    static unsigned int cursor = 0;
+    int i, id = -1;
+    double ratio, best = settings.slab_compact_ratio;
+    unsigned int pages, x, free_chunks, best_free = 0;
+    void *page, *best_page = NULL;
+
+    /* Holding this keeps the mover idle, so no page can leave a class
+     * while we're looking at it. */
+    if (pthread_mutex_trylock(&slabs_rebalance_lock) != 0)
+        return -1;
+    if (slab_rebalance_signal != 0) {
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+        return -1;
+    }
+
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        slabclass_t *p = &slabclass[i];
+        if (p->slabs < 2 || p->sl_curr < p->perslab)
+            continue;
+        ratio = 1.0 - (double)p->sl_curr / ((double)p->slabs * p->perslab);
+        if (ratio < best) {
+            best = ratio;
+            id = i;
+        }
+    }
+    pages = id != -1 ? slabclass[id].slabs : 0;
+    pthread_mutex_unlock(&slabs_lock);
+    if (id == -1) {
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+        return -1;
+    }
+
+    /* New pages may be appended meanwhile, but none can go away */
+    for (x = 0; x < pages && x < SLAB_COMPACT_SCAN_PAGES; x++) {
+        mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+        page = slabclass[id].slab_list[(cursor + x) % pages];
+        pthread_mutex_unlock(&slabs_lock);
+        free_chunks = slabs_compact_page_free(id, page);
+        if (free_chunks > best_free) {
+            best_free = free_chunks;
+            best_page = page;
+        }
+    }
+    cursor += x;
+
+    /* Not worth it unless the page is as sparse as the class */
+    if (best_page == NULL || best_free <
+            (1.0 - settings.slab_compact_ratio) * slabclass[id].perslab) {
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+        return -1;
+    }
+
+    slab_rebal.s_clsid = id;
+    slab_rebal.d_clsid = SLAB_GLOBAL_PAGE_POOL;
+    slab_rebal.compact_page = best_page;
+    slab_rebalance_signal = 1;
+    pthread_cond_signal(&slab_rebalance_cond);
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+    return id;
+}
+
+/* Slab class re-profiling.
+ *
+ * With "stats sizes" tracking on, the size histogram can be used to pick
+ * class sizes which waste less memory on the sizes actually stored. The
+ * new classes get unused class ids and become the layout new items are
+ * sized into. The old classes are retired: nothing new lands in them, and
+ * the slab mover empties them a page at a time into the global pool,
+ * copying live items into their new classes.
+ *
+ * Histogram buckets are 32 bytes wide, so classes are picked from bucket
+ * upper bounds, and an item is assumed to sit in the middle of its bucket
+ * when estimating waste. Consecutive classes are kept within a factor of
+ * two of each other, so sizes the histogram hasn't seen waste at most half
+ * their chunk.
+ */
+#define SLAB_PROFILE_POINTS 1024
+
+struct slab_profile {
+    unsigned int count; /* classes proposed, not counting the chunk class */
+    unsigned int sizes[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t items;
+    uint64_t item_bytes; /* estimated from the histogram */
+    uint64_t waste;      /* with the current layout */
+    uint64_t projected;  /* with the proposed one */
+};
+
+static struct {
+    uint64_t reprofiles;
+    double waste_ratio;           /* measured when last re-profiled */
+    double projected_waste_ratio; /* expected once drained */
+} reprofile_stats;
+
+/* Class ids not in the layout and holding no pages. Requires slabs_lock. */
+static unsigned int slabs_free_ids(unsigned char *ids) {
+    struct slab_layout *l = slab_layout;
+    bool used[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int i, count = 0;
+
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < l->count; i++) {
+        used[l->ids[i]] = true;
+    }
+    for (i = POWER_SMALLEST; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        if (!used[i] && slabclass[i].slabs == 0) {
+            if (ids != NULL)
+                ids[count] = i;
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Finds the layout of at most max_classes sizes, plus the chunk class,
+ * wasting the least on the histogram. Returns false if none fits. */
+static bool slabs_profile(const unsigned int *hist, const int buckets,
+        const unsigned int max_classes, struct slab_profile *pr) {
+    const uint64_t chunk_max = settings.slab_chunk_size_max;
+    unsigned int *pts = NULL, *from = NULL;
+    uint64_t *n = NULL, *w = NULL, *f = NULL;
+    unsigned int npts = 0, observed = 0, stride, ladder, k, j, a;
+    uint64_t best = UINT64_MAX, size, mid;
+    unsigned int best_k = 0, best_j = 0;
+    int i, top;
+    bool ret = false;
+
+    memset(pr, 0, sizeof(*pr));
+    /* Buckets above this hold chunked items */
+    top = (chunk_max + 31) / 32;
+    if (top > buckets - 1)
+        top = buckets - 1;
+
+    pts = calloc(top + 1, sizeof(unsigned int));
+    n = calloc(top + 2, sizeof(uint64_t));
+    w = calloc(top + 2, sizeof(uint64_t));
+    if (pts == NULL || n == NULL || w == NULL)
+        goto done;
+
+    for (i = 1; i <= top; i++) {
+        if (hist[i] == 0)
+            continue;
+        size = slabclass[slabs_clsid(i * 32 > chunk_max ? chunk_max : i * 32)].size;
+        mid = i * 32 - 16 > size ? size : i * 32 - 16;
+        pr->items += hist[i];
+        pr->item_bytes += hist[i] * mid;
+        pr->waste += hist[i] * (size - mid);
+        if ((uint64_t)i * 32 < chunk_max)
+            observed++;
+    }
+    if (pr->items == 0)
+        goto done;
+
+    /* Candidate sizes: observed buckets, thinned out if there are too
+     * many, and a doubling ladder from the smallest item size so there's
+     * always a way to get from one class to the next. */
+    stride = observed / SLAB_PROFILE_POINTS + 1;
+    ladder = (sizeof(item) + settings.chunk_size + 31) / 32;
+    observed = 0;
+    for (i = 1; (uint64_t)i * 32 < chunk_max; i++) {
+        bool keep = false;
+        if (hist[i] != 0 && observed++ % stride == 0)
+            keep = true;
+        if (i == ladder) {
+            keep = true;
+            ladder *= 2;
+        }
+        if (keep)
+            pts[++npts] = i;
+    }
+
+    /* Prefix sums of items and bytes up to each candidate, with the last
+     * slot holding everything up to the chunk class. */
+    j = 1;
+    for (i = 1; i <= top; i++) {
+        while (j <= npts && pts[j] < i)
+            j++;
+        mid = i * 32 - 16 > chunk_max ? chunk_max : i * 32 - 16;
+        n[j] += hist[i];
+        w[j] += hist[i] * mid;
+    }
+    for (j = 1; j <= npts + 1; j++) {
+        n[j] += n[j - 1];
+        w[j] += w[j - 1];
+    }
+
+    /* f[k][j]: least waste for everything up to candidate j, using k
+     * classes, the largest of which is candidate j. */
+    f = malloc(sizeof(uint64_t) * (max_classes + 1) * (npts + 1));
+    from = malloc(sizeof(unsigned int) * (max_classes + 1) * (npts + 1));
+    if (f == NULL || from == NULL)
+        goto done;
+#define F(k, j) f[(k) * (npts + 1) + (j)]
+#define FROM(k, j) from[(k) * (npts + 1) + (j)]
+    for (k = 0; k <= max_classes; k++) {
+        for (j = 0; j <= npts; j++) {
+            F(k, j) = UINT64_MAX;
+        }
+    }
+    for (k = 1; k <= max_classes; k++) {
+        for (j = 1; j <= npts; j++) {
+            size = (uint64_t)pts[j] * 32;
+            if (k == 1) {
+                if (size <= 2 * (sizeof(item) + settings.chunk_size))
+                    F(k, j) = size * n[j] - w[j];
+                FROM(k, j) = 0;
+                continue;
+            }
+            for (a = j - 1; a >= 1 && (uint64_t)pts[a] * 32 * 2 >= size; a--) {
+                uint64_t cost;
+                if (F(k - 1, a) == UINT64_MAX)
+                    continue;
+                cost = F(k - 1, a) + size * (n[j] - n[a]) - (w[j] - w[a]);
+                if (cost < F(k, j)) {
+                    F(k, j) = cost;
+                    FROM(k, j) = a;
+                }
+            }
+        }
+        for (j = 1; j <= npts; j++) {
+            uint64_t cost;
+            if (F(k, j) == UINT64_MAX || (uint64_t)pts[j] * 32 * 2 < chunk_max)
+                continue;
+            cost = F(k, j) + chunk_max * (n[npts + 1] - n[j])
+                - (w[npts + 1] - w[j]);
+            if (cost < best) {
+                best = cost;
+                best_k = k;
+                best_j = j;
+            }
+        }
+    }
+
+    if (best != UINT64_MAX) {
+        pr->projected = best;
+        pr->count = best_k;
+        for (k = best_k, j = best_j; k > 0; k--) {
+            pr->sizes[k - 1] = pts[j] * 32;
+            j = FROM(k, j);
+        }
+        ret = true;
+    }
+#undef F
+#undef FROM
+
+done:
+    free(pts);
+    free(n);
+    free(w);
+    free(f);
+    free(from);
+    return ret;
+}
+
+/* Fraction of the memory holding items which isn't item data. */
+static double slabs_waste_ratio(void) {
+    struct slab_magazine_stats ms;
+    uint64_t used = 0, bytes;
+    int i;
+
+    slabs_magazine_gather(&ms);
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        slabclass_t *p = &slabclass[i];
+        used += (uint64_t)(p->slabs * p->perslab - p->sl_curr - ms.chunks[i])
+            * p->size;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+
+    STATS_LOCK();
+    bytes = stats_state.curr_bytes;
+    STATS_UNLOCK();
+    if (used == 0 || bytes >= used)
+        return 0;
+    return 1.0 - (double)bytes / used;
+}
+
+static double slabs_profile_ratio(const uint64_t waste, const uint64_t bytes) {
+    return waste + bytes == 0 ? 0 : (double)waste / (waste + bytes);
+}
+
+enum reprofile_result_type slabs_reprofile(unsigned int max_classes) {
+    struct slab_profile pr;
+    struct slab_layout *l;
+    unsigned char ids[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int *hist;
+    unsigned int i, free_ids;
+    int buckets;
+    double waste_ratio;
+
+    if (settings.memory_file != NULL)
+        return REPROFILE_RESTARTABLE;
+    if ((hist = item_stats_sizes_copy(&buckets)) == NULL)
+        return REPROFILE_NOSIZES;
+
+    /* Only one migration at a time; the rebalance lock also keeps the
+     * mover from picking up a half made layout. */
+    if (pthread_mutex_trylock(&slabs_rebalance_lock) != 0) {
+        free(hist);
+        return REPROFILE_RUNNING;
+    }
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    for (i = POWER_SMALLEST; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        if (slabclass[i].retired && slabclass[i].slabs != 0)
+            break;
+    }
+    free_ids = slabs_free_ids(ids);
+    pthread_mutex_unlock(&slabs_lock);
+    if (i != MAX_NUMBER_OF_SLAB_CLASSES) {
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+        free(hist);
+        return REPROFILE_RUNNING;
+    }
+    if (max_classes == 0 || max_classes > free_ids)
+        max_classes = free_ids;
+
+    if (!slabs_profile(hist, buckets, max_classes, &pr)) {
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+        free(hist);
+        return pr.items == 0 ? REPROFILE_NOSIZES : REPROFILE_NOSPARE;
+    }
+    free(hist);
+    if (pr.projected >= pr.waste) {
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+        return REPROFILE_NOGAIN;
+    }
+    waste_ratio = slabs_waste_ratio();
+
+    l = calloc(1, sizeof(struct slab_layout));
+    if (l == NULL) {
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+        return REPROFILE_NOSPARE;
+    }
+
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    for (i = 0; i < slab_layout->count; i++) {
+        slabclass_t *p = &slabclass[slab_layout->ids[i]];
+        if (slab_layout->ids[i] == chunk_clsid)
+            continue;
+        p->retired = true;
+        if (p->slabs != 0)
+            retired_pages_left = true;
+    }
+    for (i = 0; i < pr.count; i++) {
+        slabclass_t *p = &slabclass[ids[i]];
+        p->size = pr.sizes[i];
+        p->perslab = settings.slab_page_size / p->size;
+        p->slots = NULL;
+        p->sl_curr = 0;
+        p->retired = false;
+        if (settings.slab_magazines)
+            slabs_magazine_size(ids[i]);
+        if (ids[i] > power_largest)
+            power_largest = ids[i];
+        l->ids[l->count++] = ids[i];
+        if (settings.verbose > 1) {
+            fprintf(stderr, "slab class %3d: chunk size %9u perslab %7u\n",
+                    ids[i], p->size, p->perslab);
+        }
+    }
+    l->ids[l->count++] = chunk_clsid;
+    /* Classes must be set up before anyone can size items into them */
+    __sync_synchronize();
+    slab_layout = l;
+    pthread_mutex_unlock(&slabs_lock);
+
+    reprofile_stats.reprofiles++;
+    reprofile_stats.waste_ratio = waste_ratio;
+    reprofile_stats.projected_waste_ratio =
+        slabs_profile_ratio(pr.projected, pr.item_bytes);
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+    return REPROFILE_OK;
+}
+
+/* Hands the mover a page from a retired class. Returns the class, 0 if
+ * the mover is busy, or -1 once there's nothing left to drain. */
+int slabs_drain_retired(void) {
+    int i, id = 0;
+
+    if (!retired_pages_left)
+        return -1;
+    if (slab_rebalance_signal != 0)
+        return 0;
+    if (pthread_mutex_trylock(&slabs_rebalance_lock) != 0)
+        return 0;
+    if (slab_rebalance_signal == 0) {
+        mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+        for (i = POWER_SMALLEST; i <= power_largest; i++) {
+            if (slabclass[i].retired && slabclass[i].slabs != 0) {
+                id = i;
+                break;
+            }
+        }
+        if (id == 0) {
+            retired_pages_left = false;
+            id = -1;
+        }
+        pthread_mutex_unlock(&slabs_lock);
+    }
+    if (id > 0) {
+        slab_rebal.s_clsid = id;
+        slab_rebal.d_clsid = SLAB_GLOBAL_PAGE_POOL;
+        slab_rebalance_signal = 1;
+        pthread_cond_signal(&slab_rebalance_cond);
+    }
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+    return id;
+}
+
+void slabs_profile_stats(ADD_STAT add_stats, void *c) {
+    struct slab_profile pr;
+    unsigned int *hist;
+    unsigned int i, retired = 0, retired_pages = 0, classes, free_ids;
+    int buckets;
+    double waste_ratio = slabs_waste_ratio();
+
+    mutex_lock_class(&slabs_lock, LOCK_CLASS_SLABS, NULL);
+    classes = slab_layout->count;
+    for (i = POWER_SMALLEST; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        if (slabclass[i].retired && slabclass[i].slabs != 0) {
+            retired++;
+            retired_pages += slabclass[i].slabs;
+        }
+    }
+    free_ids = slabs_free_ids(NULL);
+    pthread_mutex_unlock(&slabs_lock);
+
+    APPEND_STAT("classes", "%u", classes);
+    APPEND_STAT("retired_classes", "%u", retired);
+    APPEND_STAT("retired_pages", "%u", retired_pages);
+    APPEND_STAT("free_class_ids", "%u", free_ids);
+    APPEND_STAT("waste_ratio", "%.4f", waste_ratio);
+
+    if ((hist = item_stats_sizes_copy(&buckets)) != NULL) {
+        bool found = slabs_profile(hist, buckets, free_ids, &pr);
+        free(hist);
+        APPEND_STAT("sized_items", "%llu", (unsigned long long)pr.items);
+        APPEND_STAT("estimated_waste_ratio", "%.4f",
+                slabs_profile_ratio(pr.waste, pr.item_bytes));
+        if (found) {
+            APPEND_STAT("projected_waste_ratio", "%.4f",
+                    slabs_profile_ratio(pr.projected, pr.item_bytes));
+            for (i = 0; i < pr.count; i++) {
+                char key_str[STAT_KEY_LEN];
+                char val_str[STAT_VAL_LEN];
+                int klen = 0, vlen = 0;
+                APPEND_NUM_STAT(i, "projected_size", "%u", pr.sizes[i]);
+            }
+        }
+    }
+
+    APPEND_STAT("reprofiles", "%llu",
+            (unsigned long long)reprofile_stats.reprofiles);
+    if (reprofile_stats.reprofiles) {
+        APPEND_STAT("last_waste_ratio", "%.4f", reprofile_stats.waste_ratio);
+        APPEND_STAT("last_projected_waste_ratio", "%.4f",
+                reprofile_stats.projected_waste_ratio);
+        APPEND_STAT("projected_savings", "%.4f", reprofile_stats.waste_ratio
+                - reprofile_stats.projected_waste_ratio);
+        APPEND_STAT("actual_savings", "%.4f",
+                reprofile_stats.waste_ratio - waste_ratio);
+    }
+    add_stats(NULL, 0, NULL, 0, c);
+}
+
 /* If we hold this lock, rebalancer can't wake up or move */
 void slabs_rebalancer_pause(void) {
     pthread_mutex_lock(&slabs_rebalance_lock);
@@ -10,6 +10,15 @@
 */
 void slabs_init(const size_t limit, const double factor, const bool prealloc, const uint32_t *slab_sizes, void *mem_base_external, bool reuse_mem);
 
+#ifdef COMPACT_ITEMS
+/** ITEM_ARENA_HEAD bytes at the start of the item arena, which items can
+ * link to like any other item */
+void *slabs_arena_head(void);
+#endif
+
+/** Progress of faulting in memory preallocated with -L */
+void slabs_prealloc_stats(ADD_STAT add_stats, void *c);
+
 /** Call only during init. Pre-allocates all available memory */
 void slabs_prefill_global(void);
 
@@ -28,6 +37,9 @@ void *slabs_alloc(const size_t size, unsigned int id, unsigned int flags);
 /** Free previously allocated object */
 void slabs_free(void *ptr, size_t size, unsigned int id);
 
+/** Give the calling worker thread a cache of free chunks per class */
+void slabs_magazine_create(void);
+
 /** Adjust global memory limit up or down */
 bool slabs_adjust_mem_limit(size_t new_mem_limit);
 
@@ -59,6 +71,25 @@ enum reassign_result_type {
 
 enum reassign_result_type slabs_reassign(int src, int dst);
 
+/* Move a page out of a class fragmented past slab_compact_ratio */
+int slabs_compact(void);
+/* Move a page out of a class while over a lowered memory limit */
+int slabs_shrink(void);
+/* Give pages idle in the global pool for slab_idle_trim seconds to the OS */
+unsigned int slabs_trim_idle(void);
+
+enum reprofile_result_type {
+    REPROFILE_OK=0, REPROFILE_RUNNING, REPROFILE_NOSIZES, REPROFILE_NOSPARE,
+    REPROFILE_NOGAIN, REPROFILE_RESTARTABLE
+};
+
+/* Replace the slab classes with ones fitted to the "stats sizes" histogram,
+ * using at most max_classes new class ids (0 for as many as are free). */
+enum reprofile_result_type slabs_reprofile(unsigned int max_classes);
+/* Move a page out of a class retired by slabs_reprofile() */
+int slabs_drain_retired(void);
+void slabs_profile_stats(ADD_STAT add_stats, void *c);
+
 void slabs_rebalancer_pause(void);
 void slabs_rebalancer_resume(void);
 
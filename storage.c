@@ -254,7 +254,7 @@ int storage_get_item(conn *c, item *it, mc_resp *resp) {
         assert(new_it == NULL || (new_it->it_flags & ITEM_CHUNKED));
         chunked = true;
     } else {
-        new_it = do_item_alloc_pull(ntotal, clsid);
+        new_it = do_item_alloc_pull(ntotal, clsid, NULL);
     }
     if (new_it == NULL)
         return -1;
@@ -429,7 +429,7 @@ static void recache_or_free(io_pending_t *pending) {
                 it->exptime = h_it->exptime;
                 it->it_flags &= ~ITEM_LINKED;
                 it->refcount = 0;
-                it->h_next = NULL; // might not be necessary.
+                it->h_next = 0; // might not be necessary.
                 STORAGE_delete(c->thread->storage, h_it);
                 item_replace(h_it, it, hv);
                 pthread_mutex_lock(&c->thread->stats.mutex);
@@ -496,7 +496,7 @@ static int storage_write(void *storage, const int clsid, const int item_age) {
     if ((it->it_flags & ITEM_HDR) == 0 &&
             (item_age == 0 || current_time - it->time > item_age)) {
         FLAGS_CONV(it, flags);
-        item *hdr_it = do_item_alloc(ITEM_key(it), it->nkey, flags, it->exptime, sizeof(item_hdr));
+        item *hdr_it = do_item_alloc_hv(ITEM_key(it), it->nkey, flags, it->exptime, sizeof(item_hdr), it_info.hv, NULL);
         /* Run the storage write understanding the start of the item is dirty.
          * We will fill it (time/exptime/etc) from the header item on read.
          */
@@ -859,7 +859,7 @@ static void storage_compact_readback(void *storage, logger *l,
                         // re-alloc and replace header.
                         client_flags_t flags;
                         FLAGS_CONV(hdr_it, flags);
-                        item *new_it = do_item_alloc(ITEM_key(hdr_it), hdr_it->nkey, flags, hdr_it->exptime, sizeof(item_hdr));
+                        item *new_it = do_item_alloc_hv(ITEM_key(hdr_it), hdr_it->nkey, flags, hdr_it->exptime, sizeof(item_hdr), hv, NULL);
                         if (new_it) {
                             // need to preserve the original item flags, but we
                             // start unlinked, with linked being added during
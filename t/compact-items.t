@@ -0,0 +1,68 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-o track_sizes");
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+my $compact = $settings->{compact_items};
+like($compact, qr/^(yes|no)$/, "compact_items reported");
+
+my $s = mem_stats($sock, ' sizes');
+ok(exists $s->{header_size}, "header size listed");
+ok(!exists $s->{items_per_gb}, "nothing measured yet");
+
+# Small counters are where the header matters most.
+my $val = 'c' x 30;
+for my $k (1 .. 1000) {
+    print $sock "set counter$k 0 0 30 noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "counter1000", $val);
+
+$s = mem_stats($sock, ' sizes');
+my $counted = 0;
+for my $k (keys %$s) {
+    $counted += $s->{$k} if $k =~ /^\d+$/;
+}
+is($counted, 1000, "every counter in the histogram");
+cmp_ok($s->{items_per_gb}, '>', 9_000_000, "items per GB measured");
+
+if ($compact eq 'yes') {
+    is($s->{header_size}, 32, "compact header");
+    cmp_ok($s->{items_per_gb}, '>', $s->{pointer_items_per_gb} * 1.15,
+        "more counters per GB than with pointer links");
+} else {
+    is($s->{items_per_gb}, $s->{pointer_items_per_gb}, "pointer links");
+}
+
+# Deletes come back out of the measurement.
+for my $k (1 .. 1000) {
+    print $sock "delete counter$k noreply\r\n";
+}
+mem_get_is($sock, "counter1000", undef);
+$s = mem_stats($sock, ' sizes');
+ok(!exists $s->{items_per_gb}, "nothing left to measure");
+
+# Items, chunks and the crawler's sentinels all link within the arena.
+my $big = 'b' x 700000;
+print $sock "set big 0 0 700000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored a chunked item");
+for my $k (1 .. 200) {
+    print $sock "set key$k 0 0 30 noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "key200", $val);
+print $sock "lru_crawler metadump all\r\n";
+my $dumped = 0;
+while (my $line = <$sock>) {
+    last if $line =~ /^END/;
+    $dumped++ if $line =~ /^key=/;
+}
+is($dumped, 201, "crawler walked every item");
+mem_get_is($sock, "big", $big);
+
+done_testing();
@@ -0,0 +1,97 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# The crawler and maintainer are off, so only the wheel reclaims anything.
+my $server = new_memcached('-o expiry_wheel=60,no_lru_crawler,no_lru_maintainer');
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, ' settings');
+is($settings->{expiry_wheel}, 60, "expiry_wheel setting reported");
+
+for my $k (1 .. 100) {
+    print $sock "set short$k 0 2 1 noreply\r\nx\r\n";
+}
+for my $k (1 .. 100) {
+    print $sock "set long$k 0 3600 1 noreply\r\nx\r\n";
+}
+print $sock "set forever 0 0 1\r\nx\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored forever");
+
+# Touched past the horizon and deleted items leave stale entries.
+print $sock "touch short1 3600\r\n";
+is(scalar <$sock>, "TOUCHED\r\n", "touched short1");
+print $sock "delete short2\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted short2");
+# A replacement under the same key, likely in the chunk just freed, isn't
+# the item the old entry was made for.
+print $sock "set short4 0 3600 1\r\ny\r\n";
+is(scalar <$sock>, "STORED\r\n", "replaced short4");
+# A meta touch moves the item to a later slot.
+print $sock "mg short3 T4\r\n";
+is(scalar <$sock>, "HD\r\n", "meta touched short3");
+
+my $stats = mem_stats($sock);
+is($stats->{curr_items}, 200, "everything stored");
+ok(defined $stats->{expiry_wheel_bytes}, "wheel memory reported");
+
+my $reclaimed = 0;
+for (1 .. 40) {
+    sleep 0.25;
+    $stats = mem_stats($sock);
+    last if $stats->{expiry_wheel_reclaimed} >= 96;
+}
+is($stats->{expiry_wheel_reclaimed}, 96, "short TTL items reclaimed without access");
+is($stats->{curr_items}, 104, "only the long TTL items are left");
+cmp_ok($stats->{expiry_wheel_stale}, '>=', 3, "stale entries skipped");
+
+mem_get_is($sock, "short1", "x");
+mem_get_is($sock, "short4", "y");
+mem_get_is($sock, "long1", "x");
+mem_get_is($sock, "forever", "x");
+
+for (1 .. 40) {
+    sleep 0.25;
+    $stats = mem_stats($sock);
+    last if $stats->{expiry_wheel_reclaimed} >= 97;
+}
+is($stats->{expiry_wheel_reclaimed}, 97, "meta touched item reclaimed later");
+is($stats->{curr_items}, 103, "short3 gone too");
+is($stats->{expiry_wheel_bytes}, 0, "no wheel memory left for short TTLs");
+
+# TTLs set by meta arithmetic are noted too.
+print $sock "set counter1 0 0 1\r\n5\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored counter1");
+print $sock "ma counter1 T2\r\n";
+is(scalar <$sock>, "HD\r\n", "incremented counter1 with a TTL");
+print $sock "ma counter2 N2\r\n";
+is(scalar <$sock>, "HD\r\n", "autovivified counter2 with a TTL");
+for (1 .. 40) {
+    sleep 0.25;
+    $stats = mem_stats($sock);
+    last if $stats->{expiry_wheel_reclaimed} >= 99;
+}
+is($stats->{expiry_wheel_reclaimed}, 99, "counters reclaimed by the wheel");
+is($stats->{curr_items}, 103, "counters gone");
+
+# Wheel memory is capped at a share of -m; what doesn't fit is left to the
+# crawler.
+$server = new_memcached('-m 8 -o expiry_wheel=60,no_lru_crawler,no_lru_maintainer');
+$sock = $server->sock;
+$stats = mem_stats($sock);
+is($stats->{expiry_wheel_limit}, 8 * 1024 * 1024 / 32, "wheel limit is 1/32 of -m");
+for my $k (1 .. 20000) {
+    print $sock "set capped$k 0 30 1 noreply\r\nx\r\n";
+}
+mem_get_is($sock, "capped20000", "x");
+$stats = mem_stats($sock);
+cmp_ok($stats->{expiry_wheel_bytes}, '<=', $stats->{expiry_wheel_limit},
+    "wheel stays under its limit");
+cmp_ok($stats->{expiry_wheel_add_failures}, '>', 0, "items past the limit not noted");
+
+done_testing();
@@ -0,0 +1,165 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Grow the hash table from its smallest allowed size, both by briefly holding
+# the item locks (default) and by pausing all threads (hash_expand_pause),
+# and for both the chained and the bucketed (hash_buckets) tables.
+# The bucketed table holds more items per bucket before it expands.
+# Background threads which take item locks, like the expiry wheel and the
+# log memory cleaner, must sit out a paused swap.
+# hash_migrate_threads splits the item migration across several threads.
+# hash_hugepages and hash_numa map the tables directly, with whatever pages
+# this box can give us.
+my @modes = (
+    ['', 2**13],
+    [',hash_expand_pause', 2**13],
+    [',hash_expand_pause,expiry_wheel=60', 2**13],
+    [',hash_expand_pause,log_memory', 2**13],
+    [',hash_buckets', 13000],
+    [',hash_migrate_threads=4', 2**13],
+    [',hash_buckets,hash_migrate_threads=4', 13000],
+    [',hash_hugepages,hash_numa=interleave', 2**13],
+    [',hash_buckets,hash_hugepages', 13000],
+    [',item_lock_mode=rwlock', 2**13],
+);
+
+# Log segments can't be reached by compact item links
+{
+    my $server = new_memcached();
+    my $settings = mem_stats($server->sock, ' settings');
+    if ($settings->{compact_items} eq 'yes') {
+        @modes = grep { $_->[0] !~ /log_memory/ } @modes;
+    }
+}
+
+for my $m (@modes) {
+    my ($mode, $count) = @$m;
+    my $server = new_memcached("-t 2 -o hashpower=12$mode");
+    my $sock = $server->sock;
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{hash_expand_pause}, $mode =~ /pause/ ? 'yes' : 'no',
+        "hash_expand_pause setting reported");
+    is($settings->{hash_buckets}, $mode =~ /buckets/ ? 'yes' : 'no',
+        "hash_buckets setting reported");
+    is($settings->{hash_migrate_threads}, $mode =~ /migrate_threads=(\d+)/ ? $1 : 1,
+        "hash_migrate_threads setting reported");
+    is($settings->{hash_hugepages}, $mode =~ /hugepages/ ? 'yes' : 'no',
+        "hash_hugepages setting reported");
+    if ($mode =~ /hugepages/) {
+        like($settings->{hash_page_type}, qr/^(default|thp|hugetlb)$/,
+            "hash_page_type reported");
+    } else {
+        is($settings->{hash_page_type}, 'default', "hash_page_type is default");
+    }
+    is($settings->{hash_numa}, $mode =~ /numa=(\w+)/ ? $1 : 'none',
+        "hash_numa setting reported");
+    like($settings->{hash_numa_applied}, qr/^(yes|no)$/,
+        "hash_numa_applied reported");
+
+    my $stats = mem_stats($sock);
+    is($stats->{hash_power_level}, 12, "starting hash level is 12");
+    is($stats->{hash_expansions}, 0, "no expansions yet");
+
+    for my $k (1 .. $count) {
+        print $sock "set key$k 0 0 1 noreply\r\nx\r\n";
+    }
+    mem_get_is($sock, "key$count", "x");
+
+    for (1 .. 50) {
+        $stats = mem_stats($sock);
+        last if $stats->{hash_expansions} > 0 && !$stats->{hash_is_expanding};
+        sleep 0.1;
+    }
+    is($stats->{hash_power_level}, 13, "hash level grew to 13");
+    is($stats->{hash_is_expanding}, 0, "expansion finished");
+    is($stats->{hash_expansions}, 1, "one expansion counted");
+    ok(defined $stats->{hash_expand_time_us}, "hash_expand_time_us reported");
+    ok(defined $stats->{hash_expand_stall_us}, "hash_expand_stall_us reported");
+
+    my $found = 0;
+    for my $k (1 .. $count) {
+        print $sock "get key$k\r\n";
+        my $line = <$sock>;
+        if ($line =~ /^VALUE key$k /) {
+            $found++;
+            <$sock>;
+            <$sock>;
+        }
+    }
+    is($found, $count, "all keys readable after expansion");
+
+    # Free up some slots, then make sure the hash walk still sees
+    # everything that's left.
+    for my $k (1 .. 100) {
+        print $sock "delete key$k noreply\r\n";
+    }
+    mem_get_is($sock, "key1", undef);
+    mem_get_is($sock, "key101", "x");
+
+    print $sock "lru_crawler metadump hash\r\n";
+    my $dumped = 0;
+    while (<$sock>) {
+        last if /^(\.|END)/;
+        $dumped++ if /^key=key\d+ /;
+    }
+    is($dumped, $count - 100, "metadump hash walks every item");
+}
+
+# Shrink back down once most items are gone.
+for my $m (['', 2**13], [',hash_buckets', 13000],
+           [',hash_migrate_threads=4', 2**13], [',hash_hugepages', 2**13]) {
+    my ($mode, $count) = @$m;
+    my $server = new_memcached("-t 2 -o hashpower=12,hash_shrink_ratio=0.5$mode");
+    my $sock = $server->sock;
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{hash_shrink_ratio}, '0.50', "hash_shrink_ratio setting reported");
+
+    for my $k (1 .. $count) {
+        print $sock "set key$k 0 0 1 noreply\r\nx\r\n";
+    }
+    mem_get_is($sock, "key$count", "x");
+
+    my $stats;
+    for (1 .. 50) {
+        $stats = mem_stats($sock);
+        last if $stats->{hash_expansions} > 0 && !$stats->{hash_is_expanding};
+        sleep 0.1;
+    }
+    is($stats->{hash_power_level}, 13, "hash level grew to 13");
+    is($stats->{hash_shrinks}, 0, "no shrinks yet");
+
+    for my $k (101 .. $count) {
+        print $sock "delete key$k noreply\r\n";
+    }
+    mem_get_is($sock, "key$count", undef);
+
+    for (1 .. 50) {
+        $stats = mem_stats($sock);
+        last if $stats->{hash_shrinks} > 0 && !$stats->{hash_is_shrinking};
+        sleep 0.1;
+    }
+    is($stats->{hash_power_level}, 12, "hash level shrunk back to 12");
+    is($stats->{hash_is_shrinking}, 0, "shrink finished");
+    is($stats->{hash_shrinks}, 1, "one shrink counted");
+    is($stats->{hash_migrate_remaining}, 0, "nothing left to migrate");
+    ok(defined $stats->{hash_shrink_time_us}, "hash_shrink_time_us reported");
+
+    for my $k (1 .. 100) {
+        mem_get_is($sock, "key$k", "x");
+    }
+
+    # Doesn't shrink below the starting size.
+    sleep 1.5;
+    $stats = mem_stats($sock);
+    is($stats->{hash_power_level}, 12, "hash level stays at 12");
+}
+
+done_testing();
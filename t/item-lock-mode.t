@@ -0,0 +1,97 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached("-t 2");
+    my $sock = $server->sock;
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{item_lock_mode}, 'mutex', "item locks are mutexes by default");
+
+    print $sock "set foo 0 0 3\r\nbar\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored foo");
+    mem_get_is($sock, "foo", "bar") for (1 .. 3);
+
+    my $stats = mem_stats($sock);
+    is($stats->{get_lock_upgrades}, 0, "no upgrades with mutex item locks");
+    ok(defined $stats->{get_lock_waits}, "get_lock_waits reported");
+}
+
+{
+    # Keep background threads from reaping the expired and flushed items
+    # before we fetch them.
+    my $server = new_memcached("-t 2 -o item_lock_mode=rwlock,no_lru_crawler,no_lru_maintainer");
+    my $sock = $server->sock;
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{item_lock_mode}, 'rwlock', "item_lock_mode setting reported");
+
+    # Misses don't need an exclusive lock.
+    mem_get_is($sock, "nope", undef);
+    my $stats = mem_stats($sock);
+    is($stats->{get_lock_upgrades}, 0, "miss served under a shared lock");
+    is($stats->{get_misses}, 1, "miss counted");
+
+    # The first fetches mark the item, which needs the exclusive lock.
+    print $sock "set foo 0 0 3\r\nbar\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored foo");
+    mem_get_is($sock, "foo", "bar") for (1 .. 5);
+    $stats = mem_stats($sock);
+    cmp_ok($stats->{get_lock_upgrades}, '>', 0, "fetch marking upgraded the lock");
+    cmp_ok($stats->{get_lock_upgrades}, '<', 5, "later hits stayed shared");
+    is($stats->{get_hits}, 5, "hits counted");
+    my $upgrades = $stats->{get_lock_upgrades};
+
+    # Expired items get unlinked under the exclusive lock.
+    print $sock "set exp 0 -1 3\r\nbar\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored already expired item");
+    mem_get_is($sock, "exp", undef);
+    $stats = mem_stats($sock);
+    is($stats->{get_lock_upgrades}, $upgrades + 1, "expired item upgraded the lock");
+    is($stats->{get_expired}, 1, "expired item counted");
+
+    # Writes still work alongside shared reads.
+    print $sock "set num 0 0 1\r\n1\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored num");
+    print $sock "incr num 5\r\n";
+    is(scalar <$sock>, "6\r\n", "incr under rwlock");
+    mem_get_is($sock, "num", "6");
+    print $sock "delete num\r\n";
+    is(scalar <$sock>, "DELETED\r\n", "deleted num");
+    mem_get_is($sock, "num", undef);
+
+    print $sock "flush_all\r\n";
+    is(scalar <$sock>, "OK\r\n", "flushed");
+    mem_get_is($sock, "foo", undef);
+    $stats = mem_stats($sock);
+    is($stats->{get_flushed}, 1, "flushed item counted");
+
+    # Multigets and meta gets share the locks too.
+    for my $k (1 .. 20) {
+        print $sock "set key$k 0 0 " . length("v$k") . "\r\nv$k\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored key$k");
+    }
+    for (1 .. 3) {
+        print $sock "get " . join(' ', map { "key$_" } 1 .. 20) . "\r\n";
+        my $found = 0;
+        while (my $line = <$sock>) {
+            last if $line eq "END\r\n";
+            $found++ if $line =~ /^VALUE key\d+ /;
+        }
+        is($found, 20, "multiget found every key");
+    }
+    print $sock "mg key1 v\r\nmg key2 v\r\nmn\r\n";
+    is(scalar <$sock>, "VA 2\r\n", "mg key1");
+    is(scalar <$sock>, "v1\r\n", "mg key1 value");
+    is(scalar <$sock>, "VA 2\r\n", "mg key2");
+    is(scalar <$sock>, "v2\r\n", "mg key2 value");
+    is(scalar <$sock>, "MN\r\n", "mn");
+}
+
+done_testing();
@@ -0,0 +1,101 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{log_memory}, 'no', "off by default");
+    print $sock "stats log\r\n";
+    is(scalar <$sock>, "ERROR\r\n", "no log stats when off");
+    # Log segments can't be reached by compact item links
+    if ($settings->{compact_items} eq 'yes') {
+        done_testing();
+        exit 0;
+    }
+}
+
+my $server = new_memcached("-m 16 -o log_memory");
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+is($settings->{log_memory}, 'yes', "log_memory reported");
+is($settings->{slab_reassign}, 'no', "no slab mover");
+
+my $s = mem_stats($sock, ' log');
+is($s->{segments_limit}, 16, "one segment per page");
+is($s->{write_amplification}, '1.0000', "nothing written yet");
+
+print $sock "cache_memlimit 32\r\n";
+is(scalar <$sock>, "MEMLIMIT_ADJUST_FAILED out of bounds or unable to adjust\r\n",
+    "memory limit is fixed");
+
+# Items of every size share the log.
+my @sizes = (10, 100, 1000, 5000, 20000);
+for my $size (@sizes) {
+    my $val = 'a' x $size;
+    print $sock "set size$size 0 0 $size\r\n$val\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored $size bytes");
+    mem_get_is($sock, "size$size", $val);
+}
+
+my $big = join('', map { chr(65 + $_ % 26) } 0 .. 700000);
+my $blen = length($big);
+print $sock "set big 0 0 $blen\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored a chunked item");
+mem_get_is($sock, "big", $big);
+
+sub set_key {
+    my $k = shift;
+    my $len = 500 + ($k * 37) % 4000;
+    my $val = 'v' x $len;
+    print $sock "set key$k 0 0 $len noreply\r\n$val\r\n";
+}
+
+# Fill most of the log, then overwrite scattered keys while a few stay hot,
+# so the cleaner has to copy live items out of the segments it frees.
+my %hot = map { ("hot$_" => ("h$_" x 100)) } 1 .. 20;
+set_key($_) for 1 .. 3000;
+for my $k (keys %hot) {
+    print $sock "set $k 0 0 " . length($hot{$k}) . " noreply\r\n$hot{$k}\r\n";
+}
+for my $step (7, 13, 17, 19, 23, 29) {
+    set_key(($_ * $step) % 3000 + 1) for 0 .. 1999;
+    for my $k (sort keys %hot) {
+        mem_get_is($sock, $k, $hot{$k});
+    }
+}
+
+for (1 .. 50) {
+    $s = mem_stats($sock, ' log');
+    last if $s->{items_relocated} > 0;
+    sleep 0.1;
+}
+cmp_ok($s->{segments_cleaned}, '>', 0, "segments cleaned");
+cmp_ok($s->{items_relocated}, '>', 0, "live items relocated");
+cmp_ok($s->{write_amplification}, '>', 1, "relocation counts as writes");
+cmp_ok($s->{bytes_reclaimed}, '>', 0, "space reclaimed");
+cmp_ok($s->{segments}, '<=', $s->{segments_limit}, "stays under the limit");
+cmp_ok($s->{utilization}, '>', 0.5, "segments kept dense");
+
+# Memory written with one size is free for any other.
+my $val = 'z' x 30000;
+for my $k (1 .. 600) {
+    print $sock "set other$k 0 0 30000 noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "other600", $val, "new size stored after the log filled");
+my $stats = mem_stats($sock);
+cmp_ok($stats->{evictions}, '>', 0, "old sizes evicted for it");
+$s = mem_stats($sock, ' log');
+cmp_ok($s->{live_bytes}, '>', 9 * 1024 * 1024, "most of the log holds the new size");
+
+print $sock "set big 0 0 $blen\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "chunked item stored again");
+mem_get_is($sock, "big", $big);
+
+done_testing();
@@ -0,0 +1,103 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# A flat LRU with no maintainer never bumps recently read items, so a scan of
+# one-off keys would normally push the working set out. With the admission
+# filter the scan only replaces itself.
+my $server = new_memcached('-m 6 -o lru_admission,no_lru_maintainer,slab_chunk_max=4096');
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, ' settings');
+is($settings->{lru_admission}, 'yes', "lru_admission setting reported");
+
+my $value = 'x' x 2000;
+my $len = length($value);
+
+for my $k (1 .. 20) {
+    print $sock "set hot$k 0 0 $len\r\n$value\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored hot$k");
+}
+for (1 .. 5) {
+    for my $k (1 .. 20) {
+        mem_get_is($sock, "hot$k", $value);
+    }
+}
+
+my $hits = 0;
+for my $k (1 .. 10000) {
+    print $sock "set scan$k 0 0 $len noreply\r\n$value\r\n";
+    if ($k % 2500 == 0) {
+        for my $h (1 .. 20) {
+            print $sock "mg hot$h\r\n";
+            my $line = <$sock>;
+            $hits++ if $line eq "HD\r\n";
+        }
+    }
+}
+is($hits, 20 * 4, "hot keys survived the scan");
+
+my $stats = mem_stats($sock);
+cmp_ok($stats->{admission_rejects}, '>', 0, "scan keys were refused");
+
+my $items = mem_stats($sock, ' items');
+my $rejects = 0;
+for my $k (keys %$items) {
+    $rejects += $items->{$k} if $k =~ /:admission_rejects$/;
+}
+is($rejects, $stats->{admission_rejects}, "per class rejects add up");
+
+# Keys already stored are never held to the filter, so a replacement always
+# lands and no stale value is left behind.
+my $replaced = 0;
+my $fresh = 0;
+for my $k (1 .. 10000) {
+    print $sock "mg scan$k\r\n";
+    next if scalar <$sock> ne "HD\r\n";
+    my $other = 'y' x $len;
+    print $sock "set scan$k 0 0 $len\r\n$other\r\n";
+    is(scalar <$sock>, "STORED\r\n", "replacement of scan$k stored");
+    $replaced++;
+    print $sock "mg scan$k v\r\n";
+    <$sock>;
+    $fresh++ if scalar <$sock> eq "$other\r\n";
+    last if $replaced == 5;
+}
+is($replaced, 5, "found resident keys to replace");
+is($fresh, $replaced, "replacements are readable");
+
+# A refused new key is dropped as if evicted at once: the client sees the
+# store succeed and it is not an out of memory error.
+$stats = mem_stats($sock);
+my $before = $stats->{admission_rejects};
+my $dropped = 0;
+for my $k (1 .. 50) {
+    print $sock "set fresh$k 0 0 $len\r\n$value\r\n";
+    is(scalar <$sock>, "STORED\r\n", "new key fresh$k answered STORED");
+    print $sock "mg fresh$k\r\n";
+    $dropped++ if scalar <$sock> eq "EN\r\n";
+}
+for my $k (1 .. 50) {
+    print $sock "ms mfresh$k $len T0\r\n$value\r\n";
+    is(scalar <$sock>, "HD\r\n", "meta set of mfresh$k answered HD");
+}
+$stats = mem_stats($sock);
+cmp_ok($dropped, '>', 0, "some new keys were dropped");
+cmp_ok($stats->{admission_rejects}, '>', $before, "drops counted as rejects");
+is($stats->{store_no_memory}, 0, "refusals not counted as out of memory");
+
+# A key which keeps being asked for more often than the hot keys (a set,
+# five gets and four checks each) earns its way in.
+for (1 .. 14) {
+    mem_get_is($sock, "wanted", undef);
+}
+print $sock "set wanted 0 0 $len\r\n$value\r\n";
+is(scalar <$sock>, "STORED\r\n", "frequently missed key admitted");
+mem_get_is($sock, "wanted", $value);
+
+done_testing();
@@ -0,0 +1,64 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# With CLOCK replacement, keys which keep getting hit survive a stream of
+# new sets which is large enough to evict everything else.
+my $server = new_memcached('-m 6 -o lru_clock,slab_chunk_max=4096');
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, ' settings');
+is($settings->{lru_clock}, 'yes', "lru_clock setting reported");
+is($settings->{lru_segmented}, 'no', "clock mode uses a flat LRU");
+
+my $value = 'x' x 2000;
+my $len = length($value);
+
+for my $k (1 .. 20) {
+    print $sock "set hot$k 0 0 $len\r\n$value\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored hot$k");
+}
+
+my $hits = 0;
+for my $k (1 .. 10000) {
+    print $sock "set cold$k 0 0 $len noreply\r\n$value\r\n";
+    if ($k % 100 == 0) {
+        for my $h (1 .. 20) {
+            print $sock "mg hot$h\r\n";
+            my $line = <$sock>;
+            $hits++ if $line eq "HD\r\n";
+        }
+    }
+}
+is($hits, 20 * 100, "hot keys were never evicted");
+
+my $stats = mem_stats($sock);
+cmp_ok($stats->{evictions}, '>', 0, "cold keys were evicted");
+mem_get_is($sock, "cold1", undef);
+
+my $items = mem_stats($sock, ' items');
+my $rescued = 0;
+for my $k (keys %$items) {
+    $rescued += $items->{$k} if $k =~ /:moves_within_lru$/;
+}
+cmp_ok($rescued, '>', 0, "the clock hand gave hot keys another pass");
+
+# Switching modes at runtime.
+print $sock "lru mode segmented\r\n";
+is(scalar <$sock>, "OK\r\n", "switched to segmented");
+$settings = mem_stats($sock, ' settings');
+is($settings->{lru_clock}, 'no', "clock off");
+is($settings->{lru_segmented}, 'yes', "segmented on");
+
+print $sock "lru mode clock\r\n";
+is(scalar <$sock>, "OK\r\n", "switched back to clock");
+$settings = mem_stats($sock, ' settings');
+is($settings->{lru_clock}, 'yes', "clock on");
+is($settings->{lru_segmented}, 'no', "segmented off");
+
+done_testing();
@@ -0,0 +1,89 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Costly items outlive a stream of cheap ones, even without any hits.
+my $server = new_memcached('-m 6 -o lru_gdsf,slab_chunk_max=4096');
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, ' settings');
+is($settings->{lru_gdsf}, 'yes', "lru_gdsf setting reported");
+is($settings->{lru_segmented}, 'no', "gdsf uses a flat LRU");
+
+my $value = 'x' x 2000;
+my $len = length($value);
+
+print $sock "ms bad $len G0\r\n$value\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "cost of 0 rejected");
+print $sock "ms bad $len G256\r\n$value\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "cost above 255 rejected");
+
+for my $k (1 .. 20) {
+    print $sock "ms costly$k $len G255\r\n$value\r\n";
+    is(scalar <$sock>, "HD\r\n", "stored costly$k");
+}
+print $sock "ms cheap0 $len\r\n$value\r\n";
+is(scalar <$sock>, "HD\r\n", "stored cheap0");
+
+# Enough to cycle the cache a few times, but not enough passes to age out
+# an item with the highest cost.
+for my $k (1 .. 5000) {
+    print $sock "set cheap$k 0 0 $len noreply\r\n$value\r\n";
+}
+mem_get_is($sock, "cheap0", undef);
+
+my $found = 0;
+for my $k (1 .. 20) {
+    print $sock "mg costly$k\r\n";
+    $found++ if scalar <$sock> eq "HD\r\n";
+}
+is($found, 20, "costly items survived");
+
+my $items = mem_stats($sock, ' items');
+my %sum;
+for my $k (keys %$items) {
+    $sum{$1} += $items->{$k} if $k =~ /:(\w+)$/;
+}
+cmp_ok($sum{evicted}, '>', 0, "cheap items were evicted");
+is($sum{evicted_cost}, $sum{evicted}, "evicted items each cost 1");
+cmp_ok($sum{moves_within_lru}, '>', 0, "costly items were given more passes");
+
+# Append copies the item, and its cost, into a bigger one.
+print $sock "ms costly1 1 MA\r\ny\r\n";
+is(scalar <$sock>, "HD\r\n", "appended to costly1");
+
+print $sock "lru mode segmented\r\n";
+is(scalar <$sock>, "OK\r\n", "switched to segmented");
+print $sock "lru mode gdsf\r\n";
+is(scalar <$sock>, "OK\r\n", "switched back to gdsf");
+$settings = mem_stats($sock, ' settings');
+is($settings->{lru_gdsf}, 'yes', "gdsf on");
+
+# Hits are credited on the shared lock path too, so items which are hit a
+# lot outlive ones stored as costly but never read.
+$server = new_memcached('-m 6 -o lru_gdsf,slab_chunk_max=4096,item_lock_mode=rwlock');
+$sock = $server->sock;
+for my $k (1 .. 20) {
+    print $sock "ms hot$k $len\r\n$value\r\n";
+    is(scalar <$sock>, "HD\r\n", "stored hot$k");
+}
+for (1 .. 100) {
+    print $sock join('', map { "mg hot$_\r\n" } 1 .. 20);
+    <$sock> for 1 .. 20;
+}
+for my $k (1 .. 8000) {
+    print $sock "set cheap$k 0 0 $len noreply\r\n$value\r\n";
+}
+$found = 0;
+for my $k (1 .. 20) {
+    print $sock "mg hot$k\r\n";
+    $found++ if scalar <$sock> eq "HD\r\n";
+}
+is($found, 20, "frequently hit items survived");
+
+done_testing();
@@ -0,0 +1,72 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{lru_maintainer_threads}, 1, "one maintainer by default");
+    my $s = mem_stats($sock, ' lru_maintainer');
+    is($s->{threads}, 1, "one thread running");
+    is($s->{'0:classes'}, 63, "it looks after every class");
+}
+
+# hash_expand_pause makes sure every maintainer thread can be paused.
+my $server = new_memcached("-m 8 -t 2 -o lru_maintainer_threads=4,hashpower=12,hash_expand_pause");
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+is($settings->{lru_maintainer_threads}, 4, "lru_maintainer_threads reported");
+
+my $s = mem_stats($sock, ' lru_maintainer');
+is($s->{threads}, 4, "four threads running");
+my $classes = 0;
+for my $t (0 .. 3) {
+    ok(defined $s->{"$t:utilization"}, "thread $t utilization reported");
+    $classes += $s->{"$t:classes"};
+}
+is($s->{'0:classes'}, 16, "thread 0 classes");
+is($s->{'3:classes'}, 15, "thread 3 classes");
+is($classes, 63, "every class has a thread");
+
+# Fill past the memory limit in a couple of classes, so the maintainers
+# have HOT and WARM items to move along.
+my $small = 'x' x 100;
+my $large = 'y' x 2000;
+for my $k (1 .. 20000) {
+    print $sock "set small$k 0 0 100 noreply\r\n$small\r\n";
+    print $sock "set large$k 0 0 2000 noreply\r\n$large\r\n" if $k % 4 == 0;
+}
+mem_get_is($sock, "small20000", $small);
+mem_get_is($sock, "large20000", $large);
+
+my $stats;
+for (1 .. 50) {
+    $stats = mem_stats($sock);
+    last if $stats->{hash_expansions} > 0 && !$stats->{hash_is_expanding};
+    sleep 0.1;
+}
+cmp_ok($stats->{evictions}, '>', 0, "evicted once full");
+cmp_ok($stats->{hash_expansions}, '>', 0, "hash table grew while paused");
+
+sleep 1.5;
+$s = mem_stats($sock, ' lru_maintainer');
+my $moves = 0;
+for my $t (0 .. 3) {
+    cmp_ok($s->{"$t:juggles"}, '>', 0, "thread $t woke up");
+    $moves += $s->{"$t:moves"};
+}
+cmp_ok($moves, '>', 0, "items were moved");
+my $items = mem_stats($sock, ' items');
+my $cold = 0;
+for my $k (keys %$items) {
+    $cold++ if $k =~ /:moves_to_cold$/ && $items->{$k} > 0;
+}
+cmp_ok($cold, '>=', 2, "items moved to cold in more than one class");
+
+done_testing();
@@ -0,0 +1,86 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Keys hit while in the small queue move to main and survive a scan which
+# only churns through the small queue.
+my $server = new_memcached('-m 6 -o lru_s3fifo,slab_chunk_max=4096');
+my $sock = $server->sock;
+
+my $settings = mem_stats($sock, ' settings');
+is($settings->{lru_s3fifo}, 'yes', "lru_s3fifo setting reported");
+is($settings->{lru_segmented}, 'no', "s3fifo doesn't use the segmented LRU");
+
+my $value = 'x' x 2000;
+my $len = length($value);
+
+for my $k (1 .. 20) {
+    print $sock "set hot$k 0 0 $len\r\n$value\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored hot$k");
+    mem_get_is($sock, "hot$k", $value);
+}
+
+my $hits = 0;
+for my $k (1 .. 10000) {
+    print $sock "set scan$k 0 0 $len noreply\r\n$value\r\n";
+    if ($k % 100 == 0) {
+        for my $h (1 .. 20) {
+            print $sock "mg hot$h\r\n";
+            my $line = <$sock>;
+            $hits++ if $line eq "HD\r\n";
+        }
+    }
+}
+is($hits, 20 * 100, "hot keys were never evicted");
+mem_get_is($sock, "scan1", undef);
+
+my $items = mem_stats($sock, ' items');
+my %sum;
+for my $k (keys %$items) {
+    $sum{$1} += $items->{$k} if $k =~ /:(\w+)$/;
+}
+cmp_ok($sum{moves_to_cold}, '>=', 20, "hot keys moved to main");
+cmp_ok($sum{evicted}, '>', 0, "scan keys were evicted");
+cmp_ok($sum{ghost_misses}, '>=', 10000, "new keys entered the small queue");
+cmp_ok($sum{main_hits}, '>', 0, "hits in the main queue counted");
+is($sum{ghost_hits}, 0, "no ghost hits yet");
+
+# A key evicted from the small queue comes back straight into main. Use the
+# latest eviction so later ones can't have pushed it out of the ghost queue.
+my $gone;
+for (my $k = 10000; $k > 0; $k--) {
+    print $sock "mg scan$k\r\n";
+    if (scalar <$sock> eq "EN\r\n") {
+        $gone = "scan$k";
+        last;
+    }
+}
+ok(defined $gone, "found the latest evicted key");
+print $sock "set $gone 0 0 $len\r\n$value\r\n";
+is(scalar <$sock>, "STORED\r\n", "re-set an evicted key");
+$items = mem_stats($sock, ' items');
+%sum = ();
+for my $k (keys %$items) {
+    $sum{$1} += $items->{$k} if $k =~ /:(\w+)$/;
+}
+is($sum{ghost_hits}, 1, "ghost hit counted");
+
+# Switching modes at runtime.
+print $sock "lru mode segmented\r\n";
+is(scalar <$sock>, "OK\r\n", "switched to segmented");
+$settings = mem_stats($sock, ' settings');
+is($settings->{lru_s3fifo}, 'no', "s3fifo off");
+mem_get_is($sock, "hot1", $value);
+
+print $sock "lru mode s3fifo\r\n";
+is(scalar <$sock>, "OK\r\n", "switched back to s3fifo");
+$settings = mem_stats($sock, ' settings');
+is($settings->{lru_s3fifo}, 'yes', "s3fifo on");
+is($settings->{lru_segmented}, 'no', "segmented off");
+
+done_testing();
@@ -0,0 +1,95 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+sub mrc_stats {
+    my $sock = shift;
+    print $sock "stats mrc\r\n";
+    my %s;
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        $s{$1} = $2 if $line =~ /^STAT (\S+) (\S+)\r\n/;
+    }
+    return \%s;
+}
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{mrc_sample_rate}, '0.000000', "off by default");
+    is(scalar keys %{mrc_stats($sock)}, 0, "stats mrc is empty when off");
+}
+
+{
+    # Sample every key so the curve is exact.
+    my $server = new_memcached("-o mrc_sample_rate=1");
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{mrc_sample_rate}, '1.000000', "mrc_sample_rate reported");
+    is($settings->{mrc_max_keys}, 65536, "mrc_max_keys reported");
+
+    # 100 items of a bit over 1k each, read back in the order they were
+    # stored: every get has ~99 items in between, which fits in 128k.
+    my $val = 'x' x 1000;
+    for my $k (1 .. 100) {
+        print $sock "set key$k 0 0 1000 noreply\r\n$val\r\n";
+    }
+    for (1 .. 2) {
+        for my $k (1 .. 100) {
+            mem_get_is($sock, "key$k", $val);
+        }
+    }
+    mem_get_is($sock, "nokey", undef);
+
+    my $s = mrc_stats($sock);
+    is($s->{sample_rate}, '1.000000', "all keys sampled");
+    is($s->{sampled_keys}, 100, "stored keys tracked");
+    is($s->{references}, 201, "sampled gets counted");
+    is($s->{cold_misses}, 1, "get for an unknown key is a cold miss");
+    is($s->{'miss_ratio:65536'}, '1.0000', "everything misses in 64k");
+    is($s->{'miss_ratio:131072'}, '0.0050', "only the cold miss misses in 128k");
+    ok(!exists $s->{'miss_ratio:262144'}, "curve stops at the largest distance");
+
+    my ($cls) = grep { /^\d+:references$/ } keys %$s;
+    ok(defined $cls, "per class curve reported");
+    $cls =~ s/:.*//;
+    is($s->{"$cls:references"}, 200, "class references");
+    is($s->{"$cls:miss_ratio:131072"}, '0.0000', "class curve");
+
+    # A get right after its set has nothing in between.
+    print $sock "set near 0 0 1\r\nx\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored near");
+    mem_get_is($sock, "near", "x");
+    $s = mrc_stats($sock);
+    is($s->{references}, 202, "another reference");
+    is($s->{'miss_ratio:65536'}, sprintf("%.4f", 201 / 202), "short reuse hits in 64k");
+
+    print $sock "stats reset\r\n";
+    is(scalar <$sock>, "RESET\r\n", "stats reset");
+    $s = mrc_stats($sock);
+    is($s->{references}, 0, "references reset");
+    is($s->{sampled_keys}, 101, "keys still tracked");
+}
+
+{
+    # Past mrc_max_keys the sample rate drops instead of using more memory.
+    my $server = new_memcached("-o mrc_sample_rate=1,mrc_max_keys=1024");
+    my $sock = $server->sock;
+    for my $k (1 .. 4000) {
+        print $sock "set key$k 0 0 1 noreply\r\nx\r\n";
+    }
+    mem_get_is($sock, "key4000", "x");
+    my $s = mrc_stats($sock);
+    cmp_ok($s->{sample_rate_drops}, '>', 0, "sample rate dropped");
+    cmp_ok($s->{sample_rate}, '<', 1, "sample rate below 1");
+    cmp_ok($s->{sampled_keys}, '<', 1024, "kept under mrc_max_keys");
+    cmp_ok($s->{sampled_keys}, '>', 0, "still sampling");
+}
+
+done_testing();
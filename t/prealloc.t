@@ -0,0 +1,50 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{prealloc_threads}, 0, "one thread per CPU by default");
+    my $stats = mem_stats($sock);
+    ok(!exists $stats->{prealloc_ready}, "no prealloc stats without -L");
+}
+
+my $server = new_memcached("-m 256 -L -o prealloc_threads=4");
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+is($settings->{prealloc_threads}, 4, "prealloc_threads reported");
+
+# Faulting in may carry on in the background after startup.
+my $stats;
+for (1 .. 100) {
+    $stats = mem_stats($sock);
+    last if $stats->{prealloc_ready};
+    sleep 0.1;
+}
+is($stats->{prealloc_ready}, 1, "preallocation finished");
+is($stats->{prealloc_bytes}, 256 * 1024 * 1024, "every byte faulted in");
+cmp_ok($stats->{prealloc_usec}, '>', 0, "time recorded");
+
+SKIP: {
+    my $status = "/proc/$stats->{pid}/status";
+    skip "no /proc", 1 unless open(my $fh, '<', $status);
+    my ($rss) = map { /^VmRSS:\s+(\d+)/ ? $1 : () } <$fh>;
+    cmp_ok($rss, '>=', 250 * 1024, "memory is resident");
+}
+
+my $val = 'p' x 1000;
+for my $k (1 .. 100) {
+    print $sock "set key$k 0 0 1000\r\n$val\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key$k");
+}
+mem_get_is($sock, "key1", $val);
+mem_get_is($sock, "key100", $val);
+
+done_testing();
@@ -0,0 +1,105 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{prefix_quotas}, 'no', "off by default");
+    print $sock "quota a 1000\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR prefix quotas not enabled\r\n",
+        "quota needs prefix_quotas");
+}
+
+my $server = new_memcached("-o prefix_quotas");
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+is($settings->{prefix_quotas}, 'yes', "prefix_quotas reported");
+
+my $val = 'x' x 1000;
+
+# Another tenant, plus keys with no prefix at all.
+for my $k (1 .. 50) {
+    print $sock "set b:$k 0 0 1000 noreply\r\n$val\r\n";
+    print $sock "set plain$k 0 0 1000 noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "b:50", $val);
+
+my $stats = mem_stats($sock, ' quotas');
+is($stats->{'b:items'}, 50, "items counted per prefix");
+cmp_ok($stats->{'b:bytes'}, '>', 50000, "bytes counted per prefix");
+is($stats->{'b:limit'}, 0, "no quota by default");
+ok(!exists $stats->{'plain1:items'}, "keys without a prefix aren't tracked");
+my $b_bytes = $stats->{'b:bytes'};
+
+print $sock "quota a 20000\r\n";
+is(scalar <$sock>, "OK\r\n", "set quota for a");
+print $sock "quota a:b 20000\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad prefix\r\n", "prefix can't hold the delimiter");
+print $sock "quota a lots\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "bad quota");
+
+for my $k (1 .. 100) {
+    print $sock "set a:$k 0 0 1000\r\n$val\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a:$k");
+}
+
+$stats = mem_stats($sock, ' quotas');
+is($stats->{'a:limit'}, 20000, "quota reported");
+cmp_ok($stats->{'a:bytes'}, '<=', 20000, "a stayed under its quota");
+cmp_ok($stats->{'a:items'}, '>', 10, "a still has items");
+is($stats->{'a:evictions'}, 100 - $stats->{'a:items'}, "a evicted its own items");
+is($stats->{'a:rejects'}, 0, "no rejects");
+is($stats->{'b:bytes'}, $b_bytes, "b untouched");
+
+mem_get_is($sock, "a:1", undef, "oldest a item evicted");
+mem_get_is($sock, "a:100", $val, "newest a item kept");
+mem_get_is($sock, "b:1", $val, "other tenant kept");
+mem_get_is($sock, "plain1", $val, "unprefixed keys kept");
+
+# Replacing and deleting keeps the accounting straight.
+my $items = $stats->{'a:items'};
+print $sock "delete a:99\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted a:99");
+print $sock "set a:100 0 0 1000\r\n$val\r\n";
+is(scalar <$sock>, "STORED\r\n", "replaced a:100");
+$stats = mem_stats($sock, ' quotas');
+is($stats->{'a:items'}, $items - 1, "items follow deletes and replaces");
+
+# Nothing can make room for an item bigger than the quota.
+print $sock "quota c 500\r\n";
+is(scalar <$sock>, "OK\r\n", "set quota for c");
+print $sock "set c:1 0 0 1000\r\n$val\r\n";
+is(scalar <$sock>, "SERVER_ERROR out of memory storing object\r\n",
+    "store over quota refused");
+$stats = mem_stats($sock, ' quotas');
+is($stats->{'c:rejects'}, 1, "reject counted");
+
+# Removing the quota lifts the cap.
+print $sock "quota a 0\r\n";
+is(scalar <$sock>, "OK\r\n", "removed quota for a");
+for my $k (101 .. 150) {
+    print $sock "set a:$k 0 0 1000 noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "a:150", $val);
+$stats = mem_stats($sock, ' quotas');
+cmp_ok($stats->{'a:bytes'}, '>', 50000, "a grew past its old quota");
+
+# A prefix overwriting the same keys doesn't pile up queue entries.
+for (1 .. 20) {
+    for my $k (1 .. 10) {
+        print $sock "set d:$k 0 0 1 noreply\r\nx\r\n";
+    }
+}
+mem_get_is($sock, "d:10", "x");
+$stats = mem_stats($sock, ' quotas');
+is($stats->{'d:items'}, 10, "d items");
+cmp_ok($stats->{'d:fifo_entries'}, '<=', 30, "stale entries pruned");
+
+done_testing();
@@ -0,0 +1,77 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-m 32 -o slab_reassign,slab_automove=3,slab_automove_window=3,lru_maintainer');
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+is($settings->{slab_automove}, 3, "marginal hit rate automover");
+
+print $sock "slabs automove 4\r\n";
+is(scalar <$sock>, "ERROR\r\n", "no such automover");
+print $sock "slabs automove 3\r\n";
+is(scalar <$sock>, "OK\r\n", "can be picked at runtime");
+
+my $watcher = $server->new_sock;
+print $watcher "watch sysevents\n";
+is(<$watcher>, "OK\r\n", "watcher enabled");
+
+# Large items which are never read again fill memory first.
+my $cold = 'c' x 20000;
+for my $k (1 .. 2000) {
+    print $sock "set cold$k 0 0 20000 noreply\r\n$cold\r\n";
+}
+mem_get_is($sock, "cold2000", $cold);
+
+# Then a working set of small items, a bit larger than the one page its
+# class gets, is read in a loop. Its misses are on keys it evicted within
+# the last page, which a page from the cold class would turn into hits.
+my $hot = 'h' x 1000;
+my $keys = 1500;
+sub hot_pass {
+    my $hits = 0;
+    for my $k (1 .. $keys) {
+        print $sock "get hot$k\r\n";
+        my $line = <$sock>;
+        if ($line =~ /^VALUE/) {
+            $hits++;
+            <$sock>;
+            <$sock>;
+        } else {
+            print $sock "set hot$k 0 0 1000 noreply\r\n$hot\r\n";
+        }
+    }
+    return $hits;
+}
+
+hot_pass();
+cmp_ok(hot_pass(), '<', $keys / 2, "working set doesn't fit at first");
+
+# The automover decides once a second, after its window has filled.
+my $hits = 0;
+for (1 .. 100) {
+    $hits = hot_pass();
+    last if $hits == $keys;
+    select(undef, undef, undef, 0.2);
+}
+is($hits, $keys, "working set fits after pages moved");
+
+my $slabs = mem_stats($sock, 'slabs');
+my $line;
+while ($line = <$watcher>) {
+    last if $line =~ /type=slab_automove /;
+}
+like($line, qr/src=\d+ dst=\d+ src_hits=\d+ dst_hits=\d+ src_pages=\d+ dst_pages=\d+/,
+    "decision logged");
+my ($src, $dst, $src_hits, $dst_hits) =
+    $line =~ /src=(\d+) dst=(\d+) src_hits=(\d+) dst_hits=(\d+)/;
+cmp_ok($slabs->{"$src:chunk_size"}, '>', 20000, "page taken from the cold class");
+cmp_ok($slabs->{"$dst:chunk_size"}, '<', 2000, "and given to the hot one");
+cmp_ok($src_hits, '<', $dst_hits, "where it was worth more");
+
+done_testing();
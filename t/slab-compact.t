@@ -0,0 +1,66 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{slab_compact_ratio}, '0.00', "off by default");
+}
+
+my $server = new_memcached("-o slab_reassign,slab_automove=0,slab_compact_ratio=0.5");
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+is($settings->{slab_compact_ratio}, '0.50', "slab_compact_ratio reported");
+
+my $val = 'x' x 100;
+for my $k (1 .. 30000) {
+    print $sock "set key$k 0 0 100 noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "key30000", $val);
+
+my $s = mem_stats($sock, ' slabs');
+my ($cls) = grep { /^\d+:total_pages$/ && $s->{$_} >= 3 } keys %$s;
+ok(defined $cls, "filled a class over a few pages");
+$cls =~ s/:.*//;
+my $pages = $s->{"$cls:total_pages"};
+
+sleep 2;
+my $stats = mem_stats($sock);
+is($stats->{slabs_compacted}, 0, "full class left alone");
+
+# Leave one item in ten behind, spread over every page.
+for my $k (1 .. 30000) {
+    next if $k % 10 == 0;
+    print $sock "delete key$k noreply\r\n";
+}
+mem_get_is($sock, "key1", undef);
+
+for (1 .. 100) {
+    $s = mem_stats($sock, ' slabs');
+    last if $s->{"$cls:total_pages"} == 1;
+    sleep 0.1;
+}
+is($s->{"$cls:total_pages"}, 1, "class packed down to one page");
+$stats = mem_stats($sock);
+is($stats->{slabs_compacted}, $pages - 1, "sparse pages compacted");
+cmp_ok($stats->{slab_global_page_pool}, '>=', $pages - 1, "pages given back");
+cmp_ok($stats->{slab_reassign_rescues}, '>', 0, "live items rescued");
+is($stats->{slab_reassign_evictions_nomem}, 0, "nothing evicted");
+
+my $bad = 0;
+for my $k (1 .. 3000) {
+    my $key = "key" . ($k * 10);
+    print $sock "get $key\r\n";
+    $bad++ unless scalar <$sock> eq "VALUE $key 0 100\r\n"
+        && scalar <$sock> eq "$val\r\n" && scalar <$sock> eq "END\r\n";
+}
+is($bad, 0, "every live item kept");
+
+done_testing();
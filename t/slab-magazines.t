@@ -0,0 +1,85 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{slab_magazines}, 0, "off by default");
+    my $s = mem_stats($sock, ' slabs');
+    ok(!exists $s->{magazine_hits}, "no magazine stats when off");
+}
+
+my $server = new_memcached("-o slab_reassign,slab_magazines=32");
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+is($settings->{slab_magazines}, 32, "slab_magazines reported");
+
+my $val = 'x' x 100;
+for my $k (1 .. 20000) {
+    print $sock "set key$k 0 0 100 noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "key20000", $val);
+
+my $s = mem_stats($sock, ' slabs');
+my ($cls) = grep { /^\d+:total_pages$/ && $s->{$_} >= 2 } keys %$s;
+ok(defined $cls, "filled a class past one page");
+$cls =~ s/:.*//;
+cmp_ok($s->{magazine_hits}, '>', 19000, "allocations came from magazines");
+cmp_ok($s->{magazine_refills}, '<', $s->{magazine_hits} / 4, "refilled in batches");
+is($s->{magazine_flushes}, 0, "nothing flushed yet");
+
+# Frees go back to the magazine, and only spill over once it's full.
+for my $k (1 .. 1000) {
+    print $sock "delete key$k noreply\r\n";
+}
+mem_get_is($sock, "key1000", undef);
+$s = mem_stats($sock, ' slabs');
+cmp_ok($s->{magazine_drains}, '>', 0, "full magazines drained");
+cmp_ok($s->{"$cls:magazine_chunks"}, '>', 0, "magazine holding chunks");
+cmp_ok($s->{"$cls:magazine_chunks"}, '<=', 32, "magazine stays small");
+is($s->{"$cls:free_chunks"} + $s->{"$cls:used_chunks"},
+    $s->{"$cls:total_chunks"}, "magazine chunks count as used");
+
+# Moving a page away has to take back the chunks held in magazines first.
+my $dst = $cls + 1;
+print $sock "slabs reassign $cls $dst\r\n";
+is(scalar <$sock>, "OK\r\n", "started a page move");
+my $stats;
+for (1 .. 50) {
+    $stats = mem_stats($sock);
+    last if $stats->{slabs_moved} > 0 && !$stats->{slab_reassign_running};
+    sleep 0.1;
+}
+is($stats->{slabs_moved}, 1, "page moved");
+$s = mem_stats($sock, ' slabs');
+is($s->{magazine_flushes}, 1, "magazines were flushed");
+
+my $bad = 0;
+for my $k (1001 .. 20000) {
+    print $sock "get key$k\r\n";
+    my $line = <$sock>;
+    next if $line eq "END\r\n";
+    my $body = <$sock>;
+    my $end = <$sock>;
+    $bad++ unless $line eq "VALUE key$k 0 100\r\n" && $body eq "$val\r\n"
+        && $end eq "END\r\n";
+}
+is($bad, 0, "surviving items are intact");
+
+# And magazines are back in use afterwards.
+my $hits = $s->{magazine_hits};
+for my $k (1 .. 100) {
+    print $sock "set new$k 0 0 100 noreply\r\n$val\r\n";
+}
+mem_get_is($sock, "new100", $val);
+$s = mem_stats($sock, ' slabs');
+cmp_ok($s->{magazine_hits}, '>=', $hits + 100, "magazines resumed");
+
+done_testing();
@@ -0,0 +1,82 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    print $sock "slabs reprofile\r\n";
+    is(scalar <$sock>, "NOSIZES no items in stats sizes\r\n",
+        "needs size tracking");
+    my $s = mem_stats($sock, ' slab_profile');
+    is($s->{reprofiles}, 0, "no reprofiles");
+    ok(!exists $s->{sized_items}, "no projection without sizes");
+}
+
+my $server = new_memcached("-m 64 -o track_sizes");
+my $sock = $server->sock;
+
+print $sock "slabs reprofile\r\n";
+is(scalar <$sock>, "NOSIZES no items in stats sizes\r\n", "nothing sized yet");
+
+# Two sizes which sit badly in the default classes.
+sub val { my $k = shift; return 'x' x ($k % 2 ? 300 : 1000) }
+for my $k (1 .. 20000) {
+    my $v = val($k);
+    print $sock "set key$k 0 0 " . length($v) . " noreply\r\n$v\r\n";
+}
+mem_get_is($sock, "key20000", val(20000));
+
+my $s = mem_stats($sock, ' slab_profile');
+my $classes = $s->{classes};
+is($s->{sized_items}, 20000, "items sized");
+cmp_ok($s->{projected_waste_ratio}, '<', $s->{estimated_waste_ratio},
+    "a better layout exists");
+ok(exists $s->{'0:projected_size'}, "proposed sizes listed");
+my $before = $s->{waste_ratio};
+
+print $sock "slabs reprofile\r\n";
+is(scalar <$sock>, "OK\r\n", "reprofiled");
+
+for (1 .. 100) {
+    $s = mem_stats($sock, ' slab_profile');
+    last if $s->{retired_pages} == 0;
+    sleep 0.1;
+}
+is($s->{retired_pages}, 0, "old classes drained");
+is($s->{reprofiles}, 1, "reprofile counted");
+cmp_ok($s->{classes}, '<', $classes, "fewer classes in use");
+is($s->{last_waste_ratio}, $before, "waste before recorded");
+cmp_ok($s->{projected_savings}, '>', 0, "savings projected");
+cmp_ok($s->{actual_savings}, '>', 0, "memory actually saved");
+cmp_ok($s->{waste_ratio}, '<', $before, "less waste than before");
+
+my $stats = mem_stats($sock);
+is($stats->{slab_reassign_evictions_nomem}, 0, "nothing evicted");
+my $bad = 0;
+for my $k (1 .. 20000) {
+    my $v = val($k);
+    print $sock "get key$k\r\n";
+    $bad++ unless scalar <$sock> eq "VALUE key$k 0 " . length($v) . "\r\n"
+        && scalar <$sock> eq "$v\r\n" && scalar <$sock> eq "END\r\n";
+}
+is($bad, 0, "every item moved intact");
+
+print $sock "slabs reprofile\r\n";
+is(scalar <$sock>, "NOGAIN current classes are as good\r\n",
+    "nothing to gain twice");
+
+# New items of other sizes still find a class.
+for my $len (10, 5000, 100000) {
+    my $v = 'y' x $len;
+    print $sock "set new$len 0 0 $len\r\n$v\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored $len bytes");
+    mem_get_is($sock, "new$len", $v);
+}
+
+done_testing();
@@ -0,0 +1,112 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $val = 'x' x 10000;
+
+sub fill {
+    my ($sock, $prefix, $count) = @_;
+    for my $k (1 .. $count) {
+        print $sock "set $prefix$k 0 0 10000 noreply\r\n$val\r\n";
+    }
+    mem_get_is($sock, "$prefix$count", $val);
+}
+
+sub wait_malloced {
+    my ($sock, $limit) = @_;
+    my $s;
+    for (1 .. 100) {
+        $s = mem_stats($sock, ' slabs');
+        last if $s->{total_malloced} <= $limit;
+        sleep 0.1;
+    }
+    return $s;
+}
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{slab_idle_trim}, 0, "idle trim off by default");
+    my $s = mem_stats($sock, ' slabs');
+    is($s->{pages_released}, 0, "nothing released yet");
+    ok(!exists $s->{pages_trimmed}, "no trim stats when off");
+}
+
+# Lowering the limit moves pages out of the classes, not just the pool.
+{
+    my $server = new_memcached("-m 64");
+    my $sock = $server->sock;
+    fill($sock, "key", 5000);
+    my $s = mem_stats($sock, ' slabs');
+    cmp_ok($s->{total_malloced}, '>', 32 * 1024 * 1024, "filled past the new limit");
+
+    print $sock "cache_memlimit 16\r\n";
+    is(scalar <$sock>, "OK\r\n", "lowered limit to 16m");
+    $s = wait_malloced($sock, 16 * 1024 * 1024);
+    cmp_ok($s->{total_malloced}, '<=', 16 * 1024 * 1024, "shrunk to the limit");
+    cmp_ok($s->{pages_released}, '>=', 16, "pages released");
+    my $stats = mem_stats($sock);
+    cmp_ok($stats->{slab_reassign_evictions_nomem}, '>', 0, "items on moved pages evicted");
+    mem_get_is($sock, "key5000", $val, "newest item kept");
+
+    fill($sock, "more", 2000);
+    $s = mem_stats($sock, ' slabs');
+    cmp_ok($s->{total_malloced}, '<=', 16 * 1024 * 1024, "stays under the limit");
+}
+
+# Preallocated memory can shrink too.
+{
+    my $server = new_memcached("-m 100 -L");
+    my $sock = $server->sock;
+    fill($sock, "key", 9000);
+
+    print $sock "cache_memlimit 64\r\n";
+    is(scalar <$sock>, "OK\r\n", "lowered preallocated limit to 64m");
+    my $s = wait_malloced($sock, 64 * 1024 * 1024);
+    cmp_ok($s->{total_malloced}, '<=', 64 * 1024 * 1024, "shrunk to the limit");
+    cmp_ok($s->{pages_released}, '>', 0, "pages released");
+
+    print $sock "cache_memlimit 100\r\n";
+    is(scalar <$sock>, "OK\r\n", "raised back to where it started");
+    fill($sock, "more", 9000);
+    $s = mem_stats($sock, ' slabs');
+    cmp_ok($s->{total_malloced}, '>', 64 * 1024 * 1024, "released pages reused");
+}
+
+# Pages the automover gives back to the pool are trimmed once idle.
+{
+    my $server = new_memcached("-m 64 -o slab_idle_trim=1,slab_automove_window=3");
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{slab_idle_trim}, 1, "slab_idle_trim reported");
+
+    fill($sock, "key", 3000);
+    my $s = mem_stats($sock, ' slabs');
+    my $malloced = $s->{total_malloced};
+    for my $k (1 .. 3000) {
+        print $sock "delete key$k noreply\r\n";
+    }
+    mem_get_is($sock, "key3000", undef);
+
+    for (1 .. 150) {
+        $s = mem_stats($sock, ' slabs');
+        last if $s->{pages_trimmed} >= 16;
+        sleep 0.1;
+    }
+    cmp_ok($s->{pages_trimmed}, '>=', 16, "idle pool pages trimmed");
+    cmp_ok($s->{total_malloced}, '<', $malloced, "memory given back");
+    is($s->{pages_released}, $s->{pages_trimmed}, "all of it by trimming");
+    $settings = mem_stats($sock, ' settings');
+    is($settings->{maxbytes}, 64 * 1024 * 1024, "limit unchanged");
+
+    fill($sock, "again", 3000);
+    mem_get_is($sock, "again1", $val, "pool regrows on demand");
+}
+
+done_testing();
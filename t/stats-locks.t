@@ -0,0 +1,57 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-t 4");
+my $sock = $server->sock;
+
+my $locks = mem_stats($sock, ' locks');
+is($locks->{'item:count'}, 2**12, "item lock stripes sized by thread count");
+is($locks->{'slabs:count'}, 1, "one slabs lock");
+is($locks->{'cas_id:count'}, 1, "one cas id lock");
+ok($locks->{'lru:count'} > 0, "lru locks counted");
+
+for my $lock (qw(item lru slabs cas_id)) {
+    for my $stat (qw(contended trylock_fails wait_us wait_lt_10us wait_lt_100us
+                     wait_lt_1ms wait_lt_10ms wait_lt_100ms wait_ge_100ms)) {
+        ok(defined $locks->{"$lock:$stat"}, "$lock:$stat reported");
+    }
+}
+
+# Hammer a few keys from several connections so the locks see some traffic.
+my @socks = map { $server->new_sock } 1 .. 4;
+for my $round (1 .. 200) {
+    for my $s (@socks) {
+        print $s "set hot$round 0 0 1 noreply\r\nx\r\nget hot$round\r\n";
+    }
+    for my $s (@socks) {
+        my $line = <$s>;
+        is($line, "VALUE hot$round 0 1\r\n", "got hot$round") if $round == 200;
+        <$s>;
+        <$s>;
+    }
+}
+
+$locks = mem_stats($sock, ' locks');
+my $hist = 0;
+$hist += $locks->{"item:$_"} for qw(wait_lt_10us wait_lt_100us wait_lt_1ms
+                                     wait_lt_10ms wait_lt_100ms wait_ge_100ms);
+is($hist, $locks->{'item:contended'}, "item wait histogram adds up");
+if ($locks->{'item:contended'} > 0) {
+    ok(defined $locks->{'item:top1:id'}, "most contended item stripe listed");
+    ok($locks->{'item:top1:id'} < 2**12, "stripe id in range");
+}
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats reset");
+$locks = mem_stats($sock, ' locks');
+is($locks->{'item:contended'}, 0, "item contention cleared");
+is($locks->{'slabs:wait_us'}, 0, "slabs wait time cleared");
+ok(!defined $locks->{'item:top1:id'}, "top stripes cleared");
+
+done_testing();
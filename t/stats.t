@@ -1,7 +1,7 @@
 #!/usr/bin/env perl
 
 use strict;
-use Test::More tests => 113;
+use Test::More tests => 131;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -28,9 +28,9 @@ if (MemcachedTest::enabled_tls_testing()) {
     # when TLS is enabled, stats contains additional keys:
     #   - ssl_handshake_errors
     #   - time_since_server_cert_refresh
-    is(scalar(keys(%$stats)), 85, "expected count of stats values");
+    is(scalar(keys(%$stats)), 96, "expected count of stats values");
 } else {
-    is(scalar(keys(%$stats)), 83, "expected count of stats values");
+    is(scalar(keys(%$stats)), 94, "expected count of stats values");
 }
 
 # Test initial state
@@ -200,4 +200,31 @@ is(scalar <$sock>, "SERVER_ERROR object too large for cache\r\n",
     "set rejected due to value too large");
 $stats = mem_stats($sock);
 is($stats->{'store_too_large'}, 1,
-    "recorded store failure due to value too large")
+    "recorded store failure due to value too large");
+
+# multiget and pipelined meta get keys are prefetched in batches
+$stats = mem_stats($sock);
+is($stats->{'get_prefetch_batches'}, 0, "no prefetch batches yet");
+print $sock "set pf1 0 0 1\r\na\r\nset pf2 0 0 1\r\nb\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored pf1");
+is(scalar <$sock>, "STORED\r\n", "stored pf2");
+print $sock "get pf1 pf2 pf3\r\n";
+is(scalar <$sock>, "VALUE pf1 0 1\r\n", "multiget pf1");
+is(scalar <$sock>, "a\r\n", "multiget pf1 value");
+is(scalar <$sock>, "VALUE pf2 0 1\r\n", "multiget pf2");
+is(scalar <$sock>, "b\r\n", "multiget pf2 value");
+is(scalar <$sock>, "END\r\n", "multiget end");
+$stats = mem_stats($sock);
+is($stats->{'get_prefetch_batches'}, 1, "multiget was one prefetch batch");
+is($stats->{'get_prefetch_keys'}, 3, "three keys prefetched");
+
+print $sock "mg pf1 v\r\nmg pf2 v\r\nmg pf3 v\r\nmn\r\n";
+is(scalar <$sock>, "VA 1\r\n", "mg pf1");
+is(scalar <$sock>, "a\r\n", "mg pf1 value");
+is(scalar <$sock>, "VA 1\r\n", "mg pf2");
+is(scalar <$sock>, "b\r\n", "mg pf2 value");
+is(scalar <$sock>, "EN\r\n", "mg pf3 miss");
+is(scalar <$sock>, "MN\r\n", "mn");
+$stats = mem_stats($sock);
+is($stats->{'get_prefetch_batches'}, 2, "mg pipeline was one prefetch batch");
+is($stats->{'get_prefetch_keys'}, 6, "three more keys prefetched");
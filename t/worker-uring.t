@@ -0,0 +1,81 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $check = new_memcached();
+my $check_settings = mem_stats($check->sock, ' settings');
+if (!exists $check_settings->{worker_uring}) {
+    plan skip_all => 'not built with --enable-worker-uring';
+}
+$check->stop;
+
+my $server = new_memcached('-o worker_uring -R 4');
+my $sock = $server->sock;
+my $settings = mem_stats($sock, ' settings');
+is($settings->{worker_uring}, 'yes', "worker_uring enabled");
+
+print $sock "set foo 0 0 6\r\nfooval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+mem_get_is($sock, "foo", "fooval");
+
+# Larger than a receive buffer in both directions.
+my $big = join('', map { chr(65 + $_ % 26) } 1 .. 300000);
+print $sock "set big 0 0 " . length($big) . "\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored a large value");
+print $sock "get big\r\n";
+is(scalar <$sock>, "VALUE big 0 " . length($big) . "\r\n", "large value header");
+ok(scalar <$sock> eq "$big\r\n", "large value intact");
+is(scalar <$sock>, "END\r\n", "large value end");
+
+# Pipelined past the -R limit, so connections yield with input buffered.
+my $n = 200;
+print $sock join('', map { "set p$_ 0 0 " . length($_) . " noreply\r\n$_\r\n" } 1 .. $n);
+print $sock join('', map { "get p$_\r\n" } 1 .. $n);
+my $ok = 0;
+for my $k (1 .. $n) {
+    my $v = <$sock>;
+    my $d = <$sock>;
+    my $e = <$sock>;
+    $ok++ if $v eq "VALUE p$k 0 " . length($k) . "\r\n" && $d eq "$k\r\n"
+        && $e eq "END\r\n";
+}
+is($ok, $n, "pipelined responses in order");
+
+# A few connections at once.
+my @socks = map { $server->new_sock } 1 .. 8;
+for my $i (0 .. $#socks) {
+    print { $socks[$i] } "set c$i 0 0 1\r\n$i\r\n";
+}
+for my $i (0 .. $#socks) {
+    is(scalar readline($socks[$i]), "STORED\r\n", "stored from connection $i");
+}
+mem_get_is($socks[$_], "c" . (7 - $_), 7 - $_) for 0 .. $#socks;
+
+# Connections handed to the logger thread, and closed from there.
+my $watcher = $server->new_sock;
+print $watcher "watch fetchers\n";
+is(<$watcher>, "OK\r\n", "watcher enabled");
+mem_get_is($sock, "foo", "fooval");
+like(<$watcher>, qr/ts=\d+\.\d+\ gid=\d+ type=item_get key=foo/,
+    "watcher saw the fetch");
+close($watcher);
+
+print $sock "quit\r\n";
+is(scalar <$sock>, undef, "closed on quit");
+
+$sock = $server->new_sock;
+mem_get_is($sock, "foo", "fooval");
+my $stats = mem_stats($sock);
+cmp_ok($stats->{uring_sqes}, '>=', $stats->{uring_submits},
+    "submits batch SQEs");
+cmp_ok($stats->{uring_submits}, '>', 0, "submitted");
+cmp_ok($stats->{uring_cqes}, '>=', $stats->{uring_cqe_batches},
+    "completions reaped in batches");
+cmp_ok($stats->{uring_cqe_batches}, '>', 0, "reaped");
+
+done_testing();
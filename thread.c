@@ -3,6 +3,11 @@
  * Thread management for memcached.
  */
 #include "memcached.h"
+#include "logmem.h"
+#include "slab_automove_shadow.h"
+#include "tinylfu.h"
+#include "expiry.h"
+#include "mrc.h"
 #ifdef EXTSTORE
 #include "storage.h"
 #endif
@@ -12,6 +17,9 @@
 #ifdef PROXY
 #include "proto_proxy.h"
 #endif
+#ifdef WORKER_URING
+#include "uring.h"
+#endif
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
@@ -68,6 +76,7 @@ struct conn_queue {
 
 /* Locks for cache LRU operations */
 pthread_mutex_t lru_locks[POWER_LARGEST];
+struct lock_stats lru_lock_stats[POWER_LARGEST];
 
 /* Connection lock around accepting new connections */
 pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -83,6 +92,12 @@ static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t worker_hang_lock;
 
 static pthread_mutex_t *item_locks;
+/* -o item_lock_mode=rwlock uses these instead. Lookups share them and
+ * everything else takes them exclusively. */
+static pthread_rwlock_t *item_rwlocks;
+static bool item_lock_rw = false;
+/* contention counters per item lock stripe */
+static struct lock_stats *item_lock_stats;
 /* size of the item lock hash table */
 static uint32_t item_lock_count;
 static unsigned int item_lock_hashpower;
@@ -118,24 +133,310 @@ static void thread_libevent_ionotify(evutil_socket_t fd, short which, void *arg)
  * without first locking and removing from the LRU.
  */
 
+/*
+ * Lock contention profiling.
+ * Counters are kept per class of lock, and per lock for the item lock
+ * stripes and the LRUs so the hottest ones can be listed. Waits are bucketed
+ * by order of magnitude, starting below 10us.
+ */
+#define LOCK_WAIT_BUCKETS 6
+#define LOCK_TOP_COUNT 5
+static struct lock_stats lock_class_stats[LOCK_CLASS_MAX];
+static uint64_t lock_wait_hist[LOCK_CLASS_MAX][LOCK_WAIT_BUCKETS];
+static const char *lock_class_names[LOCK_CLASS_MAX] = {
+    "item", "lru", "slabs", "cas_id"
+};
+static const char *lock_wait_names[LOCK_WAIT_BUCKETS] = {
+    "wait_lt_10us", "wait_lt_100us", "wait_lt_1ms", "wait_lt_10ms",
+    "wait_lt_100ms", "wait_ge_100ms"
+};
+#ifndef HAVE_GCC_64ATOMICS
+static pthread_mutex_t lock_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline void lock_stats_add(uint64_t *counter, const uint64_t val) {
+#ifdef HAVE_GCC_64ATOMICS
+    __sync_fetch_and_add(counter, val);
+#else
+    pthread_mutex_lock(&lock_stats_lock);
+    *counter += val;
+    pthread_mutex_unlock(&lock_stats_lock);
+#endif
+}
+
+static uint64_t lock_stats_now(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void lock_stats_waited(enum lock_class cls, struct lock_stats *ls,
+        const uint64_t start) {
+    uint64_t wait_us = lock_stats_now() - start;
+    uint64_t limit = 10;
+    int b;
+
+    for (b = 0; b < LOCK_WAIT_BUCKETS - 1 && wait_us >= limit; b++) {
+        limit *= 10;
+    }
+    lock_stats_add(&lock_class_stats[cls].contended, 1);
+    lock_stats_add(&lock_class_stats[cls].wait_us, wait_us);
+    lock_stats_add(&lock_wait_hist[cls][b], 1);
+    if (ls != NULL) {
+        lock_stats_add(&ls->contended, 1);
+        lock_stats_add(&ls->wait_us, wait_us);
+    }
+}
+
+/* Slow path of mutex_lock_class(), once the trylock failed. */
+void mutex_lock_contended(pthread_mutex_t *lock, enum lock_class cls, struct lock_stats *ls) {
+    uint64_t start = lock_stats_now();
+    mutex_lock(lock);
+    lock_stats_waited(cls, ls, start);
+}
+
+void lock_stats_trylock_fail(enum lock_class cls, struct lock_stats *ls) {
+    lock_stats_add(&lock_class_stats[cls].trylock_fails, 1);
+    if (ls != NULL) {
+        lock_stats_add(&ls->trylock_fails, 1);
+    }
+}
+
+void lock_stats_reset(void) {
+    memset(lock_class_stats, 0, sizeof(lock_class_stats));
+    memset(lock_wait_hist, 0, sizeof(lock_wait_hist));
+    memset(lru_lock_stats, 0, sizeof(lru_lock_stats));
+    memset(item_lock_stats, 0, sizeof(struct lock_stats) * item_lock_count);
+}
+
+/* Lists the most contended locks out of a per-lock array. */
+static void lock_stats_top(ADD_STAT add_stats, void *c, const char *cls,
+        struct lock_stats *ls, const uint32_t count) {
+    uint32_t top[LOCK_TOP_COUNT];
+    int found = 0;
+    uint32_t i;
+    int x;
+
+    for (i = 0; i < count; i++) {
+        if (ls[i].contended == 0 && ls[i].trylock_fails == 0) {
+            continue;
+        }
+        /* insertion sort into the short list */
+        for (x = found; x > 0; x--) {
+            struct lock_stats *o = &ls[top[x - 1]];
+            if (o->contended > ls[i].contended || (o->contended == ls[i].contended
+                        && o->trylock_fails >= ls[i].trylock_fails)) {
+                break;
+            }
+            if (x < LOCK_TOP_COUNT) {
+                top[x] = top[x - 1];
+            }
+        }
+        if (x < LOCK_TOP_COUNT) {
+            top[x] = i;
+            if (found < LOCK_TOP_COUNT) {
+                found++;
+            }
+        }
+    }
+
+    for (x = 0; x < found; x++) {
+        char key_str[STAT_KEY_LEN];
+        char val_str[STAT_VAL_LEN];
+        int klen = 0, vlen = 0;
+        struct lock_stats *s = &ls[top[x]];
+
+        klen = snprintf(key_str, STAT_KEY_LEN, "%s:top%d:id", cls, x + 1);
+        vlen = snprintf(val_str, STAT_VAL_LEN, "%u", top[x]);
+        add_stats(key_str, klen, val_str, vlen, c);
+        klen = snprintf(key_str, STAT_KEY_LEN, "%s:top%d:contended", cls, x + 1);
+        vlen = snprintf(val_str, STAT_VAL_LEN, "%llu", (unsigned long long)s->contended);
+        add_stats(key_str, klen, val_str, vlen, c);
+        klen = snprintf(key_str, STAT_KEY_LEN, "%s:top%d:trylock_fails", cls, x + 1);
+        vlen = snprintf(val_str, STAT_VAL_LEN, "%llu", (unsigned long long)s->trylock_fails);
+        add_stats(key_str, klen, val_str, vlen, c);
+        klen = snprintf(key_str, STAT_KEY_LEN, "%s:top%d:wait_us", cls, x + 1);
+        vlen = snprintf(val_str, STAT_VAL_LEN, "%llu", (unsigned long long)s->wait_us);
+        add_stats(key_str, klen, val_str, vlen, c);
+    }
+}
+
+void lock_stats(ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    int cls, b;
+
+    for (cls = 0; cls < LOCK_CLASS_MAX; cls++) {
+        const char *name = lock_class_names[cls];
+        struct lock_stats *s = &lock_class_stats[cls];
+        uint32_t count = 1;
+
+        if (cls == LOCK_CLASS_ITEM) {
+            count = item_lock_count;
+        } else if (cls == LOCK_CLASS_LRU) {
+            count = POWER_LARGEST;
+        }
+        APPEND_NUM_FMT_STAT("%s:%s", name, "count", "%u", count);
+        APPEND_NUM_FMT_STAT("%s:%s", name, "contended", "%llu",
+                (unsigned long long)s->contended);
+        APPEND_NUM_FMT_STAT("%s:%s", name, "trylock_fails", "%llu",
+                (unsigned long long)s->trylock_fails);
+        APPEND_NUM_FMT_STAT("%s:%s", name, "wait_us", "%llu",
+                (unsigned long long)s->wait_us);
+        for (b = 0; b < LOCK_WAIT_BUCKETS; b++) {
+            APPEND_NUM_FMT_STAT("%s:%s", name, lock_wait_names[b], "%llu",
+                    (unsigned long long)lock_wait_hist[cls][b]);
+        }
+
+        if (cls == LOCK_CLASS_ITEM) {
+            lock_stats_top(add_stats, c, name, item_lock_stats, item_lock_count);
+        } else if (cls == LOCK_CLASS_LRU) {
+            lock_stats_top(add_stats, c, name, lru_lock_stats, POWER_LARGEST);
+        }
+    }
+
+    /* getting here means both ascii and binary terminators fit */
+    add_stats(NULL, 0, NULL, 0, c);
+}
+
 void item_lock(uint32_t hv) {
-    mutex_lock(&item_locks[hv & hashmask(item_lock_hashpower)]);
+    uint32_t stripe = hv & hashmask(item_lock_hashpower);
+    if (item_lock_rw) {
+        if (pthread_rwlock_trywrlock(&item_rwlocks[stripe]) != 0) {
+            uint64_t start = lock_stats_now();
+            pthread_rwlock_wrlock(&item_rwlocks[stripe]);
+            lock_stats_waited(LOCK_CLASS_ITEM, &item_lock_stats[stripe], start);
+        }
+    } else {
+        mutex_lock_class(&item_locks[stripe], LOCK_CLASS_ITEM, &item_lock_stats[stripe]);
+    }
 }
 
 void *item_trylock(uint32_t hv) {
-    pthread_mutex_t *lock = &item_locks[hv & hashmask(item_lock_hashpower)];
-    if (pthread_mutex_trylock(lock) == 0) {
-        return lock;
+    uint32_t stripe = hv & hashmask(item_lock_hashpower);
+    if (item_lock_rw) {
+        pthread_rwlock_t *lock = &item_rwlocks[stripe];
+        if (pthread_rwlock_trywrlock(lock) == 0) {
+            return lock;
+        }
+    } else {
+        pthread_mutex_t *lock = &item_locks[stripe];
+        if (pthread_mutex_trylock(lock) == 0) {
+            return lock;
+        }
     }
+    lock_stats_trylock_fail(LOCK_CLASS_ITEM, &item_lock_stats[stripe]);
     return NULL;
 }
 
 void item_trylock_unlock(void *lock) {
-    mutex_unlock((pthread_mutex_t *) lock);
+    if (item_lock_rw) {
+        pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+    } else {
+        mutex_unlock((pthread_mutex_t *) lock);
+    }
 }
 
 void item_unlock(uint32_t hv) {
-    mutex_unlock(&item_locks[hv & hashmask(item_lock_hashpower)]);
+    if (item_lock_rw) {
+        pthread_rwlock_unlock(&item_rwlocks[hv & hashmask(item_lock_hashpower)]);
+    } else {
+        mutex_unlock(&item_locks[hv & hashmask(item_lock_hashpower)]);
+    }
+}
+
+/* refcount_incr() for holders of a shared item lock, where other readers
+ * may be taking references at the same time. Releasing references always
+ * happens under the exclusive lock, so only this side needs to be atomic. */
+unsigned short refcount_incr_shared(item *it) {
+#ifdef HAVE_GCC_ATOMICS
+    return __sync_add_and_fetch(&it->refcount, 1);
+#elif defined(__sun)
+    return atomic_inc_ushort_nv(&it->refcount);
+#else
+    unsigned short res;
+    mutex_lock(&atomics_mutex);
+    it->refcount++;
+    res = it->refcount;
+    mutex_unlock(&atomics_mutex);
+    return res;
+#endif
+}
+
+/* GDSF's credit for a hit, for callers holding the item lock shared. Other
+ * readers may be crediting the same item. */
+void item_credit_shared(item *it) {
+#ifdef HAVE_GCC_ATOMICS
+    uint8_t old = it->credit;
+    while (old < UINT8_MAX) {
+        uint8_t credit = old + it->cost > UINT8_MAX ? UINT8_MAX : old + it->cost;
+        uint8_t prev = __sync_val_compare_and_swap(&it->credit, old, credit);
+        if (prev == old)
+            break;
+        old = prev;
+    }
+#else
+    mutex_lock(&atomics_mutex);
+    it->credit = it->credit + it->cost > UINT8_MAX
+        ? UINT8_MAX : it->credit + it->cost;
+    mutex_unlock(&atomics_mutex);
+#endif
+}
+
+/* Takes the item lock for a lookup: shared in rwlock mode, exclusive
+ * otherwise. Returns true if the lock was busy and we had to wait. */
+static bool item_lock_lookup(uint32_t hv) {
+    uint32_t stripe = hv & hashmask(item_lock_hashpower);
+    uint64_t start;
+    if (item_lock_rw) {
+        pthread_rwlock_t *lock = &item_rwlocks[stripe];
+        if (pthread_rwlock_tryrdlock(lock) == 0) {
+            return false;
+        }
+        start = lock_stats_now();
+        pthread_rwlock_rdlock(lock);
+    } else {
+        pthread_mutex_t *lock = &item_locks[stripe];
+        if (pthread_mutex_trylock(lock) == 0) {
+            return false;
+        }
+        start = lock_stats_now();
+        mutex_lock(lock);
+    }
+    lock_stats_waited(LOCK_CLASS_ITEM, &item_lock_stats[stripe], start);
+    return true;
+}
+
+/* Acquires every item lock, in order. Used to publish a new hash table
+ * without pausing all threads: every hash bucket access happens under an
+ * item lock, so holding all of them excludes any reader or writer.
+ * Threads only ever block on an item lock while holding no other item lock
+ * (nested acquisitions use item_trylock()), so ordered acquisition here
+ * can't deadlock.
+ */
+void item_lock_all(void) {
+    uint32_t i;
+    for (i = 0; i < item_lock_count; i++) {
+        item_lock(i);
+    }
+}
+
+uint32_t item_lock_stripes(void) {
+    return item_lock_count;
+}
+
+void item_unlock_all(void) {
+    uint32_t i;
+    for (i = item_lock_count; i > 0; i--) {
+        item_unlock(i - 1);
+    }
 }
 
 static void wait_for_thread_registration(int nthreads) {
@@ -164,6 +465,8 @@ void pause_threads(enum pause_thread_types type) {
             slabs_rebalancer_pause();
             lru_maintainer_pause();
             lru_crawler_pause();
+            expiry_wheel_pause();
+            logmem_cleaner_pause();
 #ifdef EXTSTORE
             storage_compact_pause();
             storage_write_pause();
@@ -176,6 +479,8 @@ void pause_threads(enum pause_thread_types type) {
             slabs_rebalancer_resume();
             lru_maintainer_resume();
             lru_crawler_resume();
+            expiry_wheel_resume();
+            logmem_cleaner_resume();
 #ifdef EXTSTORE
             storage_compact_resume();
             storage_write_resume();
@@ -237,6 +542,11 @@ void stop_threads(void) {
     stop_item_crawler_thread(CRAWLER_WAIT);
     if (settings.verbose > 0)
         fprintf(stderr, "stopped lru crawler\n");
+    if (settings.expiry_wheel) {
+        stop_expiry_wheel_thread();
+        if (settings.verbose > 0)
+            fprintf(stderr, "stopped expiry wheel\n");
+    }
     if (settings.lru_maintainer_thread) {
         stop_lru_maintainer_thread();
         if (settings.verbose > 0)
@@ -247,6 +557,11 @@ void stop_threads(void) {
         if (settings.verbose > 0)
             fprintf(stderr, "stopped slab mover\n");
     }
+    if (settings.log_memory) {
+        stop_logmem_cleaner_thread();
+        if (settings.verbose > 0)
+            fprintf(stderr, "stopped log memory cleaner\n");
+    }
     logger_stop();
     if (settings.verbose > 0)
         fprintf(stderr, "stopped logger thread\n");
@@ -503,6 +818,16 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     }
 #endif
     thread_io_queue_add(me, IO_QUEUE_NONE, NULL, NULL);
+
+#ifdef WORKER_URING
+    if (settings.worker_uring) {
+        me->uring = uring_ctx_new(me->base, me);
+        if (me->uring == NULL) {
+            fprintf(stderr, "Failed to set up io_uring for worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
 }
 
 /*
@@ -516,6 +841,7 @@ static void *worker_libevent(void *arg) {
      */
     me->l = logger_create();
     me->lru_bump_buf = item_lru_bump_buf_create();
+    slabs_magazine_create();
     if (me->l == NULL || me->lru_bump_buf == NULL) {
         abort();
     }
@@ -642,6 +968,11 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
                         assert(c->thread && c->thread->ssl_wbuf);
                         c->ssl_wbuf = c->thread->ssl_wbuf;
                     }
+#endif
+#ifdef WORKER_URING
+                    if (me->uring) {
+                        uring_conn_attach(me->uring, c);
+                    }
 #endif
                 }
                 break;
@@ -871,34 +1202,107 @@ item *item_alloc(const char *key, size_t nkey, client_flags_t flags, rel_time_t
 }
 
 /*
- * Returns an item if it hasn't been marked as expired,
- * lazy-expiring as needed.
+ * item_alloc() for store commands, which answer differently when the
+ * admission filter turns the item away than when memory ran out.
  */
-item *item_get(const char *key, const size_t nkey, LIBEVENT_THREAD *t, const bool do_update) {
+item *item_alloc_admit(const char *key, size_t nkey, client_flags_t flags, rel_time_t exptime, int nbytes, bool *rejected) {
     item *it;
     uint32_t hv;
+    if (!settings.lru_admission) {
+        *rejected = false;
+        return do_item_alloc(key, nkey, flags, exptime, nbytes);
+    }
+    /* The lock lets the filter tell a new key from a replacement. */
     hv = hash(key, nkey);
     item_lock(hv);
-    it = do_item_get(key, nkey, hv, t, do_update);
+    it = do_item_alloc_hv(key, nkey, flags, exptime, nbytes, hv, rejected);
     item_unlock(hv);
     return it;
 }
 
+/*
+ * Returns an item if it hasn't been marked as expired,
+ * lazy-expiring as needed.
+ */
+item *item_get(const char *key, const size_t nkey, LIBEVENT_THREAD *t, const bool do_update) {
+    return item_get_hv(key, nkey, hash(key, nkey), t, do_update);
+}
+
+/* item_get() for callers which already hashed the key.
+ * In rwlock mode the lookup is first tried under a shared lock, which only
+ * works if the item needs no changes. If it has to be expired or bumped we
+ * drop the shared lock and start over exclusively. */
+item *item_get_hv(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update) {
+    item *it;
+    if (settings.lru_admission)
+        tinylfu_record(hv);
+    bool waited = item_lock_lookup(hv);
+    if (item_lock_rw) {
+        bool done = do_item_get_shared(key, nkey, hv, t, do_update, &it);
+        item_unlock(hv);
+        if (!done) {
+            THR_STATS_LOCK(t);
+            t->stats.get_lock_upgrades++;
+            THR_STATS_UNLOCK(t);
+            item_lock(hv);
+            it = do_item_get(key, nkey, hv, t, do_update);
+            item_unlock(hv);
+        }
+    } else {
+        it = do_item_get(key, nkey, hv, t, do_update);
+        item_unlock(hv);
+    }
+    if (waited) {
+        THR_STATS_LOCK(t);
+        t->stats.get_lock_waits++;
+        THR_STATS_UNLOCK(t);
+    }
+    if (settings.mrc_sample_rate > 0)
+        mrc_record(hv, it, true);
+    if (it == NULL && settings.slab_automove == 3)
+        slab_automove_shadow_miss(hv);
+    return it;
+}
+
+/*
+ * Prefetches the hash buckets for a batch of lookups which are about to be
+ * made, so their cache misses overlap instead of being taken one key at a
+ * time. Only bucket addresses are computed; the item headers are left to
+ * the lookups, as reading the buckets would mean taking every item lock
+ * twice.
+ */
+void item_prefetch_batch(const uint32_t *hvs, const int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        assoc_prefetch(hvs[i]);
+    }
+}
+
 // returns an item with the item lock held.
 // lock will still be held even if return is NULL, allowing caller to replace
 // an item atomically if desired.
 item *item_get_locked(const char *key, const size_t nkey, LIBEVENT_THREAD *t, const bool do_update, uint32_t *hv) {
     item *it;
     *hv = hash(key, nkey);
+    if (settings.lru_admission)
+        tinylfu_record(*hv);
     item_lock(*hv);
     it = do_item_get(key, nkey, *hv, t, do_update);
+    if (settings.mrc_sample_rate > 0)
+        mrc_record(*hv, it, true);
+    if (it == NULL && settings.slab_automove == 3)
+        slab_automove_shadow_miss(*hv);
     return it;
 }
 
 item *item_touch(const char *key, size_t nkey, uint32_t exptime, LIBEVENT_THREAD *t) {
+    return item_touch_hv(key, nkey, hash(key, nkey), exptime, t);
+}
+
+item *item_touch_hv(const char *key, size_t nkey, const uint32_t hv, uint32_t exptime, LIBEVENT_THREAD *t) {
     item *it;
-    uint32_t hv;
-    hv = hash(key, nkey);
+    if (settings.lru_admission)
+        tinylfu_record(hv);
     item_lock(hv);
     it = do_item_touch(key, nkey, exptime, hv, t);
     item_unlock(hv);
@@ -1005,6 +1409,9 @@ void threadlocal_stats_reset(void) {
 #ifdef PROXY
         PROXY_THREAD_STATS_FIELDS
 #endif
+#ifdef WORKER_URING
+        URING_THREAD_STATS_FIELDS
+#endif
 #undef X
 
         memset(&threads[ii].stats.slab_stats, 0,
@@ -1033,6 +1440,9 @@ void threadlocal_stats_aggregate(struct thread_stats *stats) {
 #ifdef PROXY
         PROXY_THREAD_STATS_FIELDS
 #endif
+#ifdef WORKER_URING
+        URING_THREAD_STATS_FIELDS
+#endif
 #undef X
 
         for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
@@ -1130,13 +1540,39 @@ void memcached_thread_init(int nthreads, void *arg) {
     item_lock_count = hashsize(power);
     item_lock_hashpower = power;
 
-    item_locks = calloc(item_lock_count, sizeof(pthread_mutex_t));
-    if (! item_locks) {
-        perror("Can't allocate item locks");
+    item_lock_stats = calloc(item_lock_count, sizeof(struct lock_stats));
+    if (! item_lock_stats) {
+        perror("Can't allocate item lock stats");
         exit(1);
     }
-    for (i = 0; i < item_lock_count; i++) {
-        pthread_mutex_init(&item_locks[i], NULL);
+
+    if (settings.item_lock_rw) {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        /* Lookups vastly outnumber writes; don't let them starve sets. */
+        pthread_rwlockattr_setkind_np(&attr,
+                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        item_rwlocks = calloc(item_lock_count, sizeof(pthread_rwlock_t));
+        if (! item_rwlocks) {
+            perror("Can't allocate item locks");
+            exit(1);
+        }
+        for (i = 0; i < item_lock_count; i++) {
+            pthread_rwlock_init(&item_rwlocks[i], &attr);
+        }
+        pthread_rwlockattr_destroy(&attr);
+        item_lock_rw = true;
+    } else {
+        item_locks = calloc(item_lock_count, sizeof(pthread_mutex_t));
+        if (! item_locks) {
+            perror("Can't allocate item locks");
+            exit(1);
+        }
+        for (i = 0; i < item_lock_count; i++) {
+            pthread_mutex_init(&item_locks[i], NULL);
+        }
     }
 
     threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
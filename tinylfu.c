@@ -0,0 +1,133 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * TinyLFU admission sketch.
+ *
+ * A count-min sketch of 4-bit saturating counters, two to a byte, tracks
+ * roughly how often each key has been seen recently. When memory is full and an allocation
+ * would evict the COLD tail, the new key only displaces the tail item if it
+ * has been seen more often. Every so often all counters are halved so old
+ * popularity decays away.
+ *
+ * Updates are deliberately racy: a lost increment only makes an estimate a
+ * little low, which a frequency filter tolerates fine.
+ */
+#include "memcached.h"
+#include "tinylfu.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TINYLFU_ROWS 4
+#define TINYLFU_COUNTER_MAX 15
+/* One counter per row for every 512 bytes of cache memory */
+#define TINYLFU_BYTES_PER_COUNTER 512
+#define TINYLFU_MIN_WIDTH (1 << 12)
+#define TINYLFU_MAX_WIDTH (1 << 24)
+/* Halve everything after this many recordings per counter in a row */
+#define TINYLFU_SAMPLE_FACTOR 10
+
+/* Counter n is the low nibble of byte n / 2 if n is even, else the high. */
+static uint8_t *sketch = NULL;
+static uint32_t sketch_mask = 0;
+static uint64_t sample_size = 0;
+static volatile uint64_t additions = 0;
+static pthread_mutex_t reset_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* odd multipliers spread one hash value over the rows */
+static const uint32_t seeds[TINYLFU_ROWS] = {
+    0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+};
+
+static inline uint32_t sketch_slot(const uint32_t hv, const int row) {
+    uint32_t h = hv * seeds[row];
+    h ^= h >> 16;
+    return (row * (sketch_mask + 1)) + (h & sketch_mask);
+}
+
+static inline int sketch_get(const uint32_t slot) {
+    return (sketch[slot >> 1] >> ((slot & 1) << 2)) & 0xf;
+}
+
+/* Another thread bumping the other half of the byte may lose its update. */
+static inline void sketch_incr(const uint32_t slot) {
+    sketch[slot >> 1] += 1 << ((slot & 1) << 2);
+}
+
+void tinylfu_init(const size_t maxbytes) {
+    uint64_t width = TINYLFU_MIN_WIDTH;
+    while (width < maxbytes / TINYLFU_BYTES_PER_COUNTER
+            && width < TINYLFU_MAX_WIDTH) {
+        width <<= 1;
+    }
+
+    sketch = calloc(TINYLFU_ROWS, width / 2);
+    if (sketch == NULL) {
+        fprintf(stderr, "Failed to allocate the admission sketch\n");
+        exit(EXIT_FAILURE);
+    }
+    sketch_mask = width - 1;
+    sample_size = width * TINYLFU_SAMPLE_FACTOR;
+}
+
+/* Halve every counter. Only one thread does this at a time; recordings
+ * racing with it just land before or after the halving. */
+static void tinylfu_age(void) {
+    if (pthread_mutex_trylock(&reset_lock) != 0)
+        return;
+    if (additions >= sample_size) {
+        uint64_t i;
+        uint64_t total = (uint64_t)TINYLFU_ROWS * (sketch_mask + 1) / 2;
+        for (i = 0; i < total; i++) {
+            sketch[i] = (sketch[i] >> 1) & 0x77;
+        }
+        additions = 0;
+    }
+    pthread_mutex_unlock(&reset_lock);
+}
+
+void tinylfu_record(const uint32_t hv) {
+    int row;
+    bool added = false;
+    if (sketch == NULL)
+        return;
+
+    for (row = 0; row < TINYLFU_ROWS; row++) {
+        uint32_t slot = sketch_slot(hv, row);
+        if (sketch_get(slot) < TINYLFU_COUNTER_MAX) {
+            sketch_incr(slot);
+            added = true;
+        }
+    }
+
+    if (added && ++additions >= sample_size) {
+        tinylfu_age();
+    }
+}
+
+int tinylfu_estimate(const uint32_t hv) {
+    int row;
+    int est = TINYLFU_COUNTER_MAX;
+    if (sketch == NULL)
+        return 0;
+
+    for (row = 0; row < TINYLFU_ROWS; row++) {
+        int c = sketch_get(sketch_slot(hv, row));
+        if (c < est)
+            est = c;
+    }
+    return est;
+}
+
+/* Should an item hashing to cand_hv replace the eviction victim?
+ * Ties go to the newcomer only if the victim was never fetched, so a stream
+ * of one-off writes keeps replacing itself without pushing out keys that
+ * are actually being read. */
+bool tinylfu_admit(const uint32_t cand_hv, const uint32_t victim_hv,
+        const bool victim_fetched) {
+    int cand = tinylfu_estimate(cand_hv);
+    int victim = tinylfu_estimate(victim_hv);
+    if (cand > victim)
+        return true;
+    if (cand == victim && !victim_fetched)
+        return true;
+    return false;
+}
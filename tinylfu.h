@@ -0,0 +1,12 @@
+#ifndef TINYLFU_H
+#define TINYLFU_H
+
+/* Frequency sketch backing the -o lru_admission filter. Counts are indexed
+ * by the item hash, so callers pass the hv they already have. */
+void tinylfu_init(const size_t maxbytes);
+void tinylfu_record(const uint32_t hv);
+int tinylfu_estimate(const uint32_t hv);
+bool tinylfu_admit(const uint32_t cand_hv, const uint32_t victim_hv,
+        const bool victim_fetched);
+
+#endif
@@ -0,0 +1,936 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * io_uring driven client connections, -o worker_uring.
+ *
+ * A worker's ring fd sits in its event base in place of one event per
+ * connection. Each connection keeps a multishot recv armed, which fills
+ * buffers from a ring provided to the kernel; the filled buffers queue up on
+ * the connection until the state machine reads them. Sends are queued as
+ * SENDMSG and the state machine is told to try again later, as it would be
+ * by a full socket. Its next sendmsg call once the send has completed
+ * returns the result instead.
+ *
+ * Completions are handled in batches and drive the state machine directly,
+ * so the sends and re-arms they cause go to the kernel together in one
+ * io_uring_enter() at the end of the batch. SQEs queued from anywhere else
+ * are flushed by activating the ring's event, which runs before the event
+ * loop polls again.
+ *
+ * Libevent is level triggered and the state machine relies on that: it may
+ * stop with input still buffered, or ask for a write event just to be
+ * called again. A connection which stops in that state is woken by
+ * activating its own event.
+ *
+ * The kernel interface is used directly, as liburing is only vendored for
+ * proxy builds.
+ */
+#include "memcached.h"
+#include "uring.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+/* Provided buffers per worker. Must be a power of two. */
+#define URING_BUF_COUNT 512
+#define URING_BUF_SIZE 8192
+#define URING_BGID 0
+/* A connection holding this many buffers stops receiving until it has read
+ * half of them, leaving the rest for others and pushing back on the client
+ * as a full socket would. */
+#define URING_CONN_MAX_BUFS 16
+/* Passes over the completion queue per wakeup. */
+#define URING_MAX_PASSES 4
+
+enum uring_op {
+    URING_OP_RECV = 1,
+    URING_OP_SEND,
+    URING_OP_ACCEPT,
+    URING_OP_CANCEL,
+};
+
+/* user_data is the fd, the low bits of the connection's generation and the
+ * op. Generations tell completions for a closed connection from those for
+ * the next one on the same fd. */
+#define URING_GEN_MASK 0xffffff
+#define URING_DATA(fd, gen, op) (((uint64_t)(fd) << 32) \
+        | (((uint64_t)(gen) & URING_GEN_MASK) << 8) | (op))
+
+struct uring_rbuf {
+    uint16_t bid;
+    uint32_t len;
+    uint32_t off;
+};
+
+struct uring_conn {
+    struct uring_ctx *u;
+    uint32_t gen;
+    bool active; /* driven by the ring until closed */
+    bool detached; /* lent to a side thread */
+    bool armed; /* multishot recv or accept outstanding */
+    bool starved; /* waiting on the ctx's rearm list */
+    bool paused; /* holding too many buffers to receive more */
+    bool send_inflight;
+    bool send_done; /* result waiting for the next sendmsg call */
+    bool closing; /* close waits for the send in flight */
+    bool eof;
+    int err;
+    ssize_t send_res;
+    ssize_t (*read)(conn *c, void *buf, size_t count);
+    ssize_t (*sendmsg)(conn *c, struct msghdr *msg, int flags);
+    struct msghdr msg; /* must outlive the SQE */
+    struct iovec *iov;
+    int iov_size;
+    struct uring_rbuf *rq; /* received buffers not yet read */
+    int rq_first;
+    int rq_count;
+    int rq_size;
+};
+
+struct uring_rearm {
+    int fd;
+    uint32_t gen;
+};
+
+struct uring_ctx {
+    int fd;
+    LIBEVENT_THREAD *t; /* NULL for the listener */
+    struct event event;
+    bool batching; /* handling completions, submit at the end */
+    bool flush_queued;
+    /* submission queue */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_flags;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sqe_tail; /* prepared, not yet published */
+    struct io_uring_sqe *sqes;
+    /* completion queue */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    /* provided buffers */
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    uint16_t br_tail;
+    /* connections to re-arm once buffers or SQEs free up */
+    struct uring_rearm *rearm;
+    int rearm_count;
+    int rearm_size;
+    bool rearm_ready;
+    /* stats, folded into the thread's at the end of each wakeup */
+    uint64_t submits;
+    uint64_t sqes_submitted;
+    uint64_t cqe_batches;
+    uint64_t cqes_reaped;
+    uint64_t recv_nobufs;
+};
+
+static void uring_handler(evutil_socket_t fd, short which, void *arg);
+static void uring_recv_arm(conn *c);
+static void uring_accept_arm(conn *c);
+static bool uring_cancel_fd(conn *c);
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+        unsigned int min_complete, unsigned int flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+        unsigned int nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+struct uring_ctx *uring_ctx_new(struct event_base *base, LIBEVENT_THREAD *t) {
+    struct io_uring_params p;
+    struct uring_ctx *u = calloc(1, sizeof(struct uring_ctx));
+    if (u == NULL) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = URING_CQ_ENTRIES;
+    u->fd = sys_io_uring_setup(URING_SQ_ENTRIES, &p);
+    if (u->fd < 0) {
+        perror("io_uring_setup");
+        free(u);
+        return NULL;
+    }
+    // Multishot recv into a buffer ring needs a 6.0 kernel, which also has
+    // these.
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+            || !(p.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "io_uring: kernel is too old\n");
+        goto fail;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *ring = mmap(NULL, sq_len > cq_len ? sq_len : cq_len,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+            IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        perror("io_uring mmap");
+        goto fail;
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+            IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        perror("io_uring mmap");
+        goto fail;
+    }
+
+    u->sq_head = (unsigned int *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    u->sq_flags = (unsigned int *)(ring + p.sq_off.flags);
+    u->sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sqe_tail = *u->sq_tail;
+    // SQEs are used in order, so the index array never changes.
+    unsigned int *array = (unsigned int *)(ring + p.sq_off.array);
+    for (unsigned int i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    u->cq_head = (unsigned int *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    // Only workers receive.
+    if (t != NULL) {
+        struct io_uring_buf_reg reg;
+        u->br = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (u->br == MAP_FAILED) {
+            perror("io_uring buffer ring mmap");
+            goto fail;
+        }
+        u->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+        if (u->bufs == NULL) {
+            fprintf(stderr, "Failed to allocate io_uring buffers\n");
+            goto fail;
+        }
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uintptr_t)u->br;
+        reg.ring_entries = URING_BUF_COUNT;
+        reg.bgid = URING_BGID;
+        if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING,
+                    &reg, 1) != 0) {
+            perror("io_uring buffer ring register");
+            goto fail;
+        }
+        for (int i = 0; i < URING_BUF_COUNT; i++) {
+            struct io_uring_buf *b = &u->br->bufs[i];
+            b->addr = (uintptr_t)(u->bufs + (size_t)i * URING_BUF_SIZE);
+            b->len = URING_BUF_SIZE;
+            b->bid = i;
+        }
+        u->br_tail = URING_BUF_COUNT;
+        __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    }
+
+    u->t = t;
+    event_set(&u->event, u->fd, EV_READ | EV_PERSIST, uring_handler, u);
+    event_base_set(base, &u->event);
+    if (event_add(&u->event, 0) == -1) {
+        perror("event_add");
+        goto fail;
+    }
+
+    return u;
+fail:
+    // Callers give up on startup, so the mappings go with the process.
+    close(u->fd);
+    free(u);
+    return NULL;
+}
+
+/* Hands the kernel everything queued so far. */
+static void uring_submit(struct uring_ctx *u) {
+    unsigned int flags = 0;
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    unsigned int pending = u->sqe_tail
+        - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    // Completions which didn't fit in the CQ are only moved over on entry.
+    if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+        flags |= IORING_ENTER_GETEVENTS;
+    } else if (pending == 0) {
+        return;
+    }
+
+    int ret = sys_io_uring_enter(u->fd, pending, 0, flags);
+    if (ret < 0) {
+        // Whatever wasn't consumed goes with the next submit.
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+            perror("io_uring_enter");
+        }
+        return;
+    }
+    if (pending) {
+        u->submits++;
+        u->sqes_submitted += ret;
+    }
+}
+
+/* Asks for a flush if nothing else will submit soon. */
+static void uring_queued(struct uring_ctx *u) {
+    if (!u->batching && !u->flush_queued) {
+        u->flush_queued = true;
+        event_active(&u->event, EV_READ, 1);
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_ctx *u) {
+    if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)
+            >= u->sq_entries) {
+        uring_submit(u);
+        if (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)
+                >= u->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sqe_tail++;
+    return sqe;
+}
+
+static void uring_buf_recycle(struct uring_ctx *u, uint16_t bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUF_COUNT - 1)];
+    b->addr = (uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    u->rearm_ready = true;
+}
+
+/* Connections go on the rearm list when the kernel is out of buffers for
+ * them, or we are out of SQEs. */
+static void uring_rearm_later(struct uring_ctx *u, conn *c) {
+    struct uring_conn *st = c->uring;
+    if (st->starved) {
+        return;
+    }
+    if (u->rearm_count == u->rearm_size) {
+        int size = u->rearm_size ? u->rearm_size * 2 : 64;
+        struct uring_rearm *r = realloc(u->rearm,
+                sizeof(struct uring_rearm) * size);
+        if (r == NULL) {
+            // Nothing to wake it; let the socket error out.
+            st->err = ENOMEM;
+            return;
+        }
+        u->rearm = r;
+        u->rearm_size = size;
+    }
+    u->rearm[u->rearm_count].fd = c->sfd;
+    u->rearm[u->rearm_count].gen = st->gen;
+    u->rearm_count++;
+    st->starved = true;
+}
+
+static void uring_rearm_run(struct uring_ctx *u) {
+    int count = u->rearm_count;
+    u->rearm_ready = false;
+    u->rearm_count = 0;
+    // Arming may put a connection back on the list, but never past the
+    // entry being looked at.
+    for (int i = 0; i < count; i++) {
+        conn *c = conns[u->rearm[i].fd];
+        struct uring_conn *st = c ? c->uring : NULL;
+        if (st == NULL || !st->active || !st->starved
+                || st->gen != u->rearm[i].gen) {
+            continue;
+        }
+        st->starved = false;
+        if (st->closing) {
+            if (!uring_cancel_fd(c)) {
+                uring_rearm_later(u, c);
+                u->rearm_ready = true;
+            }
+        } else if (c->state == conn_listening) {
+            if (!st->armed && (c->ev_flags & EV_READ)) {
+                uring_accept_arm(c);
+            }
+        } else if (!st->detached && !st->armed && !st->paused
+                && !st->eof && !st->err) {
+            uring_recv_arm(c);
+        }
+    }
+}
+
+static void uring_cancel(struct uring_ctx *u, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_DATA(0, 0, URING_OP_CANCEL);
+}
+
+/* Cancels everything outstanding on the connection's socket. The kernel
+ * matches this against the open file, so it has to be issued before the fd
+ * is closed. */
+static bool uring_cancel_fd(conn *c) {
+    struct uring_ctx *u = c->uring->u;
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = c->sfd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_DATA(0, 0, URING_OP_CANCEL);
+    uring_queued(u);
+    return true;
+}
+
+static void uring_recv_arm(conn *c) {
+    struct uring_conn *st = c->uring;
+    struct io_uring_sqe *sqe = uring_get_sqe(st->u);
+    if (sqe == NULL) {
+        uring_rearm_later(st->u, c);
+        st->u->rearm_ready = true;
+        uring_queued(st->u);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->sfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_DATA(c->sfd, st->gen, URING_OP_RECV);
+    st->armed = true;
+    uring_queued(st->u);
+}
+
+static void uring_accept_arm(conn *c) {
+    struct uring_conn *st = c->uring;
+    struct io_uring_sqe *sqe = uring_get_sqe(st->u);
+    if (sqe == NULL) {
+        uring_rearm_later(st->u, c);
+        st->u->rearm_ready = true;
+        uring_queued(st->u);
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = c->sfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = URING_DATA(c->sfd, st->gen, URING_OP_ACCEPT);
+    st->armed = true;
+    uring_queued(st->u);
+}
+
+static ssize_t uring_read(conn *c, void *buf, size_t count) {
+    struct uring_conn *st = c->uring;
+    struct uring_ctx *u = st->u;
+    size_t done = 0;
+
+    // A side thread given the connection may poll it before the worker
+    // has let go of it.
+    if (!pthread_equal(pthread_self(), c->thread->thread_id)) {
+        return st->read(c, buf, count);
+    }
+
+    while (done < count && st->rq_count) {
+        struct uring_rbuf *rb = &st->rq[st->rq_first];
+        size_t len = rb->len - rb->off;
+        if (len > count - done) {
+            len = count - done;
+        }
+        memcpy((char *)buf + done,
+                u->bufs + (size_t)rb->bid * URING_BUF_SIZE + rb->off, len);
+        done += len;
+        rb->off += len;
+        if (rb->off == rb->len) {
+            uring_buf_recycle(u, rb->bid);
+            st->rq_first++;
+            st->rq_count--;
+        }
+    }
+    if (st->rq_count == 0) {
+        st->rq_first = 0;
+    }
+
+    if (st->paused && st->rq_count <= URING_CONN_MAX_BUFS / 2) {
+        st->paused = false;
+        // Otherwise the cancelled recv's last completion re-arms.
+        if (!st->armed && !st->starved && !st->eof && !st->err) {
+            uring_recv_arm(c);
+        }
+    }
+
+    if (done) {
+        return done;
+    }
+    if (st->eof) {
+        return 0;
+    }
+    if (st->err) {
+        errno = st->err;
+        return -1;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static ssize_t uring_sendmsg(conn *c, struct msghdr *msg, int flags) {
+    struct uring_conn *st = c->uring;
+
+    if (st->send_done) {
+        // transmit() rebuilt the same message, as nothing was sent since.
+        st->send_done = false;
+        if (st->send_res < 0) {
+            errno = -st->send_res;
+            return -1;
+        }
+        return st->send_res;
+    }
+    if (st->send_inflight) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // The kernel may read the message after this returns.
+    if (msg->msg_iovlen > st->iov_size) {
+        struct iovec *iov = realloc(st->iov,
+                sizeof(struct iovec) * msg->msg_iovlen);
+        if (iov == NULL) {
+            return st->sendmsg(c, msg, flags);
+        }
+        st->iov = iov;
+        st->iov_size = msg->msg_iovlen;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(st->u);
+    if (sqe == NULL) {
+        return st->sendmsg(c, msg, flags);
+    }
+    memcpy(st->iov, msg->msg_iov, sizeof(struct iovec) * msg->msg_iovlen);
+    st->msg = *msg;
+    st->msg.msg_iov = st->iov;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->sfd;
+    sqe->addr = (uintptr_t)&st->msg;
+    sqe->msg_flags = flags;
+    sqe->user_data = URING_DATA(c->sfd, st->gen, URING_OP_SEND);
+    st->send_inflight = true;
+    uring_queued(st->u);
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static bool uring_rq_push(struct uring_conn *st, uint16_t bid, uint32_t len) {
+    if (st->rq_first + st->rq_count == st->rq_size) {
+        if (st->rq_first) {
+            memmove(st->rq, &st->rq[st->rq_first],
+                    sizeof(struct uring_rbuf) * st->rq_count);
+            st->rq_first = 0;
+        } else {
+            int size = st->rq_size ? st->rq_size * 2 : 4;
+            struct uring_rbuf *rq = realloc(st->rq,
+                    sizeof(struct uring_rbuf) * size);
+            if (rq == NULL) {
+                return false;
+            }
+            st->rq = rq;
+            st->rq_size = size;
+        }
+    }
+    struct uring_rbuf *rb = &st->rq[st->rq_first + st->rq_count];
+    rb->bid = bid;
+    rb->len = len;
+    rb->off = 0;
+    st->rq_count++;
+    return true;
+}
+
+static bool uring_conn_waiting(conn *c) {
+    switch (c->state) {
+        case conn_io_queue:
+        case conn_io_pending:
+        case conn_watch:
+        case conn_closed:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static void uring_recv_done(struct uring_ctx *u, conn *c,
+        struct uring_conn *st, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        st->armed = false;
+    }
+
+    if (cqe->res > 0) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!uring_rq_push(st, bid, cqe->res)) {
+            uring_buf_recycle(u, bid);
+            st->err = ENOMEM;
+        } else if (st->rq_count >= URING_CONN_MAX_BUFS && !st->paused) {
+            st->paused = true;
+            if (st->armed) {
+                uring_cancel(u, cqe->user_data);
+            }
+        }
+    } else {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_buf_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (cqe->res == 0) {
+            st->eof = true;
+        } else if (cqe->res == -ENOBUFS) {
+            u->recv_nobufs++;
+            uring_rearm_later(u, c);
+        } else if (cqe->res != -ECANCELED) {
+            st->err = -cqe->res;
+        }
+    }
+
+    if (st->detached) {
+        return;
+    }
+    if (!st->armed && !st->starved && !st->paused && !st->eof && !st->err) {
+        uring_recv_arm(c);
+    }
+    if ((c->ev_flags & EV_READ) && uring_conn_waiting(c)
+            && (st->rq_count || st->eof || st->err)) {
+        conn_uring_event(c, EV_READ);
+    }
+}
+
+static void uring_accept_done(conn *c, struct uring_conn *st,
+        struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        st->armed = false;
+    }
+
+    if (cqe->res >= 0) {
+        conn_accepted(c, cqe->res);
+    } else if (cqe->res == -EMFILE) {
+        // The kernel goes on accepting while we handle what it accepted
+        // before, so the descriptor it wanted may have been closed since.
+        int sfd = accept4(c->sfd, NULL, NULL, SOCK_NONBLOCK);
+        if (sfd >= 0) {
+            conn_accepted(c, sfd);
+        } else if (errno == EMFILE) {
+            if (settings.verbose > 0)
+                fprintf(stderr, "Too many open connections\n");
+            accept_new_conns(false);
+        }
+    } else if (cqe->res != -ECANCELED && cqe->res != -EAGAIN) {
+        errno = -cqe->res;
+        perror("accept()");
+    }
+
+    if (!st->armed && (c->ev_flags & EV_READ)) {
+        uring_accept_arm(c);
+    }
+}
+
+static void uring_handle_cqe(struct uring_ctx *u, struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & 0xff;
+    int fd = cqe->user_data >> 32;
+    uint32_t gen = (cqe->user_data >> 8) & URING_GEN_MASK;
+
+    if (op == URING_OP_CANCEL) {
+        return;
+    }
+
+    conn *c = conns[fd];
+    struct uring_conn *st = c ? c->uring : NULL;
+    if (st == NULL || st->u != u || !st->active
+            || (st->gen & URING_GEN_MASK) != gen) {
+        // Left over from a connection which has been closed.
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_buf_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        return;
+    }
+
+    if (st->closing) {
+        // Only the send is waited for; it finishes the close.
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_buf_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (op == URING_OP_RECV && !(cqe->flags & IORING_CQE_F_MORE)) {
+            st->armed = false;
+        }
+        if (op == URING_OP_SEND) {
+            st->send_inflight = false;
+            conn_uring_event(c, EV_WRITE);
+        }
+        return;
+    }
+
+    switch (op) {
+        case URING_OP_RECV:
+            uring_recv_done(u, c, st, cqe);
+            break;
+        case URING_OP_SEND:
+            st->send_inflight = false;
+            st->send_done = true;
+            st->send_res = cqe->res;
+            if (!st->detached && (c->ev_flags & EV_WRITE)
+                    && uring_conn_waiting(c)) {
+                conn_uring_event(c, EV_WRITE);
+            }
+            break;
+        case URING_OP_ACCEPT:
+            uring_accept_done(c, st, cqe);
+            break;
+    }
+}
+
+static void uring_handler(evutil_socket_t fd, short which, void *arg) {
+    struct uring_ctx *u = arg;
+
+    u->batching = true;
+    u->flush_queued = false;
+    for (int pass = 0; pass < URING_MAX_PASSES; pass++) {
+        unsigned int head = *u->cq_head;
+        unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head != tail) {
+            u->cqe_batches++;
+        }
+        while (head != tail) {
+            // Copy it out so the slot can be reused before it's handled.
+            struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+            head++;
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+            u->cqes_reaped++;
+            uring_handle_cqe(u, &cqe);
+        }
+
+        if (u->rearm_count && u->rearm_ready) {
+            uring_rearm_run(u);
+        }
+        unsigned int queued = u->sqe_tail - *u->sq_tail;
+        uring_submit(u);
+        // Sends may complete inline; pick them up while we're here.
+        if (queued == 0) {
+            break;
+        }
+    }
+    u->batching = false;
+
+    if (u->t) {
+        LIBEVENT_THREAD *t = u->t;
+        pthread_mutex_lock(&t->stats.mutex);
+        t->stats.uring_submits += u->submits;
+        t->stats.uring_sqes += u->sqes_submitted;
+        t->stats.uring_cqe_batches += u->cqe_batches;
+        t->stats.uring_cqes += u->cqes_reaped;
+        t->stats.uring_recv_nobufs += u->recv_nobufs;
+        pthread_mutex_unlock(&t->stats.mutex);
+    }
+    u->submits = 0;
+    u->sqes_submitted = 0;
+    u->cqe_batches = 0;
+    u->cqes_reaped = 0;
+    u->recv_nobufs = 0;
+}
+
+void uring_conn_attach(struct uring_ctx *u, conn *c) {
+    struct uring_conn *st = c->uring;
+
+    if (IS_UDP(c->transport)) {
+        return;
+    }
+#ifdef TLS
+    if (c->ssl) {
+        return;
+    }
+#endif
+    if (st == NULL) {
+        // Stays on libevent if this fails.
+        st = calloc(1, sizeof(struct uring_conn));
+        if (st == NULL) {
+            return;
+        }
+        c->uring = st;
+    }
+
+    st->u = u;
+    st->active = true;
+    st->detached = false;
+    st->armed = false;
+    st->starved = false;
+    st->paused = false;
+    st->send_inflight = false;
+    st->send_done = false;
+    st->closing = false;
+    st->eof = false;
+    st->err = 0;
+    st->rq_first = 0;
+    st->rq_count = 0;
+    event_del(&c->event);
+
+    if (c->state == conn_listening) {
+        if (c->ev_flags & EV_READ) {
+            uring_accept_arm(c);
+        }
+        return;
+    }
+
+    st->read = c->read;
+    st->sendmsg = c->sendmsg;
+    c->read = uring_read;
+    c->sendmsg = uring_sendmsg;
+    uring_recv_arm(c);
+}
+
+/* Gives the socket back to plain reads for a side thread. */
+void uring_conn_detach(conn *c) {
+    struct uring_conn *st = c->uring;
+    if (!st->active || st->detached) {
+        return;
+    }
+    st->detached = true;
+    c->read = st->read;
+    c->sendmsg = st->sendmsg;
+    if (st->armed) {
+        uring_cancel(st->u, URING_DATA(c->sfd, st->gen, URING_OP_RECV));
+        uring_submit(st->u);
+    }
+}
+
+/* Wakes a connection which stopped with an event it asked for already
+ * satisfied, as libevent would keep firing it. */
+static void uring_conn_wake(conn *c, struct uring_conn *st) {
+    short which = 0;
+    if ((c->ev_flags & EV_READ) && (st->rq_count || st->eof || st->err)) {
+        which |= EV_READ;
+    }
+    if ((c->ev_flags & EV_WRITE) && !st->send_inflight) {
+        which |= EV_WRITE;
+    }
+    if (which) {
+        event_active(&c->event, which, 1);
+    }
+}
+
+/* Back from a side thread or an IO queue. */
+bool uring_conn_readd(conn *c) {
+    struct uring_conn *st = c->uring;
+    if (!st->active) {
+        return false;
+    }
+    c->ev_flags = EV_READ | EV_PERSIST;
+    if (st->detached && c->state != conn_closing) {
+        st->detached = false;
+        c->read = uring_read;
+        c->sendmsg = uring_sendmsg;
+        if (!st->armed && !st->starved && !st->paused
+                && !st->eof && !st->err) {
+            uring_recv_arm(c);
+        }
+    }
+    uring_conn_wake(c, st);
+    return true;
+}
+
+/* Stands in for changing the connection's libevent event. */
+bool uring_conn_update(conn *c, const int new_flags) {
+    struct uring_conn *st = c->uring;
+    if (!st->active || st->detached) {
+        return false;
+    }
+    c->ev_flags = new_flags;
+    if (c->state == conn_listening) {
+        if (new_flags & EV_READ) {
+            if (!st->armed) {
+                uring_accept_arm(c);
+            }
+        } else if (st->armed) {
+            uring_cancel(st->u, URING_DATA(c->sfd, st->gen, URING_OP_ACCEPT));
+            uring_queued(st->u);
+        }
+    }
+    return true;
+}
+
+/* Called when the state machine stops. */
+void uring_conn_pending(conn *c) {
+    struct uring_conn *st = c->uring;
+    if (!st->active || st->detached || st->closing
+            || !uring_conn_waiting(c)) {
+        return;
+    }
+    uring_conn_wake(c, st);
+}
+
+/* Returns false if the close has to wait for a send, which may still be
+ * reading the connection's responses, or may not be cancellable at all. Its
+ * completion drives the connection again, which closes it for real. */
+bool uring_conn_close(conn *c) {
+    struct uring_conn *st = c->uring;
+    struct uring_ctx *u = st->u;
+    if (!st->active) {
+        return true;
+    }
+
+    if ((st->armed || st->send_inflight) && !st->closing) {
+        // With no SQE free a send is retried from the rearm list, as it may
+        // be waiting on a client which never reads.
+        if (!uring_cancel_fd(c) && st->send_inflight) {
+            uring_rearm_later(u, c);
+            u->rearm_ready = true;
+            uring_queued(u);
+        }
+        uring_submit(u);
+    }
+
+    while (st->rq_count) {
+        uring_buf_recycle(u, st->rq[st->rq_first].bid);
+        st->rq_first++;
+        st->rq_count--;
+    }
+    st->rq_first = 0;
+    if (st->send_inflight) {
+        st->closing = true;
+        return false;
+    }
+    st->closing = false;
+    st->active = false;
+    st->gen++;
+    if (c->state != conn_listening && !st->detached) {
+        c->read = st->read;
+        c->sendmsg = st->sendmsg;
+    }
+    return true;
+}
+
+void uring_conn_free(conn *c) {
+    struct uring_conn *st = c->uring;
+    if (st) {
+        free(st->iov);
+        free(st->rq);
+        free(st);
+        c->uring = NULL;
+    }
+}
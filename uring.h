@@ -0,0 +1,23 @@
+#ifndef URING_H
+#define URING_H
+
+/* io_uring driven connections, behind -o worker_uring.
+ *
+ * Each worker thread has a ring whose fd is the only thing it polls for its
+ * client connections. Connections receive through a multishot recv into a
+ * ring of provided buffers and send through SENDMSG, and the SQEs queued
+ * while a batch of completions is handled go to the kernel in one call.
+ * The listener thread has a ring of its own for multishot accepts.
+ */
+
+struct uring_ctx *uring_ctx_new(struct event_base *base, LIBEVENT_THREAD *t);
+
+void uring_conn_attach(struct uring_ctx *u, conn *c);
+void uring_conn_detach(conn *c);
+bool uring_conn_readd(conn *c);
+bool uring_conn_update(conn *c, const int new_flags);
+void uring_conn_pending(conn *c);
+bool uring_conn_close(conn *c);
+void uring_conn_free(conn *c);
+
+#endif